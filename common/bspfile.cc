@@ -1334,106 +1334,24 @@ BSP2to2rmq_Nodes(const bsp2_dnode_t *dnodes2, int numnodes) {
  * =========================================================================
  */
 
-static void *CopyArray(const void *in, int numelems, size_t elemsize)
+/*
+ * Lumps with the same layout in both formats are handed over instead of
+ * copied; the source pointer is cleared so freeing the old format leaves
+ * the lump alone.
+ */
+template <typename T>
+static T *MoveArray(T *&in)
 {
-    void *out = (void *)calloc(numelems, elemsize);
-    memcpy(out, in, numelems * elemsize);
+    T *out = in;
+    in = nullptr;
     return out;
 }
 
-static dmodel_t *BSP29_CopyModels(const dmodel_t *dmodels, int nummodels)
-{
-    return (dmodel_t *)CopyArray(dmodels, nummodels, sizeof(*dmodels));
-}
-
-static byte *BSP29_CopyVisData(const byte *dvisdata, int visdatasize)
-{
-    return (byte *)CopyArray(dvisdata, visdatasize, 1);
-}
-
-static byte *BSP29_CopyLightData(const byte *dlightdata, int lightdatasize)
-{
-    return (byte *)CopyArray(dlightdata, lightdatasize, 1);
-}
-
-static dmiptexlump_t *BSP29_CopyTexData(const dmiptexlump_t *dtexdata, int texdatasize)
-{
-    return (dmiptexlump_t *)CopyArray(dtexdata, texdatasize, 1);
-}
-
-static char *BSP29_CopyEntData(const char *dentdata, int entdatasize)
-{
-    return (char *)CopyArray(dentdata, entdatasize, 1);
-}
-
-static dplane_t *BSP29_CopyPlanes(const dplane_t *dplanes, int numplanes)
-{
-    return (dplane_t *)CopyArray(dplanes, numplanes, sizeof(*dplanes));
-}
-
-static dvertex_t *BSP29_CopyVertexes(const dvertex_t *dvertexes, int numvertexes)
-{
-    return (dvertex_t *)CopyArray(dvertexes, numvertexes, sizeof(*dvertexes));
-}
-
-static texinfo_t *BSP29_CopyTexinfo(const texinfo_t *texinfo, int numtexinfo)
-{
-    return (texinfo_t *)CopyArray(texinfo, numtexinfo, sizeof(*texinfo));
-}
-
-static int32_t *BSP29_CopySurfedges(const int32_t *surfedges, int numsurfedges)
-{
-    return (int32_t *)CopyArray(surfedges, numsurfedges, sizeof(*surfedges));
-}
-
-static bsp2_dface_t *BSP2_CopyFaces(const bsp2_dface_t *dfaces, int numfaces)
-{
-    return (bsp2_dface_t *)CopyArray(dfaces, numfaces, sizeof(*dfaces));
-}
-
-static bsp2_dclipnode_t *BSP2_CopyClipnodes(const bsp2_dclipnode_t *dclipnodes, int numclipnodes)
-{
-    return (bsp2_dclipnode_t *)CopyArray(dclipnodes, numclipnodes, sizeof(*dclipnodes));
-}
-
-static bsp2_dedge_t *BSP2_CopyEdges(const bsp2_dedge_t *dedges, int numedges)
-{
-    return (bsp2_dedge_t *)CopyArray(dedges, numedges, sizeof(*dedges));
-}
-
-static uint32_t *BSP2_CopyMarksurfaces(const uint32_t *marksurfaces, int nummarksurfaces)
-{
-    return (uint32_t *)CopyArray(marksurfaces, nummarksurfaces, sizeof(*marksurfaces));
-}
-
-static bsp2_dnode_t *BSP2_CopyNodes(const bsp2_dnode_t *dnodes, int numnodes)
-{
-    return (bsp2_dnode_t *)CopyArray(dnodes, numnodes, sizeof(*dnodes));
-}
-
-static uint16_t *Q2BSP_CopyLeafBrushes(const uint16_t *leafbrushes, int count)
-{
-    return (uint16_t *)CopyArray(leafbrushes, count, sizeof(*leafbrushes));
-}
-
-static darea_t *Q2BSP_CopyAreas(const darea_t *areas, int count)
-{
-    return (darea_t *)CopyArray(areas, count, sizeof(*areas));
-}
-
-static dareaportal_t *Q2BSP_CopyAreaPortals(const dareaportal_t *areaportals, int count)
-{
-    return (dareaportal_t *)CopyArray(areaportals, count, sizeof(*areaportals));
-}
-
-static dbrush_t *Q2BSP_CopyBrushes(const dbrush_t *brushes, int count)
-{
-    return (dbrush_t *)CopyArray(brushes, count, sizeof(*brushes));
-}
-
-static dbrushside_t *Q2BSP_CopyBrushSides(const dbrushside_t *dbrushsides, int count)
+static void *CopyArray(const void *in, int numelems, size_t elemsize)
 {
-    return (dbrushside_t *)CopyArray(dbrushsides, count, sizeof(*dbrushsides));
+    void *out = (void *)calloc(numelems, elemsize);
+    memcpy(out, in, numelems * elemsize);
+    return out;
 }
 
 
@@ -1568,7 +1486,7 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
     // conversions to GENERIC_BSP
     
     if (bspdata->version == BSPVERSION && version == GENERIC_BSP) {
-        const bsp29_t *bsp29 = &bspdata->data.bsp29;
+        bsp29_t *bsp29 = &bspdata->data.bsp29;
         mbsp_t *mbsp = &bspdata->data.mbsp;
         
         memset(mbsp, 0, sizeof(*mbsp));
@@ -1591,24 +1509,24 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
         mbsp->numsurfedges = bsp29->numsurfedges;
         
         // copy or convert data
-        mbsp->dmodels = BSP29_CopyModels(bsp29->dmodels, bsp29->nummodels);
-        mbsp->dvisdata = BSP29_CopyVisData(bsp29->dvisdata, bsp29->visdatasize);
-        mbsp->dlightdata = BSP29_CopyLightData(bsp29->dlightdata, bsp29->lightdatasize);
-        mbsp->dtexdata = BSP29_CopyTexData(bsp29->dtexdata, bsp29->texdatasize);
-        mbsp->dentdata = BSP29_CopyEntData(bsp29->dentdata, bsp29->entdatasize);
+        mbsp->dmodels = MoveArray(bsp29->dmodels);
+        mbsp->dvisdata = MoveArray(bsp29->dvisdata);
+        mbsp->dlightdata = MoveArray(bsp29->dlightdata);
+        mbsp->dtexdata = MoveArray(bsp29->dtexdata);
+        mbsp->dentdata = MoveArray(bsp29->dentdata);
         mbsp->dleafs = BSP29toM_Leafs(bsp29->dleafs, bsp29->numleafs);
-        mbsp->dplanes = BSP29_CopyPlanes(bsp29->dplanes, bsp29->numplanes);
-        mbsp->dvertexes = BSP29_CopyVertexes(bsp29->dvertexes, bsp29->numvertexes);
+        mbsp->dplanes = MoveArray(bsp29->dplanes);
+        mbsp->dvertexes = MoveArray(bsp29->dvertexes);
         mbsp->dnodes = BSP29to2_Nodes(bsp29->dnodes, bsp29->numnodes);
         mbsp->texinfo = BSP29toM_Texinfo(bsp29->texinfo, bsp29->numtexinfo);
         mbsp->dfaces = BSP29to2_Faces(bsp29->dfaces, bsp29->numfaces);
         mbsp->dclipnodes = BSP29to2_Clipnodes(bsp29->dclipnodes, bsp29->numclipnodes);
         mbsp->dedges = BSP29to2_Edges(bsp29->dedges, bsp29->numedges);
         mbsp->dleaffaces = BSP29to2_Marksurfaces(bsp29->dmarksurfaces, bsp29->nummarksurfaces);
-        mbsp->dsurfedges = BSP29_CopySurfedges(bsp29->dsurfedges, bsp29->numsurfedges);
+        mbsp->dsurfedges = MoveArray(bsp29->dsurfedges);
         
         /* Free old data */
-        FreeBSP29((bsp29_t *)bsp29);
+        FreeBSP29(bsp29);
         
         /* Conversion complete! */
         mbsp->loadversion = bspdata->version;
@@ -1618,7 +1536,7 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
     }
     
     if (bspdata->version == Q2_BSPVERSION && version == GENERIC_BSP) {
-        const q2bsp_t *q2bsp = &bspdata->data.q2bsp;
+        q2bsp_t *q2bsp = &bspdata->data.q2bsp;
         mbsp_t *mbsp = &bspdata->data.mbsp;
         
         memset(mbsp, 0, sizeof(*mbsp));
@@ -1646,27 +1564,27 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
         // copy or convert data
         mbsp->dmodels = Q2BSPtoM_Models(q2bsp->dmodels, q2bsp->nummodels);
         mbsp->dvisdata = (byte *)CopyArray(q2bsp->dvis, q2bsp->visdatasize, 1);
-        mbsp->dlightdata = BSP29_CopyLightData(q2bsp->dlightdata, q2bsp->lightdatasize);
-        mbsp->dentdata = BSP29_CopyEntData(q2bsp->dentdata, q2bsp->entdatasize);
+        mbsp->dlightdata = MoveArray(q2bsp->dlightdata);
+        mbsp->dentdata = MoveArray(q2bsp->dentdata);
         mbsp->dleafs = Q2BSPtoM_Leafs(q2bsp->dleafs, q2bsp->numleafs);
-        mbsp->dplanes = BSP29_CopyPlanes(q2bsp->dplanes, q2bsp->numplanes);
-        mbsp->dvertexes = BSP29_CopyVertexes(q2bsp->dvertexes, q2bsp->numvertexes);
+        mbsp->dplanes = MoveArray(q2bsp->dplanes);
+        mbsp->dvertexes = MoveArray(q2bsp->dvertexes);
         mbsp->dnodes = Q2BSPto2_Nodes(q2bsp->dnodes, q2bsp->numnodes);
         mbsp->texinfo = Q2BSPtoM_Texinfo(q2bsp->texinfo, q2bsp->numtexinfo);
         mbsp->dfaces = Q2BSPto2_Faces(q2bsp->dfaces, q2bsp->numfaces);
         mbsp->dedges = BSP29to2_Edges(q2bsp->dedges, q2bsp->numedges);
         mbsp->dleaffaces = BSP29to2_Marksurfaces(q2bsp->dleaffaces, q2bsp->numleaffaces);
-        mbsp->dleafbrushes = Q2BSP_CopyLeafBrushes(q2bsp->dleafbrushes, q2bsp->numleafbrushes);
-        mbsp->dsurfedges = BSP29_CopySurfedges(q2bsp->dsurfedges, q2bsp->numsurfedges);
+        mbsp->dleafbrushes = MoveArray(q2bsp->dleafbrushes);
+        mbsp->dsurfedges = MoveArray(q2bsp->dsurfedges);
         
-        mbsp->dareas = Q2BSP_CopyAreas(q2bsp->dareas, q2bsp->numareas);
-        mbsp->dareaportals = Q2BSP_CopyAreaPortals(q2bsp->dareaportals, q2bsp->numareaportals);
+        mbsp->dareas = MoveArray(q2bsp->dareas);
+        mbsp->dareaportals = MoveArray(q2bsp->dareaportals);
         
-        mbsp->dbrushes = Q2BSP_CopyBrushes(q2bsp->dbrushes, q2bsp->numbrushes);
-        mbsp->dbrushsides = Q2BSP_CopyBrushSides(q2bsp->dbrushsides, q2bsp->numbrushsides);
+        mbsp->dbrushes = MoveArray(q2bsp->dbrushes);
+        mbsp->dbrushsides = MoveArray(q2bsp->dbrushsides);
         
         /* Free old data */
-        FreeQ2BSP((q2bsp_t *)q2bsp);
+        FreeQ2BSP(q2bsp);
         
         /* Conversion complete! */
         mbsp->loadversion = bspdata->version;
@@ -1676,7 +1594,7 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
     }
     
     if (bspdata->version == BSP2RMQVERSION && version == GENERIC_BSP) {
-        const bsp2rmq_t *bsp2rmq = &bspdata->data.bsp2rmq;
+        bsp2rmq_t *bsp2rmq = &bspdata->data.bsp2rmq;
         mbsp_t *mbsp = &bspdata->data.mbsp;
         
         memset(mbsp, 0, sizeof(*mbsp));
@@ -1699,24 +1617,24 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
         mbsp->numsurfedges = bsp2rmq->numsurfedges;
         
         // copy or convert data
-        mbsp->dmodels = BSP29_CopyModels(bsp2rmq->dmodels, bsp2rmq->nummodels);
-        mbsp->dvisdata = BSP29_CopyVisData(bsp2rmq->dvisdata, bsp2rmq->visdatasize);
-        mbsp->dlightdata = BSP29_CopyLightData(bsp2rmq->dlightdata, bsp2rmq->lightdatasize);
-        mbsp->dtexdata = BSP29_CopyTexData(bsp2rmq->dtexdata, bsp2rmq->texdatasize);
-        mbsp->dentdata = BSP29_CopyEntData(bsp2rmq->dentdata, bsp2rmq->entdatasize);
+        mbsp->dmodels = MoveArray(bsp2rmq->dmodels);
+        mbsp->dvisdata = MoveArray(bsp2rmq->dvisdata);
+        mbsp->dlightdata = MoveArray(bsp2rmq->dlightdata);
+        mbsp->dtexdata = MoveArray(bsp2rmq->dtexdata);
+        mbsp->dentdata = MoveArray(bsp2rmq->dentdata);
         mbsp->dleafs = BSP2rmqtoM_Leafs(bsp2rmq->dleafs, bsp2rmq->numleafs);
-        mbsp->dplanes = BSP29_CopyPlanes(bsp2rmq->dplanes, bsp2rmq->numplanes);
-        mbsp->dvertexes = BSP29_CopyVertexes(bsp2rmq->dvertexes, bsp2rmq->numvertexes);
+        mbsp->dplanes = MoveArray(bsp2rmq->dplanes);
+        mbsp->dvertexes = MoveArray(bsp2rmq->dvertexes);
         mbsp->dnodes = BSP2rmqto2_Nodes(bsp2rmq->dnodes, bsp2rmq->numnodes);
         mbsp->texinfo = BSP29toM_Texinfo(bsp2rmq->texinfo, bsp2rmq->numtexinfo);
-        mbsp->dfaces = BSP2_CopyFaces(bsp2rmq->dfaces, bsp2rmq->numfaces);
-        mbsp->dclipnodes = BSP2_CopyClipnodes(bsp2rmq->dclipnodes, bsp2rmq->numclipnodes);
-        mbsp->dedges = BSP2_CopyEdges(bsp2rmq->dedges, bsp2rmq->numedges);
-        mbsp->dleaffaces = BSP2_CopyMarksurfaces(bsp2rmq->dmarksurfaces, bsp2rmq->nummarksurfaces);
-        mbsp->dsurfedges = BSP29_CopySurfedges(bsp2rmq->dsurfedges, bsp2rmq->numsurfedges);
+        mbsp->dfaces = MoveArray(bsp2rmq->dfaces);
+        mbsp->dclipnodes = MoveArray(bsp2rmq->dclipnodes);
+        mbsp->dedges = MoveArray(bsp2rmq->dedges);
+        mbsp->dleaffaces = MoveArray(bsp2rmq->dmarksurfaces);
+        mbsp->dsurfedges = MoveArray(bsp2rmq->dsurfedges);
         
         /* Free old data */
-        FreeBSP2RMQ((bsp2rmq_t *)bsp2rmq);
+        FreeBSP2RMQ(bsp2rmq);
         
         /* Conversion complete! */
         mbsp->loadversion = bspdata->version;
@@ -1726,7 +1644,7 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
     }
     
     if (bspdata->version == BSP2VERSION && version == GENERIC_BSP) {
-        const bsp2_t *bsp2 = &bspdata->data.bsp2;
+        bsp2_t *bsp2 = &bspdata->data.bsp2;
         mbsp_t *mbsp = &bspdata->data.mbsp;
         
         memset(mbsp, 0, sizeof(*mbsp));
@@ -1749,24 +1667,24 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
         mbsp->numsurfedges = bsp2->numsurfedges;
         
         // copy or convert data
-        mbsp->dmodels = BSP29_CopyModels(bsp2->dmodels, bsp2->nummodels);
-        mbsp->dvisdata = BSP29_CopyVisData(bsp2->dvisdata, bsp2->visdatasize);
-        mbsp->dlightdata = BSP29_CopyLightData(bsp2->dlightdata, bsp2->lightdatasize);
-        mbsp->dtexdata = BSP29_CopyTexData(bsp2->dtexdata, bsp2->texdatasize);
-        mbsp->dentdata = BSP29_CopyEntData(bsp2->dentdata, bsp2->entdatasize);
+        mbsp->dmodels = MoveArray(bsp2->dmodels);
+        mbsp->dvisdata = MoveArray(bsp2->dvisdata);
+        mbsp->dlightdata = MoveArray(bsp2->dlightdata);
+        mbsp->dtexdata = MoveArray(bsp2->dtexdata);
+        mbsp->dentdata = MoveArray(bsp2->dentdata);
         mbsp->dleafs = BSP2toM_Leafs(bsp2->dleafs, bsp2->numleafs);
-        mbsp->dplanes = BSP29_CopyPlanes(bsp2->dplanes, bsp2->numplanes);
-        mbsp->dvertexes = BSP29_CopyVertexes(bsp2->dvertexes, bsp2->numvertexes);
-        mbsp->dnodes = BSP2_CopyNodes(bsp2->dnodes, bsp2->numnodes);
+        mbsp->dplanes = MoveArray(bsp2->dplanes);
+        mbsp->dvertexes = MoveArray(bsp2->dvertexes);
+        mbsp->dnodes = MoveArray(bsp2->dnodes);
         mbsp->texinfo = BSP29toM_Texinfo(bsp2->texinfo, bsp2->numtexinfo);
-        mbsp->dfaces = BSP2_CopyFaces(bsp2->dfaces, bsp2->numfaces);
-        mbsp->dclipnodes = BSP2_CopyClipnodes(bsp2->dclipnodes, bsp2->numclipnodes);
-        mbsp->dedges = BSP2_CopyEdges(bsp2->dedges, bsp2->numedges);
-        mbsp->dleaffaces = BSP2_CopyMarksurfaces(bsp2->dmarksurfaces, bsp2->nummarksurfaces);
-        mbsp->dsurfedges = BSP29_CopySurfedges(bsp2->dsurfedges, bsp2->numsurfedges);
+        mbsp->dfaces = MoveArray(bsp2->dfaces);
+        mbsp->dclipnodes = MoveArray(bsp2->dclipnodes);
+        mbsp->dedges = MoveArray(bsp2->dedges);
+        mbsp->dleaffaces = MoveArray(bsp2->dmarksurfaces);
+        mbsp->dsurfedges = MoveArray(bsp2->dsurfedges);
         
         /* Free old data */
-        FreeBSP2((bsp2_t *)bsp2);
+        FreeBSP2(bsp2);
         
         /* Conversion complete! */
         mbsp->loadversion = bspdata->version;
@@ -1779,7 +1697,7 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
     
     if (bspdata->version == GENERIC_BSP && version == BSPVERSION) {
         bsp29_t *bsp29 = &bspdata->data.bsp29;
-        const mbsp_t *mbsp = &bspdata->data.mbsp;
+        mbsp_t *mbsp = &bspdata->data.mbsp;
         
         memset(bsp29, 0, sizeof(*bsp29));
         
@@ -1801,24 +1719,24 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
         bsp29->numsurfedges = mbsp->numsurfedges;
         
         // copy or convert data
-        bsp29->dmodels = BSP29_CopyModels(mbsp->dmodels, mbsp->nummodels);
-        bsp29->dvisdata = BSP29_CopyVisData(mbsp->dvisdata, mbsp->visdatasize);
-        bsp29->dlightdata = BSP29_CopyLightData(mbsp->dlightdata, mbsp->lightdatasize);
-        bsp29->dtexdata = BSP29_CopyTexData(mbsp->dtexdata, mbsp->texdatasize);
-        bsp29->dentdata = BSP29_CopyEntData(mbsp->dentdata, mbsp->entdatasize);
+        bsp29->dmodels = MoveArray(mbsp->dmodels);
+        bsp29->dvisdata = MoveArray(mbsp->dvisdata);
+        bsp29->dlightdata = MoveArray(mbsp->dlightdata);
+        bsp29->dtexdata = MoveArray(mbsp->dtexdata);
+        bsp29->dentdata = MoveArray(mbsp->dentdata);
         bsp29->dleafs = MBSPto29_Leafs(mbsp->dleafs, mbsp->numleafs);
-        bsp29->dplanes = BSP29_CopyPlanes(mbsp->dplanes, mbsp->numplanes);
-        bsp29->dvertexes = BSP29_CopyVertexes(mbsp->dvertexes, mbsp->numvertexes);
+        bsp29->dplanes = MoveArray(mbsp->dplanes);
+        bsp29->dvertexes = MoveArray(mbsp->dvertexes);
         bsp29->dnodes = BSP2to29_Nodes(mbsp->dnodes, mbsp->numnodes);
         bsp29->texinfo = MBSPto29_Texinfo(mbsp->texinfo, mbsp->numtexinfo);
         bsp29->dfaces = BSP2to29_Faces(mbsp->dfaces, mbsp->numfaces);
         bsp29->dclipnodes = BSP2to29_Clipnodes(mbsp->dclipnodes, mbsp->numclipnodes);
         bsp29->dedges = BSP2to29_Edges(mbsp->dedges, mbsp->numedges);
         bsp29->dmarksurfaces = BSP2to29_Marksurfaces(mbsp->dleaffaces, mbsp->numleaffaces);
-        bsp29->dsurfedges = BSP29_CopySurfedges(mbsp->dsurfedges, mbsp->numsurfedges);
+        bsp29->dsurfedges = MoveArray(mbsp->dsurfedges);
         
         /* Free old data */
-        FreeMBSP((mbsp_t *)mbsp);
+        FreeMBSP(mbsp);
         
         /* Conversion complete! */
         bspdata->version = version;
@@ -1827,7 +1745,7 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
     }
     
     if (bspdata->version == GENERIC_BSP && version == Q2_BSPVERSION) {
-        const mbsp_t *mbsp = &bspdata->data.mbsp;
+        mbsp_t *mbsp = &bspdata->data.mbsp;
         q2bsp_t *q2bsp = &bspdata->data.q2bsp;
         
         memset(q2bsp, 0, sizeof(*q2bsp));
@@ -1855,27 +1773,27 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
         // copy or convert data
         q2bsp->dmodels = MBSPtoQ2_Models(mbsp->dmodels, mbsp->nummodels);
         q2bsp->dvis = (dvis_t *)CopyArray(mbsp->dvisdata, mbsp->visdatasize, 1);
-        q2bsp->dlightdata = BSP29_CopyLightData(mbsp->dlightdata, mbsp->lightdatasize);
-        q2bsp->dentdata = BSP29_CopyEntData(mbsp->dentdata, mbsp->entdatasize);
+        q2bsp->dlightdata = MoveArray(mbsp->dlightdata);
+        q2bsp->dentdata = MoveArray(mbsp->dentdata);
         q2bsp->dleafs = MBSPtoQ2_Leafs(mbsp->dleafs, mbsp->numleafs);
-        q2bsp->dplanes = BSP29_CopyPlanes(mbsp->dplanes, mbsp->numplanes);
-        q2bsp->dvertexes = BSP29_CopyVertexes(mbsp->dvertexes, mbsp->numvertexes);
+        q2bsp->dplanes = MoveArray(mbsp->dplanes);
+        q2bsp->dvertexes = MoveArray(mbsp->dvertexes);
         q2bsp->dnodes = BSP2toQ2_Nodes(mbsp->dnodes, mbsp->numnodes);
         q2bsp->texinfo = MBSPtoQ2_Texinfo(mbsp->texinfo, mbsp->numtexinfo);
         q2bsp->dfaces = BSP2toQ2_Faces(mbsp->dfaces, mbsp->numfaces);
         q2bsp->dedges = BSP2to29_Edges(mbsp->dedges, mbsp->numedges);
         q2bsp->dleaffaces = BSP2to29_Marksurfaces(mbsp->dleaffaces, mbsp->numleaffaces);
-        q2bsp->dleafbrushes = Q2BSP_CopyLeafBrushes(mbsp->dleafbrushes, mbsp->numleafbrushes);
-        q2bsp->dsurfedges = BSP29_CopySurfedges(mbsp->dsurfedges, mbsp->numsurfedges);
+        q2bsp->dleafbrushes = MoveArray(mbsp->dleafbrushes);
+        q2bsp->dsurfedges = MoveArray(mbsp->dsurfedges);
         
-        q2bsp->dareas = Q2BSP_CopyAreas(mbsp->dareas, mbsp->numareas);
-        q2bsp->dareaportals = Q2BSP_CopyAreaPortals(mbsp->dareaportals, mbsp->numareaportals);
+        q2bsp->dareas = MoveArray(mbsp->dareas);
+        q2bsp->dareaportals = MoveArray(mbsp->dareaportals);
         
-        q2bsp->dbrushes = Q2BSP_CopyBrushes(mbsp->dbrushes, mbsp->numbrushes);
-        q2bsp->dbrushsides = Q2BSP_CopyBrushSides(mbsp->dbrushsides, mbsp->numbrushsides);
+        q2bsp->dbrushes = MoveArray(mbsp->dbrushes);
+        q2bsp->dbrushsides = MoveArray(mbsp->dbrushsides);
         
         /* Free old data */
-        FreeMBSP((mbsp_t *)mbsp);
+        FreeMBSP(mbsp);
         
         /* Conversion complete! */
         bspdata->version = version;
@@ -1885,7 +1803,7 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
     
     if (bspdata->version == GENERIC_BSP && version == BSP2RMQVERSION) {
         bsp2rmq_t *bsp2rmq = &bspdata->data.bsp2rmq;
-        const mbsp_t *mbsp = &bspdata->data.mbsp;
+        mbsp_t *mbsp = &bspdata->data.mbsp;
         
         memset(bsp2rmq, 0, sizeof(*bsp2rmq));
         
@@ -1907,24 +1825,24 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
         bsp2rmq->numsurfedges = mbsp->numsurfedges;
         
         // copy or convert data
-        bsp2rmq->dmodels = BSP29_CopyModels(mbsp->dmodels, mbsp->nummodels);
-        bsp2rmq->dvisdata = BSP29_CopyVisData(mbsp->dvisdata, mbsp->visdatasize);
-        bsp2rmq->dlightdata = BSP29_CopyLightData(mbsp->dlightdata, mbsp->lightdatasize);
-        bsp2rmq->dtexdata = BSP29_CopyTexData(mbsp->dtexdata, mbsp->texdatasize);
-        bsp2rmq->dentdata = BSP29_CopyEntData(mbsp->dentdata, mbsp->entdatasize);
+        bsp2rmq->dmodels = MoveArray(mbsp->dmodels);
+        bsp2rmq->dvisdata = MoveArray(mbsp->dvisdata);
+        bsp2rmq->dlightdata = MoveArray(mbsp->dlightdata);
+        bsp2rmq->dtexdata = MoveArray(mbsp->dtexdata);
+        bsp2rmq->dentdata = MoveArray(mbsp->dentdata);
         bsp2rmq->dleafs = MBSPto2rmq_Leafs(mbsp->dleafs, mbsp->numleafs);
-        bsp2rmq->dplanes = BSP29_CopyPlanes(mbsp->dplanes, mbsp->numplanes);
-        bsp2rmq->dvertexes = BSP29_CopyVertexes(mbsp->dvertexes, mbsp->numvertexes);
+        bsp2rmq->dplanes = MoveArray(mbsp->dplanes);
+        bsp2rmq->dvertexes = MoveArray(mbsp->dvertexes);
         bsp2rmq->dnodes = BSP2to2rmq_Nodes(mbsp->dnodes, mbsp->numnodes);
         bsp2rmq->texinfo = MBSPto29_Texinfo(mbsp->texinfo, mbsp->numtexinfo);
-        bsp2rmq->dfaces = BSP2_CopyFaces(mbsp->dfaces, mbsp->numfaces);
-        bsp2rmq->dclipnodes = BSP2_CopyClipnodes(mbsp->dclipnodes, mbsp->numclipnodes);
-        bsp2rmq->dedges = BSP2_CopyEdges(mbsp->dedges, mbsp->numedges);
-        bsp2rmq->dmarksurfaces = BSP2_CopyMarksurfaces(mbsp->dleaffaces, mbsp->numleaffaces);
-        bsp2rmq->dsurfedges = BSP29_CopySurfedges(mbsp->dsurfedges, mbsp->numsurfedges);
+        bsp2rmq->dfaces = MoveArray(mbsp->dfaces);
+        bsp2rmq->dclipnodes = MoveArray(mbsp->dclipnodes);
+        bsp2rmq->dedges = MoveArray(mbsp->dedges);
+        bsp2rmq->dmarksurfaces = MoveArray(mbsp->dleaffaces);
+        bsp2rmq->dsurfedges = MoveArray(mbsp->dsurfedges);
         
         /* Free old data */
-        FreeMBSP((mbsp_t *)mbsp);
+        FreeMBSP(mbsp);
         
         /* Conversion complete! */
         bspdata->version = version;
@@ -1934,7 +1852,7 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
     
     if (bspdata->version == GENERIC_BSP && version == BSP2VERSION) {
         bsp2_t *bsp2 = &bspdata->data.bsp2;
-        const mbsp_t *mbsp = &bspdata->data.mbsp;
+        mbsp_t *mbsp = &bspdata->data.mbsp;
         
         memset(bsp2, 0, sizeof(*bsp2));
         
@@ -1956,24 +1874,24 @@ ConvertBSPFormat(int32_t version, bspdata_t *bspdata)
         bsp2->numsurfedges = mbsp->numsurfedges;
         
         // copy or convert data
-        bsp2->dmodels = BSP29_CopyModels(mbsp->dmodels, mbsp->nummodels);
-        bsp2->dvisdata = BSP29_CopyVisData(mbsp->dvisdata, mbsp->visdatasize);
-        bsp2->dlightdata = BSP29_CopyLightData(mbsp->dlightdata, mbsp->lightdatasize);
-        bsp2->dtexdata = BSP29_CopyTexData(mbsp->dtexdata, mbsp->texdatasize);
-        bsp2->dentdata = BSP29_CopyEntData(mbsp->dentdata, mbsp->entdatasize);
+        bsp2->dmodels = MoveArray(mbsp->dmodels);
+        bsp2->dvisdata = MoveArray(mbsp->dvisdata);
+        bsp2->dlightdata = MoveArray(mbsp->dlightdata);
+        bsp2->dtexdata = MoveArray(mbsp->dtexdata);
+        bsp2->dentdata = MoveArray(mbsp->dentdata);
         bsp2->dleafs = MBSPto2_Leafs(mbsp->dleafs, mbsp->numleafs);
-        bsp2->dplanes = BSP29_CopyPlanes(mbsp->dplanes, mbsp->numplanes);
-        bsp2->dvertexes = BSP29_CopyVertexes(mbsp->dvertexes, mbsp->numvertexes);
-        bsp2->dnodes = BSP2_CopyNodes(mbsp->dnodes, mbsp->numnodes);
+        bsp2->dplanes = MoveArray(mbsp->dplanes);
+        bsp2->dvertexes = MoveArray(mbsp->dvertexes);
+        bsp2->dnodes = MoveArray(mbsp->dnodes);
         bsp2->texinfo = MBSPto29_Texinfo(mbsp->texinfo, mbsp->numtexinfo);
-        bsp2->dfaces = BSP2_CopyFaces(mbsp->dfaces, mbsp->numfaces);
-        bsp2->dclipnodes = BSP2_CopyClipnodes(mbsp->dclipnodes, mbsp->numclipnodes);
-        bsp2->dedges = BSP2_CopyEdges(mbsp->dedges, mbsp->numedges);
-        bsp2->dmarksurfaces = BSP2_CopyMarksurfaces(mbsp->dleaffaces, mbsp->numleaffaces);
-        bsp2->dsurfedges = BSP29_CopySurfedges(mbsp->dsurfedges, mbsp->numsurfedges);
+        bsp2->dfaces = MoveArray(mbsp->dfaces);
+        bsp2->dclipnodes = MoveArray(mbsp->dclipnodes);
+        bsp2->dedges = MoveArray(mbsp->dedges);
+        bsp2->dmarksurfaces = MoveArray(mbsp->dleaffaces);
+        bsp2->dsurfedges = MoveArray(mbsp->dsurfedges);
         
         /* Free old data */
-        FreeMBSP((mbsp_t *)mbsp);
+        FreeMBSP(mbsp);
         
         /* Conversion complete! */
         bspdata->version = version;
@@ -2273,9 +2191,15 @@ LoadBSPFile(char *filename, bspdata_t *bspdata)
     
     logprint("LoadBSPFile: '%s'\n", filename);
     
-    /* load the file header */
+    /*
+     * load the file header. Plain files are mapped rather than read, so
+     * the only heap copy of the data is the lumps copied out below.
+     */
     byte *file_data;
-    uint32_t flen = LoadFilePak(filename, &file_data);
+    int mappedlen = MapFile(filename, &file_data);
+    uint32_t flen = (mappedlen >= 0) ? mappedlen : LoadFilePak(filename, &file_data);
+    if (flen < sizeof(dheader_t))
+        Error("%s: %s is too short to be a BSP file (%u bytes)", __func__, filename, flen);
 
     /* transfer the header data to these variables */
     int numlumps;
@@ -2284,6 +2208,8 @@ LoadBSPFile(char *filename, bspdata_t *bspdata)
 
     /* check for IBSP */
     if (LittleLong(((int *)file_data)[0]) == Q2_BSPIDENT) {
+        if (flen < sizeof(q2_dheader_t))
+            Error("%s: %s is too short to be a BSP file (%u bytes)", __func__, filename, flen);
         q2_dheader_t *q2header = (q2_dheader_t *)file_data;
         q2header->version = LittleLong(q2header->version);
         
@@ -2448,9 +2374,7 @@ LoadBSPFile(char *filename, bspdata_t *bspdata)
                 {
                     uint32_t ofs = LittleLong(xlump[xlumps].fileofs);
                     uint32_t len = LittleLong(xlump[xlumps].filelen);
-                    void *lumpdata = malloc(len);
-                    memcpy(lumpdata, (const byte*)header + ofs, len);
-                    BSPX_AddLump(bspdata, xlump[xlumps].lumpname, lumpdata, len);
+                    BSPX_AddLump(bspdata, xlump[xlumps].lumpname, (const byte*)header + ofs, len);
                 }
             }
             else
@@ -2462,7 +2386,10 @@ LoadBSPFile(char *filename, bspdata_t *bspdata)
     }
     
     /* everything has been copied out */
-    free(file_data);
+    if (mappedlen >= 0)
+        UnmapFile(file_data, mappedlen);
+    else
+        free(file_data);
 
     /* swap everything */
     SwapBSPFile(bspdata, TO_CPU);
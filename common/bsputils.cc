@@ -449,3 +449,107 @@ void Face_DebugPrint(const mbsp_t *bsp, const bsp2_dface_t *face)
                  edge);
     }
 }
+
+int BSP_NumClusters(const mbsp_t *bsp)
+{
+    if (!bsp->visdatasize)
+        return 0;
+    
+    if (bsp->loadversion == Q2_BSPVERSION) {
+        const dvis_t *dvis = reinterpret_cast<const dvis_t *>(bsp->dvisdata);
+        return dvis->numclusters;
+    }
+    
+    // Q1 has one cluster per leaf, not including the solid leaf 0
+    return bsp->dmodels[0].visleafs;
+}
+
+int BSP_LeafCluster(const mbsp_t *bsp, const mleaf_t *leaf)
+{
+    if (!bsp->visdatasize)
+        return -1;
+    
+    if (bsp->loadversion == Q2_BSPVERSION) {
+        if (leaf->contents & Q2_CONTENTS_SOLID)
+            return -1;
+        return leaf->cluster;
+    }
+    
+    const int leafnum = static_cast<int>(leaf - bsp->dleafs);
+    if (leafnum < 1 || leafnum > bsp->dmodels[0].visleafs)
+        return -1;
+    if (leaf->contents == CONTENTS_SOLID || leaf->visofs < 0)
+        return -1;
+    return leafnum - 1;
+}
+
+bool BSP_DecompressClusterPVS(const mbsp_t *bsp, const int cluster, uint8_t *out)
+{
+    const int numclusters = BSP_NumClusters(bsp);
+    if (cluster < 0 || cluster >= numclusters)
+        return false;
+    
+    int visofs;
+    if (bsp->loadversion == Q2_BSPVERSION) {
+        const dvis_t *dvis = reinterpret_cast<const dvis_t *>(bsp->dvisdata);
+        visofs = dvis->bitofs[cluster][DVIS_PVS];
+    } else {
+        visofs = bsp->dleafs[cluster + 1].visofs;
+    }
+    if (visofs < 0 || visofs >= bsp->visdatasize)
+        return false;
+    
+    // zero bytes are run-length encoded as 0, count
+    const uint8_t *in = bsp->dvisdata + visofs;
+    const uint8_t *in_end = bsp->dvisdata + bsp->visdatasize;
+    uint8_t *out_p = out;
+    uint8_t *out_end = out + ((numclusters + 7) >> 3);
+    
+    while (out_p < out_end && in < in_end) {
+        if (*in) {
+            *out_p++ = *in++;
+            continue;
+        }
+        if (in + 1 >= in_end)
+            break;
+        int count = in[1];
+        in += 2;
+        while (count-- && out_p < out_end) {
+            *out_p++ = 0;
+        }
+    }
+    
+    // treat anything truncated as visible
+    while (out_p < out_end) {
+        *out_p++ = 0xff;
+    }
+    return true;
+}
+
+bool BSP_VisSeesThroughLiquids(const mbsp_t *bsp)
+{
+    // Q2 vis always sees through liquids
+    if (bsp->loadversion == Q2_BSPVERSION)
+        return true;
+    
+    const int numclusters = BSP_NumClusters(bsp);
+    std::vector<uint8_t> row((numclusters + 7) >> 3);
+    bool liquids = false;
+    
+    for (int i = 0; i < numclusters; i++) {
+        const mleaf_t *leaf = &bsp->dleafs[i + 1];
+        if (leaf->contents != CONTENTS_WATER
+            && leaf->contents != CONTENTS_SLIME
+            && leaf->contents != CONTENTS_LAVA)
+            continue;
+        liquids = true;
+        if (!BSP_DecompressClusterPVS(bsp, i, row.data()))
+            continue;
+        
+        for (int j = 0; j < numclusters; j++) {
+            if ((row[j >> 3] & (1 << (j & 7))) && bsp->dleafs[j + 1].contents == CONTENTS_EMPTY)
+                return true;
+        }
+    }
+    return !liquids;
+}
@@ -31,6 +31,8 @@
 
 #ifdef LINUX
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #endif
@@ -718,6 +720,68 @@ LoadFile(const char *filename, void *destptr)
     return length;
 }
 
+/*
+ * ==============
+ * MapFile
+ * maps a file into memory, copy-on-write, instead of reading it into a
+ * malloc'd buffer. Returns -1 if the file can't be opened. Platforms
+ * without mmap fall back to LoadFile. Release with UnmapFile.
+ * ==============
+ */
+int
+MapFile(const char *filename, void *destptr)
+{
+    byte **bufferptr = static_cast<byte**>(destptr);
+#ifdef LINUX
+    struct stat st;
+    int fd;
+    void *buffer;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0)
+        Error("%s: stat of %s failed: %s", __func__, filename, strerror(errno));
+
+    /* mmap can't map an empty file, so hand out an empty buffer */
+    if (st.st_size == 0) {
+        close(fd);
+        *bufferptr = NULL;
+        return 0;
+    }
+
+    buffer = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buffer == MAP_FAILED)
+        Error("%s: mapping %s failed: %s", __func__, filename, strerror(errno));
+
+    *bufferptr = static_cast<byte*>(buffer);
+    return st.st_size;
+#else
+    FILE *file = fopen(filename, "rb");
+    if (!file)
+        return -1;
+    fclose(file);
+    return LoadFile(filename, destptr);
+#endif
+}
+
+/*
+ * ==============
+ * UnmapFile
+ * ==============
+ */
+void
+UnmapFile(void *buffer, int length)
+{
+#ifdef LINUX
+    if (buffer)
+        munmap(buffer, length);
+#else
+    free(buffer);
+#endif
+}
+
 /*
  * ==============
  * SaveFile
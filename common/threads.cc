@@ -7,6 +7,10 @@
 #include <common/log.hh>
 #include <common/threads.hh>
 
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
 /*
  * FIXME - Temporary hack while trying to get qbsp to use the common
  *         thread/logging code.  Error() would normally be defined in
@@ -18,46 +22,210 @@ void Error(const char *error, ...)
 /* Make the locks no-ops if we aren't running threads */
 static bool threads_active = false;
 
-static int dispatch;
+/* false while RunThreadsOnQuiet is running */
+static bool threads_progress = true;
+
+/*
+ * Work-stealing dispatch
+ *
+ * The work items are dealt round-robin into one queue per thread (most
+ * expensive first, when costs are given). Each queue is a range of
+ * `workqueue` packed into a single 64-bit word: the owner pops from the
+ * front and idle threads steal the back half, both with one
+ * compare-and-swap, so handing out work never takes the global lock.
+ */
+struct threadqueue_t {
+    std::atomic<uint64_t> range; /* begin in the low 32 bits, end in the high 32 bits */
+    char pad[64 - sizeof(std::atomic<uint64_t>)]; /* keep queues on separate cache lines */
+};
+
+static std::vector<int> workqueue;
+static threadqueue_t *threadqueues;
+static int numthreadqueues;
+
+static int workstart;
 static int workcount;
-static int oldpercent = -1;
+static std::atomic<int> dispatched;
+static std::atomic<int> oldpercent(-1);
+
+/* index of the calling thread's queue, -1 for threads not started by RunThreadsOn */
+static thread_local int threadnum = -1;
+
+static inline uint64_t
+ThreadQueue_Range(uint32_t begin, uint32_t end)
+{
+    return (static_cast<uint64_t>(end) << 32) | begin;
+}
+
+static void
+ThreadQueues_Init(int start, int workcnt, const float *cost, int numqueues)
+{
+    std::vector<int> order;
+    for (int i = start; i < workcnt; i++)
+        order.push_back(i);
+
+    if (cost) {
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+            return cost[a - start] > cost[b - start];
+        });
+    }
+
+    numthreadqueues = numqueues;
+    threadqueues = new threadqueue_t[numqueues];
+    workqueue.clear();
+    workqueue.reserve(order.size());
+
+    for (int i = 0; i < numqueues; i++) {
+        const uint32_t begin = static_cast<uint32_t>(workqueue.size());
+        for (size_t j = i; j < order.size(); j += numqueues)
+            workqueue.push_back(order[j]);
+        threadqueues[i].range = ThreadQueue_Range(begin, static_cast<uint32_t>(workqueue.size()));
+    }
+
+    workstart = start;
+    workcount = workcnt;
+    dispatched = 0;
+    oldpercent = -1;
+}
+
+static void
+ThreadQueues_Free(void)
+{
+    delete[] threadqueues;
+    threadqueues = NULL;
+    numthreadqueues = 0;
+    workqueue.clear();
+}
+
+static int
+ThreadQueue_Pop(threadqueue_t *queue)
+{
+    uint64_t range = queue->range.load();
+    while (1) {
+        const uint32_t begin = static_cast<uint32_t>(range);
+        const uint32_t end = static_cast<uint32_t>(range >> 32);
+        if (begin >= end)
+            return -1;
+        if (queue->range.compare_exchange_weak(range, ThreadQueue_Range(begin + 1, end)))
+            return workqueue[begin];
+    }
+}
 
 /*
- * =============
- * GetThreadWork
- * =============
+ * Takes the back half of the fullest queue. The first stolen item is
+ * returned, the rest becomes the thief's own (empty) queue.
  */
-int
-GetThreadWork_Locked__(void)
+static int
+ThreadQueue_Steal(int thief)
 {
-    int ret;
-    int percent;
+    while (1) {
+        int victim = -1;
+        uint64_t victimrange = 0;
+        uint32_t most = 0;
+
+        for (int i = 0; i < numthreadqueues; i++) {
+            if (i == thief)
+                continue;
+            const uint64_t range = threadqueues[i].range.load();
+            const uint32_t begin = static_cast<uint32_t>(range);
+            const uint32_t end = static_cast<uint32_t>(range >> 32);
+            if (end > begin && end - begin > most) {
+                most = end - begin;
+                victim = i;
+                victimrange = range;
+            }
+        }
+        if (victim == -1)
+            return -1;
+
+        const uint32_t begin = static_cast<uint32_t>(victimrange);
+        const uint32_t end = static_cast<uint32_t>(victimrange >> 32);
+
+        if (thief < 0) {
+            /* no queue to put the rest in; take a single item */
+            if (threadqueues[victim].range.compare_exchange_strong(victimrange, ThreadQueue_Range(begin, end - 1)))
+                return workqueue[end - 1];
+            continue;
+        }
+
+        const uint32_t mid = begin + (end - begin) / 2;
+        if (!threadqueues[victim].range.compare_exchange_strong(victimrange, ThreadQueue_Range(begin, mid)))
+            continue;
+
+        threadqueues[thief].range = ThreadQueue_Range(mid + 1, end);
+        return workqueue[mid];
+    }
+}
 
-    if (dispatch == workcount)
-        return -1;
+static void
+ThreadProgress(int dispatch, bool locked)
+{
+    if (!threads_progress)
+        return;
+
+    const int percent = 50 * dispatch / workcount;
 
-    percent = 50 * dispatch / workcount;
+    if (oldpercent.load() >= percent)
+        return;
+
+    if (!locked)
+        ThreadLock();
     while (oldpercent < percent) {
-        oldpercent++;
-        logprint_locked__("%c", (oldpercent % 5) ? '.' : '0' + (oldpercent / 5));
+        const int printpercent = ++oldpercent;
+        logprint_locked__("%c", (printpercent % 5) ? '.' : '0' + (printpercent / 5));
     }
+    if (!locked)
+        ThreadUnlock();
+}
 
-    ret = dispatch;
-    dispatch++;
+static int
+GetThreadWork__(bool locked)
+{
+    if (!threadqueues)
+        return -1;
+
+    int ret = -1;
+    if (threadnum >= 0 && threadnum < numthreadqueues)
+        ret = ThreadQueue_Pop(&threadqueues[threadnum]);
+    if (ret == -1)
+        ret = ThreadQueue_Steal(threadnum < numthreadqueues ? threadnum : -1);
+    if (ret == -1)
+        return -1;
+
+    ThreadProgress(workstart + dispatched++, locked);
 
     return ret;
 }
 
+/*
+ * =============
+ * GetThreadWork
+ * =============
+ */
 int
-GetThreadWork(void)
+GetThreadWork_Locked__(void)
 {
-    int ret;
+    return GetThreadWork__(true);
+}
 
-    ThreadLock();
-    ret = GetThreadWork_Locked__();
-    ThreadUnlock();
+int
+GetThreadWork(void)
+{
+    return GetThreadWork__(false);
+}
 
-    return ret;
+/*
+ * =============
+ * ThreadsActive
+ *
+ * True while RunThreadsOn is running, so code shared between threaded and
+ * unthreaded callers can avoid starting threads from a worker.
+ * =============
+ */
+bool
+ThreadsActive(void)
+{
+    return threads_active;
 }
 
 void
@@ -69,6 +237,53 @@ InterruptThreadProgress__(void)
     }
 }
 
+struct threadstart_t {
+    void *(*func)(void *);
+    void *arg;
+    int threadnum;
+};
+
+static void *
+ThreadStart(void *arg)
+{
+    const threadstart_t *start = static_cast<const threadstart_t *>(arg);
+
+    threadnum = start->threadnum;
+    void *ret = start->func(start->arg);
+    threadnum = -1;
+
+    return ret;
+}
+
+/*
+ * =============
+ * RunThreadsOn
+ *
+ * Compatibility wrapper for callers without cost estimates.
+ * =============
+ */
+void
+RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
+{
+    RunThreadsOnWithCost(start, workcnt, NULL, func, arg);
+}
+
+/*
+ * =============
+ * RunThreadsOnQuiet
+ *
+ * As RunThreadsOn, without the progress bar, for work that is a small
+ * part of a bigger stage.
+ * =============
+ */
+void
+RunThreadsOnQuiet(int start, int workcnt, void *(func)(void *), void *arg)
+{
+    threads_progress = false;
+    RunThreadsOnWithCost(start, workcnt, NULL, func, arg);
+    threads_progress = true;
+}
+
 /*
  * ===================================================================
  *                              WIN32
@@ -113,35 +328,38 @@ ThreadUnlock(void)
 }
 
 /*
- * =============
- * RunThreadsOn
- * =============
+ * ====================
+ * RunThreadsOnWithCost
+ * ====================
  */
 void
-RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
+RunThreadsOnWithCost(int start, int workcnt, const float *cost, void *(func)(void *), void *arg)
 {
     uintptr_t i; /* avoid warning due to cast for the CreateThread API */
     DWORD *threadid;
     HANDLE *threadhandle;
+    threadstart_t *threadstart;
 
-    dispatch = start;
-    workcount = workcnt;
-    oldpercent = -1;
+    ThreadQueues_Init(start, workcnt, cost, numthreads);
 
     threadid = static_cast<DWORD *>(malloc(sizeof(*threadid) * numthreads));
     threadhandle = static_cast<HANDLE *>(malloc(sizeof(*threadhandle) * numthreads));
+    threadstart = static_cast<threadstart_t *>(malloc(sizeof(*threadstart) * numthreads));
 
-    if (!threadid || !threadhandle)
+    if (!threadid || !threadhandle || !threadstart)
         Error("Failed to allocate memory for threads");
 
     /* run threads in parallel */
     InitializeCriticalSection(&crit);
     threads_active = true;
     for (i = 0; i < numthreads; i++) {
+        threadstart[i].func = func;
+        threadstart[i].arg = arg;
+        threadstart[i].threadnum = static_cast<int>(i);
         threadhandle[i] = CreateThread(NULL,
                                        0,
-                                       (LPTHREAD_START_ROUTINE)func,
-                                       (LPVOID)arg,
+                                       (LPTHREAD_START_ROUTINE)ThreadStart,
+                                       (LPVOID)&threadstart[i],
                                        0,
                                        &threadid[i]);
     }
@@ -152,9 +370,12 @@ RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
     threads_active = false;
     oldpercent = -1;
     DeleteCriticalSection(&crit);
+    ThreadQueues_Free();
 
-    logprint("\n");
+    if (threads_progress)
+        logprint("\n");
 
+    free(threadstart);
     free(threadhandle);
     free(threadid);
 }
@@ -214,22 +435,21 @@ ThreadUnlock(void)
 
 
 /*
- * =============
- * RunThreadsOn
- * =============
+ * ====================
+ * RunThreadsOnWithCost
+ * ====================
  */
 void
-RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
+RunThreadsOnWithCost(int start, int workcnt, const float *cost, void *(func)(void *), void *arg)
 {
     pthread_t *threads;
+    threadstart_t *threadstart;
     pthread_mutexattr_t mattrib;
     pthread_attr_t attrib;
     int status;
     int i;
 
-    dispatch = start;
-    workcount = workcnt;
-    oldpercent = -1;
+    ThreadQueues_Init(start, workcnt, cost, numthreads);
 
     status = pthread_mutexattr_init(&mattrib);
     if (status)
@@ -247,13 +467,17 @@ RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
         Error("pthread_attr_init failed");
 
     threads = static_cast<pthread_t *>(malloc(sizeof(*threads) * numthreads));
-    if (!threads)
+    threadstart = static_cast<threadstart_t *>(malloc(sizeof(*threadstart) * numthreads));
+    if (!threads || !threadstart)
         Error("failed to allocate memory for threads");
 
     threads_active = true;
 
     for (i = 0; i < numthreads; i++) {
-        status = pthread_create(&threads[i], &attrib, func, arg);
+        threadstart[i].func = func;
+        threadstart[i].arg = arg;
+        threadstart[i].threadnum = i;
+        status = pthread_create(&threads[i], &attrib, ThreadStart, &threadstart[i]);
         if (status)
             Error("pthread_create failed");
     }
@@ -271,10 +495,14 @@ RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
     if (status)
         Error("pthread_mutex_destroy failed");
 
+    ThreadQueues_Free();
+
+    free(threadstart);
     free(threads);
     free(my_mutex);
 
-    logprint("\n");
+    if (threads_progress)
+        logprint("\n");
 }
 
 #endif /* USE_PTHREADS */
@@ -293,20 +521,27 @@ void ThreadLock(void) {}
 void ThreadUnlock(void) {}
 
 /*
- * =============
- * RunThreadsOn
- * =============
+ * ====================
+ * RunThreadsOnWithCost
+ * ====================
  */
 void
-RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg)
+RunThreadsOnWithCost(int start, int workcnt, const float *cost, void *(func)(void *), void *arg)
 {
-    dispatch = start;
-    workcount = workcnt;
-    oldpercent = -1;
+    threadstart_t threadstart;
 
-    func(arg);
+    ThreadQueues_Init(start, workcnt, cost, 1);
+
+    threadstart.func = func;
+    threadstart.arg = arg;
+    threadstart.threadnum = 0;
+    ThreadStart(&threadstart);
+
+    oldpercent = -1;
+    ThreadQueues_Free();
 
-    logprint("\n");
+    if (threads_progress)
+        logprint("\n");
 }
 
 #endif
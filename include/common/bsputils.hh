@@ -72,4 +72,22 @@ std::vector<qvec3f> GLM_FacePoints(const mbsp_t *bsp, const bsp2_dface_t *face);
 qvec3f Face_Centroid(const mbsp_t *bsp, const bsp2_dface_t *face);
 void Face_DebugPrint(const mbsp_t *bsp, const bsp2_dface_t *face);
 
+/*
+ * PVS access. Clusters are the units the PVS is stored in: Q2 clusters, or
+ * leafs 1..visleafs in Q1 (cluster = leafnum - 1).
+ * BSP_LeafCluster returns -1 if there is no vis data for the leaf.
+ * BSP_DecompressClusterPVS writes (BSP_NumClusters(bsp) + 7) / 8 bytes to `out`.
+ */
+int BSP_NumClusters(const mbsp_t *bsp);
+int BSP_LeafCluster(const mbsp_t *bsp, const mleaf_t *leaf);
+bool BSP_DecompressClusterPVS(const mbsp_t *bsp, int cluster, uint8_t *out);
+
+/*
+ * True unless the map has liquid leafs and none of them sees an empty leaf,
+ * which is what vis produces when it treats liquids as opaque (qbsp
+ * -notranswater). The PVS is then wrong for light, which still passes
+ * through liquids.
+ */
+bool BSP_VisSeesThroughLiquids(const mbsp_t *bsp);
+
 #endif /* __COMMON_BSPUTILS_HH__ */
@@ -91,6 +91,8 @@ void SafeWrite(FILE *f, const void *buffer, int count);
 
 int LoadFilePak(char *filename, void *destptr);
 int LoadFile(const char *filename, void *destptr);
+int MapFile(const char *filename, void *destptr);
+void UnmapFile(void *buffer, int length);
 void SaveFile(const char *filename, const void *buffer, int count);
 
 void DefaultExtension(char *path, const char *extension);
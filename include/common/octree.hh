@@ -22,9 +22,9 @@
 
 #include <common/aabb.hh>
 
+#include <algorithm>
 #include <utility> // for std::pair
 #include <vector>
-#include <set>
 #include <cassert>
 
 static inline aabb3f bboxOctant(const aabb3f &box, int i)
@@ -110,14 +110,15 @@ private:
         node->m_leafNode = false;
     }
     
-    void queryTouchingBBox(octree_nodeid thisNode, const aabb3f &query, std::set<T> &dest) const {
+    // appends to dest; objects in several leafs are appended once per leaf
+    void queryTouchingBBox(octree_nodeid thisNode, const aabb3f &query, std::vector<T> &dest) const {
         const octree_node_t<T> *node = &m_nodes[thisNode];
         
         if (node->m_leafNode) {
             // Test all objects
             for (const auto &boxObjPair : node->m_leafObjects) {
                 if (!query.disjoint(boxObjPair.first)) {
-                    dest.insert(boxObjPair.second);
+                    dest.push_back(boxObjPair.second);
                 }
             }
             return;
@@ -169,16 +170,19 @@ public:
         insert(0, objBox, obj);
     }
     
-    std::vector<T> queryTouchingBBox(const aabb3f &query) const {
-        std::set<T> res;
-        queryTouchingBBox(0, query, res);
+    // sorted, without duplicates; reuses the storage of dest
+    void queryTouchingBBox(const aabb3f &query, std::vector<T> &dest) const {
+        dest.clear();
+        queryTouchingBBox(0, query, dest);
         
-        std::vector<T> res_vec;
-        res_vec.reserve(res.size()); //mxd. https://clang.llvm.org/extra/clang-tidy/checks/performance-inefficient-vector-operation.html
-        for (const auto &item : res) {
-            res_vec.push_back(item);
-        }
-        return res_vec;
+        std::sort(dest.begin(), dest.end());
+        dest.erase(std::unique(dest.begin(), dest.end()), dest.end());
+    }
+    
+    std::vector<T> queryTouchingBBox(const aabb3f &query) const {
+        std::vector<T> res;
+        queryTouchingBBox(query, res);
+        return res;
     }
     
     octree_t(const aabb3f &box) {
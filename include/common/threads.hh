@@ -11,8 +11,17 @@ int GetMaxThreads(void); /* returns 0 if no limit specified */
 int GetThreadWork(void);
 int GetThreadWork_Locked__(void); /* caller must take care of locking */
 void RunThreadsOn(int start, int workcnt, void *(func)(void *), void *arg);
+/*
+ * As RunThreadsOn, but cost (if not NULL) holds an estimated cost for each
+ * work item start..workcnt-1, and GetThreadWork hands out the most
+ * expensive items first.
+ */
+void RunThreadsOnWithCost(int start, int workcnt, const float *cost, void *(func)(void *), void *arg);
+/* As RunThreadsOn, without the progress bar */
+void RunThreadsOnQuiet(int start, int workcnt, void *(func)(void *), void *arg);
 void ThreadLock(void);
 void ThreadUnlock(void);
+bool ThreadsActive(void); /* true while RunThreadsOn is running */
 
 /* Call if needing to print to stdout - should be called with lock held */
 void InterruptThreadProgress__(void);
@@ -41,12 +41,26 @@ typedef struct {
     /* estimated visible AABB culling */
     vec3_t mins;
     vec3_t maxs;
+    
+    /* PVS culling; vis cluster of pos, -1 if unknown */
+    int cluster;
 } bouncelight_t;
 
 // public functions
 
+/* a range of BounceLights() */
+struct bouncelightrange_t {
+    const bouncelight_t *first;
+    const bouncelight_t *last;
+    
+    const bouncelight_t *begin() const { return first; }
+    const bouncelight_t *end() const { return last; }
+    bool empty() const { return first == last; }
+    size_t size() const { return static_cast<size_t>(last - first); }
+};
+
 const std::vector<bouncelight_t> &BounceLights();
-const std::vector<int> &BounceLightsForFaceNum(int facenum);
+bouncelightrange_t BounceLightsForFaceNum(int facenum);
 void MakeTextureColors (const mbsp_t *bsp);
 void MakeBounceLights (const globalconfig_t &cfg, const mbsp_t *bsp);
 void Face_LookupTextureColor (const mbsp_t *bsp, const bsp2_dface_t *face, vec3_t color); //mxd
@@ -70,6 +70,7 @@ public:
     const char *classname() const;
     
     vec3_t mins, maxs;
+    int cluster;            // vis cluster of the light origin, -1 if unknown
     
 public:
     lockable_vec_t light, atten, formula, spotangle, spotangle2, style, anglescale;
@@ -94,6 +95,7 @@ public:
         epairs {nullptr},
         targetent {nullptr},
         generated {false},
+        cluster {-1},
 
         // settings
     
@@ -167,6 +169,7 @@ public:
 std::string TargetnameForLightStyle(int style);
 const std::vector<light_t>& GetLights();
 const std::vector<sun_t>& GetSuns();
+const std::vector<skydir_t>& GetSkyDirs();
 
 const entdict_t *FindEntDictWithKeyPair(const std::string &key, const std::string &value);
 const char *ValueForKey(const light_t *ent, const char *key);
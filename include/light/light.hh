@@ -69,6 +69,14 @@ public:
     struct sun_s *next;
     qboolean dirt;
     float anglescale;
+    int skydir;         /* index into GetSkyDirs() */
+};
+
+/* a direction to the sky, shared by all of the suns in that direction */
+class skydir_t {
+public:
+    vec3_t dir;         /* normalized, pointing towards the sky */
+    int octant;         /* sign bits of dir, for ordering rays */
 };
 
 /* for vanilla this would be 18. some engines allow higher limits though, which will be needed if we're scaling lightmap resolution. */
@@ -87,7 +95,7 @@ class globalconfig_t;
 class lightmap_t {
 public:
     int style;
-    lightsample_t *samples; // malloc'ed array of numpoints   //FIXME: this is stupid, we shouldn't need to allocate extra data here for -extra4
+    lightsample_t *samples; // numpoints entries, owned by the thread's scratch   //FIXME: this is stupid, we shouldn't need to allocate extra data here for -extra4
 };
 
 using lightmapdict_t = std::vector<lightmap_t>;
@@ -117,22 +125,35 @@ typedef struct {
     vec3_t midpoint;
     
     int numpoints;
-    vec3_t *points; // malloc'ed array of numpoints
-    vec3_t *normals; // malloc'ed array of numpoints
-    bool *occluded; // malloc'ed array of numpoints
-    int *realfacenums; // malloc'ed array of numpoints
+    vec3_t *points; // numpoints entries, owned by the thread's scratch
+    vec3_t *normals; // numpoints entries, owned by the thread's scratch
+    bool *occluded; // numpoints entries, owned by the thread's scratch
+    int *realfacenums; // numpoints entries, owned by the thread's scratch
     
     /*
      raw ambient occlusion amount per sample point, 0-1, where 1 is
      fully occluded. dirtgain/dirtscale are not applied yet
      */
-    vec_t *occlusion; // malloc'ed array of numpoints
+    vec_t *occlusion; // numpoints entries, owned by the thread's scratch
+    
+    /* the unoccluded points and their normals again, with one array per
+       coordinate (point x/y/z, normal x/y/z) for the SIMD loops.
+       soaindex gives each one's index in points. padded with copies of
+       the last one to a whole number of SIMD lanes. owned by the thread's
+       scratch */
+    int numsoapoints;
+    float *soa[6];
+    int *soaindex;
     
     /* for sphere culling */
     vec3_t origin;
     vec_t radius;
     /* for AABB culling */
     vec3_t mins, maxs;
+    
+    /* for PVS culling: union of the PVS of the clusters containing the
+       sample points, one bit per cluster. empty if PVS culling can't be used */
+    std::vector<uint8_t> pvs;
 
     // for radiosity
     vec3_t radiosity;
@@ -169,6 +190,9 @@ typedef enum {
 extern debugmode_t debugmode;
 extern bool verbose_log;
 
+/* modelinfo has one entry per bsp model */
+extern std::vector<modelinfo_t *> modelinfo;
+
 /* tracelist is a std::vector of pointers to modelinfo_t to use for LOS tests */
 extern std::vector<const modelinfo_t *> tracelist;
 extern std::vector<const modelinfo_t *> selfshadowlist;
@@ -281,6 +305,7 @@ public:
     lockable_bool_t bounce;
     lockable_bool_t bouncestyled;
     lockable_vec_t bouncescale, bouncecolorscale;
+    lockable_vec_t bouncecuts;
     
     /* Q2 surface lights (mxd) */
     lockable_vec_t surflightscale;
@@ -330,6 +355,7 @@ public:
         bouncestyled {"bouncestyled", false},
         bouncescale {"bouncescale", 1.0f, 0.0f, 100.0f},
         bouncecolorscale {"bouncecolorscale", 0.0f, 0.0f, 1.0f},
+        bouncecuts {"bouncecuts", 0.0f, 0.0f, 1.0f},
 
         /* Q2 surface lights (mxd) */
         surflightscale       { "surflightscale", 0.3f }, // Strange defaults to match arghrad3 look...
@@ -363,7 +389,7 @@ public:
             &dirtMode, &dirtDepth, &dirtScale, &dirtGain, &dirtAngle,
             &minlightDirt,
             &phongallowed,
-            &bounce, &bouncestyled, &bouncescale, &bouncecolorscale,
+            &bounce, &bouncestyled, &bouncescale, &bouncecolorscale, &bouncecuts,
             &surflightscale, &surflightbouncescale, &surflightsubdivision, //mxd
             &sunlight,
             &sunlight_color,
@@ -393,11 +419,14 @@ extern qboolean onlyents;
 extern qboolean scaledonly;
 extern uint64_t *extended_texinfo_flags;
 extern qboolean novisapprox;
+extern bool usepvs;
+extern bool adaptive_oversample;
 extern bool nolights;
 
 typedef enum {
     backend_bsp,
-    backend_embree
+    backend_embree,
+    backend_native
 } backend_t;
     
 extern backend_t rtbackend;
@@ -409,7 +438,9 @@ extern char mapfilename[1024];
 lockable_setting_t *FindSetting(std::string name);
 void SetGlobalSetting(std::string name, std::string value, bool cmdline);
 void FixupGlobalSettings(void);
-void GetFileSpace(byte **lightdata, byte **colordata, byte **deluxdata, int size);
+void InitFileSpace(const mbsp_t *bsp);
+int GetFileSpace(int slot, byte **lightdata, byte **colordata, byte **deluxdata, int size);
+void FinishFileSpace(mbsp_t *bsp);
 const modelinfo_t *ModelInfoForModel(const mbsp_t *bsp, int modelnum);
 const modelinfo_t *ModelInfoForFace(const mbsp_t *bsp, int facenum);
 //bool Leaf_HasSky(const mbsp_t *bsp, const mleaf_t *leaf); //mxd. Missing definition
@@ -31,6 +31,7 @@
 #include <light/litfile.hh>
 #include <light/trace.hh>
 #include <light/entities.hh>
+#include <light/bounce.hh>
 
 #include <vector>
 #include <map>
@@ -77,9 +78,42 @@ void WorldToTexCoord(const vec3_t world, const gtexinfo_t *tex, vec_t coord[2]);
 void PrintFaceInfo(const bsp2_dface_t *face, const mbsp_t *bsp);
 // FIXME: remove light param. add normal param and dir params.
 vec_t GetLightValue(const globalconfig_t &cfg, const light_t *entity, vec_t dist);
-std::map<int, qvec3f> GetDirectLighting(const globalconfig_t &cfg, raystream_t *rs, const vec3_t origin, const vec3_t normal);
+float GetLightValueWithAngle(const globalconfig_t &cfg, const light_t *entity, const vec3_t surfnorm, const vec3_t surfpointToLightDir, float dist, bool twosided);
+void GetLightContrib(const globalconfig_t &cfg, const light_t *entity, const vec3_t surfnorm, const vec3_t surfpoint, bool twosided,
+                     vec3_t color_out, vec3_t surfpointToLightDir_out, vec3_t normalmap_addition_out, float *dist_out);
+/* a sample point lit by an entity, found by GetLightContribs */
+struct entitycontrib_t {
+    int point;
+    float add;      /* GetLightValueWithAngle */
+};
+void GetLightContribs(const globalconfig_t &cfg, const light_t *entity, const lightsurf_t *lightsurf,
+                      std::vector<entitycontrib_t> &out);
+/* the most rays GetDirectLighting and DirtAtPoints trace at once */
+#define DIRECT_BATCH_RAYS 4096
+void GetDirectLighting(const globalconfig_t &cfg, raystream_t *rs, int numpoints, const vec3_t *origins, const vec3_t *normals, std::map<int, qvec3f> *result);
 void SetupDirt(globalconfig_t &cfg);
-float DirtAtPoint(const globalconfig_t &cfg, raystream_t *rs, const vec3_t point, const vec3_t normal, const modelinfo_t *selfshadow);
+void DirtAtPoints(const globalconfig_t &cfg, raystream_t *rs, int numpoints, const vec3_t *points, const vec3_t *normals, const modelinfo_t *selfshadow, vec_t *occlusion_out);
+void MakeLightIndex(const globalconfig_t &cfg, const mbsp_t *bsp);
+void MakeClusterPVS(const mbsp_t *bsp);
+qvec3f GetIndirectLighting(const globalconfig_t &cfg, const bouncelight_t *vpl, const qvec3f &bounceLightColor, const qvec3f &dir, const float dist, const qvec3f &origin, const qvec3f &normal);
+
+/* _bouncecuts: a tree of bounce lights, see BounceTree_Cut */
+struct bouncetree_t;
+bouncetree_t *BounceTree_Make(const std::vector<bouncelight_t> &lights);
+void BounceTree_Free(bouncetree_t *tree);
+void BounceTree_Cut(const bouncetree_t *tree, const lightsurf_t *lightsurf, float epsilon, std::vector<const bouncelight_t *> &cut);
 void LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globalconfig_t &cfg);
 
+/* -adaptive supersampling, see LightFace_Adaptive */
+typedef enum {
+    refine_none = 0,
+    refine_all,         /* relit completely */
+    refine_direct       /* direct light relit, indirect reused */
+} refine_t;
+void Adaptive_FindEdges(const lightmap_t &lm, const lightmap_t *im, const std::vector<int> &slots,
+                        int bw, int bh, vec_t threshold, std::vector<refine_t> *refine);
+void Adaptive_GrowRefined(const std::vector<int> &slots, int bw, int bh, std::vector<refine_t> *refine);
+lightsample_t Adaptive_Interpolate(const lightmap_t &lm, const std::vector<int> &reps,
+                                   int bw, int bh, int width, int s, int t, int b);
+
 #endif /* __LIGHT_LTFACE_H__ */
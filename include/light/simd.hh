@@ -0,0 +1,150 @@
+/*  Copyright (C) 2026 ericw-tools contributors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#ifndef __LIGHT_SIMD_H__
+#define __LIGHT_SIMD_H__
+
+/*
+ * SIMD wrappers used by the native ray tracer and the face lighting loops.
+ * vfloat holds LIGHT_SIMD_WIDTH floats (8 with AVX, 4 with SSE2, 1
+ * otherwise), vmask the result of a per-lane comparison. The width is
+ * fixed when compiling; AVX is only used when the compiler targets it,
+ * e.g. with the ENABLE_LIGHT_AVX CMake option.
+ */
+
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define LIGHT_SIMD_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LIGHT_SIMD_SSE2
+#endif
+
+#if defined(LIGHT_SIMD_AVX)
+
+#define LIGHT_SIMD_WIDTH 8
+#define LIGHT_SIMD_NAME "AVX"
+
+struct vfloat {
+    __m256 v;
+    vfloat() {}
+    vfloat(__m256 x) : v(x) {}
+    explicit vfloat(float f) : v(_mm256_set1_ps(f)) {}
+    static vfloat load(const float *p) { return _mm256_load_ps(p); }
+    static vfloat loadu(const float *p) { return _mm256_loadu_ps(p); }
+};
+struct vmask {
+    __m256 v;
+    vmask(__m256 x) : v(x) {}
+};
+
+static inline vfloat operator+(vfloat a, vfloat b) { return _mm256_add_ps(a.v, b.v); }
+static inline vfloat operator-(vfloat a, vfloat b) { return _mm256_sub_ps(a.v, b.v); }
+static inline vfloat operator*(vfloat a, vfloat b) { return _mm256_mul_ps(a.v, b.v); }
+static inline vfloat operator/(vfloat a, vfloat b) { return _mm256_div_ps(a.v, b.v); }
+static inline vfloat vmin(vfloat a, vfloat b) { return _mm256_min_ps(a.v, b.v); }
+static inline vfloat vmax(vfloat a, vfloat b) { return _mm256_max_ps(a.v, b.v); }
+static inline vfloat vsqrt(vfloat a) { return _mm256_sqrt_ps(a.v); }
+static inline vfloat vabs(vfloat a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+static inline vmask operator<(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+static inline vmask operator<=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+static inline vmask operator>(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+static inline vmask operator>=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ); }
+static inline vmask operator!=(vfloat a, vfloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_NEQ_OQ); }
+static inline vmask operator&(vmask a, vmask b) { return _mm256_and_ps(a.v, b.v); }
+static inline vfloat select(vmask m, vfloat a, vfloat b) { return _mm256_blendv_ps(b.v, a.v, m.v); }
+static inline unsigned movemask(vmask m) { return static_cast<unsigned>(_mm256_movemask_ps(m.v)); }
+static inline void store(float *p, vfloat a) { _mm256_store_ps(p, a.v); }
+
+#elif defined(LIGHT_SIMD_SSE2)
+
+#define LIGHT_SIMD_WIDTH 4
+#define LIGHT_SIMD_NAME "SSE2"
+
+struct vfloat {
+    __m128 v;
+    vfloat() {}
+    vfloat(__m128 x) : v(x) {}
+    explicit vfloat(float f) : v(_mm_set1_ps(f)) {}
+    static vfloat load(const float *p) { return _mm_load_ps(p); }
+    static vfloat loadu(const float *p) { return _mm_loadu_ps(p); }
+};
+struct vmask {
+    __m128 v;
+    vmask(__m128 x) : v(x) {}
+};
+
+static inline vfloat operator+(vfloat a, vfloat b) { return _mm_add_ps(a.v, b.v); }
+static inline vfloat operator-(vfloat a, vfloat b) { return _mm_sub_ps(a.v, b.v); }
+static inline vfloat operator*(vfloat a, vfloat b) { return _mm_mul_ps(a.v, b.v); }
+static inline vfloat operator/(vfloat a, vfloat b) { return _mm_div_ps(a.v, b.v); }
+static inline vfloat vmin(vfloat a, vfloat b) { return _mm_min_ps(a.v, b.v); }
+static inline vfloat vmax(vfloat a, vfloat b) { return _mm_max_ps(a.v, b.v); }
+static inline vfloat vsqrt(vfloat a) { return _mm_sqrt_ps(a.v); }
+static inline vfloat vabs(vfloat a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v); }
+static inline vmask operator<(vfloat a, vfloat b) { return _mm_cmplt_ps(a.v, b.v); }
+static inline vmask operator<=(vfloat a, vfloat b) { return _mm_cmple_ps(a.v, b.v); }
+static inline vmask operator>(vfloat a, vfloat b) { return _mm_cmpgt_ps(a.v, b.v); }
+static inline vmask operator>=(vfloat a, vfloat b) { return _mm_cmpge_ps(a.v, b.v); }
+static inline vmask operator!=(vfloat a, vfloat b) { return _mm_cmpneq_ps(a.v, b.v); }
+static inline vmask operator&(vmask a, vmask b) { return _mm_and_ps(a.v, b.v); }
+static inline vfloat select(vmask m, vfloat a, vfloat b) { return _mm_or_ps(_mm_and_ps(m.v, a.v), _mm_andnot_ps(m.v, b.v)); }
+static inline unsigned movemask(vmask m) { return static_cast<unsigned>(_mm_movemask_ps(m.v)); }
+static inline void store(float *p, vfloat a) { _mm_store_ps(p, a.v); }
+
+#else
+
+#define LIGHT_SIMD_WIDTH 1
+#define LIGHT_SIMD_NAME "scalar"
+
+struct vfloat {
+    float v;
+    vfloat() {}
+    explicit vfloat(float f) : v(f) {}
+    static vfloat load(const float *p) { return vfloat(*p); }
+    static vfloat loadu(const float *p) { return vfloat(*p); }
+};
+struct vmask {
+    bool v;
+    vmask(bool x) : v(x) {}
+};
+
+static inline vfloat operator+(vfloat a, vfloat b) { return vfloat(a.v + b.v); }
+static inline vfloat operator-(vfloat a, vfloat b) { return vfloat(a.v - b.v); }
+static inline vfloat operator*(vfloat a, vfloat b) { return vfloat(a.v * b.v); }
+static inline vfloat operator/(vfloat a, vfloat b) { return vfloat(a.v / b.v); }
+static inline vfloat vmin(vfloat a, vfloat b) { return vfloat(a.v < b.v ? a.v : b.v); }
+static inline vfloat vmax(vfloat a, vfloat b) { return vfloat(a.v > b.v ? a.v : b.v); }
+static inline vfloat vsqrt(vfloat a) { return vfloat(std::sqrt(a.v)); }
+static inline vfloat vabs(vfloat a) { return vfloat(std::fabs(a.v)); }
+static inline vmask operator<(vfloat a, vfloat b) { return a.v < b.v; }
+static inline vmask operator<=(vfloat a, vfloat b) { return a.v <= b.v; }
+static inline vmask operator>(vfloat a, vfloat b) { return a.v > b.v; }
+static inline vmask operator>=(vfloat a, vfloat b) { return a.v >= b.v; }
+static inline vmask operator!=(vfloat a, vfloat b) { return a.v != b.v; }
+static inline vmask operator&(vmask a, vmask b) { return a.v && b.v; }
+static inline vfloat select(vmask m, vfloat a, vfloat b) { return m.v ? a : b; }
+static inline unsigned movemask(vmask m) { return m.v ? 1u : 0u; }
+static inline void store(float *p, vfloat a) { *p = a.v; }
+
+#endif
+
+#endif /* __LIGHT_SIMD_H__ */
@@ -36,6 +36,9 @@ typedef struct {
     // Estimated visible AABB culling
     vec3_t mins;
     vec3_t maxs;
+
+    // PVS culling; vis clusters the points are in. Empty if any point's cluster is unknown
+    std::vector<int> clusters;
 } surfacelight_t;
 
 const std::vector<surfacelight_t> &SurfaceLights();
@@ -44,6 +44,7 @@ enum class hittype_t : uint8_t {
 
 const mleaf_t *Light_PointInLeaf( const mbsp_t *bsp, const vec3_t point );
 int Light_PointContents( const mbsp_t *bsp, const vec3_t point );
+int Light_PointCluster( const mbsp_t *bsp, const vec3_t point );
 uint32_t clamp_texcoord(vec_t in, uint32_t width);
 color_rgba SampleTexture(const bsp2_dface_t *face, const mbsp_t *bsp, const vec3_t point); //mxd. Palette index -> RGBA
 
@@ -95,6 +96,17 @@ public:
 
 raystream_t *MakeRayStream(int maxrays);
 
+/*
+ * Scene setup shared by the raytracing backends
+ */
+std::vector<polylib::winding_t *> MakeFaces(const mbsp_t *bsp, const dmodel_t *model);
+void FreeWindings(std::vector<polylib::winding_t *> &windings);
+void Trace_ClassifyFaces(const mbsp_t *bsp,
+                         std::vector<const bsp2_dface_t *> *skyfaces,
+                         std::vector<const bsp2_dface_t *> *solidfaces,
+                         std::vector<const bsp2_dface_t *> *filterfaces,
+                         std::vector<polylib::winding_t *> *skipwindings);
+
 void MakeTnodes(const mbsp_t *bsp);
 
 #endif /* __LIGHT_TRACE_H__ */
@@ -22,12 +22,14 @@
 #ifndef QBSP_CSG4_HH
 #define QBSP_CSG4_HH
 
-extern int csgmergefaces;
+extern thread_local int csgmergefaces;
 
 // build surfaces is also used by GatherNodeFaces
 surface_t *BuildSurfaces(const std::map<int, face_t *> &planefaces);
 face_t *NewFaceFromFace(face_t *in);
 void SplitFace(face_t *in, const qbsp_plane_t *split, face_t **front, face_t **back);
 void UpdateFaceSphere(face_t *in);
+void BeginSkipTexinfo();
+void EndSkipTexinfo();
 
 #endif
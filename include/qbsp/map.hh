@@ -189,6 +189,7 @@ void Entity_SortBrushes(mapentity_t *dst);
 
 
 surface_t *CSGFaces(const mapentity_t *entity);
+void FindHeadnodePlanes(const mapentity_t *entity);
 void PortalizeWorld(const mapentity_t *entity, node_t *headnode, const int hullnum);
 void TJunc(const mapentity_t *entity, node_t *headnode);
 node_t *SolidBSP(const mapentity_t *entity, surface_t *surfhead, bool midsplit);
@@ -24,5 +24,6 @@
 
 node_t *PointInLeaf(node_t *node, const vec3_t point);
 bool FillOutside(node_t *node, const int hullnum);
+void WritePendingLeak(void);
 
 #endif
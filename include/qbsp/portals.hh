@@ -29,7 +29,7 @@ typedef struct portal_s {
     winding_t *winding;
 } portal_t;
 
-extern node_t outside_node;     // portals outside the world face this
+extern thread_local node_t outside_node;     // portals outside the world face this
 
 void FreeAllPortals(node_t *node);
 
@@ -22,7 +22,7 @@
 #ifndef QBSP_SOLIDBSP_HH
 #define QBSP_SOLIDBSP_HH
 
-extern int splitnodes;
+extern thread_local int splitnodes;
 
 void DetailToSolid(node_t *node);
 int Contents_Priority(int contents);
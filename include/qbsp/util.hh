@@ -38,6 +38,8 @@ extern const int MemSize_BSP2[GLOBAL + 1];
 
 void *AllocMem(int Type, int cSize, bool fZero);
 void FreeMem(void *pMem, int Type, int cSize);
+void FreeMemPools(void);
+int MemActiveBytes(int Type);
 void FreeAllMem(void);
 void PrintMem(void);
 
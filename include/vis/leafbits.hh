@@ -81,4 +81,33 @@ LeafbitsSize(int numleafs)
 	return sizeof(leafbits_t) + (sizeof(leafblock_t) * numblocks);
 }
 
+/*
+ * Vectorised operations on arrays of numblocks leafblock_t's, dispatched
+ * at startup to the widest of AVX-512/AVX2/SSE2 the CPU supports. The
+ * int results are 0 or 1.
+ */
+
+/* dst = a & b; returns whether dst has any bits not set in seen */
+int Leafbits_AndTestNew(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b, const leafblock_t *seen, int numblocks);
+/* dst = a & ~b (dst may be a); returns whether any bits are left */
+int Leafbits_AndNot(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b, int numblocks);
+/* dst |= src */
+void Leafbits_Or(leafblock_t *dst, const leafblock_t *src, int numblocks);
+int Leafbits_TestAny(const leafblock_t *bits, int numblocks);
+int Leafbits_PopCount(const leafblock_t *bits, int numblocks);
+const char *Leafbits_KernelName(void);
+
+/* One set of the kernels above, exposed so the tests can check each set */
+typedef struct {
+    const char *name;
+    int (*andtestnew)(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b, const leafblock_t *seen, int numblocks);
+    int (*andnot)(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b, int numblocks);
+    void (*or_)(leafblock_t *dst, const leafblock_t *src, int numblocks);
+    int (*testany)(const leafblock_t *bits, int numblocks);
+    int (*popcount)(const leafblock_t *bits, int numblocks);
+} leafbits_kernels_t;
+
+/* Fills sets with the sets this CPU can run, widest first, scalar last */
+int Leafbits_SupportedKernels(const leafbits_kernels_t **sets, int max);
+
 #endif /* VIS_LEAFBITS_H */
@@ -102,8 +102,18 @@ typedef struct {
     leafbits_t *leafvis;
     portal_t *base;
     pstack_t pstack_head;
+
+    /*
+     * Per-thread mightsee bitsets, one per RecursiveLeafFlow level.
+     * Allocated MIGHTSEE_BLOCK levels at a time on first use and kept
+     * for the life of the thread.
+     */
+    leafbits_t **mightsee_levels;   // [portalleafs]
+    int mightsee_depth;
 } threaddata_t;
 
+#define MIGHTSEE_BLOCK 64
+
 extern int numportals;
 extern int portalleafs;
 extern int portalleafs_real;
@@ -137,7 +147,9 @@ extern char statetmpfile[1024];
 
 void BasePortalVis(void);
 
-void PortalFlow(portal_t *p);
+void AllocMightseeArena(threaddata_t *thread);
+void FreeMightseeArena(threaddata_t *thread);
+void PortalFlow(threaddata_t *thread, portal_t *p);
 
 void CalcAmbientSounds(mbsp_t *bsp);
 
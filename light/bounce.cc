@@ -36,7 +36,6 @@
 #include <unordered_map>
 #include <set>
 #include <algorithm>
-#include <mutex>
 #include <string>
 
 #include <common/qvec.hh>
@@ -44,10 +43,13 @@
 using namespace std;
 using namespace polylib;
 
-mutex radlights_lock;
 map<string, qvec3f> texturecolors;
 std::vector<bouncelight_t> radlights;
-std::map<int, std::vector<int>> radlightsByFacenum;
+/* the bounce lights of face f are radlights[radlightsFaceOffsets[f] .. radlightsFaceOffsets[f + 1]) */
+std::vector<int> radlightsFaceOffsets;
+/* while MakeBounceLights runs: the bounce lights of each face. each face
+   is only touched by the thread lighting it, so no lock is needed */
+static std::vector<std::vector<bouncelight_t>> radlightsByFace;
 
 class patch_t {
 public:
@@ -71,15 +73,35 @@ MakePatch (const globalconfig_t &cfg, winding_t *w)
     // nudge the cernter point 1 unit off
     VectorMA(p->center, 1.0f, p->plane.normal, p->samplepoint);
     
-    // calculate direct light
-    
-    raystream_t *rs = MakeRayStream(numDirtVectors);
-    p->lightByStyle = GetDirectLighting(cfg, rs, p->samplepoint, p->plane.normal);
-    delete rs;
+    // direct light is calculated for all of the face's patches at once
     
     return p;
 }
 
+/*
+ * Fills in the direct light of each patch of a face, tracing the rays of
+ * all of them together.
+ */
+static void
+CalcPatchLighting (const globalconfig_t &cfg, raystream_t *rs, vector<unique_ptr<patch_t>> &patches)
+{
+    const int numpatches = static_cast<int>(patches.size());
+    unique_ptr<vec3_t[]> origins { new vec3_t[numpatches] };
+    unique_ptr<vec3_t[]> normals { new vec3_t[numpatches] };
+    vector<map<int, qvec3f>> lightByStyle(numpatches);
+    
+    for (int i = 0; i < numpatches; i++) {
+        VectorCopy(patches[i]->samplepoint, origins[i]);
+        VectorCopy(patches[i]->plane.normal, normals[i]);
+    }
+    
+    GetDirectLighting(cfg, rs, numpatches, origins.get(), normals.get(), lightByStyle.data());
+    
+    for (int i = 0; i < numpatches; i++) {
+        patches[i]->lightByStyle = std::move(lightByStyle[i]);
+    }
+}
+
 struct make_bounce_lights_args_t {
     const mbsp_t *bsp;
     const globalconfig_t *cfg;
@@ -144,6 +166,8 @@ MakeBounceLightsThread (void *arg)
     const mbsp_t *bsp = static_cast<make_bounce_lights_args_t *>(arg)->bsp;
     const globalconfig_t &cfg = *static_cast<make_bounce_lights_args_t *>(arg)->cfg;
     
+    raystream_t *rs = MakeRayStream(DIRECT_BATCH_RAYS);
+    
     while (1) {
         int i = GetThreadWork();
         if (i == -1)
@@ -175,6 +199,8 @@ MakeBounceLightsThread (void *arg)
         DiceWinding(winding, 64.0f, SaveWindingFn, &args);
         winding = nullptr; // DiceWinding frees winding
         
+        CalcPatchLighting(cfg, rs, patches);
+        
         // average them, area weighted
         map<int, qvec3f> sum;
         float totalarea = 0;
@@ -220,6 +246,7 @@ MakeBounceLightsThread (void *arg)
         AddBounceLight(facemidpoint, emitcolors, faceplane.normal, facearea, face, bsp);
     }
     
+    delete rs;
     return NULL;
 }
 
@@ -257,11 +284,9 @@ AddBounceLight(const vec3_t pos, const std::map<int, qvec3f> &colorByStyle, cons
         EstimateVisibleBoundsAtPoint(pos, l.mins, l.maxs);
     }
     
-    unique_lock<mutex> lck { radlights_lock };
-    radlights.push_back(l);
+    l.cluster = Light_PointCluster(bsp, pos);
     
-    const int lastBounceLightIndex = static_cast<int>(radlights.size()) - 1;
-    radlightsByFacenum[Face_GetNum(bsp, face)].push_back(lastBounceLightIndex);
+    radlightsByFace[Face_GetNum(bsp, face)].push_back(std::move(l));
 }
 
 const std::vector<bouncelight_t> &BounceLights()
@@ -269,15 +294,14 @@ const std::vector<bouncelight_t> &BounceLights()
     return radlights;
 }
 
-const std::vector<int> &BounceLightsForFaceNum(int facenum)
+bouncelightrange_t BounceLightsForFaceNum(int facenum)
 {
-    const auto &vec = radlightsByFacenum.find(facenum);
-    if (vec != radlightsByFacenum.end()) {
-        return vec->second;
+    if (facenum < 0 || facenum + 1 >= static_cast<int>(radlightsFaceOffsets.size())) {
+        return bouncelightrange_t { nullptr, nullptr };
     }
     
-    static std::vector<int> empty;
-    return empty;
+    const bouncelight_t *lights = radlights.data();
+    return bouncelightrange_t { lights + radlightsFaceOffsets[facenum], lights + radlightsFaceOffsets[facenum + 1] };
 }
 
 // Returns color in [0,255]
@@ -331,5 +355,21 @@ MakeBounceLights (const globalconfig_t &cfg, const mbsp_t *bsp)
     const dmodel_t *model = &bsp->dmodels[0];
     make_bounce_lights_args_t args { bsp, &cfg }; //mxd. https://clang.llvm.org/extra/clang-tidy/checks/cppcoreguidelines-pro-type-member-init.html
     
+    radlightsByFace.clear();
+    radlightsByFace.resize(bsp->numfaces);
+    
     RunThreadsOn(model->firstface, model->firstface + model->numfaces, MakeBounceLightsThread, (void *)&args);
+    
+    // gather them in face order, so the list doesn't depend on which thread finished first
+    radlights.clear();
+    radlightsFaceOffsets.resize(bsp->numfaces + 1);
+    for (int i = 0; i < bsp->numfaces; i++) {
+        radlightsFaceOffsets[i] = static_cast<int>(radlights.size());
+        for (bouncelight_t &l : radlightsByFace[i]) {
+            radlights.push_back(std::move(l));
+        }
+    }
+    radlightsFaceOffsets[bsp->numfaces] = static_cast<int>(radlights.size());
+    
+    std::vector<std::vector<bouncelight_t>>().swap(radlightsByFace);
 }
@@ -31,6 +31,7 @@ using strings = std::vector<std::string>;
 
 std::vector<light_t> all_lights;
 std::vector<sun_t> all_suns;
+std::vector<skydir_t> all_skydirs;
 std::vector<entdict_t> entdicts;
 
 const std::vector<light_t>& GetLights() {
@@ -41,6 +42,10 @@ const std::vector<sun_t>& GetSuns() {
     return all_suns;
 }
 
+const std::vector<skydir_t>& GetSkyDirs() {
+    return all_skydirs;
+}
+
 /* surface lights */
 static void MakeSurfaceLights(const mbsp_t *bsp);
 
@@ -395,6 +400,34 @@ Dirt_ResolveFlag(const globalconfig_t &cfg, int dirtInt)
         else return cfg.globalDirt.boolValue();
 }
 
+/*
+ * =============
+ * SkyDirForSunvec
+ *
+ * Returns the index of the sky direction of a sun vector, adding one if
+ * no other sun uses it yet
+ * =============
+ */
+static int
+SkyDirForSunvec(const vec3_t sunvec)
+{
+    vec3_t dir;
+    VectorCopy(sunvec, dir);
+    VectorNormalize(dir);
+
+    for (size_t i = 0; i < all_skydirs.size(); i++) {
+        const vec_t *other = all_skydirs[i].dir;
+        if (other[0] == dir[0] && other[1] == dir[1] && other[2] == dir[2])
+            return static_cast<int>(i);
+    }
+
+    skydir_t skydir {};
+    VectorCopy(dir, skydir.dir);
+    skydir.octant = (dir[0] < 0 ? 1 : 0) | (dir[1] < 0 ? 2 : 0) | (dir[2] < 0 ? 4 : 0);
+    all_skydirs.push_back(skydir);
+    return static_cast<int>(all_skydirs.size()) - 1;
+}
+
 /*
  * =============
  * AddSun
@@ -414,6 +447,7 @@ AddSun(const globalconfig_t &cfg, vec3_t sunvec, vec_t light, const vec3_t color
     VectorCopy(color, sun.sunlight_color);
     sun.anglescale = sun_anglescale;
     sun.dirt = Dirt_ResolveFlag(cfg, dirtInt);
+    sun.skydir = SkyDirForSunvec(sun.sunvec);
 
     // add to list
     all_suns.push_back(sun);
@@ -1204,6 +1238,14 @@ FixLightsOnFaces(const mbsp_t *bsp)
     }
 }
 
+static void
+FindLightClusters(const mbsp_t *bsp)
+{
+    for (light_t &entity : all_lights) {
+        entity.cluster = Light_PointCluster(bsp, *entity.origin.vec3Value());
+    }
+}
+
 void EstimateVisibleBoundsAtPoint(const vec3_t point, vec3_t mins, vec3_t maxs)
 {
     const int N = 32;
@@ -1308,11 +1350,13 @@ SetupLights(const globalconfig_t &cfg, const mbsp_t *bsp)
     SetupSuns(cfg);
     SetupSkyDome(cfg);
     FixLightsOnFaces(bsp);
+    FindLightClusters(bsp);
     EstimateLightVisibility();
     
-    logprint("Final count: %d lights, %d suns in use.\n",
+    logprint("Final count: %d lights, %d suns in use (%d sky directions).\n",
              static_cast<int>(all_lights.size()),
-             static_cast<int>(all_suns.size()));
+             static_cast<int>(all_suns.size()),
+             static_cast<int>(all_skydirs.size()));
     
     
     Q_assert(final_lightcount == all_lights.size());
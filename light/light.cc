@@ -68,17 +68,34 @@ qboolean surflight_dump = false;
 static facesup_t *faces_sup;    //lit2/bspx stuff
 
 byte *filebase;                 // start of lightmap data
-static byte *file_p;            // start of free space after data
-static byte *file_end;          // end of free space for lightmap data
-
 byte *lit_filebase;             // start of litfile data
-static byte *lit_file_p;        // start of free space after litfile data
-static byte *lit_file_end;      // end of space for litfile data
-
-byte *lux_buffer;               // luxfile allocation (misaligned)
 byte *lux_filebase;             // start of luxfile data
-static byte *lux_file_p;        // start of free space after luxfile data
-static byte *lux_file_end;      // end of space for luxfile data
+
+/*
+ * Lightmap output. While lighting, each face's lightmaps are written to
+ * chunks owned by the thread lighting it, and the face's lightofs holds
+ * a slot handle (see GetFileSpace). Once all faces are done,
+ * FinishFileSpace lays the slots out in face order and assigns the real
+ * offsets, so the result doesn't depend on thread timing.
+ */
+#define FILESPACE_CHUNK_SIZE    (1024 * 1024)
+
+typedef struct {
+    byte *data;                 // size bytes of light, then 3*size of lit and lux
+    int size;
+} filespace_t;
+
+static std::vector<filespace_t> filespace_slots;
+static std::vector<byte *> filespace_chunks;
+static std::mutex filespace_lock;
+static int filespace_generation;
+
+struct filespace_cache_t {
+    byte *p;
+    byte *end;
+    int generation;
+};
+static thread_local filespace_cache_t filespace_cache;
 
 std::vector<modelinfo_t *> modelinfo;
 std::vector<const modelinfo_t *> tracelist;
@@ -91,6 +108,8 @@ int write_litfile = 0;  /* 0 for none, 1 for .lit, 2 for bspx, 3 for both */
 int write_luxfile = 0;  /* 0 for none, 1 for .lux, 2 for bspx, 3 for both */
 qboolean onlyents = false;
 qboolean novisapprox = false;
+bool usepvs = false;
+bool adaptive_oversample = false;
 bool nolights = false;
 backend_t rtbackend = backend_embree;
 bool debug_highlightseams = false;
@@ -164,42 +183,115 @@ PrintOptionsSummary(void)
 }
 
 /*
- * Return space for the lightmap and colourmap at the same time so it can
- * be done in a thread-safe manner.
+ * Return space for the lightmap, colourmap and deluxemap of lightmap slot
+ * "slot" (2 * facenum, plus 1 for the scaled lightmaps of faces_sup).
+ * The caller stores the returned handle in lightofs; FinishFileSpace
+ * replaces it with the final offset.
  */
-void
-GetFileSpace(byte **lightdata, byte **colordata, byte **deluxdata, int size)
+int
+GetFileSpace(int slot, byte **lightdata, byte **colordata, byte **deluxdata, int size)
 {
-    ThreadLock();
-
-    /* align to 4 byte boudaries */
-    file_p = (byte *)(((uintptr_t)file_p + 3) & ~3);
-    *lightdata = file_p;
-    file_p += size;
-
-    if (colordata) {
-        /* align to 12 byte boundaries to match offets with 3 * lightdata */
-        if ((uintptr_t)lit_file_p % 12)
-            lit_file_p += 12 - ((uintptr_t)lit_file_p % 12);
-        *colordata = lit_file_p;
-        lit_file_p += size * 3;
+    /* align to 4 bytes, so the lit/lux offsets are 3 * the light offset */
+    const size_t need = ((size_t)size * 7 + 3) & ~(size_t)3;
+    filespace_cache_t *cache = &filespace_cache;
+
+    if (cache->generation != filespace_generation || (size_t)(cache->end - cache->p) < need) {
+        const size_t chunksize = qmax((size_t)FILESPACE_CHUNK_SIZE, need);
+        byte *chunk = (byte *)malloc(chunksize);
+        if (!chunk)
+            Error("%s: allocation of %i bytes failed.", __func__, (int)chunksize);
+        {
+            std::lock_guard<std::mutex> lock(filespace_lock);
+            filespace_chunks.push_back(chunk);
+        }
+        cache->p = chunk;
+        cache->end = chunk + chunksize;
+        cache->generation = filespace_generation;
     }
 
-    if (deluxdata) {
-        /* align to 12 byte boundaries to match offets with 3 * lightdata */
-        if ((uintptr_t)lux_file_p % 12)
-            lux_file_p += 12 - ((uintptr_t)lux_file_p % 12);
-        *deluxdata = lux_file_p;
-        lux_file_p += size * 3;
+    filespace_t *out = &filespace_slots.at(slot);
+    Q_assert(!out->data);
+    out->data = cache->p;
+    out->size = size;
+    cache->p += need;
+
+    *lightdata = out->data;
+    if (colordata)
+        *colordata = out->data + size;
+    if (deluxdata)
+        *deluxdata = out->data + size * 4;
+
+    return -2 - slot;
+}
+
+void
+InitFileSpace(const mbsp_t *bsp)
+{
+    filespace_slots.assign(bsp->numfaces * 2, filespace_t{ nullptr, 0 });
+    filespace_generation++;
+}
+
+static int32_t
+FileSpaceOffset(int32_t lightofs, const std::vector<int32_t> &offsets)
+{
+    /* handles from GetFileSpace are <= -2; anything else wasn't relit */
+    if (lightofs > -2)
+        return lightofs;
+    return offsets.at(-2 - lightofs);
+}
+
+/*
+ * Copy the lightmaps out of the per-thread chunks into the final
+ * lightdata, lit and lux buffers in slot order, and replace the slot
+ * handles in lightofs with real offsets.
+ */
+void
+FinishFileSpace(mbsp_t *bsp)
+{
+    std::vector<int32_t> offsets(filespace_slots.size(), -1);
+    int lightdatasize = 0;
+
+    for (size_t i = 0; i < filespace_slots.size(); i++) {
+        if (!filespace_slots[i].data)
+            continue;
+        lightdatasize = (lightdatasize + 3) & ~3;
+        offsets[i] = lightdatasize;
+        lightdatasize += filespace_slots[i].size;
     }
 
-    ThreadUnlock();
+    free(bsp->dlightdata);
+    free(lit_filebase);
+    free(lux_filebase);
+
+    /* calloc, so the alignment padding is zero */
+    bsp->lightdatasize = lightdatasize;
+    bsp->dlightdata = filebase = (byte *)calloc(lightdatasize + 1, 1);
+    lit_filebase = (byte *)calloc(lightdatasize * 3 + 1, 1);
+    lux_filebase = (byte *)calloc(lightdatasize * 3 + 1, 1);
+    if (!filebase || !lit_filebase || !lux_filebase)
+        Error("%s: allocation of %i bytes failed.", __func__, lightdatasize * 7);
+
+    for (size_t i = 0; i < filespace_slots.size(); i++) {
+        const filespace_t &slot = filespace_slots[i];
+        if (!slot.data)
+            continue;
+        memcpy(filebase + offsets[i], slot.data, slot.size);
+        memcpy(lit_filebase + offsets[i] * 3, slot.data + slot.size, slot.size * 3);
+        memcpy(lux_filebase + offsets[i] * 3, slot.data + slot.size * 4, slot.size * 3);
+    }
 
-    if (file_p > file_end)
-        Error("%s: overrun", __func__);
+    for (int i = 0; i < bsp->numfaces; i++) {
+        bsp2_dface_t *face = BSP_GetFace(bsp, i);
+        face->lightofs = FileSpaceOffset(face->lightofs, offsets);
+        if (faces_sup)
+            faces_sup[i].lightofs = FileSpaceOffset(faces_sup[i].lightofs, offsets);
+    }
 
-    if (lit_file_p > lit_file_end)
-        Error("%s: overrun", __func__);
+    for (byte *chunk : filespace_chunks)
+        free(chunk);
+    filespace_chunks.clear();
+    filespace_slots.clear();
+    filespace_generation++;
 }
 
 const modelinfo_t *ModelInfoForModel(const mbsp_t *bsp, int modelnum)
@@ -351,6 +443,37 @@ FindModelInfo(const mbsp_t *bsp, const char *lmscaleoverride)
     Q_assert(modelinfo.size() == bsp->nummodels);
 }
 
+/*
+ * Rough relative cost of lighting a face (its luxel count), used to
+ * schedule the big faces first so they don't stall the end of the run.
+ */
+static float
+Face_LightCost(const mbsp_t *bsp, int facenum)
+{
+    const bsp2_dface_t *face = BSP_GetFace(bsp, facenum);
+    const modelinfo_t *face_modelinfo = ModelInfoForFace(bsp, facenum);
+    const gtexinfo_t *tex = Face_Texinfo(bsp, face);
+
+    if (face_modelinfo == nullptr || tex == nullptr || face->numedges < 3 || !Face_IsLightmapped(bsp, face))
+        return 0;
+
+    const float lmscale = faces_sup ? faces_sup[facenum].lmscale : face_modelinfo->lightmapscale;
+
+    vec_t mins[2] = { VECT_MAX, VECT_MAX };
+    vec_t maxs[2] = { -VECT_MAX, -VECT_MAX };
+    for (int i = 0; i < face->numedges; i++) {
+        vec_t texcoord[2];
+        WorldToTexCoord(GetSurfaceVertexPoint(bsp, face, i), tex, texcoord);
+        for (int j = 0; j < 2; j++) {
+            mins[j] = qmin(mins[j], texcoord[j]);
+            maxs[j] = qmax(maxs[j], texcoord[j]);
+        }
+    }
+
+    return (ceil(maxs[0] / lmscale) - floor(mins[0] / lmscale) + 1)
+         * (ceil(maxs[1] / lmscale) - floor(mins[1] / lmscale) + 1);
+}
+
 /*
  * =============
  *  LightWorld
@@ -362,35 +485,7 @@ LightWorld(bspdata_t *bspdata, qboolean forcedscale)
     logprint("--- LightWorld ---\n" );
     
     mbsp_t *const bsp = &bspdata->data.mbsp;
-    if (bsp->dlightdata)
-        free(bsp->dlightdata);
-    if (lux_buffer)
-        free(lux_buffer);
-
-    /* FIXME - remove this limit */
-    bsp->lightdatasize = MAX_MAP_LIGHTING;
-    bsp->dlightdata = (byte *)malloc(bsp->lightdatasize + 16); /* for alignment */
-    if (!bsp->dlightdata)
-        Error("%s: allocation of %i bytes failed.",
-              __func__, bsp->lightdatasize);
-    memset(bsp->dlightdata, 0, bsp->lightdatasize + 16);
-    bsp->lightdatasize /= 4;
-
-    /* align filebase to a 4 byte boundary */
-    filebase = file_p = (byte *)(((uintptr_t)bsp->dlightdata + 3) & ~3);
-    file_end = filebase + bsp->lightdatasize;
-
-    /* litfile data stored in dlightdata, after the white light */
-    lit_filebase = file_end + 12 - ((uintptr_t)file_end % 12);
-    lit_file_p = lit_filebase;
-    lit_file_end = lit_filebase + 3 * (MAX_MAP_LIGHTING / 4);
-
-    /* lux data stored in a separate buffer */
-    lux_buffer = (byte *)malloc(bsp->lightdatasize*3);
-    lux_filebase = lux_buffer + 12 - ((uintptr_t)lux_buffer % 12);
-    lux_file_p = lux_filebase;
-    lux_file_end = lux_filebase + 3 * (MAX_MAP_LIGHTING / 4);
-
+    InitFileSpace(bsp);
 
     if (forcedscale)
         BSPX_AddLump(bspdata, "LMSHIFT", NULL, 0);
@@ -424,6 +519,9 @@ LightWorld(bspdata_t *bspdata, qboolean forcedscale)
         if (isQuake2map)   MakeSurfaceLights(cfg_static, bsp);
         if (bouncerequired) MakeBounceLights(cfg_static, bsp);
     }
+
+    MakeLightIndex(cfg_static, bsp);
+    MakeClusterPVS(bsp);
     
 #if 0
     lightbatchthread_info_t info;
@@ -433,7 +531,10 @@ LightWorld(bspdata_t *bspdata, qboolean forcedscale)
     RunThreadsOn(0, info.all_batches.size(), LightBatchThread, &info);
 #else
     logprint("--- LightThread ---\n"); //mxd
-    RunThreadsOn(0, bsp->numfaces, LightThread, bsp);
+    std::vector<float> facecost(bsp->numfaces);
+    for (int i = 0; i < bsp->numfaces; i++)
+        facecost[i] = Face_LightCost(bsp, i);
+    RunThreadsOnWithCost(0, bsp->numfaces, facecost.data(), LightThread, bsp);
 #endif
 
     if (bouncerequired || isQuake2map) { //mxd. Print some extra stats...
@@ -444,7 +545,7 @@ LightWorld(bspdata_t *bspdata, qboolean forcedscale)
     }
 
     logprint("Lighting Completed.\n\n");
-    bsp->lightdatasize = file_p - filebase;
+    FinishFileSpace(bsp);
     logprint("lightdatasize: %i\n", bsp->lightdatasize);
 
     if (faces_sup) {
@@ -748,9 +849,11 @@ static void PrintUsage()
 "  -threads n          set the number of threads\n"
 "  -extra              2x supersampling\n"
 "  -extra4             4x supersampling, slowest, use for final compile\n"
+"  -adaptive           with -extra/-extra4, only supersample luxels near edges\n"
 "  -gate n             cutoff lights at this brightness level\n"
 "  -sunsamples n       set samples for _sunlight2, default 64\n"
 "  -surflight_subdivide  surface light subdivision size\n"
+"  -backend name       raytracing backend: embree (default when available) or native\n"
 "\n"
 "Output format options:\n"
 "  -lit                write .lit file\n"
@@ -765,6 +868,7 @@ static void PrintUsage()
 "  -bouncedebug        only save bounced lighting to the lightmap\n"
 "  -surflight_dump     dump surface lights to a .map file\n"
 "  -novisapprox        disable approximate visibility culling of lights\n"
+"  -pvs                use the bsp's PVS to cull lights\n"
 "\n"
 "Experimental options:\n"
 "  -lit2               write .lit2 file\n"
@@ -937,6 +1041,9 @@ light_main(int argc, const char **argv)
         } else if (!strcmp(argv[i], "-extra4")) {
             oversample = 4;
             logprint("extra 4x4 sampling enabled\n");
+        } else if (!strcmp(argv[i], "-adaptive")) {
+            adaptive_oversample = true;
+            logprint("adaptive supersampling enabled\n");
         } else if (!strcmp(argv[i], "-gate")) {
             fadegate = ParseVec(&i, argc, argv);
             if (fadegate > 1) {
@@ -1009,6 +1116,9 @@ light_main(int argc, const char **argv)
         } else if ( !strcmp( argv[ i ], "-novisapprox" ) ) {
             novisapprox = true;
             logprint( "Skipping approximate light visibility\n" );
+        } else if ( !strcmp( argv[ i ], "-pvs" ) ) {
+            usepvs = true;
+            logprint( "Using the PVS to cull lights\n" );
         } else if ( !strcmp( argv[ i ], "-nolights" ) ) {
             nolights = true;
             logprint( "Skipping all light entities (sunlight / minlight only)\n" );
@@ -1018,6 +1128,8 @@ light_main(int argc, const char **argv)
                 rtbackend = backend_bsp;
             } else if (!strcmp(requested, "embree")) {
                 rtbackend = backend_embree;
+            } else if (!strcmp(requested, "native")) {
+                rtbackend = backend_native;
             } else {
                 Error("unknown backend %s", requested);
             }
@@ -1088,7 +1200,7 @@ light_main(int argc, const char **argv)
     
 #ifndef HAVE_EMBREE
     if (rtbackend == backend_embree) {
-        rtbackend = backend_bsp;
+        rtbackend = backend_native;
     }
 #endif
     
@@ -1096,6 +1208,7 @@ light_main(int argc, const char **argv)
     switch (rtbackend) {
         case backend_bsp: logprint("BSP\n"); break;
         case backend_embree: logprint("Embree\n"); break;
+        case backend_native: logprint("native\n"); break;
     }
     
     if (numthreads > 1)
@@ -1170,6 +1283,11 @@ light_main(int argc, const char **argv)
     FindDebugFace(bsp);
     FindDebugVert(bsp);
 
+    if (usepvs && BSP_NumClusters(bsp) && !BSP_VisSeesThroughLiquids(bsp)) {
+        logprint("WARNING: vis didn't see through liquids (qbsp -notranswater?), ignoring -pvs\n");
+        usepvs = false;
+    }
+
     MakeTnodes(bsp);
     
     if (debugmode == debugmode_phong_obj) {
@@ -1234,6 +1352,7 @@ light_main(int argc, const char **argv)
     logprint("%5.3f seconds elapsed\n", end - start);
     logprint("\n");
     logprint("stats:\n");
+    logprint("%u sample points lit\n", static_cast<unsigned>(total_samplepoints));
     logprint("%f lights tested, %f hits per sample point\n",
              static_cast<double>(total_light_rays) / static_cast<double>(total_samplepoints),
              static_cast<double>(total_light_ray_hits) / static_cast<double>(total_samplepoints));
@@ -24,8 +24,10 @@
 #include <light/entities.hh>
 #include <light/trace.hh>
 #include <light/ltface.hh>
+#include <light/simd.hh>
 
 #include <common/bsputils.hh>
+#include <common/octree.hh>
 #include <common/qvec.hh>
 
 #include <cassert>
@@ -673,6 +675,262 @@ PositionSamplePointOnFace(const mbsp_t *bsp,
     return position_t(face, point, pointNormal);
 }
 
+/* the rays LightFace_Sky traced towards one sky direction, shared by its suns */
+struct skyrays_t {
+    int batch;
+    int firstray;
+    int numrays;
+};
+
+/* a bounce light while building the bounce light tree (see BounceTree_Make) */
+struct bouncemember_t {
+    qvec3f pos;
+    qvec3f normal;
+    float power;        // area * brightness of componentwiseMaxColor
+    const bouncelight_t *light;
+};
+
+/* the most vis clusters a node of the bounce light tree lists; nodes with
+   members in more of them are always split */
+#define BOUNCE_NODE_CLUSTERS 8
+
+/* a node of the bounce light tree */
+struct bouncenode_t {
+    aabb3f bounds { qvec3f(0), qvec3f(0) }; // positions of the members
+    qvec3f coneaxis;    // member surface normals are within acos(conecos) of coneaxis
+    float conecos;
+    float power;        // sum of the members' power
+    const bouncelight_t *brightest;
+    const bouncelight_t *light; // the only member of a leaf, or the cluster standing in for all of them
+    int children[2];    // -1 for a leaf
+    
+    /* union and intersection of the members' estimated visible AABBs */
+    vec3_t vismins, vismaxs;
+    vec3_t sharedmins, sharedmaxs;
+    bool shared;        // false if the intersection is empty
+    
+    /* the members' vis clusters, numclusters -1 if there are too many */
+    int numclusters;
+    int clusters[BOUNCE_NODE_CLUSTERS];
+};
+
+struct bouncetree_t {
+    std::vector<bouncenode_t> nodes; // nodes[0] is the root
+    std::vector<bouncelight_t> clusters;
+};
+
+/* a cluster in a cut through the bounce light tree */
+struct bouncecut_t {
+    float bound;
+    float estimate;
+    int nodenum;
+    
+    bool operator<(const bouncecut_t &other) const {
+        return bound < other.bound;
+    }
+};
+
+/* the most rays LightFace_Sky traces at once, unless one direction needs more */
+#define SKY_BATCH_RAYS 8192
+
+/*
+ * Per-thread storage reused by LightFace from one face to the next: the
+ * lightsurf itself, its per-point arrays, the lightmap sample buffers and
+ * the ray stream. Everything is sized for the largest face the thread has
+ * lit so far and only ever grows.
+ */
+class lightsurf_scratch_t {
+public:
+    /* the per-point arrays of a lightsurf */
+    class pointarrays_t {
+    public:
+        vec3_t *points = nullptr;
+        vec3_t *normals = nullptr;
+        bool *occluded = nullptr;
+        int *realfacenums = nullptr;
+        vec_t *occlusion = nullptr;
+        float *soa[6] {};
+        int *soaindex = nullptr;
+
+        ~pointarrays_t() {
+            free(points);
+            free(normals);
+            free(occluded);
+            free(realfacenums);
+            free(occlusion);
+            for (float *coords : soa)
+                free(coords);
+            free(soaindex);
+        }
+
+        void resize(int count) {
+            points = (vec3_t *) realloc(points, count * sizeof(vec3_t));
+            normals = (vec3_t *) realloc(normals, count * sizeof(vec3_t));
+            occluded = (bool *) realloc(occluded, count * sizeof(bool));
+            realfacenums = (int *) realloc(realfacenums, count * sizeof(int));
+            occlusion = (vec_t *) realloc(occlusion, count * sizeof(vec_t));
+            for (float *&coords : soa)
+                coords = (float *) realloc(coords, (count + LIGHT_SIMD_WIDTH) * sizeof(float));
+            soaindex = (int *) realloc(soaindex, count * sizeof(int));
+        }
+    };
+
+    lightsurf_t lightsurf {};
+
+    int maxpoints = 0;
+    pointarrays_t full;
+
+    /* -adaptive: the subset of points lit by a pass, and the lightmaps of
+       the passes (see LightFace_Adaptive) */
+    pointarrays_t sub;
+    lightmapdict_t passmaps[5];
+
+    /* one buffer of maxpoints samples per lightmap slot ever used, for
+       lightsurf.lightmapsByStyle and each of passmaps */
+    std::vector<lightsample_t *> samples[6];
+
+    raystream_t *stream = nullptr;
+
+    /* LightFace_Sky: the suns lighting the face, in GetSuns() order and
+       grouped by direction, the points they light and those points' dirt,
+       the rays of each sky direction, and a stream big enough for several
+       directions' rays */
+    std::vector<const sun_t *> skysuns;
+    std::vector<const sun_t *> skyorder;
+    std::vector<int> skypoints;
+    std::vector<vec_t> skydirt;
+    std::vector<skyrays_t> skyrays;
+    raystream_t *skystream = nullptr;
+    int maxskyrays = 0;
+
+    /* LightIndex_Query results: the entity lights for LightFace_AllLights,
+       the bounce lights for LightFace_Bounce */
+    std::vector<int> lightnums;
+    std::vector<int> bouncenums;
+
+    /* LightFace_Entity: the points reached by the light */
+    std::vector<entitycontrib_t> contribs;
+
+    /* LightFace_Bounce: the bounce lights reaching the face, and the light
+       of each style of a bounce light along each of its rays */
+    std::vector<const bouncelight_t *> bouncelights;
+    std::vector<qvec3f> bouncecolors;
+
+    /* BounceTree_Cut: the clusters in the cut while choosing it */
+    std::vector<bouncecut_t> bounceheap;
+
+    ~lightsurf_scratch_t() {
+        for (const auto &pool : samples) {
+            for (lightsample_t *s : pool)
+                free(s);
+        }
+        delete stream;
+        delete skystream;
+    }
+
+    void reserve(int numpoints) {
+        if (numpoints <= maxpoints && stream != nullptr)
+            return;
+
+        /* grow geometrically so a run of slightly bigger faces doesn't realloc every time */
+        maxpoints = qmax(numpoints, maxpoints + maxpoints / 2);
+
+        full.resize(maxpoints);
+        if (adaptive_oversample)
+            sub.resize(maxpoints);
+
+        /* sample contents don't survive between faces, so no need to copy */
+        for (auto &pool : samples) {
+            for (lightsample_t *&s : pool) {
+                free(s);
+                s = (lightsample_t *) malloc(maxpoints * sizeof(lightsample_t));
+            }
+        }
+
+        delete stream;
+        stream = MakeRayStream(maxpoints);
+    }
+
+    raystream_t *skyStream(int numpoints) {
+        const int needed = qmax(numpoints, SKY_BATCH_RAYS);
+        if (needed > maxskyrays) {
+            delete skystream;
+            skystream = MakeRayStream(needed);
+            maxskyrays = needed;
+        }
+        return skystream;
+    }
+
+    lightsample_t *samplesForSlot(const lightmapdict_t *lightmaps, size_t slot) {
+        int poolnum = 0;
+        for (int j = 0; j < 5; j++) {
+            if (lightmaps == &passmaps[j])
+                poolnum = j + 1;
+        }
+        std::vector<lightsample_t *> &pool = samples[poolnum];
+        while (pool.size() <= slot) {
+            pool.push_back((lightsample_t *) malloc(maxpoints * sizeof(lightsample_t)));
+        }
+        return pool[slot];
+    }
+};
+
+static thread_local lightsurf_scratch_t lightsurf_scratch;
+
+/*
+ * Returns the thread's scratch lightsurf, reset to its zero state for a new
+ * face. The pvs and lightmap vectors are emptied but keep their capacity.
+ */
+static lightsurf_t *
+Lightsurf_Begin()
+{
+    lightsurf_t *lightsurf = &lightsurf_scratch.lightsurf;
+
+    std::vector<uint8_t> pvs;
+    lightmapdict_t lightmaps;
+    pvs.swap(lightsurf->pvs);
+    lightmaps.swap(lightsurf->lightmapsByStyle);
+
+    *lightsurf = lightsurf_t {};
+
+    pvs.clear();
+    lightmaps.clear();
+    lightsurf->pvs.swap(pvs);
+    lightsurf->lightmapsByStyle.swap(lightmaps);
+
+    return lightsurf;
+}
+
+/*
+ * Points lightsurf's per-coordinate arrays at those in `arrays` and fills
+ * them from its points, normals and occluded flags.
+ */
+static void
+Lightsurf_FillSoA(lightsurf_t *lightsurf, lightsurf_scratch_t::pointarrays_t &arrays)
+{
+    int n = 0;
+    for (int i = 0; i < lightsurf->numpoints; i++) {
+        if (lightsurf->occluded[i])
+            continue;
+        for (int k = 0; k < 3; k++) {
+            arrays.soa[k][n] = lightsurf->points[i][k];
+            arrays.soa[3 + k][n] = lightsurf->normals[i][k];
+        }
+        arrays.soaindex[n] = i;
+        n++;
+    }
+    
+    /* pad so that the last point can be loaded as a whole vector */
+    for (int k = 0; k < 6; k++) {
+        const float last = (n > 0) ? arrays.soa[k][n - 1] : 0.0f;
+        for (int pad = n; pad < n + LIGHT_SIMD_WIDTH; pad++)
+            arrays.soa[k][pad] = last;
+        lightsurf->soa[k] = arrays.soa[k];
+    }
+    lightsurf->soaindex = arrays.soaindex;
+    lightsurf->numsoapoints = n;
+}
+
 /*
  * =================
  * CalcPoints
@@ -698,12 +956,13 @@ CalcPoints(const modelinfo_t *modelinfo, const vec3_t offset, lightsurf_t *surf,
     const float startt = (surf->texmins[1] - 0.5 + (0.5 / oversample)) * surf->lightmapscale;
     const float st_step = surf->lightmapscale / oversample;
 
-    /* Allocate surf->points */
+    /* Point surf->points at the thread's scratch buffers; every entry is written below */
     surf->numpoints = surf->width * surf->height;
-    surf->points = (vec3_t *) calloc(surf->numpoints, sizeof(vec3_t));
-    surf->normals = (vec3_t *) calloc(surf->numpoints, sizeof(vec3_t));
-    surf->occluded = (bool *)calloc(surf->numpoints, sizeof(bool));
-    surf->realfacenums = (int *)calloc(surf->numpoints, sizeof(int));
+    lightsurf_scratch.reserve(surf->numpoints);
+    surf->points = lightsurf_scratch.full.points;
+    surf->normals = lightsurf_scratch.full.normals;
+    surf->occluded = lightsurf_scratch.full.occluded;
+    surf->realfacenums = lightsurf_scratch.full.realfacenums;
     
     const auto points = GLM_FacePoints(bsp, face);
     const auto edgeplanes = GLM_MakeInwardFacingEdgePlanes(points);
@@ -734,6 +993,8 @@ CalcPoints(const modelinfo_t *modelinfo, const vec3_t offset, lightsurf_t *surf,
         }
     }
     
+    Lightsurf_FillSoA(surf, lightsurf_scratch.full);
+    
     const int facenum = (face - bsp->dfaces);
     if (dump_facenum == facenum) {
         CalcPoints_Debug(surf, bsp);
@@ -748,6 +1009,88 @@ Face_IsLiquid(const mbsp_t *bsp, const bsp2_dface_t *face)
     return name[0] == '*';
 }*/
 
+/*
+ * -pvs: the decompressed PVS row of every cluster, with the cluster's own
+ * bit set, built once by MakeClusterPVS. A cluster whose row couldn't be
+ * decompressed has no entry in cluster_pvs_valid and disables culling.
+ */
+static std::vector<uint8_t> cluster_pvs;
+static std::vector<bool> cluster_pvs_valid;
+static size_t cluster_pvs_rowbytes;
+
+void
+MakeClusterPVS(const mbsp_t *bsp)
+{
+    cluster_pvs.clear();
+    cluster_pvs_valid.clear();
+    cluster_pvs_rowbytes = 0;
+
+    const int numclusters = BSP_NumClusters(bsp);
+    if (!usepvs || numclusters == 0)
+        return;
+
+    cluster_pvs_rowbytes = (numclusters + 7) >> 3;
+    cluster_pvs.assign(numclusters * cluster_pvs_rowbytes, 0);
+    cluster_pvs_valid.assign(numclusters, false);
+
+    for (int cluster = 0; cluster < numclusters; cluster++) {
+        uint8_t *row = &cluster_pvs[cluster * cluster_pvs_rowbytes];
+        if (!BSP_DecompressClusterPVS(bsp, cluster, row))
+            continue;
+        row[cluster >> 3] |= (1 << (cluster & 7));
+        cluster_pvs_valid[cluster] = true;
+    }
+}
+
+/*
+ * Builds lightsurf->pvs, the union of the PVS rows of the clusters that the
+ * unoccluded sample points are in. Lights whose cluster isn't in it can't
+ * reach any sample point, so they can be skipped.
+ */
+static void
+CalcPVS(const mbsp_t *bsp, lightsurf_t *lightsurf)
+{
+    if (cluster_pvs.empty())
+        return;
+    
+    std::vector<int> clusters;
+    for (int i = 0; i < lightsurf->numpoints; i++) {
+        if (lightsurf->occluded[i])
+            continue;
+        
+        const int cluster = Light_PointCluster(bsp, lightsurf->points[i]);
+        if (cluster < 0 || cluster >= (int)cluster_pvs_valid.size() || !cluster_pvs_valid[cluster]) {
+            /* can't cull */
+            return;
+        }
+        if (std::find(clusters.begin(), clusters.end(), cluster) == clusters.end())
+            clusters.push_back(cluster);
+    }
+    
+    std::vector<uint8_t> &pvs = lightsurf->pvs;
+    pvs.assign(cluster_pvs_rowbytes, 0);
+    
+    for (const int cluster : clusters) {
+        const uint8_t *row = &cluster_pvs[cluster * cluster_pvs_rowbytes];
+        for (size_t i = 0; i < cluster_pvs_rowbytes; i++) {
+            pvs[i] |= row[i];
+        }
+    }
+}
+
+/*
+ * Returns true if a light in the given cluster can't be seen from any of
+ * the sample points of lightsurf.
+ */
+static inline bool
+Lightsurf_PVSCull(const lightsurf_t *lightsurf, int cluster)
+{
+    if (lightsurf->pvs.empty() || cluster < 0)
+        return false;
+    
+    return !(lightsurf->pvs[cluster >> 3] & (1 << (cluster & 7)));
+}
+
 static bool
 Lightsurf_Init(const modelinfo_t *modelinfo, const bsp2_dface_t *face,
                const mbsp_t *bsp, lightsurf_t *lightsurf, facesup_t *facesup)
@@ -849,23 +1192,27 @@ Lightsurf_Init(const modelinfo_t *modelinfo, const bsp2_dface_t *face,
     VectorAdd(lightsurf->mins, modelinfo->offset, lightsurf->mins);
     VectorAdd(lightsurf->maxs, modelinfo->offset, lightsurf->maxs);
     
-    /* Allocate occlusion array */
-    lightsurf->occlusion = (float *) calloc(lightsurf->numpoints, sizeof(float));
+    CalcPVS(bsp, lightsurf);
+    
+    /* Clear occlusion array */
+    lightsurf->occlusion = lightsurf_scratch.full.occlusion;
+    memset(lightsurf->occlusion, 0, lightsurf->numpoints * sizeof(vec_t));
     
-    lightsurf->stream = MakeRayStream(lightsurf->numpoints);
+    lightsurf->stream = lightsurf_scratch.stream;
+    lightsurf->stream->clearPushedRays();
     return true;
 }
 
 static void
-Lightmap_AllocOrClear(lightmap_t *lightmap, const lightsurf_t *lightsurf)
+Lightmap_AllocOrClear(lightmap_t *lightmap, const lightsurf_t *lightsurf,
+                      const lightmapdict_t *lightmaps, size_t slot)
 {
     if (lightmap->samples == NULL) {
-        /* first use of this lightmap, allocate the storage for it. */
-        lightmap->samples = (lightsample_t *) calloc(lightsurf->numpoints, sizeof(lightsample_t));
-    } else {
-        /* clear only the data that is going to be merged to it. there's no point clearing more */
-        memset(lightmap->samples, 0, sizeof(*lightmap->samples)*lightsurf->numpoints);
+        /* first use of this lightmap, take the thread's buffer for this slot. */
+        lightmap->samples = lightsurf_scratch.samplesForSlot(lightmaps, slot);
     }
+    /* clear only the data that is going to be merged to it. there's no point clearing more */
+    memset(lightmap->samples, 0, sizeof(*lightmap->samples)*lightsurf->numpoints);
 }
 
 static const lightmap_t *
@@ -896,7 +1243,7 @@ Lightmap_ForStyle(lightmapdict_t *lightmaps, const int style, const lightsurf_t
     // no exact match, check for an unsaved one
     for (auto &lm : *lightmaps) {
         if (lm.style == 255) {
-            Lightmap_AllocOrClear(&lm, lightsurf);
+            Lightmap_AllocOrClear(&lm, lightsurf, lightmaps, &lm - lightmaps->data());
             return &lm;
         }
     }
@@ -904,7 +1251,7 @@ Lightmap_ForStyle(lightmapdict_t *lightmaps, const int style, const lightsurf_t
     // add a new one to the vector (invalidates existing lightmap_t pointers)
     lightmap_t newLightmap {};
     newLightmap.style = 255;
-    Lightmap_AllocOrClear(&newLightmap, lightsurf);
+    Lightmap_AllocOrClear(&newLightmap, lightsurf, lightmaps, lightmaps->size());
     lightmaps->push_back(newLightmap);
     
     return &lightmaps->back();
@@ -1215,6 +1562,10 @@ CullLight(const light_t *entity, const lightsurf_t *lightsurf)
         return true;
     }
     
+    if (Lightsurf_PVSCull(lightsurf, entity->cluster)) {
+        return true;
+    }
+    
     vec3_t distvec;
     VectorSubtract(*entity->origin.vec3Value(), lightsurf->origin, distvec);
     const float dist = VectorLength(distvec) - lightsurf->radius;
@@ -1309,115 +1660,310 @@ static qboolean LightFace_SampleMipTex(rgba_miptex_t *tex, const float *projecti
  * ================
  * GetDirectLighting
  *
- * Mesaures direct lighting at a point, currently only used for bounce lighting.
+ * Mesaures direct lighting at points, currently only used for bounce lighting.
+ * result[i] gets the light at origins[i] by style. The dirt, light and sky
+ * rays of all of the points are traced together, up to DIRECT_BATCH_RAYS
+ * at a time, so rs must hold that many rays.
  * FIXME: factor out / merge with LightFace
  * ================
  */
-std::map<int, qvec3f>
-GetDirectLighting(const globalconfig_t &cfg, raystream_t *rs, const vec3_t origin, const vec3_t normal)
+void
+GetDirectLighting(const globalconfig_t &cfg, raystream_t *rs, int numpoints, const vec3_t *origins, const vec3_t *normals, std::map<int, qvec3f> *result)
 {
-    std::map<int, qvec3f> result;
-
-    float occlusion = DirtAtPoint(cfg, rs, origin, normal, /* FIXME: pass selfshadow? */ nullptr);
-    if (std::isnan(occlusion)) {
-        // HACK: getting an invalid normal of (0, 0, 0).
-        occlusion = 0.0f;
+    std::vector<float> occlusion(numpoints);
+    DirtAtPoints(cfg, rs, numpoints, origins, normals, nullptr, occlusion.data());
+    for (int i = 0; i < numpoints; i++) {
+        result[i].clear();
+        if (std::isnan(occlusion[i])) {
+            // HACK: getting an invalid normal of (0, 0, 0).
+            occlusion[i] = 0.0f;
+        }
     }
-
+    
+    /* light that reaches each ray's point, if the ray from the light is unoccluded */
+    struct directray_t {
+        int point;
+        int style;
+        qvec3f color;
+    };
+    std::vector<directray_t> pending;
+    
+    const auto traceLightRays = [&]() {
+        rs->tracePushedRaysOcclusion();
+        for (size_t j = 0; j < pending.size(); j++) {
+            if (!rs->getPushedRayOccluded(j))
+                result[pending[j].point][pending[j].style] += pending[j].color;
+        }
+        rs->clearPushedRays();
+        pending.clear();
+    };
+    const auto pushLightRay = [&](int i, const vec3_t lightorigin, int style, const vec3_t color) {
+        if (pending.size() == DIRECT_BATCH_RAYS)
+            traceLightRays();
+        
+        // same ray as TestLight(lightorigin, origins[i])
+        vec3_t dir;
+        VectorSubtract(origins[i], lightorigin, dir);
+        const vec_t dist = VectorNormalize(dir);
+        rs->pushRay(i, lightorigin, dir, dist, nullptr);
+        pending.push_back({i, style, vec3_t_to_glm(color)});
+    };
+    
+    rs->clearPushedRays();
+    
     //mxd. Surface lights...
     for (const surfacelight_t &vpl : SurfaceLights()) {
-        // Bounce light falloff. Uses light surface center and intensity based on face area
-        vec3_t surfpointToLightDir;
-        const float surfpointToLightDist = qmax(128.0f, GetDir(surfpointToLightDir, vpl.pos, surfpointToLightDir)); // Clamp away hotspots, also avoid division by 0...
-        const float angle = DotProduct(surfpointToLightDir, normal);
-        if (angle <= 0) continue;
-
-        // Exponential falloff
-        const float add = (vpl.totalintensity / SQR(surfpointToLightDist)) * angle;
-        if(add <= 0) continue;
-
-        // Write out the final color
-        vec3_t color;
-        VectorScale(vpl.color, add, color); // color_out is expected to be in [0..255] range, vpl->color is in [0..1] range.
-
-        const float dirt = Dirt_GetScaleFactor(cfg, occlusion, nullptr, surfpointToLightDist, /* FIXME: pass */ nullptr);
-        VectorScale(color, dirt, color);
-        VectorScale(color, cfg.surflightbouncescale.floatValue(), color);
-
-        // NOTE: Skip negative lights, which would make no sense to bounce!
-        if (LightSample_Brightness(color) <= fadegate)
-            continue;
-
-        if (!TestLight(vpl.pos, origin, nullptr))
-            continue;
-
-        result[0] += vec3_t_to_glm(color);
+        for (int i = 0; i < numpoints; i++) {
+            // Bounce light falloff. Uses light surface center and intensity based on face area
+            vec3_t surfpointToLightDir;
+            const float surfpointToLightDist = qmax(128.0f, GetDir(origins[i], vpl.pos, surfpointToLightDir)); // Clamp away hotspots, also avoid division by 0...
+            const float angle = DotProduct(surfpointToLightDir, normals[i]);
+            if (angle <= 0) continue;
+            
+            // Exponential falloff
+            const float add = (vpl.totalintensity / SQR(surfpointToLightDist)) * angle;
+            if(add <= 0) continue;
+            
+            // Write out the final color
+            vec3_t color;
+            VectorScale(vpl.color, add, color); // color_out is expected to be in [0..255] range, vpl->color is in [0..1] range.
+            
+            const float dirt = Dirt_GetScaleFactor(cfg, occlusion[i], nullptr, surfpointToLightDist, /* FIXME: pass */ nullptr);
+            VectorScale(color, dirt, color);
+            VectorScale(color, cfg.surflightbouncescale.floatValue(), color);
+            
+            // NOTE: Skip negative lights, which would make no sense to bounce!
+            if (LightSample_Brightness(color) <= fadegate)
+                continue;
+            
+            pushLightRay(i, vpl.pos, 0, color);
+        }
     }
     
     for (const light_t &entity : GetLights()) {
-        vec3_t surfpointToLightDir;
-        float surfpointToLightDist;
-        vec3_t color, normalcontrib;
-        
         // Skip styled lights if "bouncestyled" setting is off.
         if (entity.style.intValue() != 0 && !cfg.bouncestyled.boolValue()) {
             continue;
         }
         
-        GetLightContrib(cfg, &entity, normal, origin, false, color, surfpointToLightDir, normalcontrib, &surfpointToLightDist);
-        
-        const float dirt = Dirt_GetScaleFactor(cfg, occlusion, &entity, surfpointToLightDist, /* FIXME: pass */ nullptr);
-        VectorScale(color, dirt, color);
-        VectorScale(color, entity.bouncescale.floatValue(), color);
-        
-        // NOTE: Skip negative lights, which would make no sense to bounce!
-        if (LightSample_Brightness(color) <= fadegate) {
-            continue;
-        }
-        
-        if (!TestLight(*entity.origin.vec3Value(), origin, NULL)) {
-            continue;
+        for (int i = 0; i < numpoints; i++) {
+            vec3_t surfpointToLightDir;
+            float surfpointToLightDist;
+            vec3_t color, normalcontrib;
+            
+            GetLightContrib(cfg, &entity, normals[i], origins[i], false, color, surfpointToLightDir, normalcontrib, &surfpointToLightDist);
+            
+            const float dirt = Dirt_GetScaleFactor(cfg, occlusion[i], &entity, surfpointToLightDist, /* FIXME: pass */ nullptr);
+            VectorScale(color, dirt, color);
+            VectorScale(color, entity.bouncescale.floatValue(), color);
+            
+            // NOTE: Skip negative lights, which would make no sense to bounce!
+            if (LightSample_Brightness(color) <= fadegate) {
+                continue;
+            }
+            
+            pushLightRay(i, *entity.origin.vec3Value(), entity.style.intValue(), color);
         }
-        
-        result[entity.style.intValue()] += vec3_t_to_glm(color);
     }
     
+    traceLightRays();
+    
+    /* sky visibility of each point in each direction with a sun to bounce,
+       traced from the first such sun (as TestSky) and shared by the rest */
+    const std::vector<skydir_t> &skydirs = GetSkyDirs();
+    const int numskydirs = static_cast<int>(skydirs.size());
+    std::vector<const sun_t *> skysun(numskydirs, nullptr);
     for (const sun_t &sun : GetSuns()) {
-        
         // NOTE: Skip negative lights, which would make no sense to bounce!
-        if (sun.sunlight < 0)
-            continue;
+        if (sun.sunlight >= 0 && skysun[sun.skydir] == nullptr)
+            skysun[sun.skydir] = &sun;
+    }
+    
+    std::vector<uint8_t> skyvisible(numpoints * numskydirs, 0);
+    std::vector<int> skyray; // point * numskydirs + skydir of each pushed ray
+    
+    const auto traceSkyRays = [&]() {
+        rs->tracePushedRaysIntersection();
+        for (size_t j = 0; j < skyray.size(); j++) {
+            skyvisible[skyray[j]] = (rs->getPushedRayHitType(j) == hittype_t::SKY);
+        }
+        rs->clearPushedRays();
+        skyray.clear();
+    };
+    
+    for (int i = 0; i < numpoints; i++) {
+        for (int d = 0; d < numskydirs; d++) {
+            if (skysun[d] == nullptr || DotProduct(skydirs[d].dir, normals[i]) < 0)
+                continue;
+            
+            if (skyray.size() == DIRECT_BATCH_RAYS)
+                traceSkyRays();
+            
+            vec3_t dir;
+            VectorCopy(skysun[d]->sunvec, dir);
+            VectorNormalize(dir);
+            rs->pushRay(i, origins[i], dir, MAX_SKY_DIST, nullptr);
+            skyray.push_back(i * numskydirs + d);
+        }
+    }
+    traceSkyRays();
+    
+    for (int i = 0; i < numpoints; i++) {
+        for (const sun_t &sun : GetSuns()) {
+            
+            // NOTE: Skip negative lights, which would make no sense to bounce!
+            if (sun.sunlight < 0)
+                continue;
+            
+            const vec_t *originLightDir = skydirs[sun.skydir].dir;
+            
+            vec_t cosangle = DotProduct(originLightDir, normals[i]);
+            if (cosangle < 0) {
+                continue;
+            }
+            
+            // apply anglescale
+            cosangle = (1.0 - sun.anglescale) + sun.anglescale * cosangle;
+            
+            if (!skyvisible[i * numskydirs + sun.skydir]) {
+                continue;
+            }
+            
+            float dirt = 1;
+            if (sun.dirt) {
+                dirt = Dirt_GetScaleFactor(cfg, occlusion[i], nullptr, 0.0, /* FIXME: pass */ nullptr);
+            }
             
-        vec3_t originLightDir;
-        VectorCopy(sun.sunvec, originLightDir);
-        VectorNormalize(originLightDir);
+            const int sunstyle = 0;
+            const qvec3f sunContrib = vec3_t_to_glm(sun.sunlight_color) * (dirt * cosangle * sun.sunlight / 255.0f);
+            result[i][sunstyle] += sunContrib;
+        }
+    }
+}
+
+
+/*
+ * SIMD version of GetLightValueWithAngle, for all of the unoccluded points
+ * of lightsurf and an entity without a projected texture. Fills `out` with
+ * the points that get more than fadegate from the light, not counting dirt
+ * (which only darkens) or shadows.
+ *
+ * Lengths are worked out in single precision here, so the caller should
+ * still use GetDir for the rays; an ulp of difference in a ray direction
+ * is enough to move a shadow edge.
+ */
+void
+GetLightContribs(const globalconfig_t &cfg, const light_t *entity, const lightsurf_t *lightsurf,
+                 std::vector<entitycontrib_t> &out)
+{
+    out.clear();
+    
+    const vfloat zero(0.0f);
+    const vfloat one(1.0f);
+    
+    const vec_t *origin = *entity->origin.vec3Value();
+    const vfloat ox(origin[0]), oy(origin[1]), oz(origin[2]);
+    
+    const bool absangle = entity->bleed.boolValue() || lightsurf->twosided;
+    const float anglescale = entity->anglescale.floatValue();
+    const vfloat angleconst(1.0f - anglescale), anglefactor(anglescale);
+    
+    const bool spotlight = entity->spotlight;
+    const vfloat spotx(entity->spotvec[0]), spoty(entity->spotvec[1]), spotz(entity->spotvec[2]);
+    const vfloat spotfalloff(entity->spotfalloff), spotfalloff2(entity->spotfalloff2);
+    const vfloat spotrange(entity->spotfalloff - entity->spotfalloff2);
+    
+    /* GetLightValue */
+    const light_formula_t formula = entity->getFormula();
+    const float light = entity->light.floatValue();
+    const float lightdistance = entity->falloff.floatValue();
+    const vfloat vlight(light);
+    const vfloat vlightdistance(lightdistance);
+    const vfloat distscale(cfg.scaledist.floatValue() * entity->atten.floatValue());
+    const vfloat lfscale(LF_SCALE), lfscale2(LF_SCALE * LF_SCALE);
+    
+    const vec_t *color = *entity->color.vec3Value();
+    const vfloat red(color[0]), green(color[1]), blue(color[2]);
+    const vfloat inv255(1.0f / 255.0f), third(1.0f / 3.0f);
+    const vfloat vfadegate(fadegate);
+    
+    alignas(32) float adds[LIGHT_SIMD_WIDTH];
+    
+    const int numpoints = lightsurf->numsoapoints;
+    for (int k = 0; k < numpoints; k += LIGHT_SIMD_WIDTH) {
+        const vfloat dx = ox - vfloat::loadu(lightsurf->soa[0] + k);
+        const vfloat dy = oy - vfloat::loadu(lightsurf->soa[1] + k);
+        const vfloat dz = oz - vfloat::loadu(lightsurf->soa[2] + k);
+        const vfloat dist = vsqrt(dx * dx + dy * dy + dz * dz);
+        const vfloat invdist = select(dist > zero, one / dist, zero);
+        const vfloat dirx = dx * invdist;
+        const vfloat diry = dy * invdist;
+        const vfloat dirz = dz * invdist;
         
-        vec_t cosangle = DotProduct(originLightDir, normal);
-        if (cosangle < 0) {
-            continue;
+        vfloat angle = dirx * vfloat::loadu(lightsurf->soa[3] + k)
+                     + diry * vfloat::loadu(lightsurf->soa[4] + k)
+                     + dirz * vfloat::loadu(lightsurf->soa[5] + k);
+        if (absangle) {
+            angle = vabs(angle);
         }
         
-        // apply anglescale
-        cosangle = (1.0 - sun.anglescale) + sun.anglescale * cosangle;
+        /* light behind the sample point gives nothing */
+        vmask lit = (angle >= zero);
+        angle = angleconst + anglefactor * angle;
         
-        if (!TestSky(origin, sun.sunvec, NULL)) {
-            continue;
+        vfloat spotscale = one;
+        if (spotlight) {
+            const vfloat falloff = spotx * dirx + spoty * diry + spotz * dirz;
+            lit = lit & (falloff <= spotfalloff);
+            spotscale = select(falloff > spotfalloff2, one - (falloff - spotfalloff2) / spotrange, one);
         }
         
-        float dirt = 1;
-        if (sun.dirt) {
-            dirt = Dirt_GetScaleFactor(cfg, occlusion, nullptr, 0.0, /* FIXME: pass */ nullptr);
+        vfloat value;
+        if (lightdistance > 0.0f && formula == LF_LINEAR) {
+            value = select(vlightdistance > dist, vlight * (one - dist / vlightdistance), zero);
+        } else if (formula == LF_INFINITE || formula == LF_LOCALMIN) {
+            value = vlight;
+        } else {
+            vfloat scaled = distscale * dist;
+            switch (formula) {
+                case LF_INVERSE:
+                    value = vlight / (scaled / lfscale);
+                    break;
+                case LF_INVERSE2A:
+                    scaled = scaled + lfscale;
+                    /* Fall through */
+                case LF_INVERSE2:
+                    value = vlight / ((scaled * scaled) / lfscale2);
+                    break;
+                case LF_LINEAR:
+                    value = (light > 0) ? vmax(vlight - scaled, zero) : vmin(vlight + scaled, zero);
+                    break;
+                default:
+                    Error("Internal error: unknown light formula");
+                    throw; //mxd. Silences compiler warning
+            }
         }
         
-        const int sunstyle = 0;
-        const qvec3f sunContrib = vec3_t_to_glm(sun.sunlight_color) * (dirt * cosangle * sun.sunlight / 255.0f);
-        result[sunstyle] += sunContrib;
+        const vfloat add = value * angle * spotscale;
+        const vfloat scale = add * inv255;
+        const vfloat brightness = (red * scale + green * scale + blue * scale) * third;
+        lit = lit & (vabs(brightness) > vfadegate);
+        
+        unsigned mask = movemask(lit);
+        if (numpoints - k < LIGHT_SIMD_WIDTH)
+            mask &= (1u << (numpoints - k)) - 1;
+        if (!mask)
+            continue;
+        
+        store(adds, add);
+        for (int lane = 0; lane < LIGHT_SIMD_WIDTH; lane++) {
+            if (mask & (1u << lane)) {
+                out.push_back(entitycontrib_t { lightsurf->soaindex[k + lane], adds[lane] });
+            }
+        }
     }
-    
-    return result;
 }
 
-
 /*
  * ================
  * LightFace_Entity
@@ -1456,28 +2002,55 @@ LightFace_Entity(const mbsp_t *bsp,
     raystream_t *rs = lightsurf->stream;
     rs->clearPushedRays();
     
-    for (int i = 0; i < lightsurf->numpoints; i++) {
-        const vec_t *surfpoint = lightsurf->points[i];
-        const vec_t *surfnorm = lightsurf->normals[i];
-        
-        if (lightsurf->occluded[i])
-            continue;
-        
-        vec3_t surfpointToLightDir;
-        float surfpointToLightDist;
-        vec3_t color, normalcontrib;
-        
-        GetLightContrib(cfg, entity, surfnorm, surfpoint, lightsurf->twosided, color, surfpointToLightDir, normalcontrib, &surfpointToLightDist);
- 
-        const float occlusion = Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], entity, surfpointToLightDist, lightsurf);
-        VectorScale(color, occlusion, color);
-        
-        /* Quick distance check first */
-        if (fabs(LightSample_Brightness(color)) <= fadegate) {
-            continue;
+    if (entity->projectedmip) {
+        /* the color varies per point, so this one is done a point at a time */
+        for (int i = 0; i < lightsurf->numpoints; i++) {
+            const vec_t *surfpoint = lightsurf->points[i];
+            const vec_t *surfnorm = lightsurf->normals[i];
+            
+            if (lightsurf->occluded[i])
+                continue;
+            
+            vec3_t surfpointToLightDir;
+            float surfpointToLightDist;
+            vec3_t color, normalcontrib;
+            
+            GetLightContrib(cfg, entity, surfnorm, surfpoint, lightsurf->twosided, color, surfpointToLightDir, normalcontrib, &surfpointToLightDist);
+            
+            const float occlusion = Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], entity, surfpointToLightDist, lightsurf);
+            VectorScale(color, occlusion, color);
+            
+            /* Quick distance check first */
+            if (fabs(LightSample_Brightness(color)) <= fadegate) {
+                continue;
+            }
+            
+            rs->pushRay(i, surfpoint, surfpointToLightDir, surfpointToLightDist, modelinfo, color, normalcontrib);
         }
+    } else {
+        std::vector<entitycontrib_t> &contribs = lightsurf_scratch.contribs;
+        GetLightContribs(cfg, entity, lightsurf, contribs);
         
-        rs->pushRay(i, surfpoint, surfpointToLightDir, surfpointToLightDist, modelinfo, color, normalcontrib);
+        for (const entitycontrib_t &contrib : contribs) {
+            const int i = contrib.point;
+            const vec_t *surfpoint = lightsurf->points[i];
+            
+            vec3_t surfpointToLightDir;
+            const float surfpointToLightDist = GetDir(surfpoint, *entity->origin.vec3Value(), surfpointToLightDir);
+            
+            vec3_t color, normalcontrib;
+            VectorScale(*entity->color.vec3Value(), contrib.add * (1.0f / 255.0f), color);
+            VectorScale(surfpointToLightDir, contrib.add, normalcontrib);
+            
+            const float occlusion = Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], entity, surfpointToLightDist, lightsurf);
+            VectorScale(color, occlusion, color);
+            
+            if (fabs(LightSample_Brightness(color)) <= fadegate) {
+                continue;
+            }
+            
+            rs->pushRay(i, surfpoint, surfpointToLightDir, surfpointToLightDist, modelinfo, color, normalcontrib);
+        }
     }
     
     rs->tracePushedRaysOcclusion();
@@ -1522,103 +2095,207 @@ LightFace_Entity(const mbsp_t *bsp,
 }
 
 /*
- * =============
- * LightFace_Sky
- * =============
+ * Light from a sun at point i of the face, before the sky visibility test.
+ * Returns false if it's too dim to bother tracing.
  */
-static void
-LightFace_Sky(const sun_t *sun, const lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+static inline bool
+LightFace_SkyContrib(const lightsurf_t *lightsurf, const sun_t *sun, const vec_t *incoming, const vec_t *dirt,
+                     int i, vec3_t color, vec3_t normalcontrib)
 {
-    const globalconfig_t &cfg = *lightsurf->cfg;
-    const modelinfo_t *modelinfo = lightsurf->modelinfo;
-    const plane_t *plane = &lightsurf->plane;
+    float angle = DotProduct(incoming, lightsurf->normals[i]);
+    if (lightsurf->twosided) {
+        if (angle < 0) {
+            angle = -angle;
+        }
+    }
 
-    // FIXME: Normalized sun vector should be stored in the sun_t. Also clarify which way the vector points (towards or away..)
-    vec3_t incoming;
-    VectorCopy(sun->sunvec, incoming);
-    VectorNormalize(incoming);
+    angle = qmax(0.0f, angle);
 
-    /* Don't bother if surface facing away from sun */
-    const float dp = DotProduct(incoming, plane->normal);
-    if (dp < -ANGLE_EPSILON && !lightsurf->curved && !lightsurf->twosided) {
-        return;
+    angle = (1.0 - sun->anglescale) + sun->anglescale * angle;
+    float value = angle * sun->sunlight;
+    if (sun->dirt) {
+        value *= dirt[i];
     }
 
-    /* Check each point... */
-    raystream_t *rs = lightsurf->stream;
-    rs->clearPushedRays();
-    
-    for (int i = 0; i < lightsurf->numpoints; i++) {
-        const vec_t *surfpoint = lightsurf->points[i];
-        const vec_t *surfnorm = lightsurf->normals[i];
-        
-        if (lightsurf->occluded[i])
+    VectorScale(sun->sunlight_color, value / 255.0, color);
+    VectorScale(sun->sunvec, value, normalcontrib);
+
+    /* Quick distance check first */
+    return fabs(LightSample_Brightness(color)) > fadegate;
+}
+
+/*
+ * Traces the rays pushed for batch number `batch` and adds the light of
+ * each sun whose direction was in the batch, in GetSuns() order.
+ */
+static void
+LightFace_SkyBatch(const lightsurf_t *lightsurf, lightmapdict_t *lightmaps, raystream_t *rs, int batch)
+{
+    rs->tracePushedRaysIntersection();
+
+    const std::vector<skydir_t> &skydirs = GetSkyDirs();
+    const vec_t *dirt = lightsurf_scratch.skydirt.data();
+
+    /* if sunlight is set, use a style 0 light map */
+    int cached_style = 0;
+    lightmap_t *cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
+
+    for (const sun_t *sun : lightsurf_scratch.skysuns) {
+        const skyrays_t &rays = lightsurf_scratch.skyrays[sun->skydir];
+        if (rays.batch != batch)
             continue;
-        
-        float angle = DotProduct(incoming, surfnorm);
-        if (lightsurf->twosided) {
-            if (angle < 0) {
-                angle = -angle;
+
+        const vec_t *incoming = skydirs[sun->skydir].dir;
+
+        for (int j = rays.firstray; j < rays.firstray + rays.numrays; j++) {
+            if (rs->getPushedRayHitType(j) != hittype_t::SKY) {
+                continue;
             }
-        }
 
-        angle = qmax(0.0f, angle);
-        
-        angle = (1.0 - sun->anglescale) + sun->anglescale * angle;
-        float value = angle * sun->sunlight;
-        if (sun->dirt) {
-            value *= Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], NULL, 0.0, lightsurf);
+            const int i = rs->getPushedRayPointIndex(j);
+
+            vec3_t color, normalcontrib;
+            if (!LightFace_SkyContrib(lightsurf, sun, incoming, dirt, i, color, normalcontrib)) {
+                continue;
+            }
+
+            /* the ray was traced with a white color, so this is just the tint of any glass it went through */
+            vec3_t tint;
+            rs->getPushedRayColor(j, tint);
+            for (int k = 0; k < 3; k++) {
+                color[k] *= tint[k];
+            }
+
+            // check if we hit a dynamic shadow caster
+            int desired_style = 0;
+            if (rs->getPushedRayDynamicStyle(j) != 0) {
+                desired_style = rs->getPushedRayDynamicStyle(j);
+            }
+
+            // if necessary, switch which lightmap we are writing to.
+            if (desired_style != cached_style) {
+                cached_style = desired_style;
+                cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
+            }
+
+            lightsample_t *sample = &cached_lightmap->samples[i];
+
+            VectorAdd(sample->color, color, sample->color);
+            VectorAdd(sample->direction, normalcontrib, sample->direction);
+
+            Lightmap_Save(lightmaps, lightsurf, cached_lightmap, cached_style);
         }
-        
-        vec3_t color, normalcontrib;
-        VectorScale(sun->sunlight_color, value / 255.0, color);
-        VectorScale(sun->sunvec, value, normalcontrib);
-        
-        /* Quick distance check first */
-        if (fabs(LightSample_Brightness(color)) <= fadegate) {
+    }
+}
+
+/*
+ * =============
+ * LightFace_Sky
+ *
+ * Lights the face from all suns with positive light, or with negative
+ * light if `negative` is set. Each sky direction is traced once per point
+ * and the result is shared by all suns in that direction. The rays of as
+ * many directions as fit go into one stream and are traced together,
+ * grouped by the octant of the direction so that neighbouring rays stay
+ * coherent. Finding the unoccluded points and their dirt is done once for
+ * all suns.
+ * =============
+ */
+static void
+LightFace_Sky(const lightsurf_t *lightsurf, lightmapdict_t *lightmaps, bool negative)
+{
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    const modelinfo_t *modelinfo = lightsurf->modelinfo;
+    const plane_t *plane = &lightsurf->plane;
+    const std::vector<skydir_t> &skydirs = GetSkyDirs();
+
+    std::vector<const sun_t *> &suns = lightsurf_scratch.skysuns;
+    suns.clear();
+
+    bool anydirt = false;
+    for (const sun_t &sun : GetSuns()) {
+        if (negative ? !(sun.sunlight < 0) : !(sun.sunlight > 0))
+            continue;
+
+        /* Don't bother if surface facing away from sun */
+        const float dp = DotProduct(skydirs[sun.skydir].dir, plane->normal);
+        if (dp < -ANGLE_EPSILON && !lightsurf->curved && !lightsurf->twosided) {
             continue;
         }
-        
-        rs->pushRay(i, surfpoint, incoming, MAX_SKY_DIST, modelinfo, color, normalcontrib);
+
+        suns.push_back(&sun);
+        anydirt |= (sun.dirt != 0);
     }
-    
-    rs->tracePushedRaysIntersection();
-    
-    /* if sunlight is set, use a style 0 light map */
-    int cached_style = 0;
-    lightmap_t *cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
-    
-    const int N = rs->numPushedRays();
-    for (int j = 0; j < N; j++) {
-        if (rs->getPushedRayHitType(j) != hittype_t::SKY) {
+    if (suns.empty())
+        return;
+
+    /* e.g. _sunlight2 and _sunlight3 domes alternate between the hemispheres */
+    std::vector<const sun_t *> &order = lightsurf_scratch.skyorder;
+    order.assign(suns.begin(), suns.end());
+    std::stable_sort(order.begin(), order.end(), [&skydirs](const sun_t *a, const sun_t *b) {
+        const int a_octant = skydirs[a->skydir].octant;
+        const int b_octant = skydirs[b->skydir].octant;
+        if (a_octant != b_octant)
+            return a_octant < b_octant;
+        return a->skydir < b->skydir;
+    });
+
+    std::vector<int> &points = lightsurf_scratch.skypoints;
+    std::vector<vec_t> &dirt = lightsurf_scratch.skydirt;
+    points.clear();
+    dirt.resize(lightsurf->numpoints);
+    for (int i = 0; i < lightsurf->numpoints; i++) {
+        if (lightsurf->occluded[i])
             continue;
+        points.push_back(i);
+        dirt[i] = anydirt ? Dirt_GetScaleFactor(cfg, lightsurf->occlusion[i], NULL, 0.0, lightsurf) : 1.0f;
+    }
+    if (points.empty())
+        return;
+
+    std::vector<skyrays_t> &rays = lightsurf_scratch.skyrays;
+    rays.assign(skydirs.size(), skyrays_t { -1, 0, 0 });
+
+    raystream_t *rs = lightsurf_scratch.skyStream(lightsurf->numpoints);
+    const size_t maxrays = static_cast<size_t>(lightsurf_scratch.maxskyrays);
+    rs->clearPushedRays();
+
+    const vec3_t white = { 1.0f, 1.0f, 1.0f };
+    int batch = 0;
+    for (size_t k = 0; k < order.size(); ) {
+        /* order[k .. end) all have this direction */
+        const int skydir = order[k]->skydir;
+        size_t end = k + 1;
+        while (end < order.size() && order[end]->skydir == skydir)
+            end++;
+
+        if (rs->numPushedRays() + points.size() > maxrays) {
+            LightFace_SkyBatch(lightsurf, lightmaps, rs, batch);
+            rs->clearPushedRays();
+            batch++;
         }
-        
-        const int i = rs->getPushedRayPointIndex(j);
-        
-        // check if we hit a dynamic shadow caster
-        int desired_style = 0;
-        if (rs->getPushedRayDynamicStyle(j) != 0) {
-            desired_style = rs->getPushedRayDynamicStyle(j);
-        }
-        
-        // if necessary, switch which lightmap we are writing to.
-        if (desired_style != cached_style) {
-            cached_style = desired_style;
-            cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
+
+        const vec_t *incoming = skydirs[skydir].dir;
+        skyrays_t &dirrays = rays[skydir];
+        dirrays.batch = batch;
+        dirrays.firstray = static_cast<int>(rs->numPushedRays());
+
+        for (const int i : points) {
+            /* trace if it's worth it for any sun in this direction */
+            for (size_t s = k; s < end; s++) {
+                vec3_t color, normalcontrib;
+                if (LightFace_SkyContrib(lightsurf, order[s], incoming, dirt.data(), i, color, normalcontrib)) {
+                    rs->pushRay(i, lightsurf->points[i], incoming, MAX_SKY_DIST, modelinfo, white);
+                    break;
+                }
+            }
         }
 
-        lightsample_t *sample = &cached_lightmap->samples[i];
-        
-        vec3_t color, normalcontrib;
-        rs->getPushedRayColor(j, color);
-        rs->getPushedRayNormalContrib(j, normalcontrib);
-        
-        VectorAdd(sample->color, color, sample->color);
-        VectorAdd(sample->direction, normalcontrib, sample->direction);
-        
-        Lightmap_Save(lightmaps, lightsurf, cached_lightmap, cached_style);
+        dirrays.numrays = static_cast<int>(rs->numPushedRays()) - dirrays.firstray;
+        k = end;
     }
+
+    LightFace_SkyBatch(lightsurf, lightmaps, rs, batch);
 }
 
 /*
@@ -1785,16 +2462,14 @@ LightFace_BounceLightsDebug(const lightsurf_t *lightsurf, lightmapdict_t *lightm
     // reset all lightmaps to black (lazily)
     Lightmap_ClearAll(lightmaps);
     
-    const std::vector<int> &vpls = BounceLightsForFaceNum(Face_GetNum(lightsurf->bsp, lightsurf->face));
-    const std::vector<bouncelight_t> &all_vpls = BounceLights();
+    const bouncelightrange_t vpls = BounceLightsForFaceNum(Face_GetNum(lightsurf->bsp, lightsurf->face));
     
     /* Overwrite each point with the emitted color... */
     for (int i = 0; i < lightsurf->numpoints; i++) {
         if (lightsurf->occluded[i])
             continue;
         
-        for (const auto &vplnum : vpls) {
-            const bouncelight_t &vpl = all_vpls[vplnum];
+        for (const bouncelight_t &vpl : vpls) {
             
             // check for point in polygon (note: could be on the edge of more than one)
             if (!GLM_EdgePlanes_PointInside(vpl.poly_edgeplanes, vec3_t_to_glm(lightsurf->points[i])))
@@ -1843,7 +2518,7 @@ SurfaceLight_ColorAtDist(const globalconfig_t &cfg, const float intensity, const
 
 // dir: vpl -> sample point direction
 // returns color in [0,255]
-static inline qvec3f
+qvec3f
 GetIndirectLighting (const globalconfig_t &cfg, const bouncelight_t *vpl, const qvec3f &bounceLightColor, const qvec3f &dir, const float dist, const qvec3f &origin, const qvec3f &normal)
 {
     const float dp1 = qv::dot(vpl->surfnormal, dir);
@@ -1904,6 +2579,9 @@ BounceLight_SphereCull(const mbsp_t *bsp, const bouncelight_t *vpl, const lights
     if (!novisapprox && AABBsDisjoint(vpl->mins, vpl->maxs, lightsurf->mins, lightsurf->maxs))
         return true;
     
+    if (Lightsurf_PVSCull(lightsurf, vpl->cluster))
+        return true;
+    
     const qvec3f dir = vec3_t_to_glm(lightsurf->origin) - vpl->pos; // vpl -> sample point
     const float dist = qv::length(dir) + lightsurf->radius;
     
@@ -1919,6 +2597,18 @@ SurfaceLight_SphereCull(const surfacelight_t *vpl, const lightsurf_t *lightsurf)
     if (!novisapprox && AABBsDisjoint(vpl->mins, vpl->maxs, lightsurf->mins, lightsurf->maxs))
         return true;
 
+    if (!lightsurf->pvs.empty() && !vpl->clusters.empty()) {
+        bool visible = false;
+        for (const int cluster : vpl->clusters) {
+            if (!Lightsurf_PVSCull(lightsurf, cluster)) {
+                visible = true;
+                break;
+            }
+        }
+        if (!visible)
+            return true;
+    }
+
     const globalconfig_t &cfg = *lightsurf->cfg;
     const qvec3f dir = vec3_t_to_glm(lightsurf->origin) - vec3_t_to_glm(vpl->pos); // vpl -> sample point
     const float dist = qv::length(dir) + lightsurf->radius;
@@ -1929,6 +2619,488 @@ SurfaceLight_SphereCull(const surfacelight_t *vpl, const lightsurf_t *lightsurf)
     return LightSample_Brightness(color) < 0.25f;
 }
 
+/*
+ * ================
+ * Light index
+ *
+ * Octrees over the volume each entity light / bounce light can reach,
+ * so a face only visits the lights near its bounding sphere rather than
+ * the whole list. The volumes are conservative with respect to CullLight
+ * and BounceLight_SphereCull, which still run on every light returned.
+ * ================
+ */
+
+struct lightindex_t {
+    aabb3f domain; // light volumes are clipped to this; queries outside it fall back to all lights
+    octree_t<int> octree;
+    int count;
+};
+
+static lightindex_t *entity_light_index;
+static lightindex_t *bounce_light_index;
+static bouncetree_t *bounce_tree;
+
+static aabb3f
+LightIndex_Volume(const vec3_t origin, float radius, const vec3_t visapprox_mins, const vec3_t visapprox_maxs, const aabb3f &domain, bool *valid_out)
+{
+    aabb3f box = domain;
+
+    // pad the radius a little to stay clear of rounding in the cull tests
+    if (std::isfinite(radius) && radius < VECT_MAX) {
+        radius = (radius * 1.01f) + 1.0f;
+        const qvec3f org = vec3_t_to_glm(origin);
+        const aabb3f::intersection_t clipped = box.intersectWith(aabb3f(org - qvec3f(radius), org + qvec3f(radius)));
+        if (!clipped.valid) {
+            *valid_out = false;
+            return box;
+        }
+        box = clipped.bbox;
+    }
+
+    if (!novisapprox) {
+        const aabb3f::intersection_t clipped = box.intersectWith(aabb3f(vec3_t_to_glm(visapprox_mins), vec3_t_to_glm(visapprox_maxs)));
+        if (!clipped.valid) {
+            *valid_out = false;
+            return box;
+        }
+        box = clipped.bbox;
+    }
+
+    *valid_out = true;
+    return box;
+}
+
+static lightindex_t *
+LightIndex_Make(const aabb3f &domain, const std::vector<std::pair<aabb3f, int>> &volumes, int count)
+{
+    return new lightindex_t { domain, makeOctree(volumes), count };
+}
+
+/* fills lightnums with the lights that may reach lightsurf, in ascending order */
+static void
+LightIndex_Query(const lightindex_t *index, int count, const lightsurf_t *lightsurf, std::vector<int> &lightnums)
+{
+    const qvec3f origin = vec3_t_to_glm(lightsurf->origin);
+    const aabb3f query = aabb3f(origin - qvec3f(lightsurf->radius), origin + qvec3f(lightsurf->radius))
+        .unionWith(aabb3f(vec3_t_to_glm(lightsurf->mins), vec3_t_to_glm(lightsurf->maxs)));
+
+    if (index != nullptr && index->count == count && index->domain.contains(query)) {
+        index->octree.queryTouchingBBox(query, lightnums);
+        return;
+    }
+
+    lightnums.resize(count);
+    for (int i = 0; i < count; i++) {
+        lightnums[i] = i;
+    }
+}
+
+/*
+ * ================
+ * Bounce light tree
+ *
+ * With "bouncecuts" set, LightFace_Bounce doesn't trace every bounce light
+ * that reaches the face. The bounce lights are put in a binary tree once,
+ * clustered by position and normal, and each face picks a cut through it
+ * the way lightcuts does: clusters are split until the bound on the light
+ * each could add is within bouncecuts times the estimated total bounce
+ * light at the face. A cluster left in the cut is traced as a single
+ * bounce light at its brightest member, carrying the light of all of its
+ * members, so it is lit or shadowed as a whole: the result is an
+ * approximation. Clusters whose members aren't all visible to the face,
+ * going by PVS and the estimated visible AABBs, are always split, so a
+ * cluster never carries light the face couldn't get.
+ * ================
+ */
+
+/*
+ * Adds the node for members[first .. first + count), and its subtree, to
+ * tree. Returns its number.
+ */
+static int
+BounceTree_MakeNode(bouncetree_t *tree, std::vector<bouncemember_t> &members, int first, int count)
+{
+    bouncenode_t node;
+    node.children[0] = node.children[1] = -1;
+    node.brightest = members[first].light;
+    node.power = 0;
+    node.shared = true;
+    node.numclusters = 0;
+    VectorCopy(members[first].light->mins, node.vismins);
+    VectorCopy(members[first].light->maxs, node.vismaxs);
+    VectorCopy(members[first].light->mins, node.sharedmins);
+    VectorCopy(members[first].light->maxs, node.sharedmaxs);
+    
+    qvec3f mins = members[first].pos, maxs = mins;
+    qvec3f normalmins = members[first].normal, normalmaxs = normalmins;
+    qvec3f normalsum(0);
+    float brightestpower = 0;
+    for (int i = first; i < first + count; i++) {
+        const bouncemember_t &member = members[i];
+        for (int j = 0; j < 3; j++) {
+            mins[j] = qmin(mins[j], member.pos[j]);
+            maxs[j] = qmax(maxs[j], member.pos[j]);
+            normalmins[j] = qmin(normalmins[j], member.normal[j]);
+            normalmaxs[j] = qmax(normalmaxs[j], member.normal[j]);
+            node.vismins[j] = qmin(node.vismins[j], member.light->mins[j]);
+            node.vismaxs[j] = qmax(node.vismaxs[j], member.light->maxs[j]);
+            node.sharedmins[j] = qmax(node.sharedmins[j], member.light->mins[j]);
+            node.sharedmaxs[j] = qmin(node.sharedmaxs[j], member.light->maxs[j]);
+            if (node.sharedmins[j] > node.sharedmaxs[j])
+                node.shared = false;
+        }
+        normalsum += member.normal;
+        node.power += member.power;
+        if (member.power > brightestpower) {
+            brightestpower = member.power;
+            node.brightest = member.light;
+        }
+        
+        if (node.numclusters >= 0
+            && std::find(node.clusters, node.clusters + node.numclusters, member.light->cluster) == node.clusters + node.numclusters) {
+            if (node.numclusters == BOUNCE_NODE_CLUSTERS)
+                node.numclusters = -1;
+            else
+                node.clusters[node.numclusters++] = member.light->cluster;
+        }
+    }
+    node.bounds = aabb3f(mins, maxs);
+    
+    /* normal cone */
+    const float normallen = qv::length(normalsum);
+    if (normallen > 0.001f) {
+        node.coneaxis = normalsum / normallen;
+        node.conecos = 1.0f;
+        for (int i = first; i < first + count; i++) {
+            node.conecos = qmin(node.conecos, qv::dot(node.coneaxis, members[i].normal));
+        }
+    } else {
+        node.coneaxis = qvec3f(0, 0, 1);
+        node.conecos = -1.0f;
+    }
+    
+    const int nodenum = static_cast<int>(tree->nodes.size());
+    tree->nodes.push_back(node);
+    
+    if (count == 1) {
+        tree->nodes[nodenum].light = members[first].light;
+        return nodenum;
+    }
+    
+    /* the cluster, lit from its brightest member with everyone's light */
+    tree->clusters.emplace_back();
+    bouncelight_t &cluster = tree->clusters.back();
+    cluster.pos = node.brightest->pos;
+    cluster.surfnormal = node.brightest->surfnormal;
+    cluster.area = 1.0f;
+    cluster.componentwiseMaxColor = qvec3f(0);
+    VectorCopy(node.vismins, cluster.mins);
+    VectorCopy(node.vismaxs, cluster.maxs);
+    cluster.cluster = -1;
+    for (int i = first; i < first + count; i++) {
+        const bouncelight_t *vpl = members[i].light;
+        for (const auto &styleColor : vpl->colorByStyle) {
+            cluster.colorByStyle[styleColor.first] += styleColor.second * vpl->area;
+        }
+    }
+    for (const auto &styleColor : cluster.colorByStyle) {
+        for (int j = 0; j < 3; j++) {
+            cluster.componentwiseMaxColor[j] = qmax(cluster.componentwiseMaxColor[j], styleColor.second[j]);
+        }
+    }
+    tree->nodes[nodenum].light = &cluster;
+    
+    /* split at the median of the widest extent of the positions or the
+       normals; normals spread over the whole sphere count as much as half
+       the cluster's size */
+    const qvec3f possize = maxs - mins;
+    const qvec3f normalsize = (normalmaxs - normalmins) * (0.25f * qv::length(possize));
+    int axis = 0;
+    float widest = -1.0f;
+    for (int i = 0; i < 6; i++) {
+        const float extent = (i < 3) ? possize[i] : normalsize[i - 3];
+        if (extent > widest) {
+            widest = extent;
+            axis = i;
+        }
+    }
+    
+    const int half = count / 2;
+    std::nth_element(members.begin() + first, members.begin() + first + half, members.begin() + first + count,
+                     [axis](const bouncemember_t &a, const bouncemember_t &b) {
+                         if (axis < 3)
+                             return a.pos[axis] < b.pos[axis];
+                         return a.normal[axis - 3] < b.normal[axis - 3];
+                     });
+    
+    const int left = BounceTree_MakeNode(tree, members, first, half);
+    const int right = BounceTree_MakeNode(tree, members, first + half, count - half);
+    tree->nodes[nodenum].children[0] = left;
+    tree->nodes[nodenum].children[1] = right;
+    return nodenum;
+}
+
+bouncetree_t *
+BounceTree_Make(const std::vector<bouncelight_t> &lights)
+{
+    bouncetree_t *tree = new bouncetree_t;
+    if (lights.empty())
+        return tree;
+    
+    std::vector<bouncemember_t> members;
+    for (const bouncelight_t &vpl : lights) {
+        members.push_back({vpl.pos, vpl.surfnormal, vpl.area * LightSample_Brightness(vpl.componentwiseMaxColor), &vpl});
+    }
+    
+    /* nodes point at their clusters, so they mustn't move */
+    tree->nodes.reserve(2 * lights.size() - 1);
+    tree->clusters.reserve(lights.size() - 1);
+    BounceTree_MakeNode(tree, members, 0, static_cast<int>(members.size()));
+    return tree;
+}
+
+void
+BounceTree_Free(bouncetree_t *tree)
+{
+    delete tree;
+}
+
+/*
+ * Upper bound on the brightness (before bouncescale and the 255 scale) the
+ * node's members together can add to any sample point of the face, which
+ * lie within radius of origin.
+ */
+static float
+BounceTree_Bound(const bouncenode_t &node, const lightsurf_t *lightsurf, const qvec3f &origin, float radius)
+{
+    float dist2 = 0;
+    for (int i = 0; i < 3; i++) {
+        const float d = qmax(0.0f, qmax(node.bounds.mins()[i] - origin[i], origin[i] - node.bounds.maxs()[i]));
+        dist2 += d * d;
+    }
+    const float mindist = qmax(0.0f, sqrt(dist2) - radius);
+    const float clamped = qmax(mindist, 128.0f); // as BounceLight_ColorAtDist
+    
+    /* largest cosine between a member's normal and the direction to a sample point */
+    float cosbound = 1.0f;
+    if (node.conecos > -1.0f) {
+        const qvec3f center = (node.bounds.mins() + node.bounds.maxs()) * 0.5f;
+        const float spread = 0.5f * qv::length(node.bounds.size()) + radius;
+        const qvec3f tocenter = origin - center;
+        const float len = qv::length(tocenter);
+        if (len > spread) {
+            const float axisangle = acos(qmax(-1.0f, qmin(1.0f, qv::dot(node.coneaxis, tocenter) / len)));
+            const float angle = axisangle - asin(spread / len) - acos(node.conecos);
+            if (angle >= Q_PI * 0.5)
+                return 0;
+            if (angle > 0)
+                cosbound = cos(angle);
+        }
+    }
+    
+    /* on a flat face, the cosine at the sample point is at most the
+       members' height above the face over their distance. the sample
+       points may be a little off the plane, so allow a unit */
+    if (!lightsurf->curved && !lightsurf->twosided) {
+        float height = 1.0f - lightsurf->plane.dist;
+        for (int i = 0; i < 3; i++) {
+            const float n = lightsurf->plane.normal[i];
+            height += n * ((n > 0) ? node.bounds.maxs()[i] : node.bounds.mins()[i]);
+        }
+        if (height <= 0)
+            return 0;
+        if (height < mindist)
+            cosbound *= height / mindist;
+    }
+    
+    return node.power * cosbound / (clamped * clamped);
+}
+
+/*
+ * Estimate of the brightness (before bouncescale and the 255 scale) the
+ * node adds at origin, lit from its brightest member.
+ */
+static float
+BounceTree_Estimate(const bouncenode_t &node, const qvec3f &origin, const qvec3f &normal)
+{
+    qvec3f dir = origin - node.brightest->pos;
+    const float dist = qv::length(dir);
+    if (dist == 0)
+        return 0;
+    dir /= dist;
+    
+    const float dp1 = qv::dot(node.brightest->surfnormal, dir);
+    const float dp2 = -qv::dot(dir, normal);
+    if (dp1 <= 0 || dp2 <= 0)
+        return 0;
+    
+    const float clamped = qmax(dist, 128.0f);
+    return node.power * dp1 * dp2 / (clamped * clamped);
+}
+
+typedef enum {
+    bouncevis_none,     // none of the node's members reach the face
+    bouncevis_some,
+    bouncevis_all
+} bouncevis_t;
+
+/* which of the node's members get past the PVS and estimated visible AABB
+   culling in BounceLight_SphereCull */
+static bouncevis_t
+BounceTree_Visibility(const bouncenode_t &node, const lightsurf_t *lightsurf)
+{
+    bool all = true;
+    
+    if (!novisapprox) {
+        if (AABBsDisjoint(node.vismins, node.vismaxs, lightsurf->mins, lightsurf->maxs))
+            return bouncevis_none;
+        if (!node.shared || AABBsDisjoint(node.sharedmins, node.sharedmaxs, lightsurf->mins, lightsurf->maxs))
+            all = false;
+    }
+    
+    if (node.numclusters < 0) {
+        if (!lightsurf->pvs.empty())
+            all = false;
+    } else {
+        int visible = 0;
+        for (int i = 0; i < node.numclusters; i++) {
+            if (!Lightsurf_PVSCull(lightsurf, node.clusters[i]))
+                visible++;
+        }
+        if (!visible)
+            return bouncevis_none;
+        if (visible < node.numclusters)
+            all = false;
+    }
+    
+    return all ? bouncevis_all : bouncevis_some;
+}
+
+/*
+ * Fills cut with the bounce lights the face traces: bounce lights that
+ * pass BounceLight_SphereCull, and clusters standing in for the rest.
+ * With epsilon 0 that's every bounce light that could light the face.
+ */
+void
+BounceTree_Cut(const bouncetree_t *tree, const lightsurf_t *lightsurf, float epsilon, std::vector<const bouncelight_t *> &cut)
+{
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    std::vector<bouncecut_t> &heap = lightsurf_scratch.bounceheap;
+    
+    cut.clear();
+    if (tree->nodes.empty())
+        return;
+    
+    const float scale = 255.0f * cfg.bouncescale.floatValue();
+    const qvec3f origin = vec3_t_to_glm(lightsurf->origin);
+    const qvec3f normal = vec3_t_to_glm(lightsurf->plane.normal);
+    const float radius = lightsurf->radius + lightsurf->lightmapscale; // sample points can sit off the face
+    
+    heap.clear(); // clusters in the cut, largest bound first
+    float total = 0; // estimated bounce light at the face over the whole cut
+    
+    auto visit = [&](int nodenum) {
+        const bouncenode_t &node = tree->nodes[nodenum];
+        const bool leaf = (node.children[0] == -1);
+        
+        bouncevis_t vis;
+        if (leaf)
+            vis = BounceLight_SphereCull(lightsurf->bsp, node.light, lightsurf) ? bouncevis_none : bouncevis_all;
+        else
+            vis = BounceTree_Visibility(node, lightsurf);
+        if (vis == bouncevis_none)
+            return;
+        
+        /* every member would fail the 0.25 gate in LightFace_Bounce */
+        const float bound = BounceTree_Bound(node, lightsurf, origin, radius) * scale;
+        if (bound < 0.25f)
+            return;
+        
+        const float estimate = BounceTree_Estimate(node, origin, normal) * scale;
+        total += estimate;
+        
+        if (leaf) {
+            cut.push_back(node.light);
+            return;
+        }
+        
+        /* only a node the face sees all of can stay in the cut */
+        heap.push_back({(vis == bouncevis_all) ? bound : FLT_MAX, estimate, nodenum});
+        std::push_heap(heap.begin(), heap.end());
+    };
+    
+    visit(0);
+    while (!heap.empty() && heap.front().bound > epsilon * total) {
+        std::pop_heap(heap.begin(), heap.end());
+        const bouncecut_t worst = heap.back();
+        heap.pop_back();
+        
+        total -= worst.estimate;
+        visit(tree->nodes[worst.nodenum].children[0]);
+        visit(tree->nodes[worst.nodenum].children[1]);
+    }
+    
+    for (const bouncecut_t &cluster : heap) {
+        cut.push_back(tree->nodes[cluster.nodenum].light);
+    }
+}
+
+void
+MakeLightIndex(const globalconfig_t &cfg, const mbsp_t *bsp)
+{
+    delete entity_light_index;
+    delete bounce_light_index;
+    BounceTree_Free(bounce_tree);
+    entity_light_index = nullptr;
+    bounce_light_index = nullptr;
+    bounce_tree = nullptr;
+
+    if (!bsp->nummodels)
+        return;
+
+    const dmodel_t *world = &bsp->dmodels[0];
+    const aabb3f domain(qvec3f(world->mins[0], world->mins[1], world->mins[2]) - qvec3f(1.0f),
+                        qvec3f(world->maxs[0], world->maxs[1], world->maxs[2]) + qvec3f(1.0f));
+
+    /* entity lights: CullLight passes once GetLightValue() drops to fadegate */
+    const std::vector<light_t> &lights = GetLights();
+    std::vector<std::pair<aabb3f, int>> volumes;
+    for (size_t i = 0; i < lights.size(); i++) {
+        const light_t &entity = lights[i];
+        float radius = GetLightDist(cfg, &entity, fadegate);
+        if (entity.falloff.floatValue() > 0)
+            radius = qmax(radius, entity.falloff.floatValue());
+
+        bool valid;
+        const aabb3f box = LightIndex_Volume(*entity.origin.vec3Value(), radius, entity.mins, entity.maxs, domain, &valid);
+        if (valid)
+            volumes.push_back(std::make_pair(box, static_cast<int>(i)));
+    }
+    entity_light_index = LightIndex_Make(domain, volumes, static_cast<int>(lights.size()));
+
+    /* bounce lights: BounceLight_SphereCull passes once the brightness drops below 0.25 */
+    const std::vector<bouncelight_t> &vpls = BounceLights();
+    volumes.clear();
+    for (size_t i = 0; i < vpls.size(); i++) {
+        const bouncelight_t &vpl = vpls[i];
+        const float brightness = LightSample_Brightness(vpl.componentwiseMaxColor) * vpl.area * 255.0f * cfg.bouncescale.floatValue();
+        const float radius = sqrt(brightness / 0.25f);
+
+        vec3_t pos;
+        glm_to_vec3_t(vpl.pos, pos);
+
+        bool valid;
+        const aabb3f box = LightIndex_Volume(pos, radius, vpl.mins, vpl.maxs, domain, &valid);
+        if (valid)
+            volumes.push_back(std::make_pair(box, static_cast<int>(i)));
+    }
+    bounce_light_index = LightIndex_Make(domain, volumes, static_cast<int>(vpls.size()));
+
+    /* with bouncecuts, faces pick a cut through this instead */
+    if (cfg.bouncecuts.floatValue() > 0)
+        bounce_tree = BounceTree_Make(vpls);
+}
+
 static void
 LightFace_Bounce(const mbsp_t *bsp, const bsp2_dface_t *face, const lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
 {
@@ -1943,59 +3115,97 @@ LightFace_Bounce(const mbsp_t *bsp, const bsp2_dface_t *face, const lightsurf_t
         return;
     
 #if 1
-    for (const bouncelight_t &vpl : BounceLights()) {
-        if (BounceLight_SphereCull(bsp, &vpl, lightsurf))
-            continue;
-            
-        // FIXME: This will trace the same ray multiple times, once per style,
-        // if the bouncelight is hitting a face with multiple styles.
-        for (const auto &styleColor : vpl.colorByStyle) {
-            bool hit = false;
-            const int style = styleColor.first;
-            const qvec3f &color = styleColor.second;
-            
-            raystream_t *rs = lightsurf->stream;
-            rs->clearPushedRays();
-            
-            for (int i = 0; i < lightsurf->numpoints; i++) {
-                if (lightsurf->occluded[i])
-                    continue;
-                
-                qvec3f dir = vec3_t_to_glm(lightsurf->points[i]) - vpl.pos; // vpl -> sample point
-                const float dist = qv::length(dir);
-                if (dist == 0.0f)
-                    continue; // FIXME: nudge or something
-                dir /= dist;
-                
-                const qvec3f indirect = GetIndirectLighting(cfg, &vpl, color, dir, dist, vec3_t_to_glm(lightsurf->points[i]), vec3_t_to_glm(lightsurf->normals[i]));
-                
-                if (LightSample_Brightness(indirect) < 0.25)
-                    continue;
-                
-                vec3_t vplPos, vplDir, vplColor;
-                glm_to_vec3_t(vpl.pos, vplPos);
-                glm_to_vec3_t(dir, vplDir);
-                glm_to_vec3_t(indirect, vplColor);
-                
-                rs->pushRay(i, vplPos, vplDir, dist, lightsurf->modelinfo, vplColor);
-            }
+    const std::vector<bouncelight_t> &vpls = BounceLights();
+    std::vector<qvec3f> &colors = lightsurf_scratch.bouncecolors;
+    raystream_t *rs = lightsurf->stream;
+    const vec3_t white = { 1.0f, 1.0f, 1.0f };
+    
+    std::vector<const bouncelight_t *> &bouncelights = lightsurf_scratch.bouncelights;
+    bouncelights.clear();
+    if (bounce_tree != nullptr) {
+        BounceTree_Cut(bounce_tree, lightsurf, cfg.bouncecuts.floatValue(), bouncelights);
+    } else {
+        std::vector<int> &vplnums = lightsurf_scratch.bouncenums;
+        LightIndex_Query(bounce_light_index, static_cast<int>(vpls.size()), lightsurf, vplnums);
+        for (const int vplnum : vplnums) {
+            if (!BounceLight_SphereCull(bsp, &vpls[vplnum], lightsurf))
+                bouncelights.push_back(&vpls[vplnum]);
+        }
+    }
+    
+    for (const bouncelight_t *bouncelight : bouncelights) {
+        const bouncelight_t &vpl = *bouncelight;
+        
+        /* Trace each ray once for all of the bounce light's styles. The
+           light of each style along ray j is in colors[j * numstyles + s],
+           zero if that style is too dim there. */
+        const size_t numstyles = vpl.colorByStyle.size();
+        if (colors.size() < lightsurf->numpoints * numstyles)
+            colors.resize(lightsurf->numpoints * numstyles);
+        
+        vec3_t vplPos;
+        glm_to_vec3_t(vpl.pos, vplPos);
+        
+        rs->clearPushedRays();
+        
+        for (int i = 0; i < lightsurf->numpoints; i++) {
+            if (lightsurf->occluded[i])
+                continue;
             
-            if (!rs->numPushedRays())
+            qvec3f dir = vec3_t_to_glm(lightsurf->points[i]) - vpl.pos; // vpl -> sample point
+            const float dist = qv::length(dir);
+            if (dist == 0.0f)
+                continue; // FIXME: nudge or something
+            dir /= dist;
+            
+            qvec3f *raycolors = &colors[rs->numPushedRays() * numstyles];
+            bool bright = false;
+            size_t s = 0;
+            for (const auto &styleColor : vpl.colorByStyle) {
+                raycolors[s] = GetIndirectLighting(cfg, &vpl, styleColor.second, dir, dist, vec3_t_to_glm(lightsurf->points[i]), vec3_t_to_glm(lightsurf->normals[i]));
+                if (LightSample_Brightness(raycolors[s]) < 0.25) {
+                    raycolors[s] = qvec3f(0);
+                } else {
+                    bright = true;
+                }
+                s++;
+            }
+            if (!bright)
                 continue;
             
-            total_bounce_rays += rs->numPushedRays();
-            rs->tracePushedRaysOcclusion();
+            vec3_t vplDir;
+            glm_to_vec3_t(dir, vplDir);
             
-            lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, style, lightsurf);
+            /* traced white, so the ray's color is the tint of any glass in the way */
+            rs->pushRay(i, vplPos, vplDir, dist, lightsurf->modelinfo, white);
+        }
+        
+        const int N = rs->numPushedRays();
+        if (!N)
+            continue;
+        
+        total_bounce_rays += N;
+        rs->tracePushedRaysOcclusion();
+        
+        size_t s = 0;
+        for (const auto &styleColor : vpl.colorByStyle) {
+            const int style = styleColor.first;
+            lightmap_t *lightmap = nullptr;
             
-            const int N = rs->numPushedRays();
             for (int j = 0; j < N; j++) {
                 if (rs->getPushedRayOccluded(j))
                     continue;
                 
+                const qvec3f &color = colors[j * numstyles + s];
+                if (color == qvec3f(0))
+                    continue;
+                
                 const int i = rs->getPushedRayPointIndex(j);
-                vec3_t indirect = {0};
-                rs->getPushedRayColor(j, indirect);
+                vec3_t tint, indirect;
+                rs->getPushedRayColor(j, tint);
+                for (int k = 0; k < 3; k++) {
+                    indirect[k] = color[k] * tint[k];
+                }
                 
                 Q_assert(!std::isnan(indirect[0]));
                 
@@ -2007,16 +3217,19 @@ LightFace_Bounce(const mbsp_t *bsp, const bsp2_dface_t *face, const lightsurf_t
                     VectorScale(indirect, dirtscale, indirect);
                 }
                 
+                if (lightmap == nullptr)
+                    lightmap = Lightmap_ForStyle(lightmaps, style, lightsurf);
+                
                 lightsample_t *sample = &lightmap->samples[i];
                 VectorAdd(sample->color, indirect, sample->color);
                 
-                hit = true;
                 ++total_bounce_ray_hits;
             }
             
             // If this style of this bounce light contributed anything, save.
-            if (hit)
+            if (lightmap != nullptr)
                 Lightmap_Save(lightmaps, lightsurf, lightmap, style);
+            s++;
         }
     }
 
@@ -2064,12 +3277,12 @@ LightFace_Bounce(const mbsp_t *bsp, const bsp2_dface_t *face, const lightsurf_t
                 continue;
             
             const int fnum = Face_GetNum(bsp, face);
-            const auto lights = BounceLightsForFaceNum(fnum); // FIXME: Slow
+            const bouncelightrange_t lights = BounceLightsForFaceNum(fnum);
             if (lights.empty())
                 continue;
             
             Q_assert(lights.size() == 1);
-            const bouncelight_t &vpl = lights[0];
+            const bouncelight_t &vpl = *lights.begin();
             
             const auto it = vpl.colorByStyle.find(0);
             if (it == vpl.colorByStyle.end())
@@ -2415,54 +3628,72 @@ GetDirtVector(const globalconfig_t &cfg, int i, vec3_t out)
     }
 }
 
-float
-DirtAtPoint(const globalconfig_t &cfg, raystream_t *rs, const vec3_t point, const vec3_t normal, const modelinfo_t *selfshadow)
+/*
+ * Raw ambient occlusion at each of points (0-1, 1 fully occluded), tracing
+ * the dirt rays of as many points as fit in DIRECT_BATCH_RAYS at once.
+ */
+void
+DirtAtPoints(const globalconfig_t &cfg, raystream_t *rs, int numpoints, const vec3_t *points, const vec3_t *normals, const modelinfo_t *selfshadow, vec_t *occlusion_out)
 {
     if (!dirt_in_use) {
-        return 0.0f;
+        for (int i = 0; i < numpoints; i++) {
+            occlusion_out[i] = 0.0f;
+        }
+        return;
     }
     
-    vec3_t myUp, myRt;
-    float occlusion = 0;
-    
-    // this stuff is just per-point
-    
-    GetUpRtVecs(normal, myUp, myRt);
+    const int batchpoints = DIRECT_BATCH_RAYS / numDirtVectors;
+    Q_assert(batchpoints > 0);
     
-    rs->clearPushedRays();
-    
-    for (int j=0; j<numDirtVectors; j++) {
+    for (int first = 0; first < numpoints; first += batchpoints) {
+        const int count = qmin(batchpoints, numpoints - first);
         
-        // fill in input buffers
-    
-        vec3_t dirtvec;
-        GetDirtVector(cfg, j, dirtvec);
+        rs->clearPushedRays();
         
-        vec3_t dir;
-        TransformToTangentSpace(normal, myUp, myRt, dirtvec, dir);
+        for (int i = first; i < first + count; i++) {
+            // this stuff is just per-point
+            vec3_t myUp, myRt;
+            GetUpRtVecs(normals[i], myUp, myRt);
+            
+            for (int j=0; j<numDirtVectors; j++) {
+                
+                // fill in input buffers
+                
+                vec3_t dirtvec;
+                GetDirtVector(cfg, j, dirtvec);
+                
+                vec3_t dir;
+                TransformToTangentSpace(normals[i], myUp, myRt, dirtvec, dir);
+                
+                rs->pushRay(i, points[i], dir, cfg.dirtDepth.floatValue(), selfshadow);
+            }
+        }
         
-        rs->pushRay(j, point, dir, cfg.dirtDepth.floatValue(), selfshadow);
-    }
-    
-    Q_assert(rs->numPushedRays() == numDirtVectors);
-    
-    // trace the batch
-    rs->tracePushedRaysIntersection();
-    
-    // accumulate hitdists
-    for (int j=0; j<numDirtVectors; j++) {
-        if (rs->getPushedRayHitType(j) == hittype_t::SOLID) {
-            const float dist = rs->getPushedRayHitDist(j);
-            occlusion += qmin(cfg.dirtDepth.floatValue(), dist);
-        } else {
-            occlusion += cfg.dirtDepth.floatValue();
+        Q_assert(rs->numPushedRays() == count * numDirtVectors);
+        
+        // trace the batch
+        rs->tracePushedRaysIntersection();
+        
+        // accumulate hitdists
+        for (int i = first; i < first + count; i++) {
+            float occlusion = 0;
+            for (int j=0; j<numDirtVectors; j++) {
+                const int ray = (i - first) * numDirtVectors + j;
+                if (rs->getPushedRayHitType(ray) == hittype_t::SOLID) {
+                    const float dist = rs->getPushedRayHitDist(ray);
+                    occlusion += qmin(cfg.dirtDepth.floatValue(), dist);
+                } else {
+                    occlusion += cfg.dirtDepth.floatValue();
+                }
+            }
+            
+            // process the results.
+            const vec_t avgHitdist = occlusion / numDirtVectors;
+            occlusion_out[i] = 1 - (avgHitdist / cfg.dirtDepth.floatValue());
         }
     }
     
-    // process the results.
-    const vec_t avgHitdist = occlusion / numDirtVectors;
-    occlusion = 1 - (avgHitdist / cfg.dirtDepth.floatValue());
-    return occlusion;
+    rs->clearPushedRays();
 }
 
 /*
@@ -3030,11 +4261,12 @@ WriteLightmaps(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const
         size *= 3;
     
     byte *out, *lit, *lux;
-    GetFileSpace(&out, &lit, &lux, size * numstyles);
+    const int slot = Face_GetNum(bsp, face) * 2 + (facesup ? 1 : 0);
+    const int lightofs = GetFileSpace(slot, &out, &lit, &lux, size * numstyles);
     if (facesup) {
-        facesup->lightofs = out - filebase;
+        facesup->lightofs = lightofs;
     } else {
-        face->lightofs = out - filebase;
+        face->lightofs = lightofs;
     }
 
     // sanity check that we don't save a lightmap for a non-lightmapped face
@@ -3124,21 +4356,522 @@ WriteLightmaps(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const
     }
 }
 
-static void LightFaceShutdown(lightsurf_t *lightsurf)
+/*
+ * Adds the saved lightmaps of `src`, which must cover the same points, into
+ * `lightmaps`.
+ */
+static void
+LightFace_AddLightmaps(const lightsurf_t *lightsurf, const lightmapdict_t *src, lightmapdict_t *lightmaps)
+{
+    for (const lightmap_t &srclm : *src) {
+        if (srclm.style == 255)
+            continue;
+        
+        lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, srclm.style, lightsurf);
+        for (int i = 0; i < lightsurf->numpoints; i++) {
+            lightsample_t *sample = &lightmap->samples[i];
+            VectorAdd(sample->color, srclm.samples[i].color, sample->color);
+            VectorAdd(sample->direction, srclm.samples[i].direction, sample->direction);
+        }
+        Lightmap_Save(lightmaps, lightsurf, lightmap, srclm.style);
+    }
+}
+
+/*
+ * The lighting procedure is: cast all positive lights, fix
+ * minlight levels, then cast all negative lights. Finally, we
+ * clamp any values that may have gone negative.
+ *
+ * Only sample points that aren't marked occluded receive light (apart
+ * from minlight, which is applied everywhere).
+ *
+ * Indirect light normally goes straight into `lightmaps`. -adaptive instead
+ * keeps it separate with `indirect_out`, or supplies it ready-made with
+ * `indirect_in`.
+ */
+static void
+LightFace_AllLights(const mbsp_t *bsp, const bsp2_dface_t *face, lightsurf_t *lightsurf, lightmapdict_t *lightmaps,
+                    lightmapdict_t *indirect_out = nullptr, const lightmapdict_t *indirect_in = nullptr)
+{
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    const modelinfo_t *modelinfo = lightsurf->modelinfo;
+    
+    const std::vector<light_t> &lights = GetLights();
+    std::vector<int> &lightnums = lightsurf_scratch.lightnums;
+    LightIndex_Query(entity_light_index, static_cast<int>(lights.size()), lightsurf, lightnums);
+    
+    /* positive lights */
+    if (!modelinfo->lightignore.boolValue()) {
+        for (const int lightnum : lightnums)
+        {
+            const light_t &entity = lights[lightnum];
+            if (entity.getFormula() == LF_LOCALMIN)
+                continue;
+            if (entity.light.floatValue() > 0)
+                LightFace_Entity(bsp, &entity, lightsurf, lightmaps);
+        }
+        LightFace_Sky(lightsurf, lightmaps, false);
+
+        //mxd. Add surface lights...
+        LightFace_SurfaceLight(lightsurf, lightmaps);
+
+        /* add indirect lighting */
+        if (indirect_in != nullptr) {
+            LightFace_AddLightmaps(lightsurf, indirect_in, lightmaps);
+        } else if (indirect_out != nullptr) {
+            LightFace_Bounce(bsp, face, lightsurf, indirect_out);
+            LightFace_AddLightmaps(lightsurf, indirect_out, lightmaps);
+        } else {
+            LightFace_Bounce(bsp, face, lightsurf, lightmaps);
+        }
+    }
+    
+    /* minlight - Use Q2 surface light, or the greater of global or model minlight. */
+    const gtexinfo_t *texinfo = Face_Texinfo(bsp, face); //mxd. Surface lights...
+    if (texinfo != nullptr && texinfo->value > 0 && texinfo->flags & Q2_SURF_LIGHT) {
+        vec3_t color;
+        Face_LookupTextureColor(bsp, face, color);
+        LightFace_Min(bsp, face, color, texinfo->value * 2.0f, lightsurf, lightmaps); // Playing by the eye here... 2.0 == 256 / 128; 128 is the light value, at which the surface is renered fullbright, when using arghrad3
+    } else if (lightsurf->minlight > cfg.minlight.floatValue()) {
+        LightFace_Min(bsp, face, lightsurf->minlight_color, lightsurf->minlight, lightsurf, lightmaps);
+    } else {
+        const float light = cfg.minlight.floatValue();
+        vec3_t color;
+        VectorCopy(*cfg.minlight_color.vec3Value(), color);
+        
+        LightFace_Min(bsp, face, color, light, lightsurf, lightmaps);
+    }
+
+    /* negative lights */
+    if (!modelinfo->lightignore.boolValue()) {
+        for (const int lightnum : lightnums)
+        {
+            const light_t &entity = lights[lightnum];
+            if (entity.getFormula() == LF_LOCALMIN)
+                continue;
+            if (entity.light.floatValue() < 0)
+                LightFace_Entity(bsp, &entity, lightsurf, lightmaps);
+        }
+        LightFace_Sky(lightsurf, lightmaps, true);
+    }
+}
+
+/*
+ * Value of sample (s, t) of an unrefined luxel in -adaptive mode,
+ * interpolated bilinearly between the lit samples of the surrounding
+ * luxels. Those sit half a sample off the luxel centres, so this keeps
+ * smooth gradients from shifting. Falls back to luxel b's own sample if
+ * a surrounding luxel's sample isn't in its usual place.
+ */
+lightsample_t
+Adaptive_Interpolate(const lightmap_t &lm, const std::vector<int> &reps,
+                     int bw, int bh, int width, int s, int t, int b)
+{
+    const int N = oversample;
+    const float fx = qmin(qmax(0.0f, (s - N / 2) / static_cast<float>(N)), static_cast<float>(bw - 1));
+    const float fy = qmin(qmax(0.0f, (t - N / 2) / static_cast<float>(N)), static_cast<float>(bh - 1));
+    const int x0 = static_cast<int>(fx), y0 = static_cast<int>(fy);
+    const int x1 = qmin(x0 + 1, bw - 1), y1 = qmin(y0 + 1, bh - 1);
+    const float wx = fx - x0, wy = fy - y0;
+    
+    const int xs[4] = { x0, x1, x0, x1 };
+    const int ys[4] = { y0, y0, y1, y1 };
+    const float ws[4] = { (1 - wx) * (1 - wy), wx * (1 - wy), (1 - wx) * wy, wx * wy };
+    
+    lightsample_t result {};
+    for (int j = 0; j < 4; j++) {
+        const int rep = reps[ys[j] * bw + xs[j]];
+        if (rep != (ys[j] * N + N / 2) * width + (xs[j] * N + N / 2))
+            return lm.samples[reps[b]];
+        VectorMA(result.color, ws[j], lm.samples[rep].color, result.color);
+        VectorMA(result.direction, ws[j], lm.samples[rep].direction, result.direction);
+    }
+    return result;
+}
+
+/*
+ * Lights only the points listed in `indices`, into `lightmaps`. The points
+ * are copied into the scratch sub arrays and the lightsurf is pointed at
+ * them for the duration, so the lighting functions only loop over these.
+ * `indirect_out` and `indirect_in` are passed on to LightFace_AllLights.
+ */
+static void
+LightFace_Subset(const mbsp_t *bsp, const bsp2_dface_t *face, lightsurf_t *lightsurf,
+                 const std::vector<int> &indices, lightmapdict_t *lightmaps,
+                 lightmapdict_t *indirect_out, const lightmapdict_t *indirect_in)
+{
+    lightsurf_scratch_t::pointarrays_t &sub = lightsurf_scratch.sub;
+    const int count = static_cast<int>(indices.size());
+    
+    lightmaps->clear();
+    if (indirect_out != nullptr)
+        indirect_out->clear();
+    if (count == 0)
+        return;
+    
+    for (int k = 0; k < count; k++) {
+        const int i = indices[k];
+        VectorCopy(lightsurf->points[i], sub.points[k]);
+        VectorCopy(lightsurf->normals[i], sub.normals[k]);
+        sub.occluded[k] = false;
+        sub.realfacenums[k] = lightsurf->realfacenums[i];
+        sub.occlusion[k] = 0;
+    }
+    
+    const int numpoints = lightsurf->numpoints;
+    vec3_t *points = lightsurf->points;
+    vec3_t *normals = lightsurf->normals;
+    bool *occluded = lightsurf->occluded;
+    int *realfacenums = lightsurf->realfacenums;
+    vec_t *occlusion = lightsurf->occlusion;
+    const int numsoapoints = lightsurf->numsoapoints;
+    float *soa[6];
+    std::copy(lightsurf->soa, lightsurf->soa + 6, soa);
+    int *soaindex = lightsurf->soaindex;
+    
+    lightsurf->numpoints = count;
+    lightsurf->points = sub.points;
+    lightsurf->normals = sub.normals;
+    lightsurf->occluded = sub.occluded;
+    lightsurf->realfacenums = sub.realfacenums;
+    lightsurf->occlusion = sub.occlusion;
+    Lightsurf_FillSoA(lightsurf, sub);
+    
+    if (dirt_in_use)
+        LightFace_CalculateDirt(lightsurf);
+    LightFace_AllLights(bsp, face, lightsurf, lightmaps, indirect_out, indirect_in);
+    
+    lightsurf->numpoints = numpoints;
+    lightsurf->points = points;
+    lightsurf->normals = normals;
+    lightsurf->occluded = occluded;
+    lightsurf->realfacenums = realfacenums;
+    lightsurf->occlusion = occlusion;
+    lightsurf->numsoapoints = numsoapoints;
+    std::copy(soa, soa + 6, lightsurf->soa);
+    lightsurf->soaindex = soaindex;
+    
+    total_samplepoints += count;
+}
+
+static const lightmap_t *
+Lightmap_FindSaved(const lightmapdict_t *lightmaps, int style)
+{
+    for (const lightmap_t &lm : *lightmaps) {
+        if (lm.style == style)
+            return &lm;
+    }
+    return nullptr;
+}
+
+/*
+ * Supersampling for -extra/-extra4 when -adaptive is set.
+ *
+ * First only one sample per luxel is lit. A luxel is then refined, i.e. its
+ * remaining samples are lit too, if it has some occluded samples or an
+ * occluded neighbour, or if the second difference of the values across it
+ * in any direction (the plain difference at the edge of the face) is above
+ * both ADAPTIVE_CONTRAST output levels and ADAPTIVE_RELATIVE_CONTRAST of
+ * the brightest of the values, which is what a shadow edge looks like.
+ * Smooth falloff has a small second difference and isn't refined.
+ *
+ * Direct and indirect light are checked separately. Luxels with an edge in
+ * the direct light only take their indirect light from the first pass, as
+ * it's by far the most expensive part to trace. The samples of unrefined
+ * luxels are interpolated from the lit ones.
+ *
+ * A shadow smaller than a luxel can fall between the samples of pass 1, so
+ * the refined area is grown by one luxel to catch it from the neighbours
+ * that did see its edge. Luxels on the border of the face are always
+ * refined: they only have neighbours on one side to compare with and to
+ * interpolate from.
+ *
+ * Faces of which most luxels would be refined anyway, because they are on
+ * the border or next to occluded samples, are lit without -adaptive: the
+ * first pass would only add to the cost there.
+ */
+#define ADAPTIVE_CONTRAST           1.0f
+#define ADAPTIVE_RELATIVE_CONTRAST  0.1f
+
+static bool
+Adaptive_Contrast(const vec_t *c, const vec_t *a, const vec_t *z, vec_t threshold)
+{
+    for (int k = 0; k < 3; k++) {
+        if (z != nullptr) {
+            const vec_t diff = fabs(2 * c[k] - a[k] - z[k]);
+            const vec_t maxval = qmax(c[k], qmax(a[k], z[k]));
+            if (diff > threshold && diff > ADAPTIVE_RELATIVE_CONTRAST * maxval)
+                return true;
+        } else {
+            /* a plain difference also picks up smooth gradients, so be less eager */
+            const vec_t diff = fabs(c[k] - a[k]);
+            const vec_t maxval = qmax(c[k], a[k]);
+            if (diff > 2 * threshold && diff > 2 * ADAPTIVE_RELATIVE_CONTRAST * maxval)
+                return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Marks the luxels of `refine` that have a shadow edge in the pass 1
+ * lightmap `lm`, for luxels with a pass 1 sample (slots[b] != -1).
+ * `im` is the indirect part of `lm`, or nullptr if there is none.
+ */
+void
+Adaptive_FindEdges(const lightmap_t &lm, const lightmap_t *im, const std::vector<int> &slots,
+                   int bw, int bh, vec_t threshold, std::vector<refine_t> *refine)
+{
+    static const int dirs[4][2] = { {1, 0}, {0, 1}, {1, 1}, {1, -1} };
+    
+    /* split the pass 1 value of luxel b into direct and indirect light */
+    auto split = [&](int b, vec3_t direct, vec3_t indirect) {
+        VectorCopy(lm.samples[slots[b]].color, direct);
+        VectorClear(indirect);
+        if (im != nullptr) {
+            VectorCopy(im->samples[slots[b]].color, indirect);
+            VectorSubtract(direct, indirect, direct);
+        }
+    };
+    
+    for (int by = 0; by < bh; by++) {
+        for (int bx = 0; bx < bw; bx++) {
+            const int b = by * bw + bx;
+            if (slots[b] == -1 || (*refine)[b] == refine_all)
+                continue;
+            vec3_t c[2];
+            split(b, c[0], c[1]);
+            for (const auto &dir : dirs) {
+                const int ax = bx - dir[0], ay = by - dir[1];
+                const int zx = bx + dir[0], zy = by + dir[1];
+                const bool hasa = (ax >= 0 && ay >= 0 && ax < bw && ay < bh && slots[ay * bw + ax] != -1);
+                const bool hasz = (zx >= 0 && zy >= 0 && zx < bw && zy < bh && slots[zy * bw + zx] != -1);
+                if (!hasa && !hasz)
+                    continue;
+                vec3_t a[2], z[2];
+                /* at the edge of the face only the plain difference is available */
+                split(hasa ? ay * bw + ax : zy * bw + zx, a[0], a[1]);
+                if (hasa && hasz)
+                    split(zy * bw + zx, z[0], z[1]);
+                if (Adaptive_Contrast(c[1], a[1], (hasa && hasz) ? z[1] : nullptr, threshold)) {
+                    (*refine)[b] = refine_all;
+                    break;
+                }
+                if (Adaptive_Contrast(c[0], a[0], (hasa && hasz) ? z[0] : nullptr, threshold))
+                    (*refine)[b] = refine_direct;
+            }
+        }
+    }
+}
+
+/*
+ * Grows the refined area of `refine` by one luxel, and refines the luxels
+ * on the border of the face.
+ */
+void
+Adaptive_GrowRefined(const std::vector<int> &slots, int bw, int bh, std::vector<refine_t> *refine)
+{
+    std::vector<refine_t> grown(*refine);
+    for (int by = 0; by < bh; by++) {
+        for (int bx = 0; bx < bw; bx++) {
+            const int b = by * bw + bx;
+            if (slots[b] == -1 || (*refine)[b] == refine_all)
+                continue;
+            if (bx == 0 || by == 0 || bx == bw - 1 || by == bh - 1) {
+                grown[b] = refine_all;
+                continue;
+            }
+            for (int ny = by - 1; ny <= by + 1; ny++) {
+                for (int nx = bx - 1; nx <= bx + 1; nx++) {
+                    const refine_t r = (*refine)[ny * bw + nx];
+                    if (r == refine_all)
+                        grown[b] = refine_all;
+                    else if (r == refine_direct && grown[b] == refine_none)
+                        grown[b] = refine_direct;
+                }
+            }
+        }
+    }
+    refine->swap(grown);
+}
+
+/*
+ * Whether most of the lit luxels of a face are refined already, or are on
+ * the border of the face and will be.
+ */
+static bool
+Adaptive_MostlyRefined(const std::vector<int> &reps, const std::vector<refine_t> &refine, int bw, int bh)
+{
+    int numlit = 0, numrefined = 0;
+    for (int by = 0; by < bh; by++) {
+        for (int bx = 0; bx < bw; bx++) {
+            const int b = by * bw + bx;
+            if (reps[b] == -1)
+                continue;
+            numlit++;
+            const bool border = (bx == 0 || by == 0 || bx == bw - 1 || by == bh - 1);
+            if (refine[b] != refine_none || border)
+                numrefined++;
+        }
+    }
+    return 2 * numrefined > numlit;
+}
+
+/*
+ * Returns false without lighting anything if the face should be lit
+ * without -adaptive.
+ */
+static bool
+LightFace_Adaptive(const mbsp_t *bsp, const bsp2_dface_t *face, lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
 {
-    for (auto &lm : lightsurf->lightmapsByStyle) {
-        free(lm.samples);
+    const globalconfig_t &cfg = *lightsurf->cfg;
+    const int N = oversample;
+    const int width = lightsurf->width;
+    const int bw = width / N;
+    const int bh = lightsurf->height / N;
+    const bool *occluded = lightsurf->occluded;
+    
+    /* pick the sample closest to the middle of each luxel, -1 if all are occluded */
+    std::vector<int> reps(bw * bh, -1);
+    std::vector<refine_t> refine(bw * bh, refine_none);
+    for (int by = 0; by < bh; by++) {
+        for (int bx = 0; bx < bw; bx++) {
+            const int b = by * bw + bx;
+            const int mid = (by * N + N / 2) * width + (bx * N + N / 2);
+            int first = -1;
+            bool anyoccluded = false;
+            for (int t = by * N; t < (by + 1) * N; t++) {
+                for (int s = bx * N; s < (bx + 1) * N; s++) {
+                    const int i = t * width + s;
+                    if (occluded[i])
+                        anyoccluded = true;
+                    else if (first == -1)
+                        first = i;
+                }
+            }
+            reps[b] = occluded[mid] ? first : mid;
+            if (anyoccluded && first != -1)
+                refine[b] = refine_all;
+        }
+    }
+    for (int by = 0; by < bh; by++) {
+        for (int bx = 0; bx < bw; bx++) {
+            const int b = by * bw + bx;
+            if (reps[b] == -1)
+                continue;
+            for (int ny = qmax(0, by - 1); ny <= qmin(bh - 1, by + 1); ny++) {
+                for (int nx = qmax(0, bx - 1); nx <= qmin(bw - 1, bx + 1); nx++) {
+                    if (reps[ny * bw + nx] == -1)
+                        refine[b] = refine_all;
+                }
+            }
+        }
+    }
+    
+    if (Adaptive_MostlyRefined(reps, refine, bw, bh))
+        return false;
+    
+    /* pass 1: one sample per luxel, keeping the indirect light separately */
+    std::vector<int> pass1;
+    std::vector<int> slot1(bw * bh, -1);
+    for (int b = 0; b < bw * bh; b++) {
+        if (reps[b] != -1) {
+            slot1[b] = static_cast<int>(pass1.size());
+            pass1.push_back(reps[b]);
+        }
+    }
+    lightmapdict_t *maps1 = &lightsurf_scratch.passmaps[0];
+    lightmapdict_t *indirect1 = &lightsurf_scratch.passmaps[3];
+    LightFace_Subset(bsp, face, lightsurf, pass1, maps1, indirect1, nullptr);
+    
+    /* look for shadow edges, separately in the direct and indirect light */
+    const vec_t threshold = ADAPTIVE_CONTRAST / cfg.rangescale.floatValue();
+    for (const lightmap_t &lm : *maps1) {
+        if (lm.style != 255)
+            Adaptive_FindEdges(lm, Lightmap_FindSaved(indirect1, lm.style), slot1, bw, bh, threshold, &refine);
+    }
+    Adaptive_GrowRefined(slot1, bw, bh, &refine);
+    
+    /* pass 2: the remaining samples of the refined luxels, in one batch per kind of refinement */
+    std::vector<int> pass2[2];
+    for (int by = 0; by < bh; by++) {
+        for (int bx = 0; bx < bw; bx++) {
+            const int b = by * bw + bx;
+            if (refine[b] == refine_none)
+                continue;
+            for (int t = by * N; t < (by + 1) * N; t++) {
+                for (int s = bx * N; s < (bx + 1) * N; s++) {
+                    const int i = t * width + s;
+                    if (!occluded[i] && i != reps[b])
+                        pass2[refine[b] - refine_all].push_back(i);
+                }
+            }
+        }
+    }
+    
+    const std::vector<int> &pass2d = pass2[refine_direct - refine_all];
+    lightmapdict_t *indirect2 = &lightsurf_scratch.passmaps[4];
+    indirect2->clear();
+    for (const lightmap_t &im1 : *indirect1) {
+        if (im1.style == 255)
+            continue;
+        lightmap_t *im2 = Lightmap_ForStyle(indirect2, im1.style, lightsurf);
+        for (size_t k = 0; k < pass2d.size(); k++) {
+            const int i = pass2d[k];
+            im2->samples[k] = im1.samples[slot1[(i / width / N) * bw + (i % width) / N]];
+        }
+        Lightmap_Save(indirect2, lightsurf, im2, im1.style);
     }
     
-    free(lightsurf->points);
-    free(lightsurf->normals);
-    free(lightsurf->occlusion);
-    free(lightsurf->occluded);
-    free(lightsurf->realfacenums);
+    lightmapdict_t *maps2[2] = { &lightsurf_scratch.passmaps[1], &lightsurf_scratch.passmaps[2] };
+    LightFace_Subset(bsp, face, lightsurf, pass2[0], maps2[0], nullptr, nullptr);
+    LightFace_Subset(bsp, face, lightsurf, pass2[1], maps2[1], nullptr, indirect2);
     
-    delete lightsurf->stream;
+    /* collect the styles any pass saved into the full size lightmaps */
+    for (const lightmapdict_t *passmaps : { maps1, maps2[0], maps2[1] }) {
+        for (const lightmap_t &pm : *passmaps) {
+            if (pm.style == 255)
+                continue;
+            lightmap_t *lm = Lightmap_ForStyle(lightmaps, pm.style, lightsurf);
+            Lightmap_Save(lightmaps, lightsurf, lm, pm.style);
+        }
+    }
+    
+    for (lightmap_t &lm : *lightmaps) {
+        if (lm.style == 255)
+            continue;
+        
+        const lightmap_t *lm1 = Lightmap_FindSaved(maps1, lm.style);
+        if (lm1 != nullptr) {
+            for (size_t k = 0; k < pass1.size(); k++)
+                lm.samples[pass1[k]] = lm1->samples[k];
+        }
+        for (int j = 0; j < 2; j++) {
+            const lightmap_t *lm2 = Lightmap_FindSaved(maps2[j], lm.style);
+            if (lm2 == nullptr)
+                continue;
+            for (size_t k = 0; k < pass2[j].size(); k++)
+                lm.samples[pass2[j][k]] = lm2->samples[k];
+        }
+        
+        /* fill in the unrefined luxels */
+        for (int by = 0; by < bh; by++) {
+            for (int bx = 0; bx < bw; bx++) {
+                const int b = by * bw + bx;
+                if (reps[b] == -1 || refine[b] != refine_none)
+                    continue;
+                for (int t = by * N; t < (by + 1) * N; t++) {
+                    for (int s = bx * N; s < (bx + 1) * N; s++) {
+                        const int i = t * width + s;
+                        if (i != reps[b])
+                            lm.samples[i] = Adaptive_Interpolate(lm, reps, bw, bh, width, s, t, b);
+                    }
+                }
+            }
+        }
+    }
     
-    delete lightsurf;
+    return true;
 }
 
 /*
@@ -3189,7 +4922,7 @@ LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globa
         return;
     
     /* all good, this face is going to be lightmapped. */
-    lightsurf_t *lightsurf = new lightsurf_t {};
+    lightsurf_t *lightsurf = Lightsurf_Begin();
     lightsurf->cfg = &cfg;
     
     /* if liquid doesn't have the TEX_SPECIAL flag set, the map was qbsp'ed with
@@ -3206,68 +4939,15 @@ LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globa
     }
     lightmapdict_t *lightmaps = &lightsurf->lightmapsByStyle;
 
-    /* calculate dirt (ambient occlusion) but don't use it yet */
-    if (dirt_in_use && (debugmode != debugmode_phong))
-        LightFace_CalculateDirt(lightsurf);
-
-    /*
-     * The lighting procedure is: cast all positive lights, fix
-     * minlight levels, then cast all negative lights. Finally, we
-     * clamp any values that may have gone negative.
-     */
-
-    if (debugmode == debugmode_none) {
-        
-        total_samplepoints += lightsurf->numpoints;
-        
-        /* positive lights */
-        if (!modelinfo->lightignore.boolValue()) {
-            for (const auto &entity : GetLights())
-            {
-                if (entity.getFormula() == LF_LOCALMIN)
-                    continue;
-                if (entity.light.floatValue() > 0)
-                    LightFace_Entity(bsp, &entity, lightsurf, lightmaps);
-            }
-            for ( const sun_t &sun : GetSuns() )
-                if (sun.sunlight > 0)
-                    LightFace_Sky (&sun, lightsurf, lightmaps);
-
-            //mxd. Add surface lights...
-            LightFace_SurfaceLight(lightsurf, lightmaps);
-
-            /* add indirect lighting */
-            LightFace_Bounce(bsp, face, lightsurf, lightmaps);
-        }
-        
-        /* minlight - Use Q2 surface light, or the greater of global or model minlight. */
-        const gtexinfo_t *texinfo = Face_Texinfo(bsp, face); //mxd. Surface lights...
-        if (texinfo != nullptr && texinfo->value > 0 && texinfo->flags & Q2_SURF_LIGHT) {
-            vec3_t color;
-            Face_LookupTextureColor(bsp, face, color);
-            LightFace_Min(bsp, face, color, texinfo->value * 2.0f, lightsurf, lightmaps); // Playing by the eye here... 2.0 == 256 / 128; 128 is the light value, at which the surface is renered fullbright, when using arghrad3
-        } else if (lightsurf->minlight > cfg.minlight.floatValue()) {
-            LightFace_Min(bsp, face, lightsurf->minlight_color, lightsurf->minlight, lightsurf, lightmaps);
-        } else {
-            const float light = cfg.minlight.floatValue();
-            vec3_t color;
-            VectorCopy(*cfg.minlight_color.vec3Value(), color);
-            
-            LightFace_Min(bsp, face, color, light, lightsurf, lightmaps);
-        }
+    const bool adaptive = (debugmode == debugmode_none && adaptive_oversample && oversample > 1);
+    if (!adaptive || !LightFace_Adaptive(bsp, face, lightsurf, lightmaps)) {
+        /* calculate dirt (ambient occlusion) but don't use it yet */
+        if (dirt_in_use && (debugmode != debugmode_phong))
+            LightFace_CalculateDirt(lightsurf);
 
-        /* negative lights */
-        if (!modelinfo->lightignore.boolValue()) {
-            for (const auto &entity : GetLights())
-            {
-                if (entity.getFormula() == LF_LOCALMIN)
-                    continue;
-                if (entity.light.floatValue() < 0)
-                    LightFace_Entity(bsp, &entity, lightsurf, lightmaps);
-            }
-            for (const sun_t &sun : GetSuns())
-                if (sun.sunlight < 0)
-                    LightFace_Sky (&sun, lightsurf, lightmaps);
+        if (debugmode == debugmode_none) {
+            total_samplepoints += lightsurf->numpoints;
+            LightFace_AllLights(bsp, face, lightsurf, lightmaps);
         }
     }
     
@@ -3296,6 +4976,4 @@ LightFace(const mbsp_t *bsp, bsp2_dface_t *face, facesup_t *facesup, const globa
     LightFace_ScaleAndClamp(lightsurf, lightmaps);
     
     WriteLightmaps(bsp, face, facesup, lightsurf, lightmaps);
-    
-    LightFaceShutdown(lightsurf);
 }
@@ -31,6 +31,7 @@ See file, 'COPYING', for details.
 #include <common/bsputils.hh>
 
 #include <vector>
+#include <algorithm>
 #include <map>
 #include <mutex>
 #include <string>
@@ -156,6 +157,19 @@ MakeSurfaceLightsThread(void *arg)
         if (!novisapprox)
             EstimateVisibleBoundsAtPoint(facemidpoint, l.mins, l.maxs);
 
+        // Rays are traced from 1 unit in front of each point
+        for (const qvec3f &point : points) {
+            vec3_t raystart;
+            glm_to_vec3_t(point + l.surfnormal, raystart);
+            const int cluster = Light_PointCluster(bsp, raystart);
+            if (cluster == -1) {
+                l.clusters.clear();
+                break;
+            }
+            if (std::find(l.clusters.begin(), l.clusters.end(), cluster) == l.clusters.end())
+                l.clusters.push_back(cluster);
+        }
+
         // Store light...
         unique_lock<mutex> lck{ surfacelights_lock };
         surfacelights.push_back(l);
@@ -1,11 +1,16 @@
 #include "gtest/gtest.h"
 
 #include <light/light.hh>
+#include <light/ltface.hh>
+#include <light/simd.hh>
+#include <light/trace_native.hh>
 
+#include <atomic>
 #include <random>
 #include <algorithm> // for std::sort
 
 #include <common/qvec.hh>
+#include <common/bsputils.hh>
 
 #include <common/mesh.hh>
 #include <common/aabb.hh>
@@ -1013,6 +1018,13 @@ TEST(mathlib, octree_basic) {
         std::sort(objsTouchingObj_i_octree.begin(), objsTouchingObj_i_octree.end());
         EXPECT_EQ(objsTouchingObj_i, objsTouchingObj_i_octree);
     }
+    
+    // the same queries into one reused buffer come back sorted
+    vector<int> buffer;
+    for (int i=0; i<N; i++) {
+        octree.queryTouchingBBox(objs[i].first, buffer);
+        EXPECT_EQ(objsTouchingObjs[i], buffer);
+    }
 }
 
 TEST(qvec, matrix2x2inv) {
@@ -1098,4 +1110,884 @@ TEST(trace, clamp_texcoord) {
     EXPECT_EQ(0, clamp_texcoord(-127.5f, 128));
     EXPECT_EQ(0, clamp_texcoord(-128.0f, 128));
     EXPECT_EQ(127, clamp_texcoord(-129.0f, 128));
-}
\ No newline at end of file
+}
+
+TEST(bsputils, DecompressClusterPVS) {
+    // 20 vis leafs, so 3 bytes per row.
+    // leaf 1 sees leafs 1 and 20, stored as: 0x01, (zero run of 1), 0x08
+    // leaf 2 sees nothing, stored as a zero run of 3
+    byte visdata[] = { 0x01, 0x00, 0x01, 0x08,
+                       0x00, 0x03 };
+    
+    dmodel_t world {};
+    world.visleafs = 20;
+    
+    mleaf_t leafs[21] {};
+    leafs[0].contents = CONTENTS_SOLID;
+    leafs[0].visofs = -1;
+    for (int i=1; i<21; i++) {
+        leafs[i].contents = CONTENTS_EMPTY;
+        leafs[i].visofs = -1;
+    }
+    leafs[1].visofs = 0;
+    leafs[2].visofs = 4;
+    
+    mbsp_t bsp {};
+    bsp.loadversion = BSPVERSION;
+    bsp.nummodels = 1;
+    bsp.dmodels = &world;
+    bsp.numleafs = 21;
+    bsp.dleafs = leafs;
+    bsp.visdatasize = sizeof(visdata);
+    bsp.dvisdata = visdata;
+    
+    EXPECT_EQ(20, BSP_NumClusters(&bsp));
+    EXPECT_EQ(-1, BSP_LeafCluster(&bsp, &leafs[0]));
+    EXPECT_EQ(0, BSP_LeafCluster(&bsp, &leafs[1]));
+    EXPECT_EQ(1, BSP_LeafCluster(&bsp, &leafs[2]));
+    EXPECT_EQ(-1, BSP_LeafCluster(&bsp, &leafs[3])); // no vis data
+    
+    uint8_t row[3];
+    ASSERT_TRUE(BSP_DecompressClusterPVS(&bsp, 0, row));
+    EXPECT_EQ(0x01, row[0]);
+    EXPECT_EQ(0x00, row[1]);
+    EXPECT_EQ(0x08, row[2]);
+    
+    ASSERT_TRUE(BSP_DecompressClusterPVS(&bsp, 1, row));
+    EXPECT_EQ(0x00, row[0]);
+    EXPECT_EQ(0x00, row[1]);
+    EXPECT_EQ(0x00, row[2]);
+    
+    EXPECT_FALSE(BSP_DecompressClusterPVS(&bsp, 2, row));
+    EXPECT_FALSE(BSP_DecompressClusterPVS(&bsp, 20, row));
+    
+    // unvis'ed map
+    bsp.visdatasize = 0;
+    EXPECT_EQ(0, BSP_NumClusters(&bsp));
+    EXPECT_EQ(-1, BSP_LeafCluster(&bsp, &leafs[1]));
+}
+
+TEST(bsputils, VisSeesThroughLiquids) {
+    // leaf 1 is the air above a pool, with a light in it; leaf 2 is the
+    // water, holding the top face of a pillar under the surface.
+    // qbsp -notranswater: the leafs don't see each other
+    byte opaque[] = { 0x01,
+                      0x02 };
+    // default: they do
+    byte transparent[] = { 0x03,
+                           0x03 };
+    
+    dmodel_t world {};
+    world.visleafs = 2;
+    
+    mleaf_t leafs[3] {};
+    leafs[0].contents = CONTENTS_SOLID;
+    leafs[0].visofs = -1;
+    leafs[1].contents = CONTENTS_EMPTY;
+    leafs[1].visofs = 0;
+    leafs[2].contents = CONTENTS_WATER;
+    leafs[2].visofs = 1;
+    
+    mbsp_t bsp {};
+    bsp.loadversion = BSPVERSION;
+    bsp.nummodels = 1;
+    bsp.dmodels = &world;
+    bsp.numleafs = 3;
+    bsp.dleafs = leafs;
+    bsp.visdatasize = sizeof(opaque);
+    bsp.dvisdata = opaque;
+    
+    // the light would be culled from the underwater face by the PVS
+    uint8_t row[1];
+    ASSERT_TRUE(BSP_DecompressClusterPVS(&bsp, BSP_LeafCluster(&bsp, &leafs[2]), row));
+    EXPECT_EQ(0, row[0] & (1 << BSP_LeafCluster(&bsp, &leafs[1])));
+    EXPECT_FALSE(BSP_VisSeesThroughLiquids(&bsp));
+    
+    bsp.dvisdata = transparent;
+    EXPECT_TRUE(BSP_VisSeesThroughLiquids(&bsp));
+    
+    // no liquids at all
+    leafs[2].contents = CONTENTS_EMPTY;
+    bsp.dvisdata = opaque;
+    EXPECT_TRUE(BSP_VisSeesThroughLiquids(&bsp));
+}
+
+TEST(light, FinishFileSpace) {
+    bsp2_dface_t faces[3] {};
+    
+    mbsp_t bsp {};
+    bsp.numfaces = 3;
+    bsp.dfaces = faces;
+    
+    InitFileSpace(&bsp);
+    
+    // handed out out of order, as different threads would
+    byte *light, *lit, *lux;
+    faces[2].lightofs = GetFileSpace(4, &light, &lit, &lux, 6);
+    memset(light, 3, 6);
+    memset(lit, 30, 18);
+    memset(lux, 40, 18);
+    faces[0].lightofs = GetFileSpace(0, &light, &lit, &lux, 5);
+    memset(light, 1, 5);
+    memset(lit, 10, 15);
+    memset(lux, 20, 15);
+    faces[1].lightofs = -1; // not lit
+    
+    FinishFileSpace(&bsp);
+    
+    // laid out in slot order, 4 byte aligned
+    EXPECT_EQ(0, faces[0].lightofs);
+    EXPECT_EQ(-1, faces[1].lightofs);
+    EXPECT_EQ(8, faces[2].lightofs);
+    ASSERT_EQ(14, bsp.lightdatasize);
+    
+    const byte expected[14] = { 1, 1, 1, 1, 1, 0, 0, 0, 3, 3, 3, 3, 3, 3 };
+    EXPECT_EQ(0, memcmp(expected, bsp.dlightdata, sizeof(expected)));
+    EXPECT_EQ(10, lit_filebase[0]);
+    EXPECT_EQ(10, lit_filebase[14]);
+    EXPECT_EQ(0, lit_filebase[15]);
+    EXPECT_EQ(30, lit_filebase[24]);
+    EXPECT_EQ(30, lit_filebase[41]);
+    EXPECT_EQ(20, lux_filebase[0]);
+    EXPECT_EQ(40, lux_filebase[24]);
+    EXPECT_EQ(40, lux_filebase[41]);
+}
+
+static std::atomic<int> threadwork_count[1000];
+
+static void *
+CountThreadWork(void *arg)
+{
+    while (1) {
+        const int i = GetThreadWork();
+        if (i == -1)
+            break;
+        threadwork_count[i]++;
+    }
+    return NULL;
+}
+
+TEST(threads, RunThreadsOnWithCost) {
+    const int savedthreads = numthreads;
+    
+    std::vector<float> cost;
+    for (int i = 0; i < 1000; i++)
+        cost.push_back(static_cast<float>((i * 37) % 101));
+    
+    for (int threads : { 1, 3, 8 }) {
+        numthreads = threads;
+        for (auto &count : threadwork_count)
+            count = 0;
+        
+        // items 100..999; cost[0] is the cost of item 100
+        RunThreadsOnWithCost(100, 1000, cost.data(), CountThreadWork, NULL);
+        
+        for (int i = 0; i < 1000; i++)
+            ASSERT_EQ(i < 100 ? 0 : 1, threadwork_count[i].load()) << "item " << i << ", " << threads << " threads";
+    }
+    
+    numthreads = savedthreads;
+}
+
+static std::vector<int> threadwork_order;
+
+static void *
+RecordThreadWork(void *arg)
+{
+    while (1) {
+        const int i = GetThreadWork();
+        if (i == -1)
+            break;
+        threadwork_order.push_back(i);
+    }
+    return NULL;
+}
+
+TEST(threads, RunThreadsOnWithCost_MostExpensiveFirst) {
+    const int savedthreads = numthreads;
+    numthreads = 1;
+    
+    const float cost[] = { 1, 5, 2, 5, 0 };
+    threadwork_order.clear();
+    RunThreadsOnWithCost(0, 5, cost, RecordThreadWork, NULL);
+    
+    // ties keep their order
+    const std::vector<int> expected { 1, 3, 2, 0, 4 };
+    EXPECT_EQ(expected, threadwork_order);
+    
+    numthreads = savedthreads;
+}
+
+/*
+ * A small scene for the native raytracer. Horizontal 64x64 quads at
+ * z = 64, facing down, over a sky ceiling at z = 128:
+ *   x 0..64      "wall", solid
+ *   x 128..192   "{fence", opaque for x 128..160, transparent for 160..192
+ *   x 256..320   "glass", red, on a bmodel with alpha 0.5 and _shadow 1
+ *   x 384..640   a 4x4 grid of "wall" quads, so the BVH has several leafs
+ * Rays are traced up from z = 0.
+ */
+class nativescene_t {
+    std::vector<dvertex_t> verts;
+    std::vector<bsp2_dedge_t> edges;
+    std::vector<int32_t> surfedges;
+    std::vector<bsp2_dface_t> faces;
+    std::vector<gtexinfo_t> texinfos;
+    std::vector<uint64_t> texflags;
+    std::vector<byte> texdata;
+    dmodel_t models[2] {};
+    
+    void addTexture(const char *name, std::vector<color_rgba> pixels) {
+        dmiptexlump_t *lump = reinterpret_cast<dmiptexlump_t *>(texdata.data());
+        const int texnum = lump->nummiptex++;
+        lump->dataofs[texnum] = static_cast<int32_t>(texdata.size());
+        
+        rgba_miptex_t miptex {};
+        strcpy(miptex.name, name);
+        miptex.width = static_cast<unsigned>(pixels.size());
+        miptex.height = 1;
+        miptex.offset = sizeof(miptex);
+        
+        const byte *m = reinterpret_cast<const byte *>(&miptex);
+        texdata.insert(texdata.end(), m, m + sizeof(miptex));
+        const byte *px = reinterpret_cast<const byte *>(pixels.data());
+        texdata.insert(texdata.end(), px, px + pixels.size() * sizeof(color_rgba));
+        
+        // s = x / 32, t = y / 32
+        gtexinfo_t texinfo {};
+        texinfo.vecs[0][0] = 1.0f / 32.0f;
+        texinfo.vecs[1][1] = 1.0f / 32.0f;
+        texinfo.miptex = texnum;
+        texinfos.push_back(texinfo);
+    }
+    
+    void addQuad(float x0, float y0, float x1, float y1, float z, int texinfo) {
+        const float points[4][2] = { {x0, y0}, {x1, y0}, {x1, y1}, {x0, y1} };
+        
+        bsp2_dface_t face {};
+        face.firstedge = static_cast<int32_t>(surfedges.size());
+        face.numedges = 4;
+        face.texinfo = texinfo;
+        face.lightofs = -1;
+        
+        const uint32_t first = static_cast<uint32_t>(verts.size());
+        for (int i = 0; i < 4; i++) {
+            verts.push_back(dvertex_t { { points[i][0], points[i][1], z } });
+            edges.push_back(bsp2_dedge_t { { first + i, first + (i + 1) % 4 } });
+            surfedges.push_back(static_cast<int32_t>(edges.size()) - 1);
+        }
+        faces.push_back(face);
+    }
+    
+public:
+    mbsp_t bsp {};
+    
+    nativescene_t() {
+        texdata.resize(sizeof(dmiptexlump_t));
+        addTexture("wall", { {128, 128, 128, 255} });
+        addTexture("sky1", { {0, 0, 255, 255} });
+        addTexture("{fence", { {128, 128, 128, 255}, {0, 0, 0, 0} });
+        addTexture("glass", { {255, 0, 0, 255} });
+        
+        edges.push_back(bsp2_dedge_t {}); // edge 0 is unused
+        
+        addQuad(0, 0, 64, 64, 64, 0);
+        addQuad(128, 0, 192, 64, 64, 2);
+        addQuad(-512, -512, 1024, 512, 128, 1);
+        for (int i = 0; i < 16; i++) {
+            const float x = 384 + 64 * (i % 4);
+            const float y = 64 * (i / 4);
+            addQuad(x, y, x + 64, y + 64, 64, 0);
+        }
+        models[0].numfaces = 19;
+        
+        addQuad(256, 0, 320, 64, 64, 3);
+        models[1].firstface = 19;
+        models[1].numfaces = 1;
+        
+        texflags.resize(texinfos.size());
+        
+        bsp.loadversion = BSPVERSION;
+        bsp.nummodels = 2;
+        bsp.dmodels = models;
+        bsp.numvertexes = static_cast<int>(verts.size());
+        bsp.dvertexes = verts.data();
+        bsp.numedges = static_cast<int>(edges.size());
+        bsp.dedges = edges.data();
+        bsp.numsurfedges = static_cast<int>(surfedges.size());
+        bsp.dsurfedges = surfedges.data();
+        bsp.numfaces = static_cast<int>(faces.size());
+        bsp.dfaces = faces.data();
+        bsp.numtexinfo = static_cast<int>(texinfos.size());
+        bsp.texinfo = texinfos.data();
+        bsp.rgbatexdatasize = static_cast<int>(texdata.size());
+        bsp.drgbatexdata = reinterpret_cast<dmiptexlump_t *>(texdata.data());
+        
+        modelinfo.push_back(new modelinfo_t { &bsp, &models[0], 16 });
+        modelinfo.push_back(new modelinfo_t { &bsp, &models[1], 16 });
+        modelinfo[1]->alpha.setFloatValue(0.5f);
+        modelinfo[1]->shadow.setFloatValue(1);
+        extended_texinfo_flags = texflags.data();
+        tracelist.clear();
+        
+        Native_TraceInit(&bsp);
+    }
+    
+    ~nativescene_t() {
+        for (modelinfo_t *info : modelinfo)
+            delete info;
+        modelinfo.clear();
+        extended_texinfo_flags = nullptr;
+    }
+    
+    const modelinfo_t *world() const { return modelinfo[0]; }
+};
+
+static bool
+NativeLightVisible(const nativescene_t &scene, float x, float y)
+{
+    const vec3_t start { x, 32, 0 };
+    const vec3_t stop { x, 32, 100 };
+    return Native_TestLight(start, stop, scene.world());
+}
+
+TEST(trace_native, Occlusion) {
+    nativescene_t scene;
+    
+    EXPECT_FALSE(NativeLightVisible(scene, 32, 32));
+    EXPECT_TRUE(NativeLightVisible(scene, -32, 32));
+    EXPECT_TRUE(NativeLightVisible(scene, 96, 32));
+    
+    // stopping short of the wall
+    const vec3_t start { 32, 32, 0 };
+    const vec3_t stop { 32, 32, 60 };
+    EXPECT_TRUE(Native_TestLight(start, stop, scene.world()));
+}
+
+TEST(trace_native, Sky) {
+    nativescene_t scene;
+    
+    const vec3_t up { 0, 0, 1 };
+    const vec3_t open { -32, 32, 0 };
+    const vec3_t covered { 32, 32, 0 };
+    EXPECT_TRUE(Native_TestSky(open, up, scene.world()));
+    EXPECT_FALSE(Native_TestSky(covered, up, scene.world()));
+    
+    vec_t hitdist;
+    const bsp2_dface_t *face;
+    EXPECT_EQ(hittype_t::SKY, Native_DirtTrace(open, up, 1000, scene.world(), &hitdist, nullptr, &face));
+    EXPECT_FLOAT_EQ(128, hitdist);
+    EXPECT_EQ(&scene.bsp.dfaces[2], face);
+    EXPECT_EQ(hittype_t::SOLID, Native_DirtTrace(covered, up, 1000, scene.world(), &hitdist, nullptr, &face));
+    EXPECT_FLOAT_EQ(64, hitdist);
+    EXPECT_EQ(&scene.bsp.dfaces[0], face);
+}
+
+TEST(trace_native, Fence) {
+    nativescene_t scene;
+    
+    EXPECT_FALSE(NativeLightVisible(scene, 144, 32));
+    EXPECT_TRUE(NativeLightVisible(scene, 176, 32));
+}
+
+TEST(trace_native, Glass) {
+    nativescene_t scene;
+    
+    // glass doesn't occlude, but tints the light passing through it
+    EXPECT_TRUE(NativeLightVisible(scene, 280, 32));
+    
+    raystream_t *rs = Native_MakeRayStream(2);
+    const vec3_t up { 0, 0, 1 };
+    const vec3_t white { 1, 1, 1 };
+    // away from the diagonal between the quad's triangles, so only one is hit
+    const vec3_t throughglass { 280, 32, 0 };
+    const vec3_t beside { 224, 32, 0 };
+    rs->pushRay(0, throughglass, up, 100, scene.world(), white);
+    rs->pushRay(1, beside, up, 100, scene.world(), white);
+    rs->tracePushedRaysOcclusion();
+    
+    vec3_t color;
+    EXPECT_FALSE(rs->getPushedRayOccluded(0));
+    rs->getPushedRayColor(0, color);
+    EXPECT_FLOAT_EQ(1.0f, color[0]);
+    EXPECT_FLOAT_EQ(0.5f, color[1]);
+    EXPECT_FLOAT_EQ(0.5f, color[2]);
+    
+    EXPECT_FALSE(rs->getPushedRayOccluded(1));
+    rs->getPushedRayColor(1, color);
+    EXPECT_FLOAT_EQ(1.0f, color[1]);
+    
+    delete rs;
+}
+
+TEST(trace_native, PacketsMatchSingleRays) {
+    nativescene_t scene;
+    
+    // rays from under the scene to points on and just off the quad edges
+    // and diagonals, where the result is most sensitive to traversal
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> jitter(-0.002f, 0.002f);
+    std::uniform_real_distribution<float> along(0.0f, 64.0f);
+    std::uniform_real_distribution<float> spread(-100.0f, 100.0f);
+    const float quadx[] = { 0, 128, 256, 384, 576 };
+    
+    const int numrays = 4096;
+    std::vector<qvec3f> starts, dirs;
+    for (int i = 0; i < numrays; i++) {
+        const float x0 = quadx[i % 5];
+        const float a = along(rng);
+        qvec3f target;
+        switch ((i / 5) % 4) {
+            case 0: target = qvec3f(x0, a, 64); break;
+            case 1: target = qvec3f(x0 + 64, a, 64); break;
+            case 2: target = qvec3f(x0 + a, a, 64); break;
+            default: target = qvec3f(x0 + a, 0, 64); break;
+        }
+        target = target + qvec3f(jitter(rng), jitter(rng), 0);
+        
+        const qvec3f start(target[0] + spread(rng), target[1] + spread(rng), 0);
+        starts.push_back(start);
+        dirs.push_back(qv::normalize(target - start));
+    }
+    
+    raystream_t *occlusion = Native_MakeRayStream(numrays);
+    raystream_t *intersection = Native_MakeRayStream(numrays);
+    for (int i = 0; i < numrays; i++) {
+        occlusion->pushRay(i, starts[i], dirs[i], 200, scene.world());
+        intersection->pushRay(i, starts[i], dirs[i], 200, scene.world());
+    }
+    occlusion->tracePushedRaysOcclusion();
+    intersection->tracePushedRaysIntersection();
+    
+    int hits = 0;
+    for (int i = 0; i < numrays; i++) {
+        vec3_t start, dir, stop;
+        glm_to_vec3_t(starts[i], start);
+        glm_to_vec3_t(dirs[i], dir);
+        VectorMA(start, 200, dir, stop);
+        
+        const bool visible = Native_TestLight(start, stop, scene.world());
+        ASSERT_EQ(!visible, occlusion->getPushedRayOccluded(i)) << "ray " << i;
+        
+        vec_t hitdist = 0;
+        const bsp2_dface_t *face = nullptr;
+        const hittype_t type = Native_DirtTrace(start, dir, 200, scene.world(), &hitdist, nullptr, &face);
+        ASSERT_EQ(type, intersection->getPushedRayHitType(i)) << "ray " << i;
+        if (type != hittype_t::NONE) {
+            ASSERT_EQ(face, intersection->getPushedRayHitFace(i)) << "ray " << i;
+            ASSERT_EQ(hitdist, intersection->getPushedRayHitDist(i)) << "ray " << i;
+            hits++;
+        }
+    }
+    
+    // make sure the rays actually exercise the edges
+    EXPECT_GT(hits, numrays / 4);
+    EXPECT_LT(hits, numrays);
+    
+    delete occlusion;
+    delete intersection;
+}
+
+/*
+ * -adaptive on a synthetic 16x16 luxel face with -extra4: a point light
+ * above it and a shadow edge running across it at a slant. The luxels
+ * left unrefined must come out within ADAPTIVE_TOLERANCE output levels
+ * of full supersampling, and the luxels on the shadow edge must be refined.
+ */
+#define ADAPTIVE_TOLERANCE 1.0f
+
+static float
+AdaptiveTestLight(float x, float y)
+{
+    // a light 128 units above (128, 80), with inverse square falloff
+    const float dx = x - 128, dy = y - 80, dz = 128;
+    const float distsq = dx * dx + dy * dy + dz * dz;
+    const float value = 300.0f * dz * dz / distsq * (dz / sqrt(distsq));
+    
+    // the shadow of a wall
+    return (x + 0.3f * y < 180.0f) ? 0.0f : value;
+}
+
+TEST(light, AdaptiveInterpolationMatchesSupersampling) {
+    const int savedoversample = oversample;
+    oversample = 4;
+    
+    const int N = 4, bw = 16, bh = 16;
+    const int width = bw * N, height = bh * N;
+    const float rangescale = 0.5f;
+    
+    // full supersampling: every sample lit, 4 units apart
+    std::vector<lightsample_t> full(width * height);
+    for (int t = 0; t < height; t++) {
+        for (int s = 0; s < width; s++) {
+            lightsample_t &sample = full[t * width + s];
+            VectorSet(sample.color, 0, 0, 0);
+            sample.color[0] = sample.color[1] = sample.color[2] = AdaptiveTestLight(s * 4.0f + 2.0f, t * 4.0f + 2.0f);
+            VectorSet(sample.direction, 0, 0, 1);
+        }
+    }
+    
+    // pass 1: the middle sample of each luxel
+    std::vector<int> reps(bw * bh), slots(bw * bh);
+    std::vector<lightsample_t> pass1(bw * bh);
+    for (int b = 0; b < bw * bh; b++) {
+        reps[b] = ((b / bw) * N + N / 2) * width + (b % bw) * N + N / 2;
+        slots[b] = b;
+        pass1[b] = full[reps[b]];
+    }
+    const lightmap_t lm1 { 0, pass1.data() };
+    
+    std::vector<refine_t> refine(bw * bh, refine_none);
+    Adaptive_FindEdges(lm1, nullptr, slots, bw, bh, 1.0f / rangescale, &refine);
+    Adaptive_GrowRefined(slots, bw, bh, &refine);
+    
+    std::vector<lightsample_t> samples(full);
+    const lightmap_t lm { 0, samples.data() };
+    int unrefined = 0;
+    for (int by = 0; by < bh; by++) {
+        for (int bx = 0; bx < bw; bx++) {
+            const int b = by * bw + bx;
+            
+            // luxels with both lit and shadowed samples
+            bool lit = false, shadowed = false;
+            for (int t = by * N; t < (by + 1) * N; t++) {
+                for (int s = bx * N; s < (bx + 1) * N; s++) {
+                    if (full[t * width + s].color[0] > 0)
+                        lit = true;
+                    else
+                        shadowed = true;
+                }
+            }
+            if (lit && shadowed)
+                EXPECT_NE(refine_none, refine[b]) << "luxel " << bx << " " << by;
+            
+            if (refine[b] != refine_none)
+                continue;
+            unrefined++;
+            
+            float adaptive = 0, supersampled = 0;
+            for (int t = by * N; t < (by + 1) * N; t++) {
+                for (int s = bx * N; s < (bx + 1) * N; s++) {
+                    const int i = t * width + s;
+                    const lightsample_t sample = (i == reps[b]) ? samples[i]
+                        : Adaptive_Interpolate(lm, reps, bw, bh, width, s, t, b);
+                    adaptive += sample.color[0] * rangescale / (N * N);
+                    supersampled += full[i].color[0] * rangescale / (N * N);
+                }
+            }
+            EXPECT_NEAR(supersampled, adaptive, ADAPTIVE_TOLERANCE) << "luxel " << bx << " " << by;
+        }
+    }
+    
+    // otherwise the test proves nothing
+    EXPECT_GT(unrefined, bw * bh / 3);
+    
+    oversample = savedoversample;
+}
+
+/*
+ * GetLightContribs is a SIMD copy of GetLightContrib; check them against
+ * each other point by point, for every falloff formula, a spotlight and
+ * bleed/twosided lights. 37 points, so the last vector is only partly used
+ * for every LIGHT_SIMD_WIDTH > 1.
+ */
+class contribsurf_t {
+    std::vector<float> coords[6];
+    std::vector<int> index;
+    
+public:
+    std::vector<qvec3f> points, normals;
+    lightsurf_t surf {};
+    
+    contribsurf_t(int numpoints) {
+        std::mt19937 rng(4321);
+        std::uniform_real_distribution<float> pos(-400.0f, 400.0f);
+        std::uniform_real_distribution<float> dir(-1.0f, 1.0f);
+        
+        for (int i = 0; i < numpoints; i++) {
+            points.push_back(qvec3f(pos(rng), pos(rng), pos(rng) / 4.0f));
+            // mostly facing up, at the light; some facing away from it
+            normals.push_back(qv::normalize(qvec3f(dir(rng), dir(rng), dir(rng) + 0.5f)));
+        }
+        
+        // every other point is occluded, as GetLightContribs only gets the others
+        for (int i = 0; i < numpoints; i += 2) {
+            for (int k = 0; k < 3; k++) {
+                coords[k].push_back(points[i][k]);
+                coords[3 + k].push_back(normals[i][k]);
+            }
+            index.push_back(i);
+        }
+        surf.numsoapoints = static_cast<int>(index.size());
+        for (int k = 0; k < 6; k++) {
+            coords[k].resize(index.size() + LIGHT_SIMD_WIDTH, coords[k].back());
+            surf.soa[k] = coords[k].data();
+        }
+        surf.soaindex = index.data();
+    }
+};
+
+static int
+CheckLightContribs(const globalconfig_t &cfg, const light_t &entity, contribsurf_t &points, bool twosided)
+{
+    points.surf.twosided = twosided;
+    
+    std::vector<entitycontrib_t> contribs;
+    GetLightContribs(cfg, &entity, &points.surf, contribs);
+    
+    std::map<int, float> simd;
+    for (const entitycontrib_t &contrib : contribs) {
+        EXPECT_EQ(0, contrib.point % 2) << "occluded point " << contrib.point;
+        EXPECT_EQ(0u, simd.count(contrib.point)) << "point " << contrib.point << " twice";
+        simd[contrib.point] = contrib.add;
+    }
+    
+    int lit = 0;
+    for (int i = 0; i < points.surf.numsoapoints; i++) {
+        const int point = points.surf.soaindex[i];
+        vec3_t surfpoint, surfnorm;
+        glm_to_vec3_t(points.points[point], surfpoint);
+        glm_to_vec3_t(points.normals[point], surfnorm);
+        
+        vec3_t color, dir, normalcontrib;
+        float dist;
+        GetLightContrib(cfg, &entity, surfnorm, surfpoint, twosided, color, dir, normalcontrib, &dist);
+        const float add = GetLightValueWithAngle(cfg, &entity, surfnorm, dir, dist, twosided);
+        const float brightness = fabs(LightSample_Brightness(color));
+        
+        const auto it = simd.find(point);
+        if (brightness > fadegate) {
+            lit++;
+            if (it == simd.end())
+                ADD_FAILURE() << "point " << point << " missing, scalar add " << add;
+            else
+                EXPECT_NEAR(add, it->second, 1e-4f * fabs(add) + 1e-4f) << "point " << point;
+        } else {
+            EXPECT_EQ(simd.end(), it) << "point " << point << ", scalar add " << add;
+        }
+    }
+    return lit;
+}
+
+static void
+SetLightFormula(light_t *entity, light_formula_t formula)
+{
+    entity->formula.setFloatValue(static_cast<float>(formula));
+}
+
+/* a light above the middle of the points */
+static void
+PlaceContribLight(light_t *entity)
+{
+    const vec3_t origin { 10, -20, 100 };
+    entity->origin.setVec3Value(origin);
+    entity->anglescale.setFloatValue(0.5f);
+}
+
+TEST(light, GetLightContribsMatchesScalar) {
+    globalconfig_t cfg;
+    contribsurf_t points(73);
+    
+    light_t entity;
+    PlaceContribLight(&entity);
+    const vec3_t color { 255, 128, 64 };
+    entity.color.setVec3Value(color);
+    
+    for (light_formula_t formula : { LF_LINEAR, LF_INVERSE, LF_INVERSE2, LF_INVERSE2A, LF_INFINITE }) {
+        SCOPED_TRACE(formula);
+        SetLightFormula(&entity, formula);
+        entity.light.setFloatValue(formula == LF_INFINITE ? 100.0f : 300.0f);
+        const int lit = CheckLightContribs(cfg, entity, points, false);
+        EXPECT_GT(lit, 0);
+        EXPECT_LT(lit, points.surf.numsoapoints);
+    }
+    
+    SCOPED_TRACE("negative linear");
+    SetLightFormula(&entity, LF_LINEAR);
+    entity.light.setFloatValue(-200.0f);
+    EXPECT_GT(CheckLightContribs(cfg, entity, points, false), 0);
+}
+
+TEST(light, GetLightContribsFalloff) {
+    globalconfig_t cfg;
+    contribsurf_t points(73);
+    
+    light_t entity;
+    PlaceContribLight(&entity);
+    entity.falloff.setFloatValue(350.0f);
+    SetLightFormula(&entity, LF_LINEAR);
+    const int lit = CheckLightContribs(cfg, entity, points, false);
+    EXPECT_GT(lit, 0);
+    EXPECT_LT(lit, points.surf.numsoapoints);
+}
+
+TEST(light, GetLightContribsSpotlight) {
+    globalconfig_t cfg;
+    contribsurf_t points(73);
+    
+    light_t entity;
+    PlaceContribLight(&entity);
+    SetLightFormula(&entity, LF_INFINITE);
+    
+    // pointing down, with a soft edge between 60 and 90 degrees wide
+    entity.spotlight = true;
+    VectorSet(entity.spotvec, 0, 0, -1);
+    entity.spotfalloff = -cos(90.0f / 2 * Q_PI / 180);
+    entity.spotfalloff2 = -cos(60.0f / 2 * Q_PI / 180);
+    const int lit = CheckLightContribs(cfg, entity, points, false);
+    EXPECT_GT(lit, 0);
+    EXPECT_LT(lit, points.surf.numsoapoints);
+}
+
+TEST(light, GetLightContribsBleedAndTwosided) {
+    globalconfig_t cfg;
+    contribsurf_t points(73);
+    
+    light_t entity;
+    PlaceContribLight(&entity);
+    SetLightFormula(&entity, LF_INVERSE);
+    
+    // the points facing away from the light are lit too
+    EXPECT_LT(CheckLightContribs(cfg, entity, points, false), points.surf.numsoapoints);
+    EXPECT_EQ(points.surf.numsoapoints, CheckLightContribs(cfg, entity, points, true));
+    
+    entity.bleed.setBoolValue(true);
+    EXPECT_EQ(points.surf.numsoapoints, CheckLightContribs(cfg, entity, points, false));
+}
+
+/* a 64x64 face at the origin, facing up at a ceiling of bounce lights */
+class bouncesurf_t {
+public:
+    std::vector<bouncelight_t> lights;
+    std::vector<qvec3f> points;
+    lightsurf_t surf {};
+    
+    bouncesurf_t(const globalconfig_t &cfg, int numlights) {
+        std::mt19937 rng(1234);
+        std::uniform_real_distribution<float> pos(-400.0f, 400.0f);
+        std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+        
+        for (int i = 0; i < numlights; i++) {
+            bouncelight_t vpl;
+            vpl.pos = qvec3f(pos(rng), pos(rng), 150.0f + 50.0f * unit(rng));
+            vpl.surfnormal = qv::normalize(qvec3f(unit(rng) - 0.5f, unit(rng) - 0.5f, -1.0f));
+            // bright enough that none fail BounceLight_SphereCull
+            vpl.area = 800.0f + 800.0f * unit(rng);
+            vpl.colorByStyle[0] = qvec3f(0.3f + 0.7f * unit(rng), 0.3f + 0.7f * unit(rng), 0.3f + 0.7f * unit(rng));
+            if (i % 3 == 0)
+                vpl.colorByStyle[1] = qvec3f(1.0f, 0.5f, 0.25f);
+            vpl.componentwiseMaxColor = qvec3f(0);
+            for (const auto &styleColor : vpl.colorByStyle) {
+                for (int j = 0; j < 3; j++)
+                    vpl.componentwiseMaxColor[j] = qmax(vpl.componentwiseMaxColor[j], styleColor.second[j]);
+            }
+            for (int j = 0; j < 3; j++) {
+                vpl.mins[j] = -1000;
+                vpl.maxs[j] = 1000;
+            }
+            vpl.cluster = -1;
+            lights.push_back(vpl);
+        }
+        
+        for (int y = -32; y <= 32; y += 16) {
+            for (int x = -32; x <= 32; x += 16) {
+                points.push_back(qvec3f(x, y, 0));
+            }
+        }
+        
+        surf.cfg = &cfg;
+        surf.plane.normal[2] = 1;
+        surf.lightmapscale = 16;
+        surf.radius = 48;
+        for (int j = 0; j < 3; j++) {
+            surf.mins[j] = (j < 2) ? -32 : -1;
+            surf.maxs[j] = (j < 2) ? 32 : 1;
+        }
+    }
+    
+    /* the unoccluded bounce light the lights add over all of the points and styles */
+    float total(const std::vector<const bouncelight_t *> &cut) const {
+        const globalconfig_t &cfg = *surf.cfg;
+        const qvec3f normal(0, 0, 1);
+        float sum = 0;
+        for (const bouncelight_t *vpl : cut) {
+            for (const qvec3f &point : points) {
+                qvec3f dir = point - vpl->pos;
+                const float dist = qv::length(dir);
+                dir /= dist;
+                for (const auto &styleColor : vpl->colorByStyle) {
+                    const qvec3f color = GetIndirectLighting(cfg, vpl, styleColor.second, dir, dist, point, normal);
+                    // the gate in LightFace_Bounce
+                    if (LightSample_Brightness(color) >= 0.25)
+                        sum += LightSample_Brightness(color);
+                }
+            }
+        }
+        return sum;
+    }
+};
+
+TEST(light, BounceCutConvergesToExactSum) {
+    globalconfig_t cfg;
+    bouncesurf_t face(cfg, 300);
+    
+    std::vector<const bouncelight_t *> all;
+    for (const bouncelight_t &vpl : face.lights)
+        all.push_back(&vpl);
+    const float exact = face.total(all);
+    ASSERT_GT(exact, 0);
+    
+    bouncetree_t *tree = BounceTree_Make(face.lights);
+    std::vector<const bouncelight_t *> cut;
+    
+    float lasterror = std::numeric_limits<float>::max();
+    size_t lastsize = 0;
+    for (const float epsilon : { 0.5f, 0.1f, 0.02f, 0.0f }) {
+        BounceTree_Cut(tree, &face.surf, epsilon, cut);
+        const float error = fabs(face.total(cut) - exact) / exact;
+        
+        EXPECT_GE(cut.size(), lastsize) << "epsilon " << epsilon;
+        EXPECT_LE(error, lasterror) << "epsilon " << epsilon;
+        lastsize = cut.size();
+        lasterror = error;
+        
+        if (epsilon == 0.5f)
+            EXPECT_LT(cut.size(), all.size() / 4); // actually clustered
+    }
+    
+    // epsilon 0 gives the lights one by one; the ones left out add nothing
+    EXPECT_LT(lasterror, 1e-5f);
+    for (const bouncelight_t *vpl : cut)
+        EXPECT_TRUE(vpl >= &face.lights.front() && vpl <= &face.lights.back());
+    
+    BounceTree_Free(tree);
+}
+
+TEST(light, BounceCutClustersOnlyVisibleLights) {
+    globalconfig_t cfg;
+    bouncesurf_t face(cfg, 300);
+    
+    // the face only sees cluster 0, the lights with x < 0
+    float visible = 0;
+    for (bouncelight_t &vpl : face.lights) {
+        vpl.cluster = (vpl.pos[0] < 0) ? 0 : 1;
+        if (vpl.cluster == 0)
+            visible += vpl.colorByStyle[0][0] * vpl.area;
+    }
+    face.surf.pvs = { 1 };
+    
+    bouncetree_t *tree = BounceTree_Make(face.lights);
+    std::vector<const bouncelight_t *> cut;
+    BounceTree_Cut(tree, &face.surf, 1.0f, cut);
+    
+    float traced = 0;
+    for (const bouncelight_t *vpl : cut) {
+        if (vpl >= &face.lights.front() && vpl <= &face.lights.back())
+            EXPECT_EQ(0, vpl->cluster);
+        traced += vpl->colorByStyle.at(0)[0] * vpl->area;
+    }
+    EXPECT_GT(traced, 0);
+    EXPECT_LE(traced, visible * 1.0001f);
+    
+    BounceTree_Free(tree);
+}
@@ -21,11 +21,14 @@
 #include <light/trace.hh>
 #include <light/ltface.hh>
 #include <common/bsputils.hh>
+#include <light/trace_native.hh>
 #ifdef HAVE_EMBREE
 #include <light/trace_embree.hh>
 #endif
 #include <cassert>
 
+using namespace polylib;
+
 #define TRACE_HIT_NONE  0
 #define TRACE_HIT_SOLID (1 << 0)
 #define TRACE_HIT_WATER (1 << 1)
@@ -137,6 +140,22 @@ int Light_PointContents( const mbsp_t *bsp, const vec3_t point )
     return Light_PointInLeaf(bsp, point)->contents;
 }
 
+/*
+==============
+Light_PointCluster
+
+Returns the vis cluster containing point, or -1 if the PVS can't be used
+for it (no vis data, point in solid, or no -pvs).
+==============
+*/
+int Light_PointCluster( const mbsp_t *bsp, const vec3_t point )
+{
+    if (!usepvs)
+        return -1;
+    
+    return BSP_LeafCluster(bsp, Light_PointInLeaf(bsp, point));
+}
+
 /*
  * ==============
  * MakeTnodes
@@ -739,7 +758,226 @@ TraceFaces (traceinfo_t *ti, int node, const vec3_t start, const vec3_t end)
 }
 
 //
-// Embree wrappers
+// Scene setup shared by the raytracing backends
+//
+
+static plane_t Node_Plane(const mbsp_t *bsp, const bsp2_dnode_t *node, bool side)
+{
+    const dplane_t *dplane = &bsp->dplanes[node->planenum];
+    plane_t plane;
+    
+    VectorCopy(dplane->normal, plane.normal);
+    plane.dist = dplane->dist;
+    
+    if (side) {
+        VectorScale(plane.normal, -1, plane.normal);
+        plane.dist *= -1.0f;
+    }
+    
+    return plane;
+}
+
+/**
+ * `planes` all of the node planes that bound this leaf, facing inward.
+ */
+static std::vector<winding_t *>
+Leaf_MakeFaces(const mbsp_t *bsp, const mleaf_t *leaf, const std::vector<plane_t> &planes)
+{
+    std::vector<winding_t *> result;
+    
+    for (const plane_t &plane : planes) {
+        // flip the inward-facing split plane to get the outward-facing plane of the face we're constructing
+        plane_t faceplane;
+        VectorScale(plane.normal, -1, faceplane.normal);
+        faceplane.dist = -plane.dist;
+        
+        winding_t *winding = BaseWindingForPlane(faceplane.normal, faceplane.dist);
+        
+        // clip `winding` by all of the other planes
+        for (const plane_t &plane2 : planes) {
+            if (&plane2 == &plane)
+                continue;
+            
+            winding_t *front = nullptr;
+            winding_t *back = nullptr;
+            
+            // frees winding.
+            ClipWinding(winding, plane2.normal, plane2.dist, &front, &back);
+            
+            // discard the back, continue clipping the front part
+            free(back);
+            winding = front;
+            
+            // check if everything was clipped away
+            if (winding == nullptr)
+                break;
+        }
+        
+        if (winding == nullptr) {
+            //logprint("WARNING: winding clipped away\n");
+        } else {
+            result.push_back(winding);
+        }
+    }
+    
+    return result;
+}
+
+void FreeWindings(std::vector<winding_t *> &windings)
+{
+    for (winding_t *winding : windings) {
+        free(winding);
+    }
+    windings.clear();
+}
+
+static void
+MakeFaces_r(const mbsp_t *bsp, const int nodenum, std::vector<plane_t> *planes, std::vector<winding_t *> *result)
+{
+    if (nodenum < 0) {
+        const int leafnum = -nodenum - 1;
+        const mleaf_t *leaf = &bsp->dleafs[leafnum];
+        
+        if (bsp->loadversion == Q2_BSPVERSION ? leaf->contents & Q2_CONTENTS_SOLID : leaf->contents == CONTENTS_SOLID) {
+            std::vector<winding_t *> leaf_windings = Leaf_MakeFaces(bsp, leaf, *planes);
+            for (winding_t *w : leaf_windings) {
+                result->push_back(w);
+            }
+        }
+        return;
+    }
+ 
+    const bsp2_dnode_t *node = &bsp->dnodes[nodenum];
+
+    // go down the front side
+    const plane_t front = Node_Plane(bsp, node, false);
+    planes->push_back(front);
+    MakeFaces_r(bsp, node->children[0], planes, result);
+    planes->pop_back();
+    
+    // go down the back side
+    const plane_t back = Node_Plane(bsp, node, true);
+    planes->push_back(back);
+    MakeFaces_r(bsp, node->children[1], planes, result);
+    planes->pop_back();
+}
+
+std::vector<winding_t *>
+MakeFaces(const mbsp_t *bsp, const dmodel_t *model)
+{
+    std::vector<winding_t *> result;
+    std::vector<plane_t> planes;
+    MakeFaces_r(bsp, model->headnode[0], &planes, &result);
+    Q_assert(planes.empty());
+    
+    return result;
+}
+
+/**
+ * Sorts the faces of all shadow casting models into the sets the raytracing
+ * backends build their geometry from:
+ *
+ * - `skyfaces` always occlude, and report a sky hit
+ * - `solidfaces` always occlude
+ * - `filterfaces` are conditional occluders (glass, fences, switchable shadows,
+ *   _shadowself and _shadowworldonly), which need the per-hit filter logic
+ * - `skipwindings` are the solid leafs of skip-textured bmodels; the caller
+ *   must free these with FreeWindings()
+ */
+void
+Trace_ClassifyFaces(const mbsp_t *bsp,
+                    std::vector<const bsp2_dface_t *> *skyfaces,
+                    std::vector<const bsp2_dface_t *> *solidfaces,
+                    std::vector<const bsp2_dface_t *> *filterfaces,
+                    std::vector<winding_t *> *skipwindings)
+{
+    // check all modelinfos
+    for (int mi = 0; mi<bsp->nummodels; mi++) {
+        const modelinfo_t *model = ModelInfoForModel(bsp, mi);
+        
+        const bool isWorld = model->isWorld();
+        const bool shadow = model->shadow.boolValue();
+        const bool shadowself = model->shadowself.boolValue();
+        const bool shadowworldonly = model->shadowworldonly.boolValue();
+        const bool switchableshadow = model->switchableshadow.boolValue();
+
+        if (!(isWorld || shadow || shadowself || shadowworldonly || switchableshadow))
+            continue;
+        
+        for (int i=0; i<model->model->numfaces; i++) {
+            const bsp2_dface_t *face = BSP_GetFace(bsp, model->model->firstface + i);
+            
+            // check for TEX_NOSHADOW
+            const uint64_t extended_flags = extended_texinfo_flags[face->texinfo];
+            if (extended_flags & TEX_NOSHADOW)
+                continue;
+            
+            // handle switchableshadow
+            if (switchableshadow) {
+                filterfaces->push_back(face);
+                continue;
+            }
+            
+            const int contents = Face_Contents(bsp, face); //mxd
+
+            //mxd. Skip NODRAW faces, but not SKY ones (Q2's sky01.wal has both flags set)
+            if(bsp->loadversion == Q2_BSPVERSION && (contents & Q2_SURF_NODRAW) && !(contents & Q2_SURF_SKY))
+                continue;
+            
+            // handle glass
+            if (model->alpha.floatValue() < 1.0f 
+                || (bsp->loadversion == Q2_BSPVERSION && (contents & Q2_SURF_TRANSLUCENT))) { //mxd. Both fence and transparent textures are done using SURF_TRANS flags in Q2
+                filterfaces->push_back(face);
+                continue;
+            }
+            
+            // fence
+            const char *texname = Face_TextureName(bsp, face);
+            if (texname[0] == '{') {
+                filterfaces->push_back(face);
+                continue;
+            }
+            
+            // handle sky
+            if (/* !Q_strncasecmp("sky", texname, 3) */ bsp->loadversion == Q2_BSPVERSION ? contents & Q2_SURF_SKY : contents == CONTENTS_SKY) { //mxd
+                skyfaces->push_back(face);
+                continue;
+            }
+            
+            // liquids
+            if (/* texname[0] == '*' */ Contents_IsTranslucent(bsp, contents)) { //mxd
+                if (!isWorld) {
+                    // world liquids never cast shadows; shadow casting bmodel liquids do
+                    solidfaces->push_back(face);
+                }
+                continue;
+            }
+            
+            // solid faces
+            
+            if (isWorld || shadow){
+                solidfaces->push_back(face);
+            } else {
+                // shadowself or shadowworldonly
+                Q_assert(shadowself || shadowworldonly);
+                filterfaces->push_back(face);
+            }
+        }
+    }
+
+    /* Special handling of skip-textured bmodels */
+    for (const modelinfo_t *model : tracelist) {
+        if (model->model->numfaces == 0) {
+            std::vector<winding_t *> windings = MakeFaces(bsp, model->model);
+            for (auto &w : windings) {
+                skipwindings->push_back(w);
+            }
+        }
+    }
+}
+
+//
+// Backend wrappers
 //
 
 qboolean TestSky(const vec3_t start, const vec3_t dirn, const modelinfo_t *self)
@@ -749,6 +987,9 @@ qboolean TestSky(const vec3_t start, const vec3_t dirn, const modelinfo_t *self)
         return Embree_TestSky(start, dirn, self);
     }
 #endif
+    if (rtbackend == backend_native) {
+        return Native_TestSky(start, dirn, self);
+    }
 #if 0
     if (rtbackend == backend_bsp) {
         return BSP_TestSky(start, dirn, self);
@@ -765,6 +1006,9 @@ qboolean TestLight(const vec3_t start, const vec3_t stop, const modelinfo_t *sel
         return Embree_TestLight(start, stop, self);
     }
 #endif
+    if (rtbackend == backend_native) {
+        return Native_TestLight(start, stop, self);
+    }
 #if 0
     if (rtbackend == backend_bsp) {
         return BSP_TestLight(start, stop, self);
@@ -782,6 +1026,9 @@ hittype_t DirtTrace(const vec3_t start, const vec3_t dirn, vec_t dist, const mod
         return Embree_DirtTrace(start, dirn, dist, self, hitdist_out, hitplane_out, face_out);
     }
 #endif
+    if (rtbackend == backend_native) {
+        return Native_DirtTrace(start, dirn, dist, self, hitdist_out, hitplane_out, face_out);
+    }
 #if 0
     if (rtbackend == backend_bsp) {
         return BSP_DirtTrace(start, dirn, dist, self, hitdist_out, hitplane_out, face_out);
@@ -925,6 +1172,9 @@ raystream_t *MakeRayStream(int maxrays)
         return Embree_MakeRayStream(maxrays);
     }
 #endif
+    if (rtbackend == backend_native) {
+        return Native_MakeRayStream(maxrays);
+    }
 #if 0
     if (rtbackend == backend_bsp) {
         return BSP_MakeRayStream(maxrays);
@@ -942,6 +1192,10 @@ void MakeTnodes(const mbsp_t *bsp)
         return;
     }
 #endif
+    if (rtbackend == backend_native) {
+        Native_TraceInit(bsp);
+        return;
+    }
 #if 0
     if (rtbackend == backend_bsp) {
         BSP_MakeTnodes(bsp);
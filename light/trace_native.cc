@@ -0,0 +1,988 @@
+/*  Copyright (C) 2026 ericw-tools contributors
+
+    The choice of faces to trace against and the filtering of hits on
+    them follow trace_embree.cc, Copyright (C) 2016 Eric Wasylishen.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * Built-in raytracing backend, used when light is built without Embree.
+ *
+ * The scene is the same set of sky / solid / filtered faces (and skip-textured
+ * bmodel windings) that the Embree backend uses, triangulated and stored in a
+ * binned-SAH bounding volume hierarchy. Rays are traced in packets of
+ * NATIVE_PACKET_SIZE, with one ray per SIMD lane (8 with AVX, 4 with SSE2,
+ * 1 otherwise).
+ */
+
+#include <light/light.hh>
+#include <light/trace_native.hh>
+#include <light/simd.hh>
+#include <common/bsputils.hh>
+#include <common/polylib.hh>
+
+#include <vector>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+using namespace std;
+using namespace polylib;
+
+/* one ray per SIMD lane */
+#define NATIVE_PACKET_SIZE LIGHT_SIMD_WIDTH
+
+static const unsigned PACKET_ALL_LANES = (1u << NATIVE_PACKET_SIZE) - 1;
+
+/*
+ * ============================================================================
+ * Scene
+ * ============================================================================
+ */
+
+enum class geomtype_t : uint8_t {
+    SKY,    // always occludes, reports a sky hit
+    SOLID,  // always occludes
+    FILTER, // conditional occluder, see Native_FilterHit
+    SKIP    // solid leafs of skip-textured bmodels; always occludes, no face
+};
+
+/* hot data, read for every ray/triangle test */
+struct bvhtri_t {
+    float v0[3];
+    float e1[3];    // v1 - v0
+    float e2[3];    // v2 - v0
+};
+
+/* cold data, only read when a ray hits the triangle */
+struct triinfo_t {
+    geomtype_t geomtype;
+    const bsp2_dface_t *face;        // nullptr for SKIP
+    const modelinfo_t *modelinfo;    // nullptr for SKIP
+    float Ng[3];                     // geometric normal, same orientation as Embree's
+};
+
+/* 32 bytes, so two nodes share a cache line */
+struct bvhnode_t {
+    float mins[3];
+    int32_t offset;     // interior: index of the second child (the first is this + 1). leaf: first triangle
+    float maxs[3];
+    uint16_t count;     // number of triangles, 0 for interior nodes
+    uint16_t axis;      // split axis of interior nodes, for front-to-back traversal
+};
+
+static const int BVH_MAX_LEAF_TRIS = 8;
+static const int BVH_MAX_DEPTH = 60;
+static const int BVH_NUM_BINS = 16;
+
+/*
+ * Slack on the barycentric coordinates in the triangle test, so rays along
+ * a shared edge can't slip between two triangles. It makes each triangle
+ * slightly bigger than its vertices, so the BVH bounds are padded to match
+ * (see BuildBVH); otherwise whether a ray hits near a node's boundary would
+ * depend on whether the other rays in its packet entered the node.
+ */
+static const float BARYCENTRIC_EPSILON = 1e-5f;
+
+static const mbsp_t *bsp_static;
+
+static std::vector<bvhnode_t> nodes;
+static std::vector<bvhtri_t> tris;
+static std::vector<triinfo_t> triinfos;
+
+/*
+ * ============================================================================
+ * BVH construction
+ * ============================================================================
+ */
+
+struct buildprim_t {
+    float mins[3];
+    float maxs[3];
+    float centroid[3];
+    int index;
+};
+
+static inline float
+BoundsHalfArea(const float mins[3], const float maxs[3])
+{
+    const float dx = maxs[0] - mins[0];
+    const float dy = maxs[1] - mins[1];
+    const float dz = maxs[2] - mins[2];
+    return dx * dy + dy * dz + dz * dx;
+}
+
+static inline void
+BoundsClear(float mins[3], float maxs[3])
+{
+    for (int i=0; i<3; i++) {
+        mins[i] = std::numeric_limits<float>::max();
+        maxs[i] = -std::numeric_limits<float>::max();
+    }
+}
+
+static inline void
+BoundsAdd(float mins[3], float maxs[3], const float addmins[3], const float addmaxs[3])
+{
+    for (int i=0; i<3; i++) {
+        mins[i] = qmin(mins[i], addmins[i]);
+        maxs[i] = qmax(maxs[i], addmaxs[i]);
+    }
+}
+
+static void
+AddTriangle(geomtype_t geomtype, const bsp2_dface_t *face, const modelinfo_t *modelinfo,
+            const vec3_t a, const vec3_t b, const vec3_t c)
+{
+    bvhtri_t tri;
+    triinfo_t info;
+    for (int i=0; i<3; i++) {
+        tri.v0[i] = a[i];
+        tri.e1[i] = b[i] - a[i];
+        tri.e2[i] = c[i] - a[i];
+    }
+
+    // Embree's Ng is cross(v0 - v1, v2 - v0)
+    info.geomtype = geomtype;
+    info.face = face;
+    info.modelinfo = modelinfo;
+    info.Ng[0] = tri.e2[1] * tri.e1[2] - tri.e2[2] * tri.e1[1];
+    info.Ng[1] = tri.e2[2] * tri.e1[0] - tri.e2[0] * tri.e1[2];
+    info.Ng[2] = tri.e2[0] * tri.e1[1] - tri.e2[1] * tri.e1[0];
+
+    tris.push_back(tri);
+    triinfos.push_back(info);
+}
+
+static void
+AddFaces(const mbsp_t *bsp, geomtype_t geomtype, const std::vector<const bsp2_dface_t *> &faces)
+{
+    for (const bsp2_dface_t *face : faces) {
+        if (face->numedges < 3)
+            continue;
+
+        const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
+        const dvertex_t *v0 = &bsp->dvertexes[Face_VertexAtIndex(bsp, face, 0)];
+
+        // same fan as the Embree backend
+        for (int j = 2; j < face->numedges; j++) {
+            const dvertex_t *v1 = &bsp->dvertexes[Face_VertexAtIndex(bsp, face, j-1)];
+            const dvertex_t *v2 = &bsp->dvertexes[Face_VertexAtIndex(bsp, face, j)];
+            AddTriangle(geomtype, face, modelinfo, v1->point, v2->point, v0->point);
+        }
+    }
+}
+
+static void
+AddWindings(const std::vector<winding_t *> &windings)
+{
+    for (const winding_t *winding : windings) {
+        Q_assert(winding->numpoints >= 3);
+        for (int j = 2; j < winding->numpoints; j++) {
+            AddTriangle(geomtype_t::SKIP, nullptr, nullptr, winding->p[j-1], winding->p[j], winding->p[0]);
+        }
+    }
+}
+
+static void
+MakeLeaf(int nodenum, int begin, int end)
+{
+    nodes[nodenum].offset = begin;
+    nodes[nodenum].count = static_cast<uint16_t>(end - begin);
+    nodes[nodenum].axis = 0;
+}
+
+/*
+ * Builds the subtree for prims [begin, end) using a binned surface area
+ * heuristic, falling back to a median split when the bins can't separate
+ * the primitives.
+ */
+static void
+BuildBVH_r(std::vector<buildprim_t> &prims, int begin, int end, int depth)
+{
+    const int nodenum = static_cast<int>(nodes.size());
+    nodes.push_back(bvhnode_t());
+
+    float cmins[3], cmaxs[3];
+    BoundsClear(nodes[nodenum].mins, nodes[nodenum].maxs);
+    BoundsClear(cmins, cmaxs);
+    for (int i=begin; i<end; i++) {
+        BoundsAdd(nodes[nodenum].mins, nodes[nodenum].maxs, prims[i].mins, prims[i].maxs);
+        BoundsAdd(cmins, cmaxs, prims[i].centroid, prims[i].centroid);
+    }
+
+    const int count = end - begin;
+    if (count <= BVH_MAX_LEAF_TRIS) {
+        MakeLeaf(nodenum, begin, end);
+        return;
+    }
+
+    // find the best split over all axes
+    const float leafcost = static_cast<float>(count);
+    float bestcost = std::numeric_limits<float>::max();
+    int bestaxis = -1;
+    int bestsplit = -1;
+
+    for (int axis=0; axis<3; axis++) {
+        const float extent = cmaxs[axis] - cmins[axis];
+        if (extent <= 0)
+            continue;
+        const float scale = BVH_NUM_BINS / extent;
+
+        int bincounts[BVH_NUM_BINS] = {0};
+        float binmins[BVH_NUM_BINS][3], binmaxs[BVH_NUM_BINS][3];
+        for (int b=0; b<BVH_NUM_BINS; b++)
+            BoundsClear(binmins[b], binmaxs[b]);
+
+        for (int i=begin; i<end; i++) {
+            const int b = qmin(BVH_NUM_BINS - 1, static_cast<int>((prims[i].centroid[axis] - cmins[axis]) * scale));
+            bincounts[b]++;
+            BoundsAdd(binmins[b], binmaxs[b], prims[i].mins, prims[i].maxs);
+        }
+
+        // sweep from the right to get the cost of everything right of each split
+        float rightarea[BVH_NUM_BINS];
+        int rightcount[BVH_NUM_BINS];
+        float mins[3], maxs[3];
+        BoundsClear(mins, maxs);
+        int n = 0;
+        for (int b=BVH_NUM_BINS-1; b>0; b--) {
+            BoundsAdd(mins, maxs, binmins[b], binmaxs[b]);
+            n += bincounts[b];
+            rightarea[b] = n ? BoundsHalfArea(mins, maxs) : 0.0f;
+            rightcount[b] = n;
+        }
+
+        BoundsClear(mins, maxs);
+        n = 0;
+        for (int b=0; b<BVH_NUM_BINS-1; b++) {
+            BoundsAdd(mins, maxs, binmins[b], binmaxs[b]);
+            n += bincounts[b];
+            if (n == 0 || rightcount[b+1] == 0)
+                continue;
+            const float cost = n * BoundsHalfArea(mins, maxs) + rightcount[b+1] * rightarea[b+1];
+            if (cost < bestcost) {
+                bestcost = cost;
+                bestaxis = axis;
+                bestsplit = b;
+            }
+        }
+    }
+
+    const float nodearea = BoundsHalfArea(nodes[nodenum].mins, nodes[nodenum].maxs);
+
+    int mid;
+    if (bestaxis == -1) {
+        // all centroids coincide
+        if (count <= 0xffff && depth < BVH_MAX_DEPTH) {
+            MakeLeaf(nodenum, begin, end);
+            return;
+        }
+        bestaxis = 0;
+        mid = begin + count / 2;
+    } else {
+        // traversal cost of ~1 triangle test per node visit
+        if (nodearea > 0 && bestcost / nodearea + 1.0f >= leafcost && count <= 4 * BVH_MAX_LEAF_TRIS) {
+            MakeLeaf(nodenum, begin, end);
+            return;
+        }
+
+        const int axis = bestaxis;
+        const float cmin = cmins[axis];
+        const float scale = BVH_NUM_BINS / (cmaxs[axis] - cmins[axis]);
+        const auto it = std::partition(prims.begin() + begin, prims.begin() + end, [=](const buildprim_t &p) {
+            return qmin(BVH_NUM_BINS - 1, static_cast<int>((p.centroid[axis] - cmin) * scale)) <= bestsplit;
+        });
+        mid = static_cast<int>(it - prims.begin());
+    }
+
+    if (depth >= BVH_MAX_DEPTH && count <= 0xffff) {
+        MakeLeaf(nodenum, begin, end);
+        return;
+    }
+
+    if (mid == begin || mid == end) {
+        mid = begin + count / 2;
+        const int axis = bestaxis;
+        std::nth_element(prims.begin() + begin, prims.begin() + mid, prims.begin() + end, [=](const buildprim_t &a, const buildprim_t &b) {
+            return a.centroid[axis] < b.centroid[axis];
+        });
+    }
+
+    nodes[nodenum].axis = static_cast<uint16_t>(bestaxis);
+    nodes[nodenum].count = 0;
+
+    BuildBVH_r(prims, begin, mid, depth + 1);
+    nodes[nodenum].offset = static_cast<int32_t>(nodes.size());
+    BuildBVH_r(prims, mid, end, depth + 1);
+}
+
+static void
+BuildBVH()
+{
+    std::vector<buildprim_t> prims;
+    prims.resize(tris.size());
+    for (size_t i=0; i<tris.size(); i++) {
+        const bvhtri_t &tri = tris[i];
+        buildprim_t &p = prims[i];
+        for (int j=0; j<3; j++) {
+            const float a = tri.v0[j];
+            const float b = a + tri.e1[j];
+            const float c = a + tri.e2[j];
+            p.mins[j] = qmin(a, qmin(b, c));
+            p.maxs[j] = qmax(a, qmax(b, c));
+            p.centroid[j] = 0.5f * (p.mins[j] + p.maxs[j]);
+
+            // the triangle test accepts u, v >= -eps and u + v <= 1 + eps,
+            // which reaches at most 2 * eps * (|e1| + |e2|) past the
+            // vertices. Add a few ulps for rounding in the slab test.
+            const float pad = 2.0f * BARYCENTRIC_EPSILON * (fabs(tri.e1[j]) + fabs(tri.e2[j]))
+                            + 4.0f * std::numeric_limits<float>::epsilon() * qmax(fabs(p.mins[j]), fabs(p.maxs[j]));
+            p.mins[j] -= pad;
+            p.maxs[j] += pad;
+        }
+        p.index = static_cast<int>(i);
+    }
+
+    nodes.clear();
+    nodes.reserve(2 * (tris.size() / 2 + 1));
+
+    if (prims.empty()) {
+        // make an empty leaf so traversal doesn't need a special case
+        bvhnode_t empty {};
+        nodes.push_back(empty);
+        return;
+    }
+
+    BuildBVH_r(prims, 0, static_cast<int>(prims.size()), 0);
+
+    // store the triangles in leaf order
+    std::vector<bvhtri_t> sortedtris;
+    std::vector<triinfo_t> sortedinfos;
+    sortedtris.reserve(tris.size());
+    sortedinfos.reserve(tris.size());
+    for (const buildprim_t &p : prims) {
+        sortedtris.push_back(tris[p.index]);
+        sortedinfos.push_back(triinfos[p.index]);
+    }
+    tris.swap(sortedtris);
+    triinfos.swap(sortedinfos);
+}
+
+void
+Native_TraceInit(const mbsp_t *bsp)
+{
+    bsp_static = bsp;
+
+    std::vector<const bsp2_dface_t *> skyfaces, solidfaces, filterfaces;
+    std::vector<winding_t *> skipwindings;
+    Trace_ClassifyFaces(bsp, &skyfaces, &solidfaces, &filterfaces, &skipwindings);
+
+    tris.clear();
+    triinfos.clear();
+    AddFaces(bsp, geomtype_t::SKY, skyfaces);
+    AddFaces(bsp, geomtype_t::SOLID, solidfaces);
+    AddFaces(bsp, geomtype_t::FILTER, filterfaces);
+    AddWindings(skipwindings);
+
+    BuildBVH();
+
+    logprint("Native_TraceInit:\n");
+    logprint("\t%d sky faces\n", (int)skyfaces.size());
+    logprint("\t%d solid faces\n", (int)solidfaces.size());
+    logprint("\t%d filtered faces\n", (int)filterfaces.size());
+    logprint("\t%d shadow-casting skip faces\n", (int)skipwindings.size());
+    logprint("\t%d triangles, %d BVH nodes, %s packets of %d rays\n",
+             (int)tris.size(), (int)nodes.size(), LIGHT_SIMD_NAME, NATIVE_PACKET_SIZE);
+
+    FreeWindings(skipwindings);
+}
+
+/*
+ * ============================================================================
+ * Traversal
+ * ============================================================================
+ */
+
+/*
+ * Side effects of rejected filter hits (glass tinting, switchable shadows).
+ * These are collected during traversal, and only applied for hits in front
+ * of the final hit, so the result doesn't depend on traversal order.
+ */
+struct rayeffect_t {
+    int lane;
+    float t;
+    int style;          // nonzero for switchable shadows
+    float opacity;      // glass
+    float color[3];     // glass
+};
+
+struct alignas(32) raypacket_t {
+    float org[3][NATIVE_PACKET_SIZE];
+    float dir[3][NATIVE_PACKET_SIZE];
+    float rdir[3][NATIVE_PACKET_SIZE];
+    float tfar[NATIVE_PACKET_SIZE];
+
+    const modelinfo_t *source[NATIVE_PACKET_SIZE];
+
+    // hit info. hittri is -1 if nothing was hit
+    int hittri[NATIVE_PACKET_SIZE];
+
+    void setRay(int lane, const vec_t *origin, const vec_t *direction, float dist, const modelinfo_t *self) {
+        for (int i=0; i<3; i++) {
+            org[i][lane] = origin[i];
+            dir[i][lane] = direction[i];
+
+            // avoid inf * 0 = NaN in the slab test
+            float d = direction[i];
+            if (fabs(d) < 1e-20f)
+                d = (d < 0) ? -1e-20f : 1e-20f;
+            rdir[i][lane] = 1.0f / d;
+        }
+        tfar[lane] = dist;
+        source[lane] = self;
+        hittri[lane] = -1;
+    }
+
+    void clearLane(int lane) {
+        for (int i=0; i<3; i++) {
+            org[i][lane] = 0;
+            dir[i][lane] = 1;
+            rdir[i][lane] = 1;
+        }
+        tfar[lane] = 0;
+        source[lane] = nullptr;
+        hittri[lane] = -1;
+    }
+};
+
+/*
+ * Same rules as Embree_FilterFuncN. Returns true if the hit is accepted.
+ */
+static bool
+Native_FilterHit(const raypacket_t &packet, int lane, float t, const triinfo_t &info, std::vector<rayeffect_t> *effects)
+{
+    const modelinfo_t *source_modelinfo = packet.source[lane];
+    const modelinfo_t *hit_modelinfo = info.modelinfo;
+    Q_assert(hit_modelinfo != nullptr);
+
+    if (hit_modelinfo->shadowworldonly.boolValue()) {
+        // we hit "_shadowworldonly" "1" geometry. Ignore the hit unless we are from world.
+        if (!source_modelinfo || !source_modelinfo->isWorld()) {
+            return false;
+        }
+    }
+
+    if (hit_modelinfo->shadowself.boolValue()) {
+        // only casts shadows on itself
+        if (source_modelinfo != hit_modelinfo) {
+            return false;
+        }
+    }
+
+    if (hit_modelinfo->switchableshadow.boolValue()) {
+        // we hit a dynamic shadow caster. reject the hit, but store the
+        // info about what we hit.
+        if (effects) {
+            rayeffect_t effect {};
+            effect.lane = lane;
+            effect.t = t;
+            effect.style = hit_modelinfo->switchshadstyle.intValue();
+            effects->push_back(effect);
+        }
+        return false;
+    }
+
+    // test fence textures and glass
+    const bsp2_dface_t *face = info.face;
+    float alpha = hit_modelinfo->alpha.floatValue();
+
+    bool isFence, isGlass;
+    if (bsp_static->loadversion == Q2_BSPVERSION) {
+        const int contents = Face_Contents(bsp_static, face);
+        isFence = ((contents & Q2_SURF_TRANSLUCENT) == Q2_SURF_TRANSLUCENT); // KMQuake 2-specific. Use texture alpha chanel when both flags are set.
+        isGlass = !isFence && (contents & Q2_SURF_TRANSLUCENT);
+        if (isGlass)
+            alpha = (contents & Q2_SURF_TRANS33 ? 0.66f : 0.33f);
+    } else {
+        const char *name = Face_TextureName(bsp_static, face);
+        isFence = (name[0] == '{');
+        isGlass = (alpha < 1.0f);
+    }
+
+    if (!(isFence || isGlass))
+        return true;
+
+    vec3_t hitpoint;
+    for (int i=0; i<3; i++) {
+        hitpoint[i] = packet.org[i][lane] + t * packet.dir[i][lane];
+    }
+    const color_rgba sample = SampleTexture(face, bsp_static, hitpoint);
+
+    if (isGlass) {
+        if (sample.a < 255)
+            alpha = sample.a / 255.0f;
+
+        const float raySurfaceCosAngle = packet.dir[0][lane] * info.Ng[0]
+                                       + packet.dir[1][lane] * info.Ng[1]
+                                       + packet.dir[2][lane] * info.Ng[2];
+
+        // only pick up the color of the glass on the _exiting_ side of the glass.
+        // (we currently trace "backwards", from surface point --> light source)
+        if (raySurfaceCosAngle < 0 && effects) {
+            rayeffect_t effect {};
+            effect.lane = lane;
+            effect.t = t;
+            effect.opacity = alpha;
+            effect.color[0] = sample.r / 255.0f;
+            effect.color[1] = sample.g / 255.0f;
+            effect.color[2] = sample.b / 255.0f;
+            effects->push_back(effect);
+        }
+        return false;
+    }
+
+    // fence
+    return sample.a == 255;
+}
+
+/*
+ * Tests the rays in `active` against triangles [first, first + count), and
+ * returns the lanes that are still active.
+ */
+template<bool occlusion>
+static inline unsigned
+IntersectLeaf(raypacket_t &packet, unsigned active, int first, int count, std::vector<rayeffect_t> *effects)
+{
+    const vfloat ox = vfloat::load(packet.org[0]);
+    const vfloat oy = vfloat::load(packet.org[1]);
+    const vfloat oz = vfloat::load(packet.org[2]);
+    const vfloat dx = vfloat::load(packet.dir[0]);
+    const vfloat dy = vfloat::load(packet.dir[1]);
+    const vfloat dz = vfloat::load(packet.dir[2]);
+    const vfloat zero(0.0f);
+    const vfloat neg_eps(-BARYCENTRIC_EPSILON);
+    const vfloat one_eps(1.0f + BARYCENTRIC_EPSILON);
+
+    for (int k=first; k<first+count; k++) {
+        const bvhtri_t &tri = tris[k];
+        const vfloat e1x(tri.e1[0]), e1y(tri.e1[1]), e1z(tri.e1[2]);
+        const vfloat e2x(tri.e2[0]), e2y(tri.e2[1]), e2z(tri.e2[2]);
+
+        // Moller-Trumbore
+        const vfloat px = dy * e2z - dz * e2y;
+        const vfloat py = dz * e2x - dx * e2z;
+        const vfloat pz = dx * e2y - dy * e2x;
+        const vfloat det = e1x * px + e1y * py + e1z * pz;
+        const vfloat inv = vfloat(1.0f) / det;
+
+        const vfloat sx = ox - vfloat(tri.v0[0]);
+        const vfloat sy = oy - vfloat(tri.v0[1]);
+        const vfloat sz = oz - vfloat(tri.v0[2]);
+        const vfloat u = (sx * px + sy * py + sz * pz) * inv;
+
+        const vfloat qx = sy * e1z - sz * e1y;
+        const vfloat qy = sz * e1x - sx * e1z;
+        const vfloat qz = sx * e1y - sy * e1x;
+        const vfloat v = (dx * qx + dy * qy + dz * qz) * inv;
+        const vfloat t = (e2x * qx + e2y * qy + e2z * qz) * inv;
+
+        const vmask valid = (det != zero) & (u >= neg_eps) & (v >= neg_eps) & ((u + v) <= one_eps)
+                          & (t > zero) & (t < vfloat::load(packet.tfar));
+        unsigned hits = movemask(valid) & active;
+        if (!hits)
+            continue;
+
+        alignas(32) float tvals[NATIVE_PACKET_SIZE];
+        store(tvals, t);
+
+        const triinfo_t &info = triinfos[k];
+        for (int lane=0; hits; lane++, hits >>= 1) {
+            if (!(hits & 1))
+                continue;
+            if (info.geomtype == geomtype_t::FILTER
+                && !Native_FilterHit(packet, lane, tvals[lane], info, effects))
+                continue;
+
+            packet.hittri[lane] = k;
+            if (occlusion) {
+                active &= ~(1u << lane);
+            } else {
+                packet.tfar[lane] = tvals[lane];
+            }
+        }
+
+        if (occlusion && !active)
+            return 0;
+    }
+    return active;
+}
+
+template<bool occlusion>
+static void
+TracePacket(raypacket_t &packet, unsigned active, std::vector<rayeffect_t> *effects)
+{
+    const vfloat ox = vfloat::load(packet.org[0]);
+    const vfloat oy = vfloat::load(packet.org[1]);
+    const vfloat oz = vfloat::load(packet.org[2]);
+    const vfloat rx = vfloat::load(packet.rdir[0]);
+    const vfloat ry = vfloat::load(packet.rdir[1]);
+    const vfloat rz = vfloat::load(packet.rdir[2]);
+    const vfloat zero(0.0f);
+
+    // visit children front to back along the packet's average direction
+    bool negative[3];
+    for (int i=0; i<3; i++) {
+        float sum = 0;
+        for (int lane=0; lane<NATIVE_PACKET_SIZE; lane++) {
+            if (active & (1u << lane))
+                sum += packet.dir[i][lane];
+        }
+        negative[i] = (sum < 0);
+    }
+
+    int stack[BVH_MAX_DEPTH + 32];
+    int sp = 0;
+    int nodenum = 0;
+
+    while (true) {
+        const bvhnode_t &node = nodes[nodenum];
+
+        // slab test
+        const vfloat tx0 = (vfloat(node.mins[0]) - ox) * rx;
+        const vfloat tx1 = (vfloat(node.maxs[0]) - ox) * rx;
+        const vfloat ty0 = (vfloat(node.mins[1]) - oy) * ry;
+        const vfloat ty1 = (vfloat(node.maxs[1]) - oy) * ry;
+        const vfloat tz0 = (vfloat(node.mins[2]) - oz) * rz;
+        const vfloat tz1 = (vfloat(node.maxs[2]) - oz) * rz;
+        const vfloat tmin = vmax(vmax(vmin(tx0, tx1), vmin(ty0, ty1)), vmax(vmin(tz0, tz1), zero));
+        const vfloat tmax = vmin(vmin(vmax(tx0, tx1), vmax(ty0, ty1)), vmin(vmax(tz0, tz1), vfloat::load(packet.tfar)));
+
+        if (movemask(tmin <= tmax) & active) {
+            if (node.count == 0) {
+                int nearchild = nodenum + 1;
+                int farchild = node.offset;
+                if (negative[node.axis])
+                    std::swap(nearchild, farchild);
+                stack[sp++] = farchild;
+                nodenum = nearchild;
+                continue;
+            }
+
+            active = IntersectLeaf<occlusion>(packet, active, node.offset, node.count, effects);
+            if (occlusion && !active)
+                return;
+        }
+
+        if (sp == 0)
+            return;
+        nodenum = stack[--sp];
+    }
+}
+
+static void
+SingleRay(raypacket_t *packet, const vec3_t start, const vec3_t dir, vec_t dist, const modelinfo_t *self)
+{
+    packet->setRay(0, start, dir, dist, self);
+    for (int lane=1; lane<NATIVE_PACKET_SIZE; lane++) {
+        packet->clearLane(lane);
+    }
+}
+
+//public
+qboolean Native_TestLight(const vec3_t start, const vec3_t stop, const modelinfo_t *self)
+{
+    vec3_t dir;
+    VectorSubtract(stop, start, dir);
+    const vec_t dist = VectorNormalize(dir);
+
+    raypacket_t packet;
+    SingleRay(&packet, start, dir, dist, self);
+    TracePacket<true>(packet, 1, nullptr);
+
+    return packet.hittri[0] == -1;
+}
+
+//public
+qboolean Native_TestSky(const vec3_t start, const vec3_t dirn, const modelinfo_t *self)
+{
+    // trace from the sample point towards the sun, and
+    // return true if we hit a sky poly.
+
+    vec3_t dir_normalized;
+    VectorCopy(dirn, dir_normalized);
+    VectorNormalize(dir_normalized);
+
+    raypacket_t packet;
+    SingleRay(&packet, start, dir_normalized, MAX_SKY_DIST, self);
+    TracePacket<false>(packet, 1, nullptr);
+
+    const int hit = packet.hittri[0];
+    return hit != -1 && triinfos[hit].geomtype == geomtype_t::SKY;
+}
+
+//public
+hittype_t Native_DirtTrace(const vec3_t start, const vec3_t dirn, vec_t dist, const modelinfo_t *self, vec_t *hitdist_out, plane_t *hitplane_out, const bsp2_dface_t **face_out)
+{
+    raypacket_t packet;
+    SingleRay(&packet, start, dirn, dist, self);
+    TracePacket<false>(packet, 1, nullptr);
+
+    const int hit = packet.hittri[0];
+    if (hit == -1)
+        return hittype_t::NONE;
+
+    const triinfo_t &info = triinfos[hit];
+
+    if (hitdist_out) {
+        *hitdist_out = packet.tfar[0];
+    }
+    if (hitplane_out) {
+        for (int i=0; i<3; i++) {
+            hitplane_out->normal[i] = info.Ng[i];
+        }
+        VectorNormalize(hitplane_out->normal);
+
+        vec3_t hitpoint;
+        VectorMA(start, packet.tfar[0], dirn, hitpoint);
+
+        hitplane_out->dist = DotProduct(hitplane_out->normal, hitpoint);
+    }
+    if (face_out) {
+        *face_out = info.face;
+    }
+
+    return (info.geomtype == geomtype_t::SKY) ? hittype_t::SKY : hittype_t::SOLID;
+}
+
+/*
+ * ============================================================================
+ * Ray streams
+ * ============================================================================
+ */
+
+class raystream_native_t : public raystream_t {
+private:
+    std::vector<float> _origins;        // 3 per ray
+    std::vector<float> _dirs;           // 3 per ray
+    std::vector<float> _rays_maxdist;
+    std::vector<const modelinfo_t *> _selfs;
+    std::vector<int> _point_indices;
+    std::vector<float> _ray_colors;         // 3 per ray
+    std::vector<float> _ray_normalcontribs; // 3 per ray
+
+    // This is set to the modelinfo's switchshadstyle if the ray hit
+    // a dynamic shadow caster. (note that for rays that hit dynamic
+    // shadow casters, all of the other hit data is assuming the ray went
+    // straight through).
+    std::vector<int> _ray_dynamic_styles;
+
+    // hit info
+    std::vector<int> _hittris;
+    std::vector<float> _hitdists;
+
+    std::vector<rayeffect_t> _effects;
+
+    int _numrays;
+    int _maxrays;
+
+    template<bool occlusion>
+    void tracePushedRays() {
+        for (int first=0; first<_numrays; first+=NATIVE_PACKET_SIZE) {
+            const int count = qmin(NATIVE_PACKET_SIZE, _numrays - first);
+
+            raypacket_t packet;
+            for (int lane=0; lane<NATIVE_PACKET_SIZE; lane++) {
+                if (lane < count) {
+                    const int j = first + lane;
+                    packet.setRay(lane, &_origins[3*j], &_dirs[3*j], _rays_maxdist[j], _selfs[j]);
+                } else {
+                    packet.clearLane(lane);
+                }
+            }
+
+            _effects.clear();
+            TracePacket<occlusion>(packet, PACKET_ALL_LANES >> (NATIVE_PACKET_SIZE - count), &_effects);
+
+            for (int lane=0; lane<count; lane++) {
+                const int j = first + lane;
+                _hittris[j] = packet.hittri[lane];
+                _hitdists[j] = packet.tfar[lane];
+            }
+
+            applyEffects(first, packet);
+        }
+    }
+
+    void applyEffects(int first, const raypacket_t &packet) {
+        float styledist[NATIVE_PACKET_SIZE];
+        for (int lane=0; lane<NATIVE_PACKET_SIZE; lane++) {
+            styledist[lane] = std::numeric_limits<float>::max();
+        }
+
+        for (const rayeffect_t &effect : _effects) {
+            const int lane = effect.lane;
+            const int j = first + lane;
+
+            // ignore anything behind the hit
+            if (packet.hittri[lane] != -1 && effect.t >= packet.tfar[lane])
+                continue;
+
+            if (effect.style) {
+                // keep the nearest dynamic shadow caster
+                if (effect.t < styledist[lane]) {
+                    styledist[lane] = effect.t;
+                    _ray_dynamic_styles[j] = effect.style;
+                }
+                continue;
+            }
+
+            // clamp opacity
+            const float opacity = qmin(qmax(0.0f, effect.opacity), 1.0f);
+
+            // lerp between original ray color and fully tinted, based on opacity
+            for (int i=0; i<3; i++) {
+                float &color = _ray_colors[3*j + i];
+                const float tinted = color * effect.color[i];
+                color = opacity * tinted + (1.0f - opacity) * color;
+            }
+        }
+    }
+
+public:
+    raystream_native_t(int maxRays) :
+        _origins(3 * maxRays),
+        _dirs(3 * maxRays),
+        _rays_maxdist(maxRays),
+        _selfs(maxRays),
+        _point_indices(maxRays),
+        _ray_colors(3 * maxRays),
+        _ray_normalcontribs(3 * maxRays),
+        _ray_dynamic_styles(maxRays),
+        _hittris(maxRays),
+        _hitdists(maxRays),
+        _numrays { 0 },
+        _maxrays { maxRays } {}
+
+    virtual void pushRay(int i, const vec_t *origin, const vec3_t dir, float dist, const modelinfo_t *modelinfo, const vec_t *color = nullptr, const vec_t *normalcontrib = nullptr) {
+        Q_assert(_numrays<_maxrays);
+        for (int k=0; k<3; k++) {
+            _origins[3*_numrays + k] = origin[k];
+            _dirs[3*_numrays + k] = dir[k];
+        }
+        _rays_maxdist[_numrays] = dist;
+        _selfs[_numrays] = modelinfo;
+        _point_indices[_numrays] = i;
+        if (color) {
+            VectorCopy(color, &_ray_colors[3*_numrays]);
+        }
+        if (normalcontrib) {
+            VectorCopy(normalcontrib, &_ray_normalcontribs[3*_numrays]);
+        }
+        _ray_dynamic_styles[_numrays] = 0;
+        _hittris[_numrays] = -1;
+        _hitdists[_numrays] = dist;
+        _numrays++;
+    }
+
+    virtual size_t numPushedRays() {
+        return _numrays;
+    }
+
+    virtual void tracePushedRaysOcclusion() {
+        tracePushedRays<true>();
+    }
+
+    virtual void tracePushedRaysIntersection() {
+        tracePushedRays<false>();
+    }
+
+    virtual bool getPushedRayOccluded(size_t j) {
+        Q_assert(j < static_cast<size_t>(_maxrays));
+        return _hittris[j] != -1;
+    }
+
+    virtual float getPushedRayDist(size_t j) {
+        Q_assert(j < static_cast<size_t>(_maxrays));
+        return _rays_maxdist[j];
+    }
+
+    virtual float getPushedRayHitDist(size_t j) {
+        Q_assert(j < static_cast<size_t>(_maxrays));
+        return _hitdists[j];
+    }
+
+    virtual hittype_t getPushedRayHitType(size_t j) {
+        Q_assert(j < static_cast<size_t>(_maxrays));
+
+        if (_hittris[j] == -1) {
+            return hittype_t::NONE;
+        } else if (triinfos[_hittris[j]].geomtype == geomtype_t::SKY) {
+            return hittype_t::SKY;
+        } else {
+            return hittype_t::SOLID;
+        }
+    }
+
+    virtual const bsp2_dface_t *getPushedRayHitFace(size_t j) {
+        Q_assert(j < static_cast<size_t>(_maxrays));
+
+        if (_hittris[j] == -1)
+            return nullptr;
+
+        return triinfos[_hittris[j]].face;
+    }
+
+    virtual void getPushedRayDir(size_t j, vec3_t out) {
+        Q_assert(j < static_cast<size_t>(_maxrays));
+        for (int i=0; i<3; i++) {
+            out[i] = _dirs[3*j + i];
+        }
+    }
+
+    virtual int getPushedRayPointIndex(size_t j) {
+        Q_assert(j < static_cast<size_t>(_maxrays));
+        return _point_indices[j];
+    }
+
+    virtual void getPushedRayColor(size_t j, vec3_t out) {
+        Q_assert(j < static_cast<size_t>(_maxrays));
+        VectorCopy(&_ray_colors[3*j], out);
+    }
+
+    virtual void getPushedRayNormalContrib(size_t j, vec3_t out) {
+        Q_assert(j < static_cast<size_t>(_maxrays));
+        VectorCopy(&_ray_normalcontribs[3*j], out);
+    }
+
+    virtual int getPushedRayDynamicStyle(size_t j) {
+        Q_assert(j < static_cast<size_t>(_maxrays));
+        return _ray_dynamic_styles[j];
+    }
+
+    virtual void clearPushedRays() {
+        _numrays = 0;
+    }
+};
+
+raystream_t *Native_MakeRayStream(int maxrays)
+{
+    return new raystream_native_t{maxrays};
+}
@@ -270,6 +270,8 @@ NewPlane(const vec3_t normal, const vec_t dist, int *side)
 /*
  * FindPlane
  * - Returns a global plane number and the side that will be the front
+ * - Finding an existing plane doesn't modify the map, so it's safe to do
+ *   concurrently as long as no thread creates new planes
  */
 int
 FindPlane(const vec3_t normal, const vec_t dist, int *side)
@@ -278,14 +280,17 @@ FindPlane(const vec3_t normal, const vec_t dist, int *side)
     VectorCopy(normal, plane.normal);
     plane.dist = dist;
     
-    for (int i : map.planehash[plane_hash_fn(&plane)]) {
-        const qbsp_plane_t &p = map.planes.at(i);
-        if (PlaneEqual(&p, &plane)) {
-            *side = SIDE_FRONT;
-            return i;
-        } else if (PlaneInvEqual(&p, &plane)) {
-            *side = SIDE_BACK;
-            return i;
+    const auto bucket = map.planehash.find(plane_hash_fn(&plane));
+    if (bucket != map.planehash.end()) {
+        for (int i : bucket->second) {
+            const qbsp_plane_t &p = map.planes.at(i);
+            if (PlaneEqual(&p, &plane)) {
+                *side = SIDE_FRONT;
+                return i;
+            } else if (PlaneInvEqual(&p, &plane)) {
+                *side = SIDE_BACK;
+                return i;
+            }
         }
     }
     return NewPlane(plane.normal, plane.dist, side);
@@ -20,8 +20,15 @@
 */
 // csg4.c
 
+#include <common/threads.hh>
 #include <qbsp/qbsp.hh>
 
+#include <algorithm>
+#include <atomic>
+
+/* entities with fewer brushes aren't worth starting threads for */
+#define CSG_THREAD_MIN_BRUSHES 256
+
 /*
 
 NOTES
@@ -30,9 +37,14 @@ Brushes that touch still need to be split at the cut point to make a tjunction
 
 */
 
-static int brushfaces;
-static int csgfaces;
-int csgmergefaces;
+static thread_local int brushfaces;
+static thread_local int csgfaces;
+thread_local int csgmergefaces;
+
+/* the skip texinfo made by BeginSkipTexinfo, -1 when not on several threads */
+static int skiptexinfo = -1;
+static std::atomic<bool> skiptexinfo_used;
+static bool skiptexinfo_new, skipmiptex_new;
 
 /*
 ==================
@@ -45,6 +57,11 @@ MakeSkipTexinfo()
     int texinfo;
     mtexinfo_t mt;
     
+    if (skiptexinfo != -1) {
+        skiptexinfo_used = true;
+        return skiptexinfo;
+    }
+    
     mt.miptex = FindMiptex("skip");
     mt.flags = TEX_SKIP;
     memset(&mt.vecs, 0, sizeof(mt.vecs));
@@ -54,6 +71,54 @@ MakeSkipTexinfo()
     return texinfo;
 }
 
+/*
+==================
+BeginSkipTexinfo
+
+The skip texinfo can't be added while brushes are clipped or clipping
+hulls are built on several threads, as the other threads read
+map.mtexinfos unlocked. So it's made beforehand. Nothing else adds
+texinfos at that stage, so it gets the same number as in a serial build.
+==================
+*/
+void
+BeginSkipTexinfo()
+{
+    Q_assert(skiptexinfo == -1);
+    
+    const int nummiptex = map.nummiptex();
+    const int numtexinfo = map.numtexinfo();
+    
+    skiptexinfo = MakeSkipTexinfo();
+    skiptexinfo_used = false;
+    skipmiptex_new = (map.nummiptex() > nummiptex);
+    skiptexinfo_new = (map.numtexinfo() > numtexinfo);
+}
+
+/*
+==================
+EndSkipTexinfo
+
+Takes the skip texinfo (and texture) out again if BeginSkipTexinfo added
+them and nothing used them, as they wouldn't be in the output
+otherwise.
+==================
+*/
+void
+EndSkipTexinfo()
+{
+    if (!skiptexinfo_used) {
+        if (skiptexinfo_new) {
+            Q_assert(skiptexinfo == map.numtexinfo() - 1);
+            map.mtexinfo_lookup.erase(map.mtexinfos.back());
+            map.mtexinfos.pop_back();
+        }
+        if (skipmiptex_new)
+            map.miptex.pop_back();
+    }
+    skiptexinfo = -1;
+}
+
 /*
 ==================
 NewFaceFromFace
@@ -532,7 +597,6 @@ CopyBrushFaces(const brush_t *brush)
 
     facelist = NULL;
     for (face = brush->faces; face; face = face->next) {
-        brushfaces++;
         newface = (face_t *)AllocMem(FACE, 1, true);
         *newface = *face;
         newface->contents[0] = CONTENTS_EMPTY;
@@ -554,6 +618,247 @@ static bool IsLiquid(int contents)
         || contents == CONTENTS_LAVA
         || contents == CONTENTS_SLIME;
 }
+/*
+==================
+Brush BVH
+
+Bounding volume hierarchy over the brush bounds of an entity, so each brush
+only visits the brushes that can clip it instead of all of them.
+==================
+*/
+#define BVH_LEAF_BRUSHES 4
+
+struct brushbvh_node_t {
+    vec3_t mins, maxs;
+    int first, count;       // leaf: brushes order[first .. first + count)
+    int children[2];        // node
+};
+
+struct brushbvh_t {
+    std::vector<const brush_t *> brushes;   // entity->brushes in list order
+    std::vector<int> order;                 // brush indices, grouped by leaf
+    std::vector<brushbvh_node_t> nodes;     // nodes[0] is the root
+};
+
+static inline bool
+BrushBoundsOverlap(const vec3_t mins1, const vec3_t maxs1, const vec3_t mins2, const vec3_t maxs2)
+{
+    for (int i = 0; i < 3; i++) {
+        if (mins1[i] > maxs2[i])
+            return false;
+        if (maxs1[i] < mins2[i])
+            return false;
+    }
+    return true;
+}
+
+static int
+BrushBVH_Build_r(brushbvh_t *bvh, int first, int count)
+{
+    const int nodenum = bvh->nodes.size();
+    bvh->nodes.push_back(brushbvh_node_t());
+
+    brushbvh_node_t node;
+    vec3_t cmins, cmaxs;
+    ClearBounds(node.mins, node.maxs);
+    ClearBounds(cmins, cmaxs);
+    for (int i = first; i < first + count; i++) {
+        const brush_t *brush = bvh->brushes[bvh->order[i]];
+        vec3_t centre;
+        AddPointToBounds(brush->mins, node.mins, node.maxs);
+        AddPointToBounds(brush->maxs, node.mins, node.maxs);
+        VectorAdd(brush->mins, brush->maxs, centre);
+        AddPointToBounds(centre, cmins, cmaxs);
+    }
+
+    if (count <= BVH_LEAF_BRUSHES) {
+        node.first = first;
+        node.count = count;
+        node.children[0] = node.children[1] = -1;
+    } else {
+        /* median split along the longest axis of the brush centres */
+        int axis = 0;
+        for (int i = 1; i < 3; i++) {
+            if (cmaxs[i] - cmins[i] > cmaxs[axis] - cmins[axis])
+                axis = i;
+        }
+        const int half = count / 2;
+        const brushbvh_t *cbvh = bvh;
+        std::nth_element(bvh->order.begin() + first, bvh->order.begin() + first + half,
+                         bvh->order.begin() + first + count, [cbvh, axis](int a, int b) {
+                             const brush_t *ba = cbvh->brushes[a], *bb = cbvh->brushes[b];
+                             return ba->mins[axis] + ba->maxs[axis] < bb->mins[axis] + bb->maxs[axis];
+                         });
+        node.first = first;
+        node.count = 0;
+        node.children[0] = BrushBVH_Build_r(bvh, first, half);
+        node.children[1] = BrushBVH_Build_r(bvh, first + half, count - half);
+    }
+
+    bvh->nodes[nodenum] = node;
+    return nodenum;
+}
+
+static void
+BrushBVH_Build(brushbvh_t *bvh, const mapentity_t *entity)
+{
+    for (const brush_t *brush = entity->brushes; brush; brush = brush->next) {
+        bvh->order.push_back(bvh->brushes.size());
+        bvh->brushes.push_back(brush);
+    }
+    if (!bvh->brushes.empty())
+        BrushBVH_Build_r(bvh, 0, bvh->brushes.size());
+}
+
+/*
+ * Appends the indices of the brushes whose bounds overlap the given bounds
+ * (by the same test CSGFaces always used), in no particular order.
+ */
+static void
+BrushBVH_Query(const brushbvh_t *bvh, int nodenum, const vec3_t mins, const vec3_t maxs,
+               std::vector<int> *result)
+{
+    const brushbvh_node_t *node = &bvh->nodes[nodenum];
+
+    if (!BrushBoundsOverlap(mins, maxs, node->mins, node->maxs))
+        return;
+
+    if (node->count) {
+        for (int i = node->first; i < node->first + node->count; i++) {
+            const brush_t *brush = bvh->brushes[bvh->order[i]];
+            if (BrushBoundsOverlap(mins, maxs, brush->mins, brush->maxs))
+                result->push_back(bvh->order[i]);
+        }
+        return;
+    }
+    BrushBVH_Query(bvh, node->children[0], mins, maxs, result);
+    BrushBVH_Query(bvh, node->children[1], mins, maxs, result);
+}
+
+struct csgbrushes_t {
+    brushbvh_t bvh;
+    std::vector<face_t *> outside;          // result of ClipBrush for each brush
+};
+
+/*
+==================
+ClipBrush
+
+Returns the faces of brush `brushnum` left after clipping away the parts
+that are inside other brushes.
+==================
+*/
+static face_t *
+ClipBrush(const csgbrushes_t *csg, int brushnum)
+{
+    const brush_t *brush = csg->bvh.brushes[brushnum];
+    face_t *inside, *outside;
+    std::vector<int> clipnums;
+
+    /*
+     * Only brushes whose bounds overlap can clip. Visit them in list order,
+     * which the overwrite rule depends on.
+     */
+    BrushBVH_Query(&csg->bvh, 0, brush->mins, brush->maxs, &clipnums);
+    std::sort(clipnums.begin(), clipnums.end());
+
+    outside = CopyBrushFaces(brush);
+    for (int clipnum : clipnums) {
+        const brush_t *clipbrush = csg->bvh.brushes[clipnum];
+        if (clipnum == brushnum) {
+            continue;
+        }
+        /* Brushes further down the list overried earlier ones */
+        const bool overwrite = (clipnum > brushnum);
+        
+        if (clipbrush->contents == CONTENTS_EMPTY) {
+            /* Ensure hint never clips anything */
+            continue;
+        }
+        
+        if (clipbrush->contents == CONTENTS_DETAIL_ILLUSIONARY
+            && brush->contents != CONTENTS_DETAIL_ILLUSIONARY) {
+            /* CONTENTS_DETAIL_ILLUSIONARY never clips anything but itself */
+            continue;
+        }
+        
+        if (clipbrush->contents == CONTENTS_DETAIL && (clipbrush->cflags & CFLAGS_DETAIL_WALL)
+            && !(brush->contents == CONTENTS_DETAIL && (brush->cflags & CFLAGS_DETAIL_WALL))) {
+            /* if clipbrush has CONTENTS_DETAIL and CFLAGS_DETAIL_WALL are set,
+               only clip other brushes with both CONTENTS_DETAIL and CFLAGS_DETAIL_WALL.
+             */
+            continue;
+        }
+        
+        if (clipbrush->contents == CONTENTS_DETAIL_FENCE
+            && brush->contents != CONTENTS_DETAIL_FENCE) {
+            /* CONTENTS_DETAIL_FENCE never clips anything but itself */
+            continue;
+        }
+        
+        if (clipbrush->contents == brush->contents
+            && (clipbrush->cflags & CFLAGS_NO_CLIPPING_SAME_TYPE)) {
+            /* _noclipfaces key */
+            continue;
+        }
+
+        /*
+         * TODO - optimise by checking for opposing planes?
+         *  => brushes can't intersect
+         */
+
+        // divide faces by the planes of the new brush
+        inside = outside;
+        outside = NULL;
+
+        RemoveOutsideFaces(clipbrush, &inside, &outside);
+        const face_t *clipface = clipbrush->faces;
+        for (; clipface; clipface = clipface->next)
+            ClipInside(clipface, overwrite, &inside, &outside);
+        
+        // inside = parts of `brush` that are inside `clipbrush`
+        // outside = parts of `brush` that are outside `clipbrush`
+        
+        /*
+         * If the brush is solid and the clipbrush is not, then we need to
+         * keep the inside faces and set the outside contents to those of
+         * the clipbrush. Otherwise, these inside surfaces are hidden and
+         * should be discarded.
+         */
+        if ((brush->contents == CONTENTS_SOLID && clipbrush->contents != CONTENTS_SOLID)
+            || (brush->contents == CONTENTS_SKY && (clipbrush->contents != CONTENTS_SOLID
+                                                    && clipbrush->contents != CONTENTS_SKY))
+            || (brush->contents == CONTENTS_DETAIL && (clipbrush->contents != CONTENTS_SOLID
+                                                       && clipbrush->contents != CONTENTS_SKY
+                                                       && clipbrush->contents != CONTENTS_DETAIL))
+            || (IsLiquid(brush->contents)          && clipbrush->contents == CONTENTS_DETAIL_ILLUSIONARY)
+            || (brush->contents == CONTENTS_DETAIL_ILLUSIONARY && IsLiquid(clipbrush->contents))
+            || (brush->contents == CONTENTS_DETAIL_FENCE && IsLiquid(clipbrush->contents)))
+        {
+            SaveInsideFaces(inside, clipbrush, &outside);
+        } else {
+            FreeFaces(inside);
+        }
+    }
+
+    return outside;
+}
+
+static void *
+ClipBrushThread(void *arg)
+{
+    csgbrushes_t *csg = static_cast<csgbrushes_t *>(arg);
+
+    while (1) {
+        const int i = GetThreadWork();
+        if (i == -1)
+            break;
+        csg->outside[i] = ClipBrush(csg, i);
+    }
+
+    return NULL;
+}
+
 /*
 ==================
 CSGFaces
@@ -564,13 +869,9 @@ Returns a list of surfaces containing all of the faces
 surface_t *
 CSGFaces(const mapentity_t *entity)
 {
-    int i;
-    const brush_t *brush, *clipbrush;
-    const face_t *clipface;
-    face_t *inside, *outside;
-    bool overwrite, mirror;
+    const brush_t *brush;
+    bool mirror;
     surface_t *surfaces;
-    int progress = 0;
 
     Message(msgProgress, "CSGFaces");
 
@@ -584,101 +885,32 @@ CSGFaces(const mapentity_t *entity)
     }
 #endif
     
+    csgbrushes_t csg;
+    BrushBVH_Build(&csg.bvh, entity);
+    
     /*
      * For each brush, clip away the parts that are inside other brushes.
      * Solid brushes override non-solid brushes.
-     *   brush     => the brush to be clipped
-     *   clipbrush => the brush we are clipping against
+     *
+     * Brushes are clipped independently, so large entities are done on
+     * all threads (unless we're already on one, building a clipping hull).
+     * The results are saved to the plane list in brush order, because
+     * merging faces depends on the order.
      */
-    for (brush = entity->brushes; brush; brush = brush->next) {
-        outside = CopyBrushFaces(brush);
-        overwrite = false;
-        clipbrush = entity->brushes;
-        for (; clipbrush; clipbrush = clipbrush->next) {
-            if (brush == clipbrush) {
-                /* Brushes further down the list overried earlier ones */
-                overwrite = true;
-                continue;
-            }
-            if (clipbrush->contents == CONTENTS_EMPTY) {
-                /* Ensure hint never clips anything */
-                continue;
-            }
-            
-            if (clipbrush->contents == CONTENTS_DETAIL_ILLUSIONARY
-                && brush->contents != CONTENTS_DETAIL_ILLUSIONARY) {
-                /* CONTENTS_DETAIL_ILLUSIONARY never clips anything but itself */
-                continue;
-            }
-            
-            if (clipbrush->contents == CONTENTS_DETAIL && (clipbrush->cflags & CFLAGS_DETAIL_WALL)
-                && !(brush->contents == CONTENTS_DETAIL && (brush->cflags & CFLAGS_DETAIL_WALL))) {
-                /* if clipbrush has CONTENTS_DETAIL and CFLAGS_DETAIL_WALL are set,
-                   only clip other brushes with both CONTENTS_DETAIL and CFLAGS_DETAIL_WALL.
-                 */
-                continue;
-            }
-            
-            if (clipbrush->contents == CONTENTS_DETAIL_FENCE
-                && brush->contents != CONTENTS_DETAIL_FENCE) {
-                /* CONTENTS_DETAIL_FENCE never clips anything but itself */
-                continue;
-            }
-            
-            if (clipbrush->contents == brush->contents
-                && (clipbrush->cflags & CFLAGS_NO_CLIPPING_SAME_TYPE)) {
-                /* _noclipfaces key */
-                continue;
-            }
-
-            /* check bounding box first */
-            for (i = 0; i < 3; i++) {
-                if (brush->mins[i] > clipbrush->maxs[i])
-                    break;
-                if (brush->maxs[i] < clipbrush->mins[i])
-                    break;
-            }
-            if (i < 3)
-                continue;
-
-            /*
-             * TODO - optimise by checking for opposing planes?
-             *  => brushes can't intersect
-             */
-
-            // divide faces by the planes of the new brush
-            inside = outside;
-            outside = NULL;
-
-            RemoveOutsideFaces(clipbrush, &inside, &outside);
-            clipface = clipbrush->faces;
-            for (; clipface; clipface = clipface->next)
-                ClipInside(clipface, overwrite, &inside, &outside);
-            
-            // inside = parts of `brush` that are inside `clipbrush`
-            // outside = parts of `brush` that are outside `clipbrush`
-            
-            /*
-             * If the brush is solid and the clipbrush is not, then we need to
-             * keep the inside faces and set the outside contents to those of
-             * the clipbrush. Otherwise, these inside surfaces are hidden and
-             * should be discarded.
-             */
-            if ((brush->contents == CONTENTS_SOLID && clipbrush->contents != CONTENTS_SOLID)
-                || (brush->contents == CONTENTS_SKY && (clipbrush->contents != CONTENTS_SOLID
-                                                        && clipbrush->contents != CONTENTS_SKY))
-                || (brush->contents == CONTENTS_DETAIL && (clipbrush->contents != CONTENTS_SOLID
-                                                           && clipbrush->contents != CONTENTS_SKY
-                                                           && clipbrush->contents != CONTENTS_DETAIL))
-                || (IsLiquid(brush->contents)          && clipbrush->contents == CONTENTS_DETAIL_ILLUSIONARY)
-                || (brush->contents == CONTENTS_DETAIL_ILLUSIONARY && IsLiquid(clipbrush->contents))
-                || (brush->contents == CONTENTS_DETAIL_FENCE && IsLiquid(clipbrush->contents)))
-            {
-                SaveInsideFaces(inside, clipbrush, &outside);
-            } else {
-                FreeFaces(inside);
-            }
-        }
+    const int numbrushes = csg.bvh.brushes.size();
+    const bool threaded = numthreads > 1 && numbrushes >= CSG_THREAD_MIN_BRUSHES && !ThreadsActive();
+    if (threaded) {
+        csg.outside.resize(numbrushes);
+        BeginSkipTexinfo();
+        RunThreadsOn(0, numbrushes, ClipBrushThread, &csg);
+    }
+    
+    for (int i = 0; i < numbrushes; i++) {
+        brush = csg.bvh.brushes[i];
+        face_t *outside = threaded ? csg.outside[i] : ClipBrush(&csg, i);
+        
+        for (const face_t *face = brush->faces; face; face = face->next)
+            brushfaces++;
 
         /*
          * All of the faces left on the outside list are real surface faces
@@ -687,9 +919,11 @@ CSGFaces(const mapentity_t *entity)
         mirror = options.fContentHack ? true : (brush->contents != CONTENTS_SOLID);
         SaveFacesToPlaneList(outside, mirror, planefaces);
 
-        progress++;
-        Message(msgPercent, progress, entity->numbrushes);
+        if (!threaded)
+            Message(msgPercent, i + 1, entity->numbrushes);
     }
+    if (threaded)
+        EndSkipTexinfo();
 
     surfaces = BuildSurfaces(planefaces);
 
@@ -19,12 +19,19 @@
     See file, 'COPYING', for details.
 */
 
+#include <common/threads.hh>
 #include <qbsp/qbsp.hh>
 
 #include <vector>
 #include <set>
 #include <list>
 #include <utility>
+#include <mutex>
+
+/* the lowest clipping hull's leak while they're filled concurrently, see WritePendingLeak */
+static std::mutex pendingleak_lock;
+static int pendingleak_hullnum;
+static std::vector<vec_t> pendingleak;
 
 /*
 ===========
@@ -215,26 +222,68 @@ WriteLeakTrail(FILE *leakfile, const vec3_t point1, const vec3_t point2)
     }
 }
 
-static void
-WriteLeakLine(const std::pair<std::vector<portal_t *>, node_t*> &leakline)
+/*
+===============
+LeakLinePoints
+
+The points of the leak line, from the entity out, three coordinates each
+===============
+*/
+static std::vector<vec_t>
+LeakLinePoints(const std::pair<std::vector<portal_t *>, node_t*> &leakline)
 {
-    FILE *ptsfile = InitPtsFile();
-    
-    vec3_t prevpt, currpt;
-    VectorCopy(leakline.second->occupant->origin, prevpt);
+    std::vector<vec_t> points(leakline.second->occupant->origin, leakline.second->occupant->origin + 3);
     
     for (auto it = leakline.first.rbegin(); it != leakline.first.rend(); ++it) {
-        portal_t *portal = *it;
-        MidpointWinding(portal->winding, currpt);
-        
-        // draw dots from prevpt to currpt
-        WriteLeakTrail(ptsfile, prevpt, currpt);
-        
-        VectorCopy(currpt, prevpt);
+        vec3_t midpoint;
+        MidpointWinding((*it)->winding, midpoint);
+        points.insert(points.end(), midpoint, midpoint + 3);
     }
     
+    return points;
+}
+
+static void
+WriteLeakLine(const std::vector<vec_t> &points)
+{
+    FILE *ptsfile = InitPtsFile();
+    
+    // draw dots from each point to the next
+    for (size_t i = 3; i < points.size(); i += 3)
+        WriteLeakTrail(ptsfile, &points[i - 3], &points[i]);
+    
     fclose(ptsfile);
     Message(msgLiteral, "Leak file written to %s\n", options.szBSPName);
+    map.leakfile = true;
+
+    /* Get rid of the .prt file since the map has a leak */
+    StripExtension(options.szBSPName);
+    strcat(options.szBSPName, ".prt");
+    remove(options.szBSPName);
+    
+    if (options.fLeakTest) {
+        logprint("Aborting because -leaktest was used.\n");
+        exit(1);
+    }
+}
+
+/*
+===============
+WritePendingLeak
+
+Writes the leak kept while the clipping hulls were filled concurrently,
+which is the one filling them in order would have written.
+===============
+*/
+void
+WritePendingLeak(void)
+{
+    if (pendingleak.empty())
+        return;
+    
+    if (!map.leakfile)
+        WriteLeakLine(pendingleak);
+    pendingleak.clear();
 }
 
 /*
@@ -437,22 +486,20 @@ FillOutside(node_t *node, const int hullnum)
         
         const vec_t *origin = leakentity->origin;
         Message(msgWarning, warnMapLeak, origin[0], origin[1], origin[2]);
-        if (map.leakfile)
-            return false;
-        
-        WriteLeakLine(leakline);
-        map.leakfile = true;
 
-        /* Get rid of the .prt file since the map has a leak */
-        StripExtension(options.szBSPName);
-        strcat(options.szBSPName, ".prt");
-        remove(options.szBSPName);
-        
-        if (options.fLeakTest) {
-            logprint("Aborting because -leaktest was used.\n");
-            exit(1);
+        /* clipping hulls may be filled concurrently; keep the lowest one's */
+        if (ThreadsActive()) {
+            std::lock_guard<std::mutex> lock(pendingleak_lock);
+            if (pendingleak.empty() || hullnum < pendingleak_hullnum) {
+                pendingleak = LeakLinePoints(leakline);
+                pendingleak_hullnum = hullnum;
+            }
+            return false;
         }
         
+        if (!map.leakfile)
+            WriteLeakLine(LeakLinePoints(leakline));
+        
         return false;
     }
 
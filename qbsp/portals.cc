@@ -22,7 +22,7 @@
 
 #include <qbsp/qbsp.hh>
 
-node_t outside_node;    // portals outside the world face this
+thread_local node_t outside_node;    // portals outside the world face this
 
 class portal_state_t {
 public:
@@ -381,6 +381,51 @@ RemovePortalFromNode(portal_t *portal, node_t *l)
 }
 
 
+/*
+================
+HeadnodePlane
+
+Plane n of the box padded around the entity bounds, in the order
+MakeHeadnodePortals creates them
+================
+*/
+static void
+HeadnodePlane(const mapentity_t *entity, int n, qbsp_plane_t *pl)
+{
+    const int i = n % 3;
+
+    // pad with some space so there will never be null volume leafs
+    memset(pl, 0, sizeof(*pl));
+    if (n >= 3) {
+        pl->normal[i] = -1;
+        pl->dist = -(entity->maxs[i] + SIDESPACE);
+    } else {
+        pl->normal[i] = 1;
+        pl->dist = entity->mins[i] - SIDESPACE;
+    }
+}
+
+/*
+================
+FindHeadnodePlanes
+
+Adds the headnode portal planes to map.planes ahead of PortalizeWorld, so
+the clipping hulls can be portalized concurrently without creating planes.
+================
+*/
+void
+FindHeadnodePlanes(const mapentity_t *entity)
+{
+    qbsp_plane_t pl;
+    int i, j, side;
+
+    for (i = 0; i < 3; i++)
+        for (j = 0; j < 2; j++) {
+            HeadnodePlane(entity, j * 3 + i, &pl);
+            FindPlane(pl.normal, pl.dist, &side);
+        }
+}
+
 /*
 ================
 MakeHeadnodePortals
@@ -391,18 +436,11 @@ The created portals will face the global outside_node
 static void
 MakeHeadnodePortals(const mapentity_t *entity, node_t *node)
 {
-    vec3_t bounds[2];
     int i, j, n;
     portal_t *p, *portals[6];
     qbsp_plane_t bplanes[6], *pl;
     int side;
 
-    // pad with some space so there will never be null volume leafs
-    for (i = 0; i < 3; i++) {
-        bounds[0][i] = entity->mins[i] - SIDESPACE;
-        bounds[1][i] = entity->maxs[i] + SIDESPACE;
-    }
-
     outside_node.contents = CONTENTS_SOLID;
     outside_node.portals = NULL;
 
@@ -414,14 +452,7 @@ MakeHeadnodePortals(const mapentity_t *entity, node_t *node)
             portals[n] = p;
 
             pl = &bplanes[n];
-            memset(pl, 0, sizeof(*pl));
-            if (j) {
-                pl->normal[i] = -1;
-                pl->dist = -bounds[j][i];
-            } else {
-                pl->normal[i] = 1;
-                pl->dist = bounds[j][i];
-            }
+            HeadnodePlane(entity, n, pl);
             p->planenum = FindPlane(pl->normal, pl->dist, &side);
 
             p->winding = BaseWindingForPlane(pl);
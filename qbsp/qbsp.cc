@@ -22,6 +22,7 @@
 #include <string.h>
 
 #include <common/log.hh>
+#include <common/threads.hh>
 #include <qbsp/qbsp.hh>
 #include <qbsp/wad.hh>
 
@@ -33,27 +34,28 @@ options_t options;
 
 /*
 ===============
-ProcessEntity
+LoadEntity
+
+Loads the brushes of the entity for the given hull. Returns false if the
+entity has no geometry of its own.
 ===============
 */
-void
-ProcessEntity(mapentity_t *entity, const int hullnum)
+static bool
+LoadEntity(mapentity_t *entity, const int hullnum)
 {
-    int i, firstface;
-    surface_t *surfs;
-    node_t *nodes;
+    int i;
     
     /* No map brushes means non-bmodel entity.
        We need to handle worldspawn containing no brushes, though. */
     if (!entity->nummapbrushes && entity != pWorldEnt())
-        return;
+        return false;
     
     /*
      * func_group and func_detail entities get their brushes added to the
      * worldspawn
      */
     if (IsWorldBrushEntity(entity))
-        return;
+        return false;
 
     if (entity != pWorldEnt()) {
         char mod[20];
@@ -148,36 +150,74 @@ ProcessEntity(mapentity_t *entity, const int hullnum)
         PrintEntity(entity);
         Error("Entity with no valid brushes");
     }
+    
+    return true;
+}
 
-    /*
-     * Take the brush_t's and clip off all overlapping and contained faces,
-     * leaving a perfect skin of the model with no hidden faces
-     */
-    surfs = CSGFaces(entity);
+/*
+===============
+BuildClipHull
+
+Builds the clipping hull node tree from the loaded brushes. Only reads the
+shared map data, so separate hulls and entities may be built concurrently.
+===============
+*/
+static node_t *
+BuildClipHull(const mapentity_t *entity, bool world, const int hullnum)
+{
+    surface_t *surfs;
+    node_t *nodes;
     
-    if (options.fObjExport && entity == pWorldEnt() && hullnum == 0) {
-        ExportObj_Surfaces("post_csg", surfs);
+    surfs = CSGFaces(entity);
+    nodes = SolidBSP(entity, surfs, true);
+    if (world && !options.fNofill) {
+        // assume non-world bmodels are simple
+        PortalizeWorld(entity, nodes, hullnum);
+        if (FillOutside(nodes, hullnum)) {
+            // Free portals before regenerating new nodes
+            FreeAllPortals(nodes);
+            surfs = GatherNodeFaces(nodes);
+            // make a really good tree
+            nodes = SolidBSP(entity, surfs, false);
+            
+            DetailToSolid(nodes);
+        }
     }
     
+    return nodes;
+}
+
+/*
+===============
+ProcessEntity
+===============
+*/
+void
+ProcessEntity(mapentity_t *entity, const int hullnum)
+{
+    int firstface;
+    surface_t *surfs;
+    node_t *nodes;
+    
+    if (!LoadEntity(entity, hullnum))
+        return;
+    
     if (hullnum != 0) {
-        nodes = SolidBSP(entity, surfs, true);
-        if (entity == pWorldEnt() && !options.fNofill) {
-            // assume non-world bmodels are simple
-            PortalizeWorld(entity, nodes, hullnum);
-            if (FillOutside(nodes, hullnum)) {
-                // Free portals before regenerating new nodes
-                FreeAllPortals(nodes);
-                surfs = GatherNodeFaces(nodes);
-                // make a really good tree
-                nodes = SolidBSP(entity, surfs, false);
-                
-                DetailToSolid(nodes);
-            }
-        }
+        nodes = BuildClipHull(entity, entity == pWorldEnt(), hullnum);
         AllocBSPPlanes();
         AllocBSPTexinfo();
         ExportClipNodes(entity, nodes, hullnum);
     } else {
+        /*
+         * Take the brush_t's and clip off all overlapping and contained faces,
+         * leaving a perfect skin of the model with no hidden faces
+         */
+        surfs = CSGFaces(entity);
+        
+        if (options.fObjExport && entity == pWorldEnt()) {
+            ExportObj_Surfaces("post_csg", surfs);
+        }
+        
         /*
          * SolidBSP generates a node tree
          *
@@ -243,6 +283,9 @@ ProcessEntity(mapentity_t *entity, const int hullnum)
     }
 
     FreeBrushes(entity);
+
+    /* everything pooled for this entity has been exported */
+    FreeMemPools();
     
     map.cTotal[LUMP_MODELS]++;
 }
@@ -545,6 +588,105 @@ CreateSingleHull(const int hullnum)
     }
 }
 
+/* one entity in one clipping hull, built by CreateClipHulls */
+struct cliphull_t {
+    int hullnum;
+    int entnum;
+    mapentity_t entity;     // copy of the entity holding this hull's brushes
+    node_t *nodes;
+};
+
+static std::vector<cliphull_t> cliphulls;
+
+static void *
+ClipHullThread(void *arg)
+{
+    while (1) {
+        const int i = GetThreadWork();
+        if (i == -1)
+            break;
+
+        cliphull_t *hull = &cliphulls.at(i);
+        hull->nodes = BuildClipHull(&hull->entity, hull->entnum == 0, hull->hullnum);
+        FreeBrushes(&hull->entity);
+    }
+
+    return NULL;
+}
+
+/*
+=================
+CreateClipHulls
+
+Builds the given clipping hulls for all entities on multiple threads. The
+output is the same as from calling CreateSingleHull on each in turn:
+
+- Brushes are loaded serially in the original order, so new planes get the
+  same numbers. The headnode portal planes are added at the same point, so
+  the threads only ever look up existing planes.
+- The skip texinfo CSG may need is made beforehand (see BeginSkipTexinfo).
+- The node trees are built concurrently.
+- A leak is written afterwards, from the lowest hull that leaked.
+- Clipnodes are exported serially in the original order.
+- The pools are released once all of them have been exported.
+=================
+*/
+static void
+CreateClipHulls(const std::vector<int> &hullnums)
+{
+    std::vector<float> cost;
+
+    for (int hullnum : hullnums) {
+        Message(msgLiteral, "Processing hull %d...\n", hullnum);
+        map.cTotal[LUMP_MODELS] = 0;
+
+        for (int i = 0; i < map.numentities(); i++) {
+            mapentity_t *entity = &map.entities.at(i);
+
+            if (LoadEntity(entity, hullnum)) {
+                cliphull_t hull;
+                hull.hullnum = hullnum;
+                hull.entnum = i;
+                hull.entity = *entity;
+                hull.nodes = NULL;
+                cliphulls.push_back(hull);
+
+                /* CSG is roughly quadratic in the brush count */
+                cost.push_back((float)entity->numbrushes * entity->numbrushes);
+                entity->brushes = NULL;
+
+                if (entity == pWorldEnt() && !options.fNofill)
+                    FindHeadnodePlanes(entity);
+
+                map.cTotal[LUMP_MODELS]++;
+            }
+            if (!options.fAllverbose)
+                options.fVerbose = false;   // don't print rest of entities
+        }
+    }
+
+    /* the thread progress replaces the per-stage percentages */
+    const bool nopercent = options.fNopercent;
+    const int numplanes = map.numplanes();
+
+    Message(msgLiteral, "Building %d clipping hull models...\n", (int)cliphulls.size());
+    options.fNopercent = true;
+    BeginSkipTexinfo();
+    RunThreadsOnWithCost(0, cliphulls.size(), cost.data(), ClipHullThread, NULL);
+    EndSkipTexinfo();
+    WritePendingLeak();
+    options.fNopercent = nopercent;
+    Q_assert(map.numplanes() == numplanes);
+
+    for (cliphull_t &hull : cliphulls) {
+        AllocBSPPlanes();
+        AllocBSPTexinfo();
+        ExportClipNodes(&map.entities.at(hull.entnum), hull.nodes, hull.hullnum);
+    }
+    cliphulls.clear();
+    FreeMemPools();
+}
+
 /*
 =================
 CreateHulls
@@ -554,7 +696,8 @@ CreateHulls
 void
 CreateHulls(void)
 {
-    /* create the hulls sequentially */
+    std::vector<int> hullnums;
+
     if (!options.fNoverbose)
         options.fVerbose = true;
 
@@ -564,15 +707,24 @@ CreateHulls(void)
     if (options.fNoclip)
         return;
 
-    CreateSingleHull(1);
-    CreateSingleHull(2);
+    hullnums.push_back(1);
+    hullnums.push_back(2);
 
     if (options.hexen2)
     {   /*note: h2mp doesn't use hull 2 automatically, however gamecode can explicitly set ent.hull=3 to access it*/
-        CreateSingleHull(3);
-        CreateSingleHull(4);
-        CreateSingleHull(5);
+        hullnums.push_back(3);
+        hullnums.push_back(4);
+        hullnums.push_back(5);
+    }
+
+    /* the clipping hulls are independent, so build them concurrently */
+    if (numthreads > 1) {
+        CreateClipHulls(hullnums);
+        return;
     }
+
+    for (int hullnum : hullnums)
+        CreateSingleHull(hullnum);
 }
 
 wad_t *wadlist = NULL;
@@ -680,6 +832,7 @@ PrintOptions(void)
            "   -nooldaxis      Uses alternate texture alignment which was default in tyrutils-ericw v0.15.1 and older\n"
            "   -forcegoodtree  Force use of expensive processing for SolidBSP stage\n"
            "   -nopercent      Prevents output of percent completion information\n"
+           "   -threads   [n]  Number of threads to use (default: all CPUs)\n"
            "   -hexen2         Generate a BSP compatible with hexen2 engines\n"
            "   -wrbrushes      (bspx) Includes a list of brushes for brush-based collision\n"
            "   -wrbrushesonly  -wrbrushes with -noclip\n"
@@ -837,6 +990,14 @@ ParseOptions(char *szOptions)
                     Error("Invalid argument to option %s", szTok);
                 options.dxLeakDist = atoi(szTok2);
                 szTok = szTok2;
+            } else if (!Q_strcasecmp(szTok, "threads")) {
+                szTok2 = GetTok(szTok + strlen(szTok) + 1, szEnd);
+                if (!szTok2)
+                    Error("Invalid argument to option %s", szTok);
+                numthreads = atoi(szTok2);
+                if (numthreads < 1)
+                    Error("Invalid thread count %d", numthreads);
+                szTok = szTok2;
             } else if (!Q_strcasecmp(szTok, "subdivide")) {
                 szTok2 = GetTok(szTok + strlen(szTok) + 1, szEnd);
                 if (!szTok2)
@@ -942,6 +1103,8 @@ InitQBSP(int argc, const char **argv)
     char *szBuf;
     int length;
 
+    numthreads = GetDefaultThreads();
+
     length = LoadFile("qbsp.ini", &szBuf, false);
     if (length) {
         Message(msgLiteral, "Loading options from qbsp.ini\n");
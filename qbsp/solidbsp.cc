@@ -21,20 +21,22 @@
 
 #include <limits.h>
 
+#include <common/threads.hh>
 #include <qbsp/qbsp.hh>
 
-int splitnodes;
+/* per-thread, since the clipping hulls are built concurrently */
+thread_local int splitnodes;
 
-static int leaffaces;
-static int nodefaces;
-static int c_solid, c_empty, c_water, c_detail, c_detail_illusionary, c_detail_fence;
-static int c_illusionary_visblocker;
-static bool usemidsplit;
+static thread_local int leaffaces;
+static thread_local int nodefaces;
+static thread_local int c_solid, c_empty, c_water, c_detail, c_detail_illusionary, c_detail_fence;
+static thread_local int c_illusionary_visblocker;
+static thread_local bool usemidsplit;
 
 /**
  * Total number of surfaces in the map
  */
-static int mapsurfaces;
+static thread_local int mapsurfaces;
 
 //============================================================================
 
@@ -160,6 +162,50 @@ FaceSide(const face_t *in, const qbsp_plane_t *split)
     return ret;
 }
 
+/*
+==================
+SurfaceSide
+
+Conservative whole-surface version of FaceSide, using the surface
+bounds. Only returns SIDE_ON if some face of the surface might be
+split by the plane; SIDE_FRONT/SIDE_BACK mean none of them can be.
+==================
+*/
+static int
+SurfaceSide(const surface_t *surf, const qbsp_plane_t *split)
+{
+    vec_t front, back;
+    int i;
+
+    if (split->type < 3) {
+        front = surf->maxs[split->type] - split->dist;
+        back = surf->mins[split->type] - split->dist;
+    } else {
+        front = back = -split->dist;
+        for (i = 0; i < 3; i++) {
+            if (split->normal[i] >= 0) {
+                front += split->normal[i] * surf->maxs[i];
+                back += split->normal[i] * surf->mins[i];
+            } else {
+                front += split->normal[i] * surf->mins[i];
+                back += split->normal[i] * surf->maxs[i];
+            }
+        }
+    }
+
+    /*
+     * FaceSide needs points beyond ON_EPSILON on both sides; half an
+     * epsilon of slack keeps this test safe against rounding in the
+     * box corner dot products.
+     */
+    if (back >= -ON_EPSILON * 0.5)
+        return SIDE_FRONT;
+    if (front <= ON_EPSILON * 0.5)
+        return SIDE_BACK;
+
+    return SIDE_ON;
+}
+
 /*
  * Split a bounding box by a plane; The front and back bounds returned
  * are such that they completely contain the portion of the input box
@@ -367,22 +413,116 @@ ChooseMidPlaneFromList(surface_t *surfaces, vec3_t mins, vec3_t maxs)
 
 
 
+/*
+==================
+CountPlaneSplits
+
+Counts the faces the surface's plane would split in the other surfaces,
+giving up once there are more than minsplits. Returns INT_MAX if the
+plane would split a hint face without being a hint itself.
+==================
+*/
+static int
+CountPlaneSplits(const surface_t *surf, const surface_t *surfaces, int minsplits)
+{
+    const qbsp_plane_t *plane, *plane2;
+    const surface_t *surf2;
+    const face_t *face;
+    bool hintsplit;
+    int splits;
+
+    /* check whether this is a hint split */
+    hintsplit = false;
+    for (face = surf->faces; face; face = face->next) {
+        if (map.mtexinfos.at(face->texinfo).flags & TEX_HINT)
+            hintsplit = true;
+    }
+
+    plane = &map.planes[surf->planenum];
+    splits = 0;
+
+    for (surf2 = surfaces; surf2; surf2 = surf2->next) {
+        if (surf2 == surf || surf2->onnode)
+            continue;
+        plane2 = &map.planes[surf2->planenum];
+        if (plane->type < 3 && plane->type == plane2->type)
+            continue;
+        /* Cheap reject of surfaces entirely on one side */
+        if (SurfaceSide(surf2, plane) != SIDE_ON)
+            continue;
+        for (face = surf2->faces; face; face = face->next) {
+            const uint64_t flags = map.mtexinfos.at(face->texinfo).flags;
+            /* Don't penalize for splitting skip faces */
+            if (flags & TEX_SKIP)
+                continue;
+            if (FaceSide(face, plane) == SIDE_ON) {
+                /* Never split a hint face except with a hint */
+                if (!hintsplit && (flags & TEX_HINT))
+                    return INT_MAX;
+                splits++;
+                if (splits >= minsplits)
+                    break;
+            }
+        }
+        if (splits > minsplits)
+            break;
+    }
+
+    return splits;
+}
+
+/*
+ * Nodes with at least this many candidate planes have them scored on all
+ * threads, PLANE_BATCH per thread at a time.
+ */
+#define PARALLEL_PLANES 64
+#define PLANE_BATCH 4
+
+struct planescoring_t {
+    const surface_t *surfaces;
+    const surface_t *const *candidates;
+    int minsplits;
+    int *splits;
+};
+
+static void *
+CountPlaneSplitsThread(void *arg)
+{
+    const planescoring_t *scoring = static_cast<const planescoring_t *>(arg);
+
+    while (1) {
+        const int i = GetThreadWork();
+        if (i == -1)
+            break;
+        scoring->splits[i] = CountPlaneSplits(scoring->candidates[i], scoring->surfaces, scoring->minsplits);
+    }
+
+    return NULL;
+}
+
 /*
 ==================
 ChoosePlaneFromList
 
 The real BSP hueristic
+
+The candidates are scored in order, each against the fewest splits so
+far. On big nodes, batches of them are scored on all threads against the
+fewest splits when the batch started, and the batch is cut short if a
+candidate in it does better, so the choice doesn't depend on threading.
 ==================
 */
 static surface_t *
 ChoosePlaneFromList(surface_t *surfaces, vec3_t mins, vec3_t maxs)
 {
     int pass, splits, minsplits;
-    bool hintsplit;
-    surface_t *surf, *surf2, *bestsurface;
+    surface_t *surf, *bestsurface;
     vec_t distribution, bestdistribution;
-    const qbsp_plane_t *plane, *plane2;
-    const face_t *face;
+    const qbsp_plane_t *plane;
+    std::vector<surface_t *> candidates;
+    std::vector<int> batchsplits;
+    planescoring_t scoring;
+    size_t i, batchend;
 
     /* pick the plane that splits the least */
     minsplits = INT_MAX - 1;
@@ -391,53 +531,44 @@ ChoosePlaneFromList(surface_t *surfaces, vec3_t mins, vec3_t maxs)
 
     /* Two passes - exhaust all non-detail faces before details */
     for (pass = 0; pass < 2; pass++) {
+        /*
+         * Check that the surface has a suitable face for the current pass
+         */
+        candidates.clear();
         for (surf = surfaces; surf; surf = surf->next) {
             if (surf->onnode)
                 continue;
-
-            /*
-             * Check that the surface has a suitable face for the current pass
-             * and check whether this is a hint split.
-             */
-             hintsplit = false;
-            for (face = surf->faces; face; face = face->next) {
-                if (map.mtexinfos.at(face->texinfo).flags & TEX_HINT)
-                    hintsplit = true;
-            }
-
             if( surf->has_struct && pass )
                 continue;
             if( !surf->has_struct && !pass )
                 continue;
-            
+            candidates.push_back(surf);
+        }
+
+        /* only from the main thread; the clipping hulls use midsplit */
+        const bool parallel = numthreads > 1 && !ThreadsActive() && candidates.size() >= PARALLEL_PLANES;
+        if (parallel) {
+            batchsplits.resize(candidates.size());
+            scoring.surfaces = surfaces;
+            scoring.candidates = candidates.data();
+            scoring.splits = batchsplits.data();
+            scoring.minsplits = minsplits;
+        }
+        batchend = 0;
 
+        for (i = 0; i < candidates.size(); i++) {
+            surf = candidates[i];
             plane = &map.planes[surf->planenum];
-            splits = 0;
 
-            for (surf2 = surfaces; surf2; surf2 = surf2->next) {
-                if (surf2 == surf || surf2->onnode)
-                    continue;
-                plane2 = &map.planes[surf2->planenum];
-                if (plane->type < 3 && plane->type == plane2->type)
-                    continue;
-                for (face = surf2->faces; face; face = face->next) {
-                    const uint64_t flags = map.mtexinfos.at(face->texinfo).flags;
-                    /* Don't penalize for splitting skip faces */
-                    if (flags & TEX_SKIP)
-                        continue;
-                    if (FaceSide(face, plane) == SIDE_ON) {
-                        /* Never split a hint face except with a hint */
-                        if (!hintsplit && (flags & TEX_HINT)) {
-                            splits = INT_MAX;
-                            break;
-                        }
-                        splits++;
-                        if (splits >= minsplits)
-                            break;
-                    }
+            if (!parallel) {
+                splits = CountPlaneSplits(surf, surfaces, minsplits);
+            } else {
+                if (i == batchend || scoring.minsplits != minsplits) {
+                    batchend = qmin(candidates.size(), i + PLANE_BATCH * numthreads);
+                    scoring.minsplits = minsplits;
+                    RunThreadsOnQuiet(i, batchend, CountPlaneSplitsThread, &scoring);
                 }
-                if (splits > minsplits)
-                    break;
+                splits = batchsplits[i];
             }
             if (splits > minsplits)
                 continue;
@@ -21,7 +21,7 @@
 
 #include <qbsp/qbsp.hh>
 #include <map>
-#include <list>
+#include <vector>
 
 static int needlmshifts;
 
@@ -179,30 +179,92 @@ static int cStartEdge;
 
 //============================================================================
 
-using vertidx_t = int;
-using edgeidx_t = int;
-static std::map<std::pair<vertidx_t, vertidx_t>, std::list<edgeidx_t>> hashedges;
-static std::map<std::tuple<int,int,int>, std::list<hashvert_t>> hashverts;
+/*
+ * Vertex welding and edge sharing for MakeFaceEdges use two flat,
+ * open-addressed hash tables. Every slot holds the newest entry for its
+ * key, and older entries with the same key are chained through an index
+ * array.
+ *
+ * Each vertex is inserted once, into the unit grid cell that contains it.
+ * GetVertex probes that cell and its lower neighbours, so a vertex at
+ * (0.99, 0.99, 0.99) is still found when searching at (1.01, 1.01, 1.01).
+ * Edges are keyed on their (v1, v2) vertex pair.
+ */
+typedef struct {
+    int key[3];
+    int head;           // newest entry with this key, -1 if the slot is free
+} hashslot_t;
+
+static std::vector<hashslot_t> hashvertslots;
+static std::vector<hashvert_t> hashverts;
+static std::vector<int> hashvertnext;
+static std::vector<hashslot_t> hashedgeslots;
+static std::vector<int> hashedgenext;   // indexed by edge number
 
 static void
-InitHash(void)
+InitHashSlots(std::vector<hashslot_t> &slots, int maxentries)
 {
+    /* keep the load factor at or below one half */
+    size_t size = 16;
+    while (size < (size_t)maxentries * 2)
+        size <<= 1;
+
+    hashslot_t empty;
+    empty.key[0] = empty.key[1] = empty.key[2] = 0;
+    empty.head = -1;
+    slots.assign(size, empty);
+}
+
+static void
+InitHash(int maxverts, int maxedges)
+{
+    InitHashSlots(hashvertslots, maxverts);
     hashverts.clear();
-    hashedges.clear();
+    hashverts.reserve(maxverts);
+    hashvertnext.clear();
+    hashvertnext.reserve(maxverts);
+
+    InitHashSlots(hashedgeslots, maxedges);
+    hashedgenext.assign(maxedges, -1);
+}
+
+static hashslot_t *
+FindHashSlot(std::vector<hashslot_t> &slots, const int key[3])
+{
+    const size_t mask = slots.size() - 1;
+    size_t i = ((uint32_t)key[0] * 73856093u
+                ^ (uint32_t)key[1] * 19349663u
+                ^ (uint32_t)key[2] * 83492791u) & mask;
+
+    /* linear probing; stops at the matching key or a free slot */
+    for (;; i = (i + 1) & mask) {
+        hashslot_t *slot = &slots[i];
+        if (slot->head == -1)
+            return slot;
+        if (slot->key[0] == key[0] && slot->key[1] == key[1] && slot->key[2] == key[2])
+            return slot;
+    }
 }
 
 static void
 AddHashEdge(int v1, int v2, int i)
 {
-    hashedges[std::make_pair(v1, v2)].push_front(i);
+    const int key[3] = { v1, v2, 0 };
+    hashslot_t *slot = FindHashSlot(hashedgeslots, key);
+
+    if (slot->head == -1) {
+        slot->key[0] = v1;
+        slot->key[1] = v2;
+    }
+    hashedgenext[i] = slot->head;
+    slot->head = i;
 }
 
-static std::tuple<int,int,int>
-HashVec(const vec3_t vec)
+static void
+HashVec(const vec3_t vec, int key[3])
 {
-    return std::make_tuple(static_cast<int>(floor(vec[0])),
-                           static_cast<int>(floor(vec[1])),
-                           static_cast<int>(floor(vec[2])));
+    for (int i = 0; i < 3; i++)
+        key[i] = static_cast<int>(floor(vec[i]));
 }
 
 static void
@@ -211,21 +273,19 @@ AddHashVert(const vec3_t vert, const int global_vert_num)
     hashvert_t hv;
     VectorCopy(vert, hv.point);
     hv.num = global_vert_num;
-    
-    // insert each vert at floor(pos[axis]) and floor(pos[axis]) + 1 (for each axis)
-    // so e.g. a vert at (0.99, 0.99, 0.99) shows up if we search at (1.01, 1.01, 1.01)
-    // this is a bit wasteful, since it inserts 8 copies of each vert.
-    
-    for (int x=0; x<=1; x++) {
-        for (int y=0; y<=1; y++) {
-            for (int z=0; z<=1; z++) {
-                const auto h = std::make_tuple(static_cast<int>(floor(vert[0])) + x,
-                                               static_cast<int>(floor(vert[1])) + y,
-                                               static_cast<int>(floor(vert[2])) + z);
-                hashverts[h].push_front(hv);
-            }
-        }
+
+    int key[3];
+    HashVec(vert, key);
+    hashslot_t *slot = FindHashSlot(hashvertslots, key);
+    if (slot->head == -1) {
+        slot->key[0] = key[0];
+        slot->key[1] = key[1];
+        slot->key[2] = key[2];
     }
+
+    hashvertnext.push_back(slot->head);
+    slot->head = hashverts.size();
+    hashverts.push_back(hv);
 }
 
 /*
@@ -248,18 +308,36 @@ GetVertex(mapentity_t *entity, const vec3_t in)
             vert[i] = in[i];
     }
 
-    const auto h = HashVec(vert);
-    auto it = hashverts.find(h);
-    if (it != hashverts.end()) {
-        for (hashvert_t &hv : it->second) {
-            if (fabs(hv.point[0] - vert[0]) < POINT_EPSILON &&
-                fabs(hv.point[1] - vert[1]) < POINT_EPSILON &&
-                fabs(hv.point[2] - vert[2]) < POINT_EPSILON) {
-
-                return hv.num;
+    /*
+     * Search the cell containing the vertex and its lower neighbours. If
+     * several vertices match, the most recently added one wins.
+     */
+    int key[3], cell[3];
+    const hashvert_t *match = NULL;
+    HashVec(vert, key);
+    for (int x = -1; x <= 0; x++) {
+        for (int y = -1; y <= 0; y++) {
+            for (int z = -1; z <= 0; z++) {
+                cell[0] = key[0] + x;
+                cell[1] = key[1] + y;
+                cell[2] = key[2] + z;
+                const hashslot_t *slot = FindHashSlot(hashvertslots, cell);
+                for (int j = slot->head; j != -1; j = hashvertnext[j]) {
+                    const hashvert_t &hv = hashverts[j];
+                    if (match && hv.num < match->num)
+                        break;
+                    if (fabs(hv.point[0] - vert[0]) < POINT_EPSILON &&
+                        fabs(hv.point[1] - vert[1]) < POINT_EPSILON &&
+                        fabs(hv.point[2] - vert[2]) < POINT_EPSILON) {
+                        match = &hv;
+                        break;
+                    }
+                }
             }
         }
     }
+    if (match)
+        return match->num;
 
     const int global_vert_num = map.cTotal[LUMP_VERTEXES]++;
 
@@ -304,23 +382,21 @@ GetEdge(mapentity_t *entity, const vec3_t p1, const vec3_t p2,
     v2 = GetVertex(entity, p2);
 
     // search for an existing edge from v2->v1
-    const std::pair<int,int> edge_hash_key = std::make_pair(v2, v1);
+    const int edge_hash_key[3] = { v2, v1, 0 };
+    const int edge_head = FindHashSlot(hashedgeslots, edge_hash_key)->head;
 
     if (options.BSPVersion == BSPVERSION) {
         bsp29_dedge_t *edge;
 
-        auto it = hashedges.find(edge_hash_key);
-        if (it != hashedges.end()) {
-            for (const int i : it->second) {
-                edge = (bsp29_dedge_t *)edges->data + i;
-                if (!(v1 == edge->v[1] && v2 == edge->v[0])) {
-                    Error("Too many edges for standard BSP format. Try compiling with -bsp2");
-                }
-                if (pEdgeFaces1[i] == NULL
-                    && pEdgeFaces0[i]->contents[0] == face->contents[0]) {
-                    pEdgeFaces1[i] = face;
-                    return -(i + cStartEdge);
-                }
+        for (i = edge_head; i != -1; i = hashedgenext[i]) {
+            edge = (bsp29_dedge_t *)edges->data + i;
+            if (!(v1 == edge->v[1] && v2 == edge->v[0])) {
+                Error("Too many edges for standard BSP format. Try compiling with -bsp2");
+            }
+            if (pEdgeFaces1[i] == NULL
+                && pEdgeFaces0[i]->contents[0] == face->contents[0]) {
+                pEdgeFaces1[i] = face;
+                return -(i + cStartEdge);
             }
         }
 
@@ -334,16 +410,13 @@ GetEdge(mapentity_t *entity, const vec3_t p1, const vec3_t p2,
     } else {
         bsp2_dedge_t *edge;
 
-        auto it = hashedges.find(edge_hash_key);
-        if (it != hashedges.end()) {
-            for (const int i : it->second) {
-                edge = (bsp2_dedge_t *)edges->data + i;
-                Q_assert(v1 == edge->v[1] && v2 == edge->v[0]);
-                if (pEdgeFaces1[i] == NULL
-                    && pEdgeFaces0[i]->contents[0] == face->contents[0]) {
-                    pEdgeFaces1[i] = face;
-                    return -(i + cStartEdge);
-                }
+        for (i = edge_head; i != -1; i = hashedgenext[i]) {
+            edge = (bsp2_dedge_t *)edges->data + i;
+            Q_assert(v1 == edge->v[1] && v2 == edge->v[0]);
+            if (pEdgeFaces1[i] == NULL
+                && pEdgeFaces0[i]->contents[0] == face->contents[0]) {
+                pEdgeFaces1[i] = face;
+                return -(i + cStartEdge);
             }
         }
 
@@ -570,7 +643,7 @@ MakeFaceEdges(mapentity_t *entity, node_t *headnode)
     pEdgeFaces0 = (const face_t **)AllocMem(OTHER, sizeof(face_t *) * edges->count, true);
     pEdgeFaces1 = (const face_t **)AllocMem(OTHER, sizeof(face_t *) * edges->count, true);
 
-    InitHash();
+    InitHash(vertices->count, edges->count);
 
     firstface = map.cTotal[LUMP_FACES];
     MakeFaceEdges_r(entity, headnode, 0);
@@ -1,5 +1,7 @@
 #include "gtest/gtest.h"
 
+#include <thread>
+
 #include <qbsp/qbsp.hh>
 #include <qbsp/map.hh>
 
@@ -307,6 +309,91 @@ TEST(qbsp, MemLeaks) {
 }
 #endif
 
+/**
+ * Windings are pooled in classes of 8 points; other types each have their own pool.
+ */
+TEST(qbsp, MemPoolSizeClasses) {
+    FreeMemPools();
+
+    void *w3 = AllocMem(WINDING, 3, true);
+    FreeMem(w3, WINDING, 1);
+    void *w8 = AllocMem(WINDING, 8, true);
+    EXPECT_EQ(w3, w8);
+
+    FreeMem(w8, WINDING, 1);
+    void *w9 = AllocMem(WINDING, 9, true);
+    EXPECT_NE(w8, w9);
+    FreeMem(w9, WINDING, 1);
+
+    void *face = AllocMem(FACE, 1, true);
+    FreeMem(face, FACE, 1);
+    void *node = AllocMem(NODE, 1, true);
+    EXPECT_NE(face, node);
+    FreeMem(node, NODE, 1);
+
+    EXPECT_EQ(face, AllocMem(FACE, 1, true));
+    EXPECT_EQ(-1, ((face_t *)face)->planenum);
+    FreeMem(face, FACE, 1);
+
+    FreeMemPools();
+}
+
+/**
+ * The winding size is stored in a header in front of the points, so FreeMem
+ * must account for exactly what AllocMem did, for every size.
+ */
+TEST(qbsp, MemPoolWindingAccounting) {
+    const int before = MemActiveBytes(WINDING);
+    int header = -1;
+
+    for (int i = 1; i <= MAX_POINTS_ON_WINDING; i++) {
+        winding_t *w = (winding_t *)AllocMem(WINDING, i, true);
+        const int bytes = MemActiveBytes(WINDING) - before;
+        const int extra = bytes - (int)offsetof(winding_t, points[i]);
+
+        if (header == -1)
+            header = extra;
+        EXPECT_EQ(header, extra);
+        EXPECT_GE(extra, (int)sizeof(int));
+
+        w->numpoints = i;
+        VectorSet(w->points[i - 1], i, i, i);
+
+        FreeMem(w, WINDING, 1);
+        EXPECT_EQ(before, MemActiveBytes(WINDING));
+    }
+
+    FreeMemPools();
+}
+
+/**
+ * A block freed on another thread goes to that thread's cache, and from there
+ * to the shared depot when the thread exits.
+ */
+TEST(qbsp, MemPoolCrossThreadFree) {
+    FreeMemPools();
+
+    void *block = nullptr;
+    std::thread alloc([&block] { block = AllocMem(BRUSH, 1, true); });
+    alloc.join();
+
+    // freed on the main thread, so reused by the main thread's next alloc
+    FreeMem(block, BRUSH, 1);
+    EXPECT_EQ(block, AllocMem(BRUSH, 1, true));
+
+    // freed on a thread that then exits, so only found through the depot
+    std::thread release([block] { FreeMem(block, BRUSH, 1); });
+    release.join();
+
+    void *reused = nullptr;
+    std::thread realloc([&reused] { reused = AllocMem(BRUSH, 1, true); });
+    realloc.join();
+    EXPECT_EQ(block, reused);
+    FreeMem(reused, BRUSH, 1);
+
+    FreeMemPools();
+}
+
 /**
  * Test that this skip face gets auto-corrected.
  */
@@ -23,16 +23,188 @@
 #include <stdarg.h>
 #include <stdlib.h>
 
+#include <atomic>
+#include <mutex>
+#include <vector>
+
 #include <common/threads.hh>
 #include <common/log.hh>
 
 #include <qbsp/qbsp.hh>
 
-static int rgMemTotal[GLOBAL + 1];
-static int rgMemActive[GLOBAL + 1];
-static int rgMemPeak[GLOBAL + 1];
-static int rgMemActiveBytes[GLOBAL + 1];
-static int rgMemPeakBytes[GLOBAL + 1];
+/* atomic, since the clipping hulls allocate from several threads */
+static std::atomic<int> rgMemTotal[GLOBAL + 1];
+static std::atomic<int> rgMemActive[GLOBAL + 1];
+static std::atomic<int> rgMemPeak[GLOBAL + 1];
+static std::atomic<int> rgMemActiveBytes[GLOBAL + 1];
+static std::atomic<int> rgMemPeakBytes[GLOBAL + 1];
+
+static void
+MemPeak(std::atomic<int> &peak, int value)
+{
+    int old = peak.load(std::memory_order_relaxed);
+    while (value > old && !peak.compare_exchange_weak(old, value, std::memory_order_relaxed))
+        ;
+}
+
+/*
+ * Single faces, windings, portals, surfaces, nodes and brushes are
+ * allocated and freed by the million while building the BSP, so they
+ * come from per-type free lists carved out of larger slabs instead of
+ * one malloc each. Windings are pooled by size class.
+ *
+ * Each thread has its own cache of free blocks, so the pools need no
+ * locking. When a thread exits its free blocks go to a shared depot,
+ * where the next thread to run dry picks them up. The slabs are only
+ * returned to the system in bulk, by FreeMemPools, once a stage has
+ * finished with everything it allocated.
+ */
+#define WINDING_HEADER          16      // holds the size; keeps points aligned
+#define WINDING_CLASS_POINTS    8
+#define WINDING_CLASSES         ((MAX_POINTS_ON_WINDING + WINDING_CLASS_POINTS - 1) / WINDING_CLASS_POINTS)
+#define MEMPOOL_SLAB_SIZE       (64 * 1024)
+
+enum {
+    POOL_FACE,
+    POOL_PORTAL,
+    POOL_SURFACE,
+    POOL_NODE,
+    POOL_BRUSH,
+    POOL_WINDING,
+    NUM_POOLS = POOL_WINDING + WINDING_CLASSES
+};
+
+typedef struct memblock_s {
+    struct memblock_s *next;
+} memblock_t;
+
+static std::mutex mempool_lock;
+static memblock_t *mempool_depot[NUM_POOLS];
+static std::vector<char *> mempool_slabs;
+
+struct mempool_cache_t {
+    memblock_t *free[NUM_POOLS];
+
+    ~mempool_cache_t() {
+        std::lock_guard<std::mutex> lock(mempool_lock);
+        for (int i = 0; i < NUM_POOLS; i++) {
+            memblock_t *block = free[i];
+            if (!block)
+                continue;
+            while (block->next)
+                block = block->next;
+            block->next = mempool_depot[i];
+            mempool_depot[i] = free[i];
+            free[i] = NULL;
+        }
+    }
+};
+
+static thread_local mempool_cache_t mempool_cache;
+
+static int
+MemPool(int Type, int cElements)
+{
+    switch (Type) {
+    case FACE:    return cElements == 1 ? POOL_FACE : -1;
+    case PORTAL:  return cElements == 1 ? POOL_PORTAL : -1;
+    case SURFACE: return cElements == 1 ? POOL_SURFACE : -1;
+    case NODE:    return cElements == 1 ? POOL_NODE : -1;
+    case BRUSH:   return cElements == 1 ? POOL_BRUSH : -1;
+    case WINDING:
+        // For windings, cElements == number of points on winding
+        return POOL_WINDING + (cElements > 0 ? (cElements - 1) / WINDING_CLASS_POINTS : 0);
+    default:
+        return -1;
+    }
+}
+
+static size_t
+MemPoolBlockSize(int pool)
+{
+    size_t size;
+
+    switch (pool) {
+    case POOL_FACE:    size = sizeof(face_t); break;
+    case POOL_PORTAL:  size = sizeof(portal_t); break;
+    case POOL_SURFACE: size = sizeof(surface_t); break;
+    case POOL_NODE:    size = sizeof(node_t); break;
+    case POOL_BRUSH:   size = sizeof(brush_t); break;
+    default:
+        size = WINDING_HEADER + offsetof(winding_t, points)
+            + (pool - POOL_WINDING + 1) * WINDING_CLASS_POINTS * sizeof(vec3_t);
+        break;
+    }
+
+    return (size + 15) & ~(size_t)15;
+}
+
+static void *
+MemPoolAlloc(int pool)
+{
+    memblock_t **free = &mempool_cache.free[pool];
+
+    if (!*free) {
+        std::lock_guard<std::mutex> lock(mempool_lock);
+        *free = mempool_depot[pool];
+        mempool_depot[pool] = NULL;
+    }
+    if (!*free) {
+        const size_t blocksize = MemPoolBlockSize(pool);
+        const size_t count = qmax((size_t)16, MEMPOOL_SLAB_SIZE / blocksize);
+        char *slab = (char *)malloc(count * blocksize);
+        if (!slab)
+            Error("allocation of %d bytes failed (%s)", (int)(count * blocksize), __func__);
+        {
+            std::lock_guard<std::mutex> lock(mempool_lock);
+            mempool_slabs.push_back(slab);
+        }
+
+        for (size_t i = count; i > 0; i--) {
+            memblock_t *block = (memblock_t *)(slab + (i - 1) * blocksize);
+            block->next = *free;
+            *free = block;
+        }
+    }
+
+    memblock_t *block = *free;
+    *free = block->next;
+    return block;
+}
+
+static void
+MemPoolFree(void *pMem, int pool)
+{
+    memblock_t *block = (memblock_t *)pMem;
+
+    block->next = mempool_cache.free[pool];
+    mempool_cache.free[pool] = block;
+}
+
+/*
+==========
+FreeMemPools
+
+Releases every pooled block at once, whether or not it was freed. Only
+call this with no threads running and once nothing allocated since the
+last call is referenced any more.
+==========
+*/
+void
+FreeMemPools(void)
+{
+    Q_assert(!ThreadsActive());
+
+    std::lock_guard<std::mutex> lock(mempool_lock);
+    for (char *slab : mempool_slabs)
+        free(slab);
+    mempool_slabs.clear();
+
+    for (int i = 0; i < NUM_POOLS; i++) {
+        mempool_depot[i] = NULL;
+        mempool_cache.free[i] = NULL;
+    }
+}
 
 /*
 ==========
@@ -43,26 +215,32 @@ void *
 AllocMem(int Type, int cElements, bool fZero)
 {
     void *pTemp;
-    int cSize;
+    int cSize, pool;
 
     if (Type < 0 || Type > OTHER)
         Error("Internal error: invalid memory type %d (%s)", Type, __func__);
 
+    pool = MemPool(Type, cElements);
+
     // For windings, cElements == number of points on winding
     if (Type == WINDING) {
         if (cElements > MAX_POINTS_ON_WINDING)
             Error("Too many points (%d) on winding (%s)", cElements, __func__);
 
-        cSize = offsetof(winding_t, points[cElements]) + sizeof(int);
+        cSize = offsetof(winding_t, points[cElements]) + WINDING_HEADER;
 
         // Set cElements to 1 so bookkeeping works OK
         cElements = 1;
     } else
         cSize = cElements * MemSize[Type];
 
-    pTemp = malloc(cSize);
-    if (!pTemp)
-        Error("allocation of %d bytes failed (%s)", cSize, __func__);
+    if (pool >= 0) {
+        pTemp = MemPoolAlloc(pool);
+    } else {
+        pTemp = malloc(cSize);
+        if (!pTemp)
+            Error("allocation of %d bytes failed (%s)", cSize, __func__);
+    }
 
     if (fZero)
         memset(pTemp, 0, cSize);
@@ -71,24 +249,17 @@ AllocMem(int Type, int cElements, bool fZero)
     if (Type == FACE && cElements == 1)
         ((face_t *)pTemp)->planenum = -1;
     if (Type == WINDING) {
-        // FIXME: Remove this! Causing UBSan warnings
         *(int *)pTemp = cSize;
-        pTemp = (char *)pTemp + sizeof(int);
+        pTemp = (char *)pTemp + WINDING_HEADER;
     }
 
     rgMemTotal[Type] += cElements;
-    rgMemActive[Type] += cElements;
-    rgMemActiveBytes[Type] += cSize;
-    if (rgMemActive[Type] > rgMemPeak[Type])
-        rgMemPeak[Type] = rgMemActive[Type];
-    if (rgMemActiveBytes[Type] > rgMemPeakBytes[Type])
-        rgMemPeakBytes[Type] = rgMemActiveBytes[Type];
+    MemPeak(rgMemPeak[Type], rgMemActive[Type] += cElements);
+    MemPeak(rgMemPeakBytes[Type], rgMemActiveBytes[Type] += cSize);
 
     // Also keep global statistics
     rgMemTotal[GLOBAL] += cSize;
-    rgMemActive[GLOBAL] += cSize;
-    if (rgMemActive[GLOBAL] > rgMemPeak[GLOBAL])
-        rgMemPeak[GLOBAL] = rgMemActive[GLOBAL];
+    MemPeak(rgMemPeak[GLOBAL], rgMemActive[GLOBAL] += cSize);
 
     return pTemp;
 }
@@ -102,17 +273,36 @@ FreeMem
 void
 FreeMem(void *pMem, int Type, int cElements)
 {
+    int pool;
+
     rgMemActive[Type] -= cElements;
     if (Type == WINDING) {
-        pMem = (char *)pMem - sizeof(int);
-        rgMemActiveBytes[Type] -= *(int *)pMem;
-        rgMemActive[GLOBAL] -= *(int *)pMem;
+        pMem = (char *)pMem - WINDING_HEADER;
+        const int cSize = *(int *)pMem;
+        rgMemActiveBytes[Type] -= cSize;
+        rgMemActive[GLOBAL] -= cSize;
+        pool = MemPool(Type, (cSize - WINDING_HEADER - (int)offsetof(winding_t, points)) / (int)sizeof(vec3_t));
     } else {
         rgMemActiveBytes[Type] -= cElements * MemSize[Type];
         rgMemActive[GLOBAL] -= cElements * MemSize[Type];
+        pool = MemPool(Type, cElements);
     }
 
-    free(pMem);
+    if (pool >= 0)
+        MemPoolFree(pMem, pool);
+    else
+        free(pMem);
+}
+
+/*
+==========
+MemActiveBytes
+==========
+*/
+int
+MemActiveBytes(int Type)
+{
+    return rgMemActiveBytes[Type].load();
 }
 
 
@@ -157,13 +347,13 @@ PrintMem(void)
                 "\nData type        CurrentNum    PeakNum      PeakMem\n");
         for (i = 0; i <= OTHER; i++)
             Message(msgLiteral, "%-16s  %9d  %9d %12d %8s\n",
-                    MemTypes[i], rgMemActive[i], rgMemPeak[i],
-                    rgMemPeakBytes[i], MemString(rgMemPeakBytes[i]));
+                    MemTypes[i], rgMemActive[i].load(), rgMemPeak[i].load(),
+                    rgMemPeakBytes[i].load(), MemString(rgMemPeakBytes[i]));
         Message(msgLiteral, "%-16s                       %12d %8s\n",
-                MemTypes[GLOBAL], rgMemPeak[GLOBAL],
+                MemTypes[GLOBAL], rgMemPeak[GLOBAL].load(),
                 MemString(rgMemPeak[GLOBAL]));
     } else
-        Message(msgLiteral, "Peak memory usage: %d (%s)\n", rgMemPeak[GLOBAL],
+        Message(msgLiteral, "Peak memory usage: %d (%s)\n", rgMemPeak[GLOBAL].load(),
                 MemString(rgMemPeak[GLOBAL]));
 }
 
@@ -130,6 +130,25 @@ ClipToSeperators(const winding_t *source,
     return target;
 }
 
+static inline leafbits_t *
+MightseeForLevel(threaddata_t *thread, int level)
+{
+    leafbits_t *mightsee = thread->mightsee_levels[level];
+    if (mightsee)
+        return mightsee;
+
+    /* first time this deep; allocate the next block of levels */
+    const size_t size = LeafbitsSize(portalleafs);
+    const int first = level - (level % MIGHTSEE_BLOCK);
+    byte *block = static_cast<byte *>(malloc(size * MIGHTSEE_BLOCK));
+    if (!block)
+        Error("%s: Out of Memory", __func__);
+    for (int i = 0; i < MIGHTSEE_BLOCK; i++)
+        thread->mightsee_levels[first + i] = reinterpret_cast<leafbits_t *>(block + (i * size));
+
+    return thread->mightsee_levels[level];
+}
+
 static int
 CheckStack(leaf_t *leaf, threaddata_t *thread)
 {
@@ -157,7 +176,7 @@ RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t *prevstack)
     plane_t backplane;
     leaf_t *leaf;
     int i, j, err, numblocks;
-    leafblock_t *test, *might, *vis, more;
+    leafblock_t *test, *might, *vis;
 
     ++c_chains;
 
@@ -193,7 +212,7 @@ RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t *prevstack)
     for (i = 0; i < STACK_WINDINGS; i++)
         stack.freewindings[i] = 1;
 
-    stack.mightsee = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
+    stack.mightsee = MightseeForLevel(thread, thread->mightsee_depth++);
     might = stack.mightsee->bits;
     vis = thread->leafvis->bits;
 
@@ -214,14 +233,8 @@ RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t *prevstack)
             test = p->mightsee->bits;
         }
 
-        more = 0;
         numblocks = (portalleafs + LEAFMASK) >> LEAFSHIFT;
-        for (j = 0; j < numblocks; j++) {
-            might[j] = prevstack->mightsee->bits[j] & test[j];
-            more |= (might[j] & ~vis[j]);
-        }
-
-        if (!more) {
+        if (!Leafbits_AndTestNew(might, prevstack->mightsee->bits, test, vis, numblocks)) {
             // can't see anything new
             c_portalskip++;
             continue;
@@ -355,36 +368,61 @@ RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t *prevstack)
         FreeStackWinding(stack.pass, &stack);
     }
 
-    free(stack.mightsee);
+    thread->mightsee_depth--;
 }
 
 
 /*
   ===============
-  PortalFlow
+  AllocMightseeArena
+
+  CheckStack stops RecursiveLeafFlow from entering a leaf twice, so it
+  never recurses deeper than portalleafs levels.
   ===============
 */
 void
-PortalFlow(portal_t *p)
+AllocMightseeArena(threaddata_t *thread)
 {
-    threaddata_t data;
+    thread->mightsee_levels = static_cast<leafbits_t **>(calloc(portalleafs + MIGHTSEE_BLOCK, sizeof(leafbits_t *)));
+    if (!thread->mightsee_levels)
+        Error("%s: Out of Memory", __func__);
+    thread->mightsee_depth = 0;
+}
 
+void
+FreeMightseeArena(threaddata_t *thread)
+{
+    for (int i = 0; i < portalleafs; i += MIGHTSEE_BLOCK)
+        free(thread->mightsee_levels[i]);
+    free(thread->mightsee_levels);
+    thread->mightsee_levels = NULL;
+}
+
+
+/*
+  ===============
+  PortalFlow
+  ===============
+*/
+void
+PortalFlow(threaddata_t *thread, portal_t *p)
+{
     if (p->status != pstat_working)
         Error("%s: reflowed", __func__);
 
     p->visbits = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
     memset(p->visbits, 0, LeafbitsSize(portalleafs));
 
-    memset(&data, 0, sizeof(data));
-    data.leafvis = p->visbits;
-    data.base = p;
+    thread->leafvis = p->visbits;
+    thread->base = p;
 
-    data.pstack_head.portal = p;
-    data.pstack_head.source = p->winding;
-    data.pstack_head.portalplane = p->plane;
-    data.pstack_head.mightsee = p->mightsee;
+    memset(&thread->pstack_head, 0, sizeof(thread->pstack_head));
+    thread->pstack_head.portal = p;
+    thread->pstack_head.source = p->winding;
+    thread->pstack_head.portalplane = p->plane;
+    thread->pstack_head.mightsee = p->mightsee;
 
-    RecursiveLeafFlow(p->leaf, &data, &data.pstack_head);
+    RecursiveLeafFlow(p->leaf, thread, &thread->pstack_head);
 }
 
 
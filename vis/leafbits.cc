@@ -0,0 +1,492 @@
+/*  Copyright (C) 2026 ericw-tools contributors
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <stdint.h>
+
+#include <vis/leafbits.hh>
+
+/*
+ * Bitset kernels. The vector versions work on the raw bytes of the block
+ * array with unaligned loads and hand the remainder to the next narrower
+ * version. The widest set the CPU supports is picked once at startup.
+ *
+ * The AVX versions clear the upper register halves themselves before
+ * calling or returning to SSE code; the compiler doesn't reliably do it
+ * for target-attribute functions, and the transition penalty otherwise
+ * costs more than the wider loads save.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LEAFBITS_X86
+#define LEAFBITS_TARGET(x) __attribute__((target(x)))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define LEAFBITS_X86
+#define LEAFBITS_TARGET(x)
+#endif
+
+#ifdef LEAFBITS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+/* ------------------------------------------------------------------------ */
+
+static int
+AndTestNew_Scalar(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b, const leafblock_t *seen, int numblocks)
+{
+    leafblock_t more = 0;
+    for (int i = 0; i < numblocks; i++) {
+        dst[i] = a[i] & b[i];
+        more |= dst[i] & ~seen[i];
+    }
+    return more != 0;
+}
+
+static int
+AndNot_Scalar(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b, int numblocks)
+{
+    leafblock_t any = 0;
+    for (int i = 0; i < numblocks; i++) {
+        dst[i] = a[i] & ~b[i];
+        any |= dst[i];
+    }
+    return any != 0;
+}
+
+static void
+Or_Scalar(leafblock_t *dst, const leafblock_t *src, int numblocks)
+{
+    for (int i = 0; i < numblocks; i++)
+        dst[i] |= src[i];
+}
+
+static int
+TestAny_Scalar(const leafblock_t *bits, int numblocks)
+{
+    for (int i = 0; i < numblocks; i++)
+        if (bits[i])
+            return 1;
+    return 0;
+}
+
+static int
+PopCount_Scalar(const leafblock_t *bits, int numblocks)
+{
+    int count = 0;
+    for (int i = 0; i < numblocks; i++) {
+#if defined(__GNUC__)
+        count += __builtin_popcountl(bits[i]);
+#else
+        leafblock_t v = bits[i];
+        for (; v; v &= v - 1)
+            count++;
+#endif
+    }
+    return count;
+}
+
+static const leafbits_kernels_t kernels_scalar = {
+    "scalar", AndTestNew_Scalar, AndNot_Scalar, Or_Scalar, TestAny_Scalar, PopCount_Scalar
+};
+
+#ifdef LEAFBITS_X86
+
+/* number of whole leafblock_t's covered by whole vectors of `width` bytes */
+#define VECTOR_BLOCKS(numblocks, width) \
+    ((int)(((numblocks) * sizeof(leafblock_t)) / (width) * (width) / sizeof(leafblock_t)))
+
+/* ------------------------------------------------------------------------ */
+
+LEAFBITS_TARGET("sse2") static int
+AndTestNew_SSE2(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b, const leafblock_t *seen, int numblocks)
+{
+    const int vblocks = VECTOR_BLOCKS(numblocks, 16);
+    __m128i more = _mm_setzero_si128();
+    for (int i = 0; i < vblocks; i += 16 / sizeof(leafblock_t)) {
+        const __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)(a + i)),
+                                        _mm_loadu_si128((const __m128i *)(b + i)));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+        more = _mm_or_si128(more, _mm_andnot_si128(_mm_loadu_si128((const __m128i *)(seen + i)), v));
+    }
+    const int vmore = _mm_movemask_epi8(_mm_cmpeq_epi8(more, _mm_setzero_si128())) != 0xffff;
+    return AndTestNew_Scalar(dst + vblocks, a + vblocks, b + vblocks, seen + vblocks, numblocks - vblocks) || vmore;
+}
+
+LEAFBITS_TARGET("sse2") static int
+AndNot_SSE2(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b, int numblocks)
+{
+    const int vblocks = VECTOR_BLOCKS(numblocks, 16);
+    __m128i any = _mm_setzero_si128();
+    for (int i = 0; i < vblocks; i += 16 / sizeof(leafblock_t)) {
+        const __m128i v = _mm_andnot_si128(_mm_loadu_si128((const __m128i *)(b + i)),
+                                           _mm_loadu_si128((const __m128i *)(a + i)));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+        any = _mm_or_si128(any, v);
+    }
+    const int vany = _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xffff;
+    return AndNot_Scalar(dst + vblocks, a + vblocks, b + vblocks, numblocks - vblocks) || vany;
+}
+
+LEAFBITS_TARGET("sse2") static void
+Or_SSE2(leafblock_t *dst, const leafblock_t *src, int numblocks)
+{
+    const int vblocks = VECTOR_BLOCKS(numblocks, 16);
+    for (int i = 0; i < vblocks; i += 16 / sizeof(leafblock_t)) {
+        const __m128i v = _mm_or_si128(_mm_loadu_si128((const __m128i *)(dst + i)),
+                                       _mm_loadu_si128((const __m128i *)(src + i)));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+    Or_Scalar(dst + vblocks, src + vblocks, numblocks - vblocks);
+}
+
+LEAFBITS_TARGET("sse2") static int
+TestAny_SSE2(const leafblock_t *bits, int numblocks)
+{
+    const int vblocks = VECTOR_BLOCKS(numblocks, 16);
+    for (int i = 0; i < vblocks; i += 16 / sizeof(leafblock_t)) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(bits + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xffff)
+            return 1;
+    }
+    return TestAny_Scalar(bits + vblocks, numblocks - vblocks);
+}
+
+/* SSE2 has no byte shuffle, so count the bits of each byte with the
+   usual shift-and-mask steps and sum the bytes with psadbw */
+LEAFBITS_TARGET("sse2") static int
+PopCount_SSE2(const leafblock_t *bits, int numblocks)
+{
+    const int vblocks = VECTOR_BLOCKS(numblocks, 16);
+    const __m128i m1 = _mm_set1_epi8(0x55);
+    const __m128i m2 = _mm_set1_epi8(0x33);
+    const __m128i m4 = _mm_set1_epi8(0x0f);
+    __m128i sum = _mm_setzero_si128();
+    for (int i = 0; i < vblocks; i += 16 / sizeof(leafblock_t)) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(bits + i));
+        v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi64(v, 1), m1));
+        v = _mm_add_epi8(_mm_and_si128(v, m2), _mm_and_si128(_mm_srli_epi64(v, 2), m2));
+        v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi64(v, 4)), m4);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(v, _mm_setzero_si128()));
+    }
+    const int vcount = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+    return PopCount_Scalar(bits + vblocks, numblocks - vblocks) + vcount;
+}
+
+static const leafbits_kernels_t kernels_sse2 = {
+    "SSE2", AndTestNew_SSE2, AndNot_SSE2, Or_SSE2, TestAny_SSE2, PopCount_SSE2
+};
+
+/* ------------------------------------------------------------------------ */
+
+LEAFBITS_TARGET("avx2") static int
+AndTestNew_AVX2(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b, const leafblock_t *seen, int numblocks)
+{
+    const int vblocks = VECTOR_BLOCKS(numblocks, 32);
+    __m256i more = _mm256_setzero_si256();
+    for (int i = 0; i < vblocks; i += 32 / sizeof(leafblock_t)) {
+        const __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                           _mm256_loadu_si256((const __m256i *)(b + i)));
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+        more = _mm256_or_si256(more, _mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)(seen + i)), v));
+    }
+    const int vmore = !_mm256_testz_si256(more, more);
+    _mm256_zeroupper();
+    return AndTestNew_SSE2(dst + vblocks, a + vblocks, b + vblocks, seen + vblocks, numblocks - vblocks) || vmore;
+}
+
+LEAFBITS_TARGET("avx2") static int
+AndNot_AVX2(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b, int numblocks)
+{
+    const int vblocks = VECTOR_BLOCKS(numblocks, 32);
+    __m256i any = _mm256_setzero_si256();
+    for (int i = 0; i < vblocks; i += 32 / sizeof(leafblock_t)) {
+        const __m256i v = _mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)(b + i)),
+                                              _mm256_loadu_si256((const __m256i *)(a + i)));
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+        any = _mm256_or_si256(any, v);
+    }
+    const int vany = !_mm256_testz_si256(any, any);
+    _mm256_zeroupper();
+    return AndNot_SSE2(dst + vblocks, a + vblocks, b + vblocks, numblocks - vblocks) || vany;
+}
+
+LEAFBITS_TARGET("avx2") static void
+Or_AVX2(leafblock_t *dst, const leafblock_t *src, int numblocks)
+{
+    const int vblocks = VECTOR_BLOCKS(numblocks, 32);
+    for (int i = 0; i < vblocks; i += 32 / sizeof(leafblock_t)) {
+        const __m256i v = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(dst + i)),
+                                          _mm256_loadu_si256((const __m256i *)(src + i)));
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+    _mm256_zeroupper();
+    Or_SSE2(dst + vblocks, src + vblocks, numblocks - vblocks);
+}
+
+LEAFBITS_TARGET("avx2") static int
+TestAny_AVX2(const leafblock_t *bits, int numblocks)
+{
+    const int vblocks = VECTOR_BLOCKS(numblocks, 32);
+    for (int i = 0; i < vblocks; i += 32 / sizeof(leafblock_t)) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)(bits + i));
+        if (!_mm256_testz_si256(v, v)) {
+            _mm256_zeroupper();
+            return 1;
+        }
+    }
+    _mm256_zeroupper();
+    return TestAny_SSE2(bits + vblocks, numblocks - vblocks);
+}
+
+/* counts of the low and high nibbles of each byte, from a 16 entry table */
+LEAFBITS_TARGET("avx2") static int
+PopCount_AVX2(const leafblock_t *bits, int numblocks)
+{
+    const int vblocks = VECTOR_BLOCKS(numblocks, 32);
+    const __m256i table = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i m4 = _mm256_set1_epi8(0x0f);
+    __m256i sum = _mm256_setzero_si256();
+    for (int i = 0; i < vblocks; i += 32 / sizeof(leafblock_t)) {
+        const __m256i v = _mm256_loadu_si256((const __m256i *)(bits + i));
+        const __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(v, m4));
+        const __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi64(v, 4), m4));
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+    }
+    const __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    const int vcount = _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_unpackhi_epi64(half, half));
+    _mm256_zeroupper();
+    return PopCount_SSE2(bits + vblocks, numblocks - vblocks) + vcount;
+}
+
+static const leafbits_kernels_t kernels_avx2 = {
+    "AVX2", AndTestNew_AVX2, AndNot_AVX2, Or_AVX2, TestAny_AVX2, PopCount_AVX2
+};
+
+/* ------------------------------------------------------------------------ */
+
+LEAFBITS_TARGET("avx512f") static int
+AndTestNew_AVX512(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b, const leafblock_t *seen, int numblocks)
+{
+    const int vblocks = VECTOR_BLOCKS(numblocks, 64);
+    __m512i more = _mm512_setzero_si512();
+    for (int i = 0; i < vblocks; i += 64 / sizeof(leafblock_t)) {
+        const __m512i v = _mm512_and_si512(_mm512_loadu_si512((const void *)(a + i)),
+                                           _mm512_loadu_si512((const void *)(b + i)));
+        _mm512_storeu_si512((void *)(dst + i), v);
+        more = _mm512_or_si512(more, _mm512_andnot_si512(_mm512_loadu_si512((const void *)(seen + i)), v));
+    }
+    const int vmore = _mm512_test_epi64_mask(more, more) != 0;
+    _mm256_zeroupper();
+    return AndTestNew_AVX2(dst + vblocks, a + vblocks, b + vblocks, seen + vblocks, numblocks - vblocks) || vmore;
+}
+
+LEAFBITS_TARGET("avx512f") static int
+AndNot_AVX512(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b, int numblocks)
+{
+    const int vblocks = VECTOR_BLOCKS(numblocks, 64);
+    __m512i any = _mm512_setzero_si512();
+    for (int i = 0; i < vblocks; i += 64 / sizeof(leafblock_t)) {
+        const __m512i v = _mm512_andnot_si512(_mm512_loadu_si512((const void *)(b + i)),
+                                              _mm512_loadu_si512((const void *)(a + i)));
+        _mm512_storeu_si512((void *)(dst + i), v);
+        any = _mm512_or_si512(any, v);
+    }
+    const int vany = _mm512_test_epi64_mask(any, any) != 0;
+    _mm256_zeroupper();
+    return AndNot_AVX2(dst + vblocks, a + vblocks, b + vblocks, numblocks - vblocks) || vany;
+}
+
+LEAFBITS_TARGET("avx512f") static void
+Or_AVX512(leafblock_t *dst, const leafblock_t *src, int numblocks)
+{
+    const int vblocks = VECTOR_BLOCKS(numblocks, 64);
+    for (int i = 0; i < vblocks; i += 64 / sizeof(leafblock_t)) {
+        const __m512i v = _mm512_or_si512(_mm512_loadu_si512((const void *)(dst + i)),
+                                          _mm512_loadu_si512((const void *)(src + i)));
+        _mm512_storeu_si512((void *)(dst + i), v);
+    }
+    _mm256_zeroupper();
+    Or_AVX2(dst + vblocks, src + vblocks, numblocks - vblocks);
+}
+
+LEAFBITS_TARGET("avx512f") static int
+TestAny_AVX512(const leafblock_t *bits, int numblocks)
+{
+    const int vblocks = VECTOR_BLOCKS(numblocks, 64);
+    for (int i = 0; i < vblocks; i += 64 / sizeof(leafblock_t)) {
+        const __m512i v = _mm512_loadu_si512((const void *)(bits + i));
+        if (_mm512_test_epi64_mask(v, v)) {
+            _mm256_zeroupper();
+            return 1;
+        }
+    }
+    _mm256_zeroupper();
+    return TestAny_AVX2(bits + vblocks, numblocks - vblocks);
+}
+
+/* AVX-512F has neither a byte shuffle nor vpopcntq, so popcount stays on AVX2 */
+static const leafbits_kernels_t kernels_avx512 = {
+    "AVX-512", AndTestNew_AVX512, AndNot_AVX512, Or_AVX512, TestAny_AVX512, PopCount_AVX2
+};
+
+/* ------------------------------------------------------------------------ */
+
+/* widest first */
+static const leafbits_kernels_t *const all_kernels[] = {
+    &kernels_avx512, &kernels_avx2, &kernels_sse2, &kernels_scalar
+};
+
+static bool
+KernelsSupported(const leafbits_kernels_t *set)
+{
+    if (set == &kernels_scalar)
+        return true;
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    if (set == &kernels_avx512)
+        return __builtin_cpu_supports("avx512f");
+    if (set == &kernels_avx2)
+        return __builtin_cpu_supports("avx2");
+    return __builtin_cpu_supports("sse2");
+#else
+    int info[4];
+    __cpuid(info, 0);
+    const int maxleaf = info[0];
+
+    __cpuid(info, 1);
+    const bool sse2 = (info[3] >> 26) & 1;
+    const bool osxsave = (info[2] >> 27) & 1;
+    const unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+
+    bool avx2 = false, avx512 = false;
+    if (maxleaf >= 7 && (xcr0 & 0x6) == 0x6) {
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] >> 5) & 1;
+        avx512 = ((info[1] >> 16) & 1) && (xcr0 & 0xe6) == 0xe6;
+    }
+    if (set == &kernels_avx512)
+        return avx512;
+    if (set == &kernels_avx2)
+        return avx2;
+    return sse2;
+#endif
+}
+
+static const leafbits_kernels_t *
+SelectSmallKernels(const leafbits_kernels_t *selected)
+{
+    if (selected == &kernels_avx512 || selected == &kernels_avx2)
+        return &kernels_sse2;
+    return selected;
+}
+
+#else /* !LEAFBITS_X86 */
+
+static const leafbits_kernels_t *const all_kernels[] = { &kernels_scalar };
+
+static bool
+KernelsSupported(const leafbits_kernels_t *set)
+{
+    return true;
+}
+
+static const leafbits_kernels_t *
+SelectSmallKernels(const leafbits_kernels_t *selected)
+{
+    return selected;
+}
+
+#endif /* LEAFBITS_X86 */
+
+#define NUM_KERNELS (int)(sizeof(all_kernels) / sizeof(all_kernels[0]))
+
+static const leafbits_kernels_t *
+SelectKernels(void)
+{
+    for (int i = 0; i < NUM_KERNELS; i++)
+        if (KernelsSupported(all_kernels[i]))
+            return all_kernels[i];
+    return &kernels_scalar;
+}
+
+/*
+ * Bitsets shorter than this stay on the 128-bit kernels; below a few
+ * wide vectors the remainder handling costs more than the width gains.
+ */
+#define LEAFBITS_WIDE_MIN_BYTES 256
+
+static const leafbits_kernels_t *const kernels = SelectKernels();
+static const leafbits_kernels_t *const small_kernels = SelectSmallKernels(kernels);
+
+static inline const leafbits_kernels_t *
+KernelsFor(int numblocks)
+{
+    return (numblocks * sizeof(leafblock_t) < LEAFBITS_WIDE_MIN_BYTES) ? small_kernels : kernels;
+}
+
+/* ------------------------------------------------------------------------ */
+
+int
+Leafbits_AndTestNew(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b, const leafblock_t *seen, int numblocks)
+{
+    return KernelsFor(numblocks)->andtestnew(dst, a, b, seen, numblocks);
+}
+
+int
+Leafbits_AndNot(leafblock_t *dst, const leafblock_t *a, const leafblock_t *b, int numblocks)
+{
+    return KernelsFor(numblocks)->andnot(dst, a, b, numblocks);
+}
+
+void
+Leafbits_Or(leafblock_t *dst, const leafblock_t *src, int numblocks)
+{
+    KernelsFor(numblocks)->or_(dst, src, numblocks);
+}
+
+int
+Leafbits_TestAny(const leafblock_t *bits, int numblocks)
+{
+    return KernelsFor(numblocks)->testany(bits, numblocks);
+}
+
+int
+Leafbits_PopCount(const leafblock_t *bits, int numblocks)
+{
+    return KernelsFor(numblocks)->popcount(bits, numblocks);
+}
+
+const char *
+Leafbits_KernelName(void)
+{
+    return kernels->name;
+}
+
+int
+Leafbits_SupportedKernels(const leafbits_kernels_t **sets, int max)
+{
+    int count = 0;
+    for (int i = 0; i < NUM_KERNELS && count < max; i++)
+        if (KernelsSupported(all_kernels[i]))
+            sets[count++] = all_kernels[i];
+    return count;
+}
@@ -0,0 +1,120 @@
+#include "gtest/gtest.h"
+
+#include <random>
+#include <vector>
+
+#include <vis/leafbits.hh>
+
+/* block counts around the 16, 32 and 64 byte vector widths */
+static const int numblocks_list[] = {
+    0, 1, 2, 3, 5, 7, 8, 9, 15, 17, 31, 33, 63, 65, 127, 131
+};
+
+static std::vector<const leafbits_kernels_t *>
+SupportedKernels(void)
+{
+    const leafbits_kernels_t *sets[8];
+    const int count = Leafbits_SupportedKernels(sets, 8);
+    return std::vector<const leafbits_kernels_t *>(sets, sets + count);
+}
+
+static const leafbits_kernels_t *
+ScalarKernels(void)
+{
+    const auto sets = SupportedKernels();
+    return sets.back();
+}
+
+/* one spare block either side, and offset by one so the loads are unaligned */
+static std::vector<leafblock_t>
+RandomBits(std::mt19937 &rng, int numblocks)
+{
+    std::vector<leafblock_t> bits(numblocks + 2);
+    for (leafblock_t &block : bits)
+        block = (leafblock_t)rng() | ((leafblock_t)rng() << 16 << 16);
+    return bits;
+}
+
+TEST(leafbits, ScalarIsLast) {
+    EXPECT_STREQ("scalar", ScalarKernels()->name);
+}
+
+TEST(leafbits, KernelsMatchScalar) {
+    const leafbits_kernels_t *scalar = ScalarKernels();
+    std::mt19937 rng(1234);
+
+    for (const leafbits_kernels_t *set : SupportedKernels()) {
+        SCOPED_TRACE(set->name);
+        for (int numblocks : numblocks_list) {
+            SCOPED_TRACE(numblocks);
+            for (int iter = 0; iter < 20; iter++) {
+                const std::vector<leafblock_t> a = RandomBits(rng, numblocks);
+                const std::vector<leafblock_t> b = RandomBits(rng, numblocks);
+                std::vector<leafblock_t> seen = RandomBits(rng, numblocks);
+
+                /* mostly already seen, so both results of AndTestNew come up */
+                if (iter & 1) {
+                    for (int i = 0; i < numblocks + 2; i++)
+                        seen[i] |= a[i] & b[i];
+                    if (numblocks && (iter & 2))
+                        seen[1 + rng() % numblocks] = 0;
+                }
+
+                std::vector<leafblock_t> expect = RandomBits(rng, numblocks);
+                std::vector<leafblock_t> actual = expect;
+                EXPECT_EQ(scalar->andtestnew(&expect[1], &a[1], &b[1], &seen[1], numblocks),
+                          set->andtestnew(&actual[1], &a[1], &b[1], &seen[1], numblocks));
+                EXPECT_EQ(expect, actual);
+
+                EXPECT_EQ(scalar->andnot(&expect[1], &a[1], &b[1], numblocks),
+                          set->andnot(&actual[1], &a[1], &b[1], numblocks));
+                EXPECT_EQ(expect, actual);
+
+                /* in place, as vis uses it */
+                expect = a;
+                actual = a;
+                EXPECT_EQ(scalar->andnot(&expect[1], &expect[1], &b[1], numblocks),
+                          set->andnot(&actual[1], &actual[1], &b[1], numblocks));
+                EXPECT_EQ(expect, actual);
+
+                scalar->or_(&expect[1], &b[1], numblocks);
+                set->or_(&actual[1], &b[1], numblocks);
+                EXPECT_EQ(expect, actual);
+
+                EXPECT_EQ(scalar->popcount(&a[1], numblocks), set->popcount(&a[1], numblocks));
+                EXPECT_EQ(scalar->testany(&a[1], numblocks), set->testany(&a[1], numblocks));
+            }
+        }
+    }
+}
+
+/* a single set bit must be found wherever it is, including the remainder */
+TEST(leafbits, KernelsFindSingleBit) {
+    for (const leafbits_kernels_t *set : SupportedKernels()) {
+        SCOPED_TRACE(set->name);
+        for (int numblocks : numblocks_list) {
+            SCOPED_TRACE(numblocks);
+
+            std::vector<leafblock_t> bits(numblocks + 2, 0);
+            std::vector<leafblock_t> none(numblocks + 2, 0);
+            std::vector<leafblock_t> dst(numblocks + 2, 0);
+            bits.front() = bits.back() = ~(leafblock_t)0;
+
+            EXPECT_EQ(0, set->testany(&bits[1], numblocks));
+            EXPECT_EQ(0, set->popcount(&bits[1], numblocks));
+
+            for (int i = 0; i < numblocks * (int)sizeof(leafblock_t) * 8; i += 7) {
+                leafblock_t &block = bits[1 + i / (sizeof(leafblock_t) * 8)];
+                block = (leafblock_t)1 << (i % (sizeof(leafblock_t) * 8));
+
+                EXPECT_EQ(1, set->testany(&bits[1], numblocks));
+                EXPECT_EQ(1, set->popcount(&bits[1], numblocks));
+                EXPECT_EQ(1, set->andnot(&dst[1], &bits[1], &none[1], numblocks));
+                EXPECT_EQ(1, set->andtestnew(&dst[1], &bits[1], &bits[1], &none[1], numblocks));
+                EXPECT_EQ(0, set->andtestnew(&dst[1], &bits[1], &bits[1], &bits[1], numblocks));
+
+                block = 0;
+            }
+        }
+    }
+}
@@ -9,6 +9,11 @@
 #include <common/log.hh>
 #include <common/threads.hh>
 
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
 /*
  * If the portal file is "PRT2" format, then the leafs we are dealing with are
  * really clusters of leaves. So, after the vis job is done we need to expand
@@ -352,6 +357,117 @@ ClipStackWinding(winding_t *in, pstack_t *stack, plane_t *split)
 
 //============================================================================
 
+/*
+  =============
+  Portal queue
+
+  Portals waiting to be processed, kept in a binary min-heap on
+  nummightsee. Ties go to the lower portal number, which is the order the
+  old linear scan picked them in. portalheapindex maps a portal to its heap
+  slot (-1 once claimed) so UpdateMightsee can move it up in place.
+
+  The queue has its own lock, so threads claiming their next portal don't
+  wait on the global ThreadLock. portalheap_lock also covers the status,
+  mightsee and nummightsee of the portals still in the queue. When both
+  locks are needed, ThreadLock is taken first.
+  =============
+*/
+static std::mutex portalheap_lock;
+static std::vector<int> portalheap;
+static std::vector<int> portalheapindex;
+
+static inline bool
+PortalHeap_Less(int a, int b)
+{
+    if (portals[a].nummightsee != portals[b].nummightsee)
+        return portals[a].nummightsee < portals[b].nummightsee;
+    return a < b;
+}
+
+static inline void
+PortalHeap_Swap(int i, int j)
+{
+    const int tmp = portalheap[i];
+    portalheap[i] = portalheap[j];
+    portalheap[j] = tmp;
+    portalheapindex[portalheap[i]] = i;
+    portalheapindex[portalheap[j]] = j;
+}
+
+static void
+PortalHeap_SiftUp(int i)
+{
+    while (i > 0) {
+        const int parent = (i - 1) / 2;
+        if (!PortalHeap_Less(portalheap[i], portalheap[parent]))
+            break;
+        PortalHeap_Swap(i, parent);
+        i = parent;
+    }
+}
+
+static void
+PortalHeap_SiftDown(int i)
+{
+    const int size = static_cast<int>(portalheap.size());
+
+    while (1) {
+        const int left = 2 * i + 1;
+        const int right = left + 1;
+        int smallest = i;
+
+        if (left < size && PortalHeap_Less(portalheap[left], portalheap[smallest]))
+            smallest = left;
+        if (right < size && PortalHeap_Less(portalheap[right], portalheap[smallest]))
+            smallest = right;
+        if (smallest == i)
+            break;
+        PortalHeap_Swap(i, smallest);
+        i = smallest;
+    }
+}
+
+static void
+PortalHeap_Init(void)
+{
+    portalheap.clear();
+    portalheapindex.assign(numportals * 2, -1);
+
+    for (int i = 0; i < numportals * 2; i++) {
+        if (portals[i].status != pstat_none)
+            continue;
+        portalheapindex[i] = static_cast<int>(portalheap.size());
+        portalheap.push_back(i);
+    }
+    for (int i = static_cast<int>(portalheap.size()) / 2 - 1; i >= 0; i--)
+        PortalHeap_SiftDown(i);
+}
+
+static portal_t *
+PortalHeap_Pop(void)
+{
+    if (portalheap.empty())
+        return NULL;
+
+    const int portalnum = portalheap[0];
+    PortalHeap_Swap(0, static_cast<int>(portalheap.size()) - 1);
+    portalheap.pop_back();
+    portalheapindex[portalnum] = -1;
+    if (!portalheap.empty())
+        PortalHeap_SiftDown(0);
+
+    return &portals[portalnum];
+}
+
+/* nummightsee of a waiting portal went down */
+static void
+PortalHeap_Decreased(const portal_t *p)
+{
+    const int i = portalheapindex[p - portals];
+    if (i >= 0)
+        PortalHeap_SiftUp(i);
+}
+
 /*
   =============
   GetNextPortal
@@ -364,28 +480,18 @@ ClipStackWinding(winding_t *in, pstack_t *stack, plane_t *split)
 portal_t *
 GetNextPortal(void)
 {
-    int i;
-    portal_t *p, *ret;
-    unsigned min;
-
-    ThreadLock();
-
-    min = INT_MAX;
-    ret = NULL;
-
-    for (i = 0, p = portals; i < numportals * 2; i++, p++) {
-        if (p->nummightsee < min && p->status == pstat_none) {
-            min = p->nummightsee;
-            ret = p;
-        }
-    }
+    portal_t *ret;
 
-    if (ret) {
-        ret->status = pstat_working;
-        GetThreadWork_Locked__();
+    {
+        std::lock_guard<std::mutex> lock(portalheap_lock);
+        ret = PortalHeap_Pop();
+        if (ret)
+            ret->status = pstat_working;
     }
 
-    ThreadUnlock();
+    /* only counts the portal for the progress display */
+    if (ret)
+        GetThreadWork();
 
     return ret;
 }
@@ -409,6 +515,8 @@ UpdateMightsee(const leaf_t *source, const leaf_t *dest)
     int i, leafnum;
     portal_t *p;
 
+    std::lock_guard<std::mutex> lock(portalheap_lock);
+
     leafnum = dest - leafs;
     for (i = 0; i < source->numportals; i++) {
         p = source->portals[i];
@@ -418,6 +526,7 @@ UpdateMightsee(const leaf_t *source, const leaf_t *dest)
             ClearLeafBit(p->mightsee, leafnum);
             p->nummightsee--;
             c_mightseeupdate++;
+            PortalHeap_Decreased(p);
         }
     }
 }
@@ -436,17 +545,21 @@ UpdateMightsee(const leaf_t *source, const leaf_t *dest)
 static void
 PortalCompleted(portal_t *completed)
 {
+    static std::vector<leafblock_t> changed;
     int i, j, k, bit, numblocks;
     int leafnum;
     const portal_t *p, *p2;
     const leaf_t *myleaf;
-    const leafblock_t *might, *vis;
-    leafblock_t changed;
+    leafblock_t block;
+    int remaining;
 
     ThreadLock();
 
     completed->status = pstat_done;
 
+    numblocks = (portalleafs + LEAFMASK) >> LEAFSHIFT;
+    changed.resize(numblocks);
+
     /*
      * For each portal on the leaf, check the leafs we eliminated from
      * mightsee during the full vis so far.
@@ -457,36 +570,33 @@ PortalCompleted(portal_t *completed)
         if (p->status != pstat_done)
             continue;
 
-        might = p->mightsee->bits;
-        vis = p->visbits->bits;
-        numblocks = (portalleafs + LEAFMASK) >> LEAFSHIFT;
-        for (j = 0; j < numblocks; j++) {
-            changed = might[j] & ~vis[j];
-            if (!changed)
-                continue;
+        if (!Leafbits_AndNot(changed.data(), p->mightsee->bits, p->visbits->bits, numblocks))
+            continue;
 
-            /*
-             * If any of these changed bits are still visible from another
-             * portal, we can't update yet.
-             */
-            for (k = 0; k < myleaf->numportals; k++) {
-                if (k == i)
-                    continue;
-                p2 = myleaf->portals[k];
-                if (p2->status == pstat_done)
-                    changed &= ~p2->visbits->bits[j];
-                else
-                    changed &= ~p2->mightsee->bits[j];
-                if (!changed)
-                    break;
-            }
+        /*
+         * If any of these changed bits are still visible from another
+         * portal, we can't update yet.
+         */
+        for (k = 0; k < myleaf->numportals; k++) {
+            if (k == i)
+                continue;
+            p2 = myleaf->portals[k];
+            if (p2->status == pstat_done)
+                remaining = Leafbits_AndNot(changed.data(), changed.data(), p2->visbits->bits, numblocks);
+            else
+                remaining = Leafbits_AndNot(changed.data(), changed.data(), p2->mightsee->bits, numblocks);
+            if (!remaining)
+                break;
+        }
 
-            /*
-             * Update mightsee for any of the changed bits that survived
-             */
-            while (changed) {
-                bit = ffsl(changed) - 1;
-                changed &= ~(1UL << bit);
+        /*
+         * Update mightsee for any of the changed bits that survived
+         */
+        for (j = 0; j < numblocks; j++) {
+            block = changed[j];
+            while (block) {
+                bit = ffsl(block) - 1;
+                block &= ~(1UL << bit);
                 leafnum = (j << LEAFSHIFT) + bit;
                 UpdateMightsee(leafs + leafnum, myleaf);
             }
@@ -509,6 +619,10 @@ LeafThread(void *arg)
 {
     double now;
     portal_t *p;
+    threaddata_t thread;
+
+    memset(&thread, 0, sizeof(thread));
+    AllocMightseeArena(&thread);
 
     do {
         ThreadLock();
@@ -524,7 +638,7 @@ LeafThread(void *arg)
         if (!p)
             break;
 
-        PortalFlow(p);
+        PortalFlow(&thread, p);
 
         PortalCompleted(p);
 
@@ -534,6 +648,8 @@ LeafThread(void *arg)
         }
     } while (1);
 
+    FreeMightseeArena(&thread);
+
     return NULL;
 }
 
@@ -568,6 +684,25 @@ CompressRow(const byte *vis, const int numbytes, byte *out)
 }
 
 
+/*
+  The per-leaf rows are built and compressed in parallel. Each thread
+  appends its compressed rows to its own output buffer; WriteLeafRows then
+  copies them into the vismap in leaf order, so the result is the same as
+  building the rows one after another.
+*/
+typedef struct {
+    const std::vector<byte> *output;    // thread output holding the compressed row
+    size_t offset;
+    int len;
+    int numvis;
+    bool sawself;                       // LeafFlow: portals saw into their own leaf
+} leafrow_t;
+
+static std::vector<leafrow_t> leafrows;
+static std::vector<std::vector<byte> *> rowoutputs;
+
+int64_t totalvis;
+
 /*
   ===============
   LeafFlow
@@ -575,36 +710,34 @@ CompressRow(const byte *vis, const int numbytes, byte *out)
   Builds the entire visibility list for a leaf
   ===============
 */
-int64_t totalvis;
-
 static void
-LeafFlow(int leafnum, mleaf_t *dleaf)
+LeafFlow(int leafnum, leafbits_t *buffer, leafrow_t *row)
 {
     leaf_t *leaf;
     byte *outbuffer;
-    byte *compressed;
-    int i, j, shift, len;
-    int numvis;
-    byte *dest;
+    int i, j, shift;
+    int numvis, numblocks;
     const portal_t *p;
 
     /*
      * flow through all portals, collecting visible bits
      */
-    outbuffer = uncompressed + leafnum * leafbytes;
     leaf = &leafs[leafnum];
+    numblocks = (portalleafs + LEAFMASK) >> LEAFSHIFT;
     for (i = 0; i < leaf->numportals; i++) {
         p = leaf->portals[i];
         if (p->status != pstat_done)
             Error("portal not done");
-        for (j = 0; j < leafbytes; j++) {
-            shift = (j << 3) & LEAFMASK;
-            outbuffer[j] |= (p->visbits->bits[j >> (LEAFSHIFT - 3)] >> shift) & 0xff;
-        }
+        Leafbits_Or(buffer->bits, p->visbits->bits, numblocks);
+    }
+
+    outbuffer = uncompressed + leafnum * leafbytes;
+    for (j = 0; j < leafbytes; j++) {
+        shift = (j << 3) & LEAFMASK;
+        outbuffer[j] |= (buffer->bits[j >> (LEAFSHIFT - 3)] >> shift) & 0xff;
     }
 
-    if (outbuffer[leafnum >> 3] & (1 << (leafnum & 7)))
-        logprint("WARNING: Leaf portals saw into leaf (%i)\n", leafnum);
+    row->sawself = !!(outbuffer[leafnum >> 3] & (1 << (leafnum & 7)));
     outbuffer[leafnum >> 3] |= (1 << (leafnum & 7));
 
     numvis = 0;
@@ -612,40 +745,17 @@ LeafFlow(int leafnum, mleaf_t *dleaf)
         if (outbuffer[i >> 3] & (1 << (i & 3)))
             numvis++;
 
-    /*
-     * compress the bit string
-     */
-    if (verbose > 1)
-        logprint("leaf %4i : %4i visible\n", leafnum, numvis);
-    totalvis += numvis;
-
-    /* Allocate for worst case where RLE might grow the data (unlikely) */
-    compressed = static_cast<byte *>(malloc(portalleafs * 2 / 8));
-    len = CompressRow(outbuffer, (portalleafs + 7) >> 3, compressed);
-
-    dest = vismap_p;
-    vismap_p += len;
-
-    if (vismap_p > vismap_end)
-        Error("Vismap expansion overflow");
-
-    /* leaf 0 is a common solid */
-    dleaf->visofs = dest - vismap;
-
-    memcpy(dest, compressed, len);
-    free(compressed);
+    row->numvis = numvis;
 }
 
 
-void
-ClusterFlow(int clusternum, leafbits_t *buffer)
+static void
+ClusterFlow(int clusternum, leafbits_t *buffer, leafrow_t *row)
 {
     leaf_t *leaf;
     byte *outbuffer;
-    byte *compressed;
-    int i, j, len;
+    int i;
     int numvis, numblocks;
-    byte *dest;
     const portal_t *p;
 
     /*
@@ -657,8 +767,7 @@ ClusterFlow(int clusternum, leafbits_t *buffer)
         p = leaf->portals[i];
         if (p->status != pstat_done)
             Error("portal not done");
-        for (j = 0; j < numblocks; j++)
-            buffer->bits[j] |= p->visbits->bits[j];
+        Leafbits_Or(buffer->bits, p->visbits->bits, numblocks);
     }
 
     // ericw -- this seems harmless and the fix for https://github.com/ericwa/ericw-tools/issues/261
@@ -680,37 +789,138 @@ ClusterFlow(int clusternum, leafbits_t *buffer)
         }
     }
 
-    /*
-     * compress the bit string
-     */
-    if (verbose > 1)
-        logprint("cluster %4i : %4i visible\n", clusternum, numvis);
-    
-    /*
-     * increment totalvis by 
-     * (# of real leafs in this cluster) x (# of real leafs visible from this cluster)
-     */
-    for (i = 0; i < portalleafs_real; i++) {
-        if (clustermap[i] == clusternum) {
-            totalvis += numvis;
-        }
+    row->sawself = false;
+    row->numvis = numvis;
+}
+
+static void *
+LeafRowThread(void *arg)
+{
+    const bool clusters = (portalleafs != portalleafs_real);
+    const int rowleafs = clusters ? portalleafs_real : portalleafs;
+    const int rowbytes = clusters ? leafbytes_real : leafbytes;
+    const int numbytes = (rowleafs + 7) >> 3;
+    std::vector<byte> *output = new std::vector<byte>;
+    leafbits_t *buffer;
+    byte *compressed;
+    int leafnum, len;
+
+    /* padded: the byte copy in LeafFlow rounds up to leafbytes */
+    buffer = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs + 64)));
+    /* worst case where RLE grows the data */
+    compressed = static_cast<byte *>(malloc(numbytes * 2 + 1));
+    if (!buffer || !compressed)
+        Error("%s: Out of Memory", __func__);
+
+    while (1) {
+        leafnum = GetThreadWork();
+        if (leafnum == -1)
+            break;
+
+        leafrow_t *row = &leafrows[leafnum];
+
+        memset(buffer, 0, LeafbitsSize(portalleafs + 64));
+        if (clusters)
+            ClusterFlow(leafnum, buffer, row);
+        else
+            LeafFlow(leafnum, buffer, row);
+
+        /*
+         * compress the bit string
+         */
+        len = CompressRow(uncompressed + leafnum * rowbytes, numbytes, compressed);
+        row->output = output;
+        row->offset = output->size();
+        row->len = len;
+        output->insert(output->end(), compressed, compressed + len);
     }
 
-    /* Allocate for worst case where RLE might grow the data (unlikely) */
-    compressed = static_cast<byte *>(malloc(portalleafs_real * 2 / 8));
-    len = CompressRow(outbuffer, (portalleafs_real + 7) >> 3, compressed);
+    free(compressed);
+    free(buffer);
 
-    dest = vismap_p;
-    vismap_p += len;
+    ThreadLock();
+    rowoutputs.push_back(output);
+    ThreadUnlock();
 
-    if (vismap_p > vismap_end)
-        Error("Vismap expansion overflow");
+    return NULL;
+}
 
-    /* leaf 0 is a common solid */
-    leaf->visofs = dest - vismap;
+/*
+  ===============
+  WriteLeafRows
 
-    memcpy(dest, compressed, len);
-    free(compressed);
+  Concatenates the compressed rows into the vismap in leaf order and
+  points the leafs (or clusters) at them. A row identical to an earlier
+  one isn't written again; the leaf points at the earlier copy.
+  ===============
+*/
+static void
+WriteLeafRows(const mbsp_t *bsp)
+{
+    const bool clusters = (portalleafs != portalleafs_real);
+    std::vector<int> clusterleafs;
+    std::unordered_map<std::string, int> rowofs;
+    byte *dest;
+    int i, visofs, numshared = 0;
+
+    if (clusters) {
+        clusterleafs.assign(portalleafs, 0);
+        for (i = 0; i < portalleafs_real; i++)
+            clusterleafs[clustermap[i]]++;
+    }
+
+    for (i = 0; i < portalleafs; i++) {
+        const leafrow_t *row = &leafrows[i];
+
+        if (clusters) {
+            if (verbose > 1)
+                logprint("cluster %4i : %4i visible\n", i, row->numvis);
+
+            /*
+             * increment totalvis by
+             * (# of real leafs in this cluster) x (# of real leafs visible from this cluster)
+             */
+            totalvis += static_cast<int64_t>(clusterleafs[i]) * row->numvis;
+        } else {
+            if (row->sawself)
+                logprint("WARNING: Leaf portals saw into leaf (%i)\n", i);
+            if (verbose > 1)
+                logprint("leaf %4i : %4i visible\n", i, row->numvis);
+            totalvis += row->numvis;
+        }
+
+        /* leafs with identical rows share a single copy */
+        const std::string key(reinterpret_cast<const char *>(row->output->data() + row->offset), row->len);
+        auto existing = rowofs.find(key);
+        if (existing != rowofs.end()) {
+            visofs = existing->second;
+            numshared++;
+        } else {
+            dest = vismap_p;
+            vismap_p += row->len;
+
+            if (vismap_p > vismap_end)
+                Error("Vismap expansion overflow");
+
+            memcpy(dest, row->output->data() + row->offset, row->len);
+            visofs = dest - vismap;
+            rowofs.emplace(key, visofs);
+        }
+
+        /* leaf 0 is a common solid */
+        if (clusters)
+            leafs[i].visofs = visofs;
+        else
+            bsp->dleafs[i + 1].visofs = visofs;
+    }
+
+    if (verbose)
+        logprint("%i of %i %s share a vis row with an earlier one\n", numshared, portalleafs, clusters ? "clusters" : "leafs");
+
+    for (std::vector<byte> *output : rowoutputs)
+        delete output;
+    rowoutputs.clear();
+    leafrows.clear();
 }
 
 /*
@@ -741,6 +951,7 @@ CalcPortalVis(const mbsp_t *bsp)
         if (p->status == pstat_done)
             startcount++;
     }
+    PortalHeap_Init();
     RunThreadsOn(startcount, numportals * 2, LeafThread, NULL);
 
     if (verbose) {
@@ -775,20 +986,14 @@ CalcVis(const mbsp_t *bsp)
 //
 // assemble the leaf vis lists by oring and compressing the portal lists
 //
-    if (portalleafs == portalleafs_real) {
-        for (i = 0; i < portalleafs; i++)
-            LeafFlow(i, &bsp->dleafs[i + 1]);
-    } else {
-        leafbits_t *buffer;
-
+    if (portalleafs != portalleafs_real)
         logprint("Expanding clusters...\n");
-        buffer = static_cast<leafbits_t *>(malloc(LeafbitsSize(portalleafs)));
-        for (i = 0; i < portalleafs; i++) {
-            memset(buffer, 0, LeafbitsSize(portalleafs));
-            ClusterFlow(i, buffer);
-        }
-        free(buffer);
-        
+
+    leafrows.assign(portalleafs, leafrow_t());
+    RunThreadsOn(0, portalleafs, LeafRowThread, NULL);
+    WriteLeafRows(bsp);
+
+    if (portalleafs != portalleafs_real) {
         // Set pointers
         for (i = 0; i < portalleafs_real; i++) {
             bsp->dleafs[i + 1].visofs = leafs[clustermap[i]].visofs;
@@ -1282,6 +1487,7 @@ main(int argc, char **argv)
     }
 
     logprint("running with %d threads\n", numthreads);
+    logprint("using %s leafbits kernels\n", Leafbits_KernelName());
     logprint("testlevel = %i\n", testlevel);
 
     stateinterval = 300; /* 5 minutes */